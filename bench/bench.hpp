@@ -0,0 +1,51 @@
+/**
+ * @file bench.hpp
+ * @author qc
+ * @brief 基准测试公共部分
+ * @details 每个结果输出两份: 标准错误上一行给人看的文本,标准输出上一行JSON,
+ *          make bench-run把所有基准的标准输出收集到bench/results.jsonl,用于回归对比.
+ * @version 0.1
+ * @date 2024-07-13
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "metrics.hpp"
+
+namespace qc {
+namespace bench {
+
+/// @brief 环境变量QC_BENCH_SCALE缩放迭代次数,例如CI中用0.1快速跑一遍
+inline uint64_t Scale(uint64_t n) {
+    static double s_scale = [] {
+        const char *s = getenv("QC_BENCH_SCALE");
+        double v = s ? atof(s) : 1.0;
+        return v > 0 ? v : 1.0;
+    }();
+    uint64_t ret = (uint64_t)(n * s_scale);
+    return ret ? ret : 1;
+}
+
+inline void Report(const char *bench, const std::string &metric, double value, const char *unit) {
+    fprintf(stderr, "%-16s %-32s %14.1f %s\n", bench, metric.c_str(), value, unit);
+    printf("{\"bench\":\"%s\",\"metric\":\"%s\",\"value\":%.3f,\"unit\":\"%s\"}\n", bench,
+           metric.c_str(), value, unit);
+    fflush(stdout);
+}
+
+/// @brief 输出直方图的p50/p99/p999/max(纳秒)
+inline void ReportLatency(const char *bench, const std::string &metric, const Histogram &h) {
+    Report(bench, metric + "_p50", h.percentile(50), "ns");
+    Report(bench, metric + "_p99", h.percentile(99), "ns");
+    Report(bench, metric + "_p999", h.percentile(99.9), "ns");
+    Report(bench, metric + "_max", h.max(), "ns");
+}
+
+}  // namespace bench
+}  // namespace qc
@@ -0,0 +1,77 @@
+/**
+ * @file bench_coro_memory.cc
+ * @author qc
+ * @brief 每个挂起操作的内存开销: 有栈Fiber vs C++20无栈Task
+ * @details 分别挂起N个等待定时器的Fiber(hook后的usleep)和N个Task(co_await sleep_for),
+ *          在它们都挂起时统计堆上分配的字节数(mallinfo2)和RSS的增量,除以N.
+ * @version 0.1
+ * @date 2024-07-15
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <malloc.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+
+#include "bench.hpp"
+#include "task.hpp"
+
+using namespace qc;
+
+static const uint64_t CONNS = bench::Scale(10000);
+static const uint64_t PARK_MS = 300;
+
+static std::atomic<uint64_t> s_parked{0};
+
+static size_t HeapBytes() {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+static size_t RssBytes() {
+    long pages = 0, rss = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        if (fscanf(fp, "%ld %ld", &pages, &rss) != 2) rss = 0;
+        fclose(fp);
+    }
+    return rss * sysconf(_SC_PAGESIZE);
+}
+
+static void park_fiber() {
+    ++s_parked;
+    usleep(PARK_MS * 1000);
+}
+
+static Task<void> park_task() {
+    ++s_parked;
+    co_await sleep_for(PARK_MS);
+}
+
+template <class Spawn>
+static void measure(const char *name, Spawn spawn) {
+    s_parked = 0;
+    IOManager iom(2, true, "bench_mem");
+    // 把上一轮释放的内存还给系统,RSS从干净的基线开始
+    malloc_trim(0);
+    size_t heap0 = HeapBytes();
+    size_t rss0 = RssBytes();
+    for (uint64_t i = 0; i < CONNS; ++i) spawn(iom);
+    // 等所有任务都挂起在定时器上
+    while (s_parked < CONNS) usleep(1000);
+    usleep(20 * 1000);
+    double heap = ((double)HeapBytes() - heap0) / CONNS;
+    double rss = ((double)RssBytes() - rss0) / CONNS;
+    iom.stop();
+    bench::Report("memory", std::string(name) + "_heap_per_conn", heap, "bytes");
+    bench::Report("memory", std::string(name) + "_rss_per_conn", rss, "bytes");
+}
+
+int main() {
+    measure("fiber", [](IOManager &iom) { iom.add_task(park_fiber); });
+    measure("task", [](IOManager &iom) { co_spawn(&iom, park_task()); });
+    return 0;
+}
@@ -0,0 +1,134 @@
+/**
+ * @file bench_echo.cc
+ * @author qc
+ * @brief 回环TCP echo: 每秒请求数和请求延迟分位数
+ * @details 服务端和example/fiber_6/server.cc一样跑在IOManager上,但改为每个连接一个协程,
+ *          直接用hook之后的accept/recv/send;客户端是普通线程上的阻塞socket,一问一答.
+ * @version 0.1
+ * @date 2024-07-13
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstring>
+#include <vector>
+
+#include "bench.hpp"
+#include "iomanager.hpp"
+#include "thread.hpp"
+
+using namespace qc;
+
+static const int CLIENTS = 4;
+static const uint64_t REQUESTS = bench::Scale(20000);
+static const size_t MSG_SIZE = 64;
+
+static std::atomic<int> s_port{0};
+static int s_listen = -1;
+
+static void handle_client(int fd) {
+    char buf[4096];
+    while (true) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) break;
+        ssize_t off = 0;
+        while (off < n) {
+            ssize_t m = send(fd, buf + off, n - off, 0);
+            if (m <= 0) break;
+            off += m;
+        }
+    }
+    close(fd);
+}
+
+static void accept_loop() {
+    s_listen = socket(AF_INET, SOCK_STREAM, 0);
+    qc_assert(s_listen >= 0);
+    int opt = 1;
+    setsockopt(s_listen, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0;
+    inet_aton("127.0.0.1", &addr.sin_addr);
+    qc_assert(bind(s_listen, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    qc_assert(listen(s_listen, 1024) == 0);
+    socklen_t len = sizeof(addr);
+    getsockname(s_listen, (struct sockaddr *)&addr, &len);
+    s_port = ntohs(addr.sin_port);
+
+    while (true) {
+        int fd = accept(s_listen, nullptr, nullptr);
+        // 监听socket被关闭后accept返回EBADF,退出
+        if (fd < 0) break;
+        int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        IOManager::GetThis()->add_task(std::bind(handle_client, fd));
+    }
+}
+
+/// @brief 客户端线程没有开启hook,都是阻塞调用
+static void run_client(Histogram *latency) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    qc_assert(fd >= 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(s_port);
+    inet_aton("127.0.0.1", &addr.sin_addr);
+    qc_assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    char req[MSG_SIZE];
+    char resp[MSG_SIZE];
+    memset(req, 'x', sizeof(req));
+    for (uint64_t i = 0; i < REQUESTS; ++i) {
+        uint64_t begin = GetMonotonicNS();
+        qc_assert(send(fd, req, sizeof(req), 0) == (ssize_t)sizeof(req));
+        size_t got = 0;
+        while (got < sizeof(resp)) {
+            ssize_t n = recv(fd, resp + got, sizeof(resp) - got, 0);
+            qc_assert(n > 0);
+            got += n;
+        }
+        latency->record(GetMonotonicNS() - begin);
+    }
+    close(fd);
+}
+
+int main() {
+    Histogram latency[CLIENTS];
+    uint64_t ns = 0;
+    {
+        IOManager iom(2, true, "bench_echo");
+        iom.setLongRunThreshold(0);
+        iom.add_task(accept_loop);
+        while (!s_port) usleep(1000);
+
+        uint64_t begin = GetMonotonicNS();
+        std::vector<Thread::ptr> clients;
+        for (int i = 0; i < CLIENTS; ++i) {
+            clients.emplace_back(
+                new Thread(std::bind(run_client, &latency[i]), "client_" + std::to_string(i)));
+        }
+        for (auto &t : clients) t->join();
+        ns = GetMonotonicNS() - begin;
+
+        iom.add_task([]() { close(s_listen); });
+        iom.stop();
+    }
+
+    Histogram all;
+    for (auto &h : latency) all.merge(h);
+    bench::Report("echo", "requests", CLIENTS * REQUESTS * 1e9 / ns, "req/s");
+    bench::ReportLatency("echo", "rtt", all);
+    return 0;
+}
@@ -0,0 +1,69 @@
+/**
+ * @file bench_fiber.cc
+ * @author qc
+ * @brief 协程创建/销毁,resume+yield切换和取得当前协程引用(Fiber::GetThis)的开销
+ * @version 0.1
+ * @date 2024-07-13
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "bench.hpp"
+#include "fiber.hpp"
+
+using namespace qc;
+
+static const uint64_t CREATE_COUNT = bench::Scale(100000);
+static const uint64_t SWITCH_COUNT = bench::Scale(2000000);
+static const uint64_t GET_THIS_COUNT = bench::Scale(10000000);
+
+static void bench_create() {
+    uint64_t begin = GetMonotonicNS();
+    for (uint64_t i = 0; i < CREATE_COUNT; ++i) {
+        // 不跑在调度器上,直接和线程主协程切换
+        Fiber::ptr fiber = Fiber::Create([]() {}, 0, false);
+        fiber->resume();
+    }
+    uint64_t ns = GetMonotonicNS() - begin;
+    bench::Report("fiber", "create_run_destroy", (double)ns / CREATE_COUNT, "ns/op");
+}
+
+static void bench_switch() {
+    bool done = false;
+    Fiber::ptr fiber = Fiber::Create(
+        [&done]() {
+            while (!done) Fiber::GetCurrent()->yield();
+        },
+        0, false);
+
+    fiber->resume();
+    uint64_t begin = GetMonotonicNS();
+    for (uint64_t i = 0; i < SWITCH_COUNT; ++i) fiber->resume();
+    uint64_t ns = GetMonotonicNS() - begin;
+    done = true;
+    fiber->resume();
+    qc_assert(fiber->getState() == Fiber::TERM);
+    // 一次resume+yield是两次上下文切换
+    bench::Report("fiber", "resume_yield", (double)ns / SWITCH_COUNT, "ns/op");
+}
+
+/// @brief hook的慢路径和addEvent都要取一次当前协程的引用,这里是一次加计数和一次减计数
+static void bench_get_this() {
+    Fiber *volatile sink = nullptr;
+    uint64_t begin = GetMonotonicNS();
+    for (uint64_t i = 0; i < GET_THIS_COUNT; ++i) {
+        Fiber::ptr cur = Fiber::GetThis();
+        sink = cur.get();
+    }
+    uint64_t ns = GetMonotonicNS() - begin;
+    qc_assert(sink == Fiber::GetCurrent());
+    bench::Report("fiber", "get_this", (double)ns / GET_THIS_COUNT, "ns/op");
+}
+
+int main() {
+    Fiber::GetThis();
+    bench_create();
+    bench_switch();
+    bench_get_this();
+    return 0;
+}
@@ -0,0 +1,70 @@
+/**
+ * @file bench_hook.cc
+ * @author qc
+ * @brief hook快路径微基准: 数据已就绪的socket上hook recv 与 原始recv_f对比
+ * @version 0.1
+ * @date 2024-07-06
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench.hpp"
+#include "fd_manager.hpp"
+#include "hook.hpp"
+#include "iomanager.hpp"
+
+using namespace qc;
+
+static const int BATCH = 4096;
+static const int ROUNDS = bench::Scale(256);
+
+static int s_fds[2];
+
+/// @brief 每轮先用send_f写满BATCH字节,只对随后逐字节recv的部分计时,保证每次recv都走快路径
+static double bench_recv(bool hooked) {
+    char buf[BATCH] = {0};
+    uint64_t total = 0;
+    for (int r = 0; r < ROUNDS; ++r) {
+        qc_assert(send_f(s_fds[1], buf, BATCH, 0) == BATCH);
+        uint64_t begin = GetMonotonicNS();
+        for (int i = 0; i < BATCH; ++i) {
+            ssize_t n = hooked ? recv(s_fds[0], buf, 1, 0) : recv_f(s_fds[0], buf, 1, 0);
+            qc_assert(n == 1);
+        }
+        total += GetMonotonicNS() - begin;
+    }
+    return (double)total / (BATCH * ROUNDS);
+}
+
+static void run_bench() {
+    qc_assert(is_hook_enable());
+    // 预热
+    bench_recv(false);
+    bench_recv(true);
+
+    double raw = bench_recv(false);
+    double hooked = bench_recv(true);
+    bench::Report("hook", "recv_raw", raw, "ns/op");
+    bench::Report("hook", "recv_hooked", hooked, "ns/op");
+    bench::Report("hook", "recv_overhead", hooked - raw, "ns/op");
+}
+
+int main() {
+    qc_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, s_fds) == 0);
+    // socketpair没有被hook,手动登记到FdManager中(同时设置为非阻塞)
+    FdMgr::GetInstance()->get(s_fds[0], true);
+    FdMgr::GetInstance()->get(s_fds[1], true);
+
+    IOManager iom(1, true, "bench_hook");
+    // 整个基准在一个协程里跑完,不需要长任务告警
+    iom.setLongRunThreshold(0);
+    iom.add_task(run_bench);
+    iom.stop();
+
+    close_f(s_fds[0]);
+    close_f(s_fds[1]);
+    return 0;
+}
@@ -0,0 +1,255 @@
+/**
+ * @file bench_percore.cc
+ * @author qc
+ * @brief 每核一个IOManager(PerCore)和共享的多线程IOManager对比: echo和KV
+ * @details 两种服务端用同样多的工作线程.共享模式是一个IOManager加一个监听socket,KV是一张读写锁保护的表;
+ *          每核模式每个核一个监听socket(SO_REUSEPORT),KV按key分片到各个核,不在本核的key用invoke发到所在的核上.
+ *          客户端是普通线程上的阻塞socket,一问一答.
+ * @version 0.1
+ * @date 2024-07-23
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstring>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "bench.hpp"
+#include "iomanager.hpp"
+#include "percore.hpp"
+#include "thread.hpp"
+
+using namespace qc;
+
+static const int CLIENTS = 4;
+static const uint64_t REQUESTS = bench::Scale(20000);
+static const size_t MSG_SIZE = 64;
+static const uint32_t KEYS = 10000;
+/// @brief 10%的请求是写
+static const int SET_PERCENT = 10;
+
+/// @brief 工作线程数,两种模式一样,至少2个才有跨核消息
+static size_t Cores() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 2 ? n : 2;
+}
+
+struct KvRequest {
+    uint32_t op;
+    uint32_t key;
+    uint64_t value;
+};
+
+enum { KV_GET = 0, KV_SET = 1 };
+
+/// @brief 读满n个字节,连接关闭或出错时返回false
+static bool read_full(int fd, void *buf, size_t n) {
+    size_t got = 0;
+    while (got < n) {
+        ssize_t m = recv(fd, (char *)buf + got, n - got, 0);
+        if (m <= 0) return false;
+        got += m;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t n) {
+    size_t off = 0;
+    while (off < n) {
+        ssize_t m = send(fd, (const char *)buf + off, n - off, 0);
+        if (m <= 0) return false;
+        off += m;
+    }
+    return true;
+}
+
+static void set_nodelay(int fd) {
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+}
+
+static void echo_conn(int fd) {
+    set_nodelay(fd);
+    char buf[4096];
+    while (true) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0 || !write_full(fd, buf, n)) break;
+    }
+    close(fd);
+}
+
+/// @brief 处理KV连接,apply执行一个请求并返回要回复的值
+static void kv_conn(int fd, const std::function<uint64_t(const KvRequest &)> &apply) {
+    set_nodelay(fd);
+    KvRequest req;
+    while (read_full(fd, &req, sizeof(req))) {
+        uint64_t value = apply(req);
+        if (!write_full(fd, &value, sizeof(value))) break;
+    }
+    close(fd);
+}
+
+/// @brief 客户端线程没有开启hook,都是阻塞调用
+static void echo_client(int port, Histogram *latency) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    qc_assert(fd >= 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_aton("127.0.0.1", &addr.sin_addr);
+    qc_assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    set_nodelay(fd);
+
+    char req[MSG_SIZE];
+    char resp[MSG_SIZE];
+    memset(req, 'x', sizeof(req));
+    for (uint64_t i = 0; i < REQUESTS; ++i) {
+        uint64_t begin = GetMonotonicNS();
+        qc_assert(write_full(fd, req, sizeof(req)));
+        qc_assert(read_full(fd, resp, sizeof(resp)));
+        latency->record(GetMonotonicNS() - begin);
+    }
+    close(fd);
+}
+
+static void kv_client(int port, Histogram *latency, int seed) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    qc_assert(fd >= 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_aton("127.0.0.1", &addr.sin_addr);
+    qc_assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    set_nodelay(fd);
+
+    std::mt19937 rng(seed);
+    for (uint64_t i = 0; i < REQUESTS; ++i) {
+        KvRequest req;
+        req.key = rng() % KEYS;
+        req.op = (int)(rng() % 100) < SET_PERCENT ? KV_SET : KV_GET;
+        req.value = i;
+        uint64_t value;
+        uint64_t begin = GetMonotonicNS();
+        qc_assert(write_full(fd, &req, sizeof(req)));
+        qc_assert(read_full(fd, &value, sizeof(value)));
+        latency->record(GetMonotonicNS() - begin);
+    }
+    close(fd);
+}
+
+/// @brief 起CLIENTS个客户端线程跑完,输出吞吐和延迟
+static void run_clients(const char *name, int port, bool kv) {
+    Histogram latency[CLIENTS];
+    uint64_t begin = GetMonotonicNS();
+    std::vector<Thread::ptr> clients;
+    for (int i = 0; i < CLIENTS; ++i) {
+        std::function<void()> fn = kv ? std::function<void()>(std::bind(kv_client, port, &latency[i], i))
+                                      : std::function<void()>(std::bind(echo_client, port, &latency[i]));
+        clients.emplace_back(new Thread(fn, "client_" + std::to_string(i)));
+    }
+    for (auto &t : clients) t->join();
+    uint64_t ns = GetMonotonicNS() - begin;
+
+    Histogram all;
+    for (auto &h : latency) all.merge(h);
+    bench::Report("percore", std::string(name) + "_requests", CLIENTS * REQUESTS * 1e9 / ns, "req/s");
+    bench::ReportLatency("percore", std::string(name) + "_rtt", all);
+}
+
+/// @brief 共享的IOManager: 一个监听socket,任意工作线程处理任意连接
+static void bench_shared(bool kv) {
+    RWMutex lock;
+    std::unordered_map<uint32_t, uint64_t> table;
+    auto apply = [&](const KvRequest &req) -> uint64_t {
+        if (req.op == KV_SET) {
+            RWMutex::WriteLock w(lock);
+            table[req.key] = req.value;
+            return req.value;
+        }
+        RWMutex::ReadLock r(lock);
+        auto it = table.find(req.key);
+        return it == table.end() ? 0 : it->second;
+    };
+
+    std::atomic<int> port{0};
+    std::atomic<int> listen_fd{-1};
+    IOManager iom(Cores(), false, "bench_shared");
+    iom.setLongRunThreshold(0);
+    iom.add_task([&]() {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        qc_assert(fd >= 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        inet_aton("127.0.0.1", &addr.sin_addr);
+        qc_assert(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+        qc_assert(listen(fd, 1024) == 0);
+        socklen_t len = sizeof(addr);
+        getsockname(fd, (struct sockaddr *)&addr, &len);
+        listen_fd = fd;
+        port = ntohs(addr.sin_port);
+        while (true) {
+            int conn = accept(fd, nullptr, nullptr);
+            // 监听socket被关闭后accept返回EBADF,退出
+            if (conn < 0) break;
+            if (kv) IOManager::GetThis()->add_task([conn, &apply]() { kv_conn(conn, apply); });
+            else IOManager::GetThis()->add_task(std::bind(echo_conn, conn));
+        }
+    });
+    while (!port) usleep(1000);
+
+    run_clients(kv ? "kv_shared" : "echo_shared", port, kv);
+
+    int fd = listen_fd;
+    iom.add_task([fd]() { close(fd); });
+    iom.stop();
+}
+
+/// @brief 每核一个IOManager: 每个核一个监听socket,KV按key分片到各个核,表只由所在的核访问,不加锁
+static void bench_percore(bool kv) {
+    PerCore cores(Cores(), "bench_core");
+    for (size_t i = 0; i < cores.size(); ++i) cores.core(i)->setLongRunThreshold(0);
+    std::vector<std::unordered_map<uint32_t, uint64_t>> shards(cores.size());
+    auto apply = [&](const KvRequest &req) -> uint64_t {
+        size_t shard = req.key % shards.size();
+        uint64_t value = 0;
+        cores.invoke(shard, [&]() {
+            std::unordered_map<uint32_t, uint64_t> &table = shards[shard];
+            if (req.op == KV_SET) {
+                table[req.key] = req.value;
+                value = req.value;
+                return;
+            }
+            auto it = table.find(req.key);
+            value = it == table.end() ? 0 : it->second;
+        });
+        return value;
+    };
+
+    PerCore::ConnHandler handler = echo_conn;
+    if (kv) handler = [&apply](int fd) { kv_conn(fd, apply); };
+    int port = cores.listen("127.0.0.1", 0, handler);
+    qc_assert(port > 0);
+
+    run_clients(kv ? "kv_percore" : "echo_percore", port, kv);
+    cores.stop();
+}
+
+int main() {
+    bench_shared(false);
+    bench_percore(false);
+    bench_shared(true);
+    bench_percore(true);
+    return 0;
+}
@@ -0,0 +1,93 @@
+/**
+ * @file bench_refcount.cc
+ * @author qc
+ * @brief Fiber::ptr用的侵入式计数(IntrusivePtr)和std::shared_ptr的对比
+ * @details 对象大小和协程对象相近,分别测: 创建+释放,拷贝一份引用再丢掉,从裸指针重新得到持有者
+ *          (shared_ptr要走enable_shared_from_this,即weak_ptr::lock的CAS循环).
+ * @version 0.1
+ * @date 2024-07-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <memory>
+#include <thread>
+
+#include "bench.hpp"
+#include "intrusive_ptr.hpp"
+#include "qc.hpp"
+
+using namespace qc;
+
+static const uint64_t CREATE_COUNT = bench::Scale(2000000);
+static const uint64_t COPY_COUNT = bench::Scale(20000000);
+
+/// @brief 和Fiber差不多大的负载
+struct Payload {
+    char data[128];
+};
+
+struct SharedObj : public std::enable_shared_from_this<SharedObj>, public Payload {};
+struct IntrusiveObj : public RefCounted<IntrusiveObj>, public Payload {};
+
+template <class Ptr, class Make>
+static void bench_create(const char *name, Make make) {
+    void *volatile sink = nullptr;
+    uint64_t begin = GetMonotonicNS();
+    for (uint64_t i = 0; i < CREATE_COUNT; ++i) {
+        Ptr p = make();
+        sink = p.get();
+    }
+    uint64_t ns = GetMonotonicNS() - begin;
+    (void)sink;
+    bench::Report("refcount", std::string(name) + "_create_release", (double)ns / CREATE_COUNT,
+                  "ns/op");
+}
+
+/// @brief 一次加计数和一次减计数,相当于把协程交给事件/定时器再执行完
+template <class Ptr>
+static void bench_copy(const char *name, const Ptr &p) {
+    void *volatile sink = nullptr;
+    uint64_t begin = GetMonotonicNS();
+    for (uint64_t i = 0; i < COPY_COUNT; ++i) {
+        Ptr copy = p;
+        sink = copy.get();
+    }
+    uint64_t ns = GetMonotonicNS() - begin;
+    qc_assert(sink == p.get());
+    bench::Report("refcount", std::string(name) + "_copy_release", (double)ns / COPY_COUNT, "ns/op");
+}
+
+/// @brief 只有裸指针(比如线程局部的当前协程)时重新取得一份引用
+template <class Ptr, class FromRaw>
+static void bench_from_raw(const char *name, const Ptr &p, FromRaw from_raw) {
+    auto *raw = p.get();
+    void *volatile sink = nullptr;
+    uint64_t begin = GetMonotonicNS();
+    for (uint64_t i = 0; i < COPY_COUNT; ++i) {
+        Ptr copy = from_raw(raw);
+        sink = copy.get();
+    }
+    uint64_t ns = GetMonotonicNS() - begin;
+    qc_assert(sink == p.get());
+    bench::Report("refcount", std::string(name) + "_from_raw", (double)ns / COPY_COUNT, "ns/op");
+}
+
+int main() {
+    // libstdc++在进程从未创建过线程时让shared_ptr使用非原子计数,调度器进程里总是有多个线程
+    std::thread([]() {}).join();
+
+    typedef std::shared_ptr<SharedObj> SharedPtr;
+    typedef IntrusivePtr<IntrusiveObj> IntrusiveObjPtr;
+
+    bench_create<SharedPtr>("shared_ptr", []() { return std::make_shared<SharedObj>(); });
+    bench_create<IntrusiveObjPtr>("intrusive", []() { return IntrusiveObjPtr(new IntrusiveObj); });
+
+    SharedPtr sp = std::make_shared<SharedObj>();
+    IntrusiveObjPtr ip(new IntrusiveObj);
+    bench_copy("shared_ptr", sp);
+    bench_copy("intrusive", ip);
+    bench_from_raw("shared_ptr", sp, [](SharedObj *raw) { return raw->shared_from_this(); });
+    bench_from_raw("intrusive", ip, [](IntrusiveObj *raw) { return IntrusiveObjPtr(raw); });
+    return 0;
+}
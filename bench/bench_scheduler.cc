@@ -0,0 +1,170 @@
+/**
+ * @file bench_scheduler.cc
+ * @author qc
+ * @brief Scheduler::add_task在1..N个生产者线程下的吞吐
+ * @details 生产者是调度器之外的普通线程,统计两个数: 生产者这边add_task的速率,
+ *          以及从开始投递到所有任务执行完(stop返回)的端到端吞吐.
+ *          fanout: 任务在工作线程上再add_task子任务,走本地队列和偷取;
+ *          fanout_nopool关闭工作线程的协程池,每个回调任务都新建协程;
+ *          fanout_1w只有一个工作线程,本地队列不加锁;fanout_1w_locked同样一个线程,
+ *          但允许补偿线程(没有开启阻塞检测,不会真的创建),本地队列照常加锁;
+ *          capture48: 回调捕获48字节,放得进TaskFunc的内部缓冲区但放不进std::function的;
+ *          probe: 队列里一直积压着批量任务时,探测任务(健康检查)从入队到执行的延迟,分别按普通和高优先级投递.
+ * @version 0.1
+ * @date 2024-07-13
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <sched.h>
+
+#include <atomic>
+#include <vector>
+
+#include "bench.hpp"
+#include "iomanager.hpp"
+#include "thread.hpp"
+
+using namespace qc;
+
+static const uint64_t TASK_COUNT = bench::Scale(400000);
+static const size_t WORKERS = 2;
+static const int MAX_PRODUCERS = 4;
+
+static void bench_producers(int producers) {
+    std::atomic<uint64_t> executed{0};
+    std::atomic<uint64_t> add_ns{0};
+    uint64_t per_producer = TASK_COUNT / producers;
+
+    uint64_t begin = GetMonotonicNS();
+    {
+        IOManager iom(WORKERS, true, "bench_sched");
+        std::vector<Thread::ptr> threads;
+        for (int p = 0; p < producers; ++p) {
+            threads.emplace_back(new Thread(
+                [&]() {
+                    uint64_t start = GetMonotonicNS();
+                    for (uint64_t i = 0; i < per_producer; ++i) {
+                        iom.add_task([&executed]() { executed.fetch_add(1, std::memory_order_relaxed); });
+                    }
+                    add_ns.fetch_add(GetMonotonicNS() - start);
+                },
+                "producer_" + std::to_string(p)));
+        }
+        for (auto &t : threads) t->join();
+        iom.stop();
+    }
+    uint64_t ns = GetMonotonicNS() - begin;
+    qc_assert(executed == per_producer * producers);
+
+    std::string suffix = "_" + std::to_string(producers) + "p";
+    // add_ns是所有生产者耗时之和,换算成单个生产者的速率再乘以生产者数
+    bench::Report("scheduler", "add_task" + suffix,
+                  per_producer * producers * 1e9 / (add_ns / producers), "ops/s");
+    bench::Report("scheduler", "throughput" + suffix, per_producer * producers * 1e9 / ns,
+                  "tasks/s");
+}
+
+static void bench_fanout(const std::string &suffix, size_t fiber_pool_size, size_t workers = WORKERS,
+                         size_t block_compensation = 0) {
+    std::atomic<uint64_t> executed{0};
+    Metrics::Snapshot before = Metrics::GetSnapshot();
+
+    uint64_t begin = GetMonotonicNS();
+    {
+        SchedulerOptions options;
+        options.fiber_pool_size = fiber_pool_size;
+        options.block_compensation = block_compensation;
+        IOManager iom(workers, true, "bench_sched", options);
+        // 投递子任务的父任务本身就是长任务
+        iom.setLongRunThreshold(0);
+        iom.add_task([&]() {
+            for (uint64_t i = 0; i < TASK_COUNT; ++i) {
+                iom.add_task([&executed]() { executed.fetch_add(1, std::memory_order_relaxed); });
+            }
+        });
+        iom.stop();
+    }
+    uint64_t ns = GetMonotonicNS() - begin;
+    qc_assert(executed == TASK_COUNT);
+
+    Metrics::Snapshot after = Metrics::GetSnapshot();
+    uint64_t steals = after.totals[Metrics::STEALS] - before.totals[Metrics::STEALS];
+    uint64_t hits = after.totals[Metrics::FIBER_POOL_HITS] - before.totals[Metrics::FIBER_POOL_HITS];
+    bench::Report("scheduler", "throughput" + suffix, TASK_COUNT * 1e9 / ns, "tasks/s");
+    bench::Report("scheduler", "steal_ratio" + suffix, (double)steals / TASK_COUNT, "ratio");
+    bench::Report("scheduler", "fiber_pool_hit_ratio" + suffix, (double)hits / TASK_COUNT, "ratio");
+}
+
+static void bench_capture() {
+    std::atomic<uint64_t> executed{0};
+    uint64_t begin = GetMonotonicNS();
+    {
+        IOManager iom(WORKERS, true, "bench_sched");
+        for (uint64_t i = 0; i < TASK_COUNT; ++i) {
+            uint64_t payload[5] = {i, i, i, i, i};
+            iom.add_task([&executed, payload]() {
+                executed.fetch_add(payload[0] == payload[4], std::memory_order_relaxed);
+            });
+        }
+        iom.stop();
+    }
+    uint64_t ns = GetMonotonicNS() - begin;
+    qc_assert(executed == TASK_COUNT);
+    bench::Report("scheduler", "throughput_capture48", TASK_COUNT * 1e9 / ns, "tasks/s");
+}
+
+static const uint64_t PROBES = bench::Scale(200);
+static const uint64_t BULK_PER_PROBE = 200;
+static const uint64_t BULK_INFLIGHT = 2000;
+static const uint64_t BULK_TASK_NS = 2000;
+
+static void bench_probe(const std::string &suffix, TaskPriority priority) {
+    Histogram latency;
+    std::atomic<uint64_t> bulk_done{0};
+    std::atomic<uint64_t> probes_done{0};
+    uint64_t bulk_added = 0;
+    {
+        // 1个工作线程 + 调用线程,调用线程直到stop才参与调度,直方图只有工作线程写
+        IOManager iom(2, true, "bench_sched");
+        for (uint64_t i = 0; i < PROBES; ++i) {
+            for (uint64_t k = 0; k < BULK_PER_PROBE; ++k) {
+                while (bulk_added - bulk_done.load(std::memory_order_acquire) >= BULK_INFLIGHT) {
+                    sched_yield();
+                }
+                iom.add_task([&bulk_done]() {
+                    uint64_t start = GetMonotonicNS();
+                    while (GetMonotonicNS() - start < BULK_TASK_NS) {
+                    }
+                    bulk_done.fetch_add(1, std::memory_order_release);
+                });
+                ++bulk_added;
+            }
+            uint64_t begin = GetMonotonicNS();
+            iom.add_task(
+                [&latency, &probes_done, begin]() {
+                    latency.record(GetMonotonicNS() - begin);
+                    probes_done.fetch_add(1, std::memory_order_release);
+                },
+                -1, priority);
+        }
+        while (bulk_done.load(std::memory_order_acquire) < bulk_added ||
+               probes_done.load(std::memory_order_acquire) < PROBES) {
+            sched_yield();
+        }
+        iom.stop();
+    }
+    bench::ReportLatency("scheduler", "probe" + suffix, latency);
+}
+
+int main() {
+    for (int p = 1; p <= MAX_PRODUCERS; p *= 2) bench_producers(p);
+    bench_fanout("_fanout", SchedulerOptions().fiber_pool_size);
+    bench_fanout("_fanout_nopool", 0);
+    bench_fanout("_fanout_1w", SchedulerOptions().fiber_pool_size, 1);
+    bench_fanout("_fanout_1w_locked", SchedulerOptions().fiber_pool_size, 1, 1);
+    bench_capture();
+    bench_probe("_normal", PRIORITY_NORMAL);
+    bench_probe("_high", PRIORITY_HIGH);
+    return 0;
+}
@@ -0,0 +1,58 @@
+/**
+ * @file bench_timer.cc
+ * @author qc
+ * @brief TimerManager插入/取消/到期的速率
+ * @version 0.1
+ * @date 2024-07-13
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <unistd.h>
+
+#include <vector>
+
+#include "bench.hpp"
+#include "qc.hpp"
+#include "timer.hpp"
+
+using namespace qc;
+
+static const uint64_t TIMER_COUNT = bench::Scale(200000);
+
+/// @brief 只测定时器本身,不需要唤醒reactor
+class BenchTimerManager : public TimerManager {
+protected:
+    void OnTimerInsertedAtFront() override {}
+};
+
+int main() {
+    BenchTimerManager mgr;
+    std::vector<Timer::ptr> timers;
+    timers.reserve(TIMER_COUNT);
+
+    // 超时时间打散,插入位置不总在末尾
+    uint64_t begin = GetMonotonicNS();
+    for (uint64_t i = 0; i < TIMER_COUNT; ++i) {
+        timers.push_back(mgr.add_timer(60 * 1000 + (i * 7919) % 10000, []() {}));
+    }
+    uint64_t ns = GetMonotonicNS() - begin;
+    bench::Report("timer", "insert", TIMER_COUNT * 1e9 / ns, "ops/s");
+
+    begin = GetMonotonicNS();
+    for (auto &t : timers) qc_assert(t->cancel());
+    ns = GetMonotonicNS() - begin;
+    bench::Report("timer", "cancel", TIMER_COUNT * 1e9 / ns, "ops/s");
+    timers.clear();
+
+    for (uint64_t i = 0; i < TIMER_COUNT; ++i) mgr.add_timer(i % 2, []() {});
+    // 毫秒精度,等所有定时器都过期
+    usleep(5 * 1000);
+    std::vector<TaskFunc> cbs;
+    begin = GetMonotonicNS();
+    mgr.listExpiredCb(cbs);
+    ns = GetMonotonicNS() - begin;
+    qc_assert(cbs.size() == TIMER_COUNT);
+    bench::Report("timer", "expire", TIMER_COUNT * 1e9 / ns, "ops/s");
+    return 0;
+}
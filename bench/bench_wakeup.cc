@@ -0,0 +1,103 @@
+/**
+ * @file bench_wakeup.cc
+ * @author qc
+ * @brief IOManager唤醒延迟: 外部线程add_task到工作线程开始执行任务的时间
+ * @details 分别在关闭/打开空闲自旋(IOManager::setIdleSpin)以及工作线程忙轮询(SchedulerOptions::busy_poll)时测量三种负载:
+ *          gap500us: 任务稀疏,工作线程每次都已经阻塞在epoll_wait中,需要tickle唤醒;
+ *          gap20us: 任务间隔短于自旋窗口,打开自旋时工作线程还没有阻塞;
+ *          stream: 生产者持续投递(最多64个在途),测量的是排队加调度的延迟.
+ *          单核机器上自旋和忙轮询会和生产者抢cpu,这两种的结果没有参考意义.
+ * @version 0.1
+ * @date 2024-07-13
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <sched.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "bench.hpp"
+#include "iomanager.hpp"
+
+using namespace qc;
+
+static const uint64_t SAMPLES = bench::Scale(1000);
+static const uint64_t STREAM_TASKS = bench::Scale(100000);
+static const uint64_t STREAM_INFLIGHT = 64;
+
+/// @brief 短间隔用忙等,usleep的精度不够
+static void Pause(uint64_t ns) {
+    if (ns >= 200 * 1000) {
+        usleep(ns / 1000);
+        return;
+    }
+    uint64_t start = GetMonotonicNS();
+    while (GetMonotonicNS() - start < ns) qc_cpu_relax();
+}
+
+static SchedulerOptions BusyPoll() {
+    SchedulerOptions options;
+    options.busy_poll = {0};
+    return options;
+}
+
+static void bench_gap(const std::string &name, uint64_t spin_ns, uint64_t gap_ns,
+                      const SchedulerOptions &options = SchedulerOptions()) {
+    Histogram latency;
+    {
+        // 1个工作线程 + 调用线程,调用线程直到stop才参与调度
+        IOManager iom(2, true, "bench_wakeup", options);
+        iom.setIdleSpin(spin_ns);
+        for (uint64_t i = 0; i < SAMPLES; ++i) {
+            // 留出时间让工作线程回到idle
+            Pause(gap_ns);
+            std::atomic<bool> done{false};
+            uint64_t begin = GetMonotonicNS();
+            iom.add_task([&]() {
+                // 只有工作线程写直方图
+                latency.record(GetMonotonicNS() - begin);
+                done.store(true, std::memory_order_release);
+            });
+            while (!done.load(std::memory_order_acquire)) sched_yield();
+        }
+        iom.stop();
+    }
+    bench::ReportLatency("wakeup", name, latency);
+}
+
+static void bench_stream(const std::string &name, uint64_t spin_ns,
+                         const SchedulerOptions &options = SchedulerOptions()) {
+    Histogram latency;
+    std::atomic<uint64_t> executed{0};
+    {
+        IOManager iom(2, true, "bench_wakeup", options);
+        iom.setIdleSpin(spin_ns);
+        for (uint64_t i = 0; i < STREAM_TASKS; ++i) {
+            while (i - executed.load(std::memory_order_acquire) >= STREAM_INFLIGHT) sched_yield();
+            uint64_t begin = GetMonotonicNS();
+            iom.add_task([&latency, &executed, begin]() {
+                latency.record(GetMonotonicNS() - begin);
+                executed.fetch_add(1, std::memory_order_release);
+            });
+        }
+        // 全部由工作线程执行完再stop,直方图只能有一个写者
+        while (executed.load(std::memory_order_acquire) < STREAM_TASKS) sched_yield();
+        iom.stop();
+    }
+    bench::ReportLatency("wakeup", name, latency);
+}
+
+int main() {
+    const uint64_t SPIN_NS = 50 * 1000;
+    bench_gap("add_task_to_run", 0, 500 * 1000);
+    bench_gap("gap20us_nospin", 0, 20 * 1000);
+    bench_gap("gap20us_spin", SPIN_NS, 20 * 1000);
+    bench_gap("gap500us_busypoll", 0, 500 * 1000, BusyPoll());
+    bench_gap("gap20us_busypoll", 0, 20 * 1000, BusyPoll());
+    bench_stream("stream_nospin", 0);
+    bench_stream("stream_spin", SPIN_NS);
+    bench_stream("stream_busypoll", 0, BusyPoll());
+    return 0;
+}
@@ -0,0 +1,46 @@
+#include <unistd.h>
+
+#include <iostream>
+
+#include "iomanager.hpp"
+#include "metrics.hpp"
+#include "profiler.hpp"
+
+using namespace qc;
+
+static volatile uint64_t s_sink = 0;
+
+__attribute__((noinline)) void spin(uint64_t ms) {
+    uint64_t start = GetMonotonicNS();
+    while (GetMonotonicNS() - start < ms * 1000 * 1000) s_sink = s_sink + 1;
+}
+
+void heavy_task() {
+    for (int i = 0; i < 3; ++i) {
+        spin(100);
+        // 让出之后在别的线程上继续跑,样本仍然归到这个入口
+        usleep(1000);
+    }
+}
+
+void light_task() { spin(50); }
+
+int main(int argc, char **argv) {
+    qc_assert(Profiler::Start(1000));
+    {
+        IOManager iom(2, true, "profiler");
+        iom.add_task(heavy_task);
+        iom.add_task(light_task);
+        iom.stop();
+    }
+    Profiler::Stop();
+
+    std::string folded = Profiler::DumpFolded();
+    std::cout << folded;
+    std::cout << "samples = " << Profiler::GetSamples() << " dropped = " << Profiler::GetDropped()
+              << std::endl;
+    qc_assert(Profiler::GetSamples() > 0);
+    qc_assert(folded.find("heavy_task();spin") != std::string::npos);
+    if (argc > 1) Profiler::WriteFolded(argv[1], true);
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include <unistd.h>
+
+#include <iostream>
+#include <stdexcept>
+
+#include "future.hpp"
+#include "iomanager.hpp"
+
+using namespace qc;
+
+/// @brief 扇出10个子任务再扇入,子任务里hook过的usleep只挂起协程
+void fan_out() {
+    std::vector<Future<int>> futures;
+    for (int i = 0; i < 10; ++i) {
+        futures.push_back(async([i]() {
+            usleep((10 - i) * 1000);
+            return i * i;
+        }));
+    }
+    when_all(futures).get();
+    int sum = 0;
+    for (auto &f : futures) sum += f.get();
+    qc_assert(sum == 285);
+    std::cout << "when_all sum = " << sum << std::endl;
+}
+
+void first_reply() {
+    std::vector<Future<std::string>> futures;
+    futures.push_back(async([]() {
+        usleep(50 * 1000);
+        return std::string("slow");
+    }));
+    futures.push_back(async([]() {
+        usleep(1000);
+        return std::string("fast");
+    }));
+    size_t idx = when_any(futures).get();
+    qc_assert(idx == 1);
+    std::cout << "when_any -> " << futures[idx].get() << std::endl;
+    // 另一个还没完成,等它结束再返回,避免stop之前任务还在跑
+    futures[0].wait();
+}
+
+void propagate_error() {
+    Future<void> f = async([]() { throw std::runtime_error("boom"); });
+    try {
+        f.get();
+        qc_assert(false);
+    } catch (const std::runtime_error &e) {
+        std::cout << "exception: " << e.what() << std::endl;
+    }
+}
+
+int main() {
+    IOManager iom(3, true, "future");
+    iom.add_task(fan_out);
+    iom.add_task(first_reply);
+    iom.add_task(propagate_error);
+
+    // 不在协程里,get()阻塞Main线程,由工作线程完成
+    Promise<int> promise;
+    Future<int> f = promise.get_future();
+    iom.add_task([promise]() mutable {
+        usleep(5 * 1000);
+        promise.set_value(42);
+    });
+    qc_assert(f.get() == 42);
+    std::cout << "main thread got 42" << std::endl;
+
+    iom.stop();
+    return 0;
+}
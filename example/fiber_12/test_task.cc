@@ -0,0 +1,80 @@
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+
+#include "fd_manager.hpp"
+#include "task.hpp"
+
+using namespace qc;
+
+Task<int> add_later(int a, int b) {
+    co_await sleep_for(10);
+    co_return a + b;
+}
+
+/// @brief 对端写什么就回什么,直到对端关闭
+Task<void> echo(int fd) {
+    char buf[256];
+    while (true) {
+        ssize_t n = co_await async_recv(fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        co_await async_send(fd, buf, n);
+    }
+    close(fd);
+}
+
+Task<std::string> client(int fd) {
+    std::string reply;
+    for (int i = 0; i < 3; ++i) {
+        std::string msg = "ping" + std::to_string(i);
+        co_await async_send(fd, msg.data(), msg.size());
+        char buf[64];
+        ssize_t n = co_await async_recv(fd, buf, sizeof(buf));
+        qc_assert(n > 0);
+        reply.append(buf, n);
+        reply.push_back(' ');
+    }
+    close(fd);
+    co_return reply;
+}
+
+Task<void> fail() {
+    co_await sleep_for(1);
+    throw std::runtime_error("boom");
+}
+
+int main() {
+    IOManager iom(2, true, "task");
+
+    int fds[2];
+    qc_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    // 登记后FdCtx会把socket设为非阻塞
+    FdMgr::GetInstance()->get(fds[0], true);
+    FdMgr::GetInstance()->get(fds[1], true);
+
+    Future<int> sum = co_spawn(&iom, add_later(1, 2));
+    Future<void> server = co_spawn(&iom, echo(fds[0]));
+    Future<std::string> reply = co_spawn(&iom, client(fds[1]));
+    Future<void> error = co_spawn(&iom, fail());
+
+    // 和Fiber混在同一个调度器上: Fiber里等待无栈协程的结果
+    iom.add_task([&]() {
+        qc_assert(sum.get() == 3);
+        std::cout << "add_later = 3" << std::endl;
+    });
+
+    std::string r = reply.get();
+    std::cout << "client got: " << r << std::endl;
+    qc_assert(r == "ping0 ping1 ping2 ");
+    server.get();
+    try {
+        error.get();
+        qc_assert(false);
+    } catch (const std::runtime_error &e) {
+        std::cout << "exception: " << e.what() << std::endl;
+    }
+    iom.stop();
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <iostream>
+#include <system_error>
+
+#include "cancel.hpp"
+#include "fd_manager.hpp"
+#include "iomanager.hpp"
+
+using namespace qc;
+
+static int s_fds[2];
+
+/// @brief deadline到达后,组内挂在recv,usleep和future上的子协程都返回ECANCELED
+void deadline() {
+    uint64_t start = GetElapsedMS();
+    Promise<int> never;
+    FiberGroup group;
+    group.setDeadline(50);
+    group.spawn([]() {
+        char buf[16];
+        ssize_t n = recv(s_fds[0], buf, sizeof(buf), 0);
+        qc_assert(n == -1 && errno == ECANCELED);
+        std::cout << "recv cancelled" << std::endl;
+    });
+    group.spawn([]() {
+        int rt = usleep(10 * 1000 * 1000);
+        qc_assert(rt == -1 && errno == ECANCELED);
+        std::cout << "usleep cancelled" << std::endl;
+    });
+    group.spawn([never]() {
+        try {
+            never.get_future().get();
+            qc_assert(false);
+        } catch (const std::system_error &e) {
+            qc_assert(e.code().value() == ECANCELED);
+            std::cout << "future wait cancelled" << std::endl;
+        }
+    });
+    group.spawn([]() {
+        // async启动的任务继承令牌,嵌套的组以当前令牌为父
+        Future<int> f = async([]() { return usleep(10 * 1000 * 1000) == -1 ? errno : 0; });
+        FiberGroup inner;
+        inner.spawn([]() { qc_assert(sleep(10) == 10 && errno == ECANCELED); });
+        inner.join();
+        // 当前协程也已经被取消,子任务还没结束时get()直接抛出ECANCELED
+        int err;
+        try {
+            err = f.get();
+        } catch (const std::system_error &e) {
+            err = e.code().value();
+        }
+        qc_assert(err == ECANCELED);
+        std::cout << "nested tasks cancelled" << std::endl;
+    });
+    group.join();
+    uint64_t used = GetElapsedMS() - start;
+    std::cout << "deadline group joined after " << used << "ms" << std::endl;
+    qc_assert(used < 1000);
+}
+
+/// @brief 显式取消,之后新的等待也立即失败
+void explicit_cancel() {
+    FiberGroup group;
+    group.spawn([]() {
+        qc_assert(usleep(10 * 1000 * 1000) == -1 && errno == ECANCELED);
+        qc_assert(usleep(10 * 1000 * 1000) == -1 && errno == ECANCELED);
+    });
+    usleep(10 * 1000);
+    group.cancel();
+    group.join();
+    std::cout << "explicit cancel done" << std::endl;
+}
+
+/// @brief 没有被取消的组正常结束
+void normal() {
+    FiberGroup group;
+    group.setDeadline(10 * 1000);
+    std::atomic<int> sum{0};
+    for (int i = 1; i <= 3; ++i) {
+        group.spawn([&sum, i]() {
+            usleep(i * 1000);
+            sum += i;
+        });
+    }
+    group.join();
+    qc_assert(sum == 6 && !group.isCancelled());
+    std::cout << "normal group sum = " << sum.load() << std::endl;
+}
+
+int main() {
+    qc_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, s_fds) == 0);
+    // socketpair没有被hook,手动登记后读写才会走协程的IO等待
+    FdMgr::GetInstance()->get(s_fds[0], true);
+    FdMgr::GetInstance()->get(s_fds[1], true);
+    {
+        IOManager iom(3, true, "cancel");
+        iom.add_task(deadline);
+        iom.add_task(explicit_cancel);
+        iom.add_task(normal);
+        iom.stop();
+    }
+    close(s_fds[0]);
+    close(s_fds[1]);
+    return 0;
+}
@@ -0,0 +1,66 @@
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iostream>
+#include <map>
+
+#include "iomanager.hpp"
+#include "numa.hpp"
+
+using namespace qc;
+
+static Mutex s_mutex;
+/// @brief 每个工作线程的tid -> 允许运行的cpu数
+static std::map<pid_t, int> s_allowed;
+static std::atomic<int> s_done{0};
+
+void child() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    qc_assert(sched_getaffinity(0, sizeof(set), &set) == 0);
+    {
+        Mutex::Lock lock(s_mutex);
+        s_allowed[syscall(SYS_gettid)] = CPU_COUNT(&set);
+    }
+    // 让父任务继续往本地队列里放任务,空闲的线程来偷
+    usleep(100);
+    ++s_done;
+}
+
+void parent() {
+    for (int i = 0; i < 1000; ++i) IOManager::GetThis()->add_task(child);
+}
+
+int main() {
+    std::cout << "numa nodes = " << Numa::NodeCount() << std::endl;
+    for (int node = 0; node < Numa::NodeCount(); ++node) {
+        std::cout << "node " << node << " cpus:";
+        for (int cpu : Numa::CpusOfNode(node)) std::cout << " " << cpu;
+        std::cout << std::endl;
+    }
+
+    uint64_t steals = Metrics::GetSnapshot().totals[Metrics::STEALS];
+    {
+        SchedulerOptions options;
+        options.numa_aware = true;
+        // 2个工作线程绑定到cpu上,use_caller的Main线程不绑定
+        IOManager iom(3, true, "affinity", options);
+        iom.add_task(parent);
+        iom.stop();
+    }
+    qc_assert(s_done == 1000);
+    Metrics::Snapshot snap = Metrics::GetSnapshot();
+    steals = snap.totals[Metrics::STEALS] - steals;
+
+    pid_t main_tid = syscall(SYS_gettid);
+    for (auto &i : s_allowed) {
+        if (i.first == main_tid) continue;
+        std::cout << "worker " << i.first << " allowed cpus = " << i.second << std::endl;
+        qc_assert(i.second == 1);
+    }
+    std::cout << "steals = " << steals << ", remote steals = "
+              << snap.totals[Metrics::REMOTE_STEALS] << std::endl;
+    return 0;
+}
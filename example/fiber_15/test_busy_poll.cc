@@ -0,0 +1,81 @@
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iostream>
+
+#include "iomanager.hpp"
+
+using namespace qc;
+
+static const int ROUNDS = 2000;
+static const int SLEEPS = 50;
+
+static Histogram s_rtt;
+static std::atomic<int> s_done{0};
+
+/// @brief 对端收到什么就回什么
+void echo(int fd) {
+    char c;
+    for (int i = 0; i < ROUNDS; ++i) {
+        qc_assert(read(fd, &c, 1) == 1);
+        qc_assert(write(fd, &c, 1) == 1);
+    }
+    close(fd);
+    ++s_done;
+}
+
+/// @brief 一问一答,记录往返时间;read在没有数据时挂起协程,由IOManager唤醒
+void ping(int fd) {
+    char c = 'x';
+    for (int i = 0; i < ROUNDS; ++i) {
+        uint64_t begin = GetMonotonicNS();
+        qc_assert(write(fd, &c, 1) == 1);
+        qc_assert(read(fd, &c, 1) == 1);
+        s_rtt.record(GetMonotonicNS() - begin);
+    }
+    close(fd);
+    ++s_done;
+}
+
+/// @brief 忙轮询线程不阻塞在epoll_wait上,定时器要在轮询循环中检查
+void sleeper() {
+    uint64_t begin = GetMonotonicNS();
+    for (int i = 0; i < SLEEPS; ++i) usleep(1000);
+    uint64_t ms = (GetMonotonicNS() - begin) / 1000000;
+    std::cout << SLEEPS << " x 1ms sleep took " << ms << " ms" << std::endl;
+    qc_assert(ms >= (uint64_t)SLEEPS);
+    ++s_done;
+}
+
+int main() {
+    uint64_t tickles = Metrics::GetSnapshot().totals[Metrics::TICKLES_SENT];
+    uint64_t stop_ms;
+    {
+        SchedulerOptions options;
+        // 第0个工作线程忙轮询,第1个照常阻塞
+        options.busy_poll = {0};
+        options.busy_poll_us = 50;
+        IOManager iom(3, true, "busy_poll", options);
+
+        int fds[2];
+        qc_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        iom.add_task(std::bind(echo, fds[0]));
+        iom.add_task(std::bind(ping, fds[1]));
+        iom.add_task(sleeper);
+
+        // 有线程在忙轮询时tickle不写管道,停止时其他阻塞的线程也要能被叫醒
+        while (s_done < 3) usleep(1000);
+        uint64_t begin = GetMonotonicNS();
+        iom.stop();
+        stop_ms = (GetMonotonicNS() - begin) / 1000000;
+    }
+    tickles = Metrics::GetSnapshot().totals[Metrics::TICKLES_SENT] - tickles;
+
+    std::cout << "rtt p50 = " << s_rtt.percentile(0.5) / 1000.0 << " us, p99 = "
+              << s_rtt.percentile(0.99) / 1000.0 << " us" << std::endl;
+    std::cout << "tickles sent = " << tickles << ", stop took " << stop_ms << " ms" << std::endl;
+    // 阻塞的线程只能等epoll_wait超时(5s)才看到停止条件时会超过这个时间
+    qc_assert(stop_ms < 1000);
+    return 0;
+}
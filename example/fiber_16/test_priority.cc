@@ -0,0 +1,142 @@
+#include <unistd.h>
+
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "iomanager.hpp"
+#include "metrics.hpp"
+
+using namespace qc;
+
+static std::atomic<bool> s_gate{false};
+static std::atomic<int> s_done{0};
+
+/// @brief 占住唯一的工作线程,让后面的任务都排在队列里
+void hold() {
+    while (!s_gate.load()) std::this_thread::yield();
+}
+
+/// @brief 等任务都由工作线程执行完再stop,调用线程在stop中才参与调度
+static void wait_done(int n) {
+    while (s_done.load() < n) std::this_thread::yield();
+}
+
+static void busy(uint64_t ns) {
+    uint64_t start = GetMonotonicNS();
+    while (GetMonotonicNS() - start < ns) {
+    }
+}
+
+/// @brief 严格优先级: 最后加入的高优先级任务最先执行,后台任务最后执行
+void test_order() {
+    SchedulerOptions options;
+    options.priority_aging_us = 0;
+    std::vector<int> order;
+    TaskPriority child = PRIORITY_INHERIT;
+    {
+        // 1个工作线程 + 调用线程,队列里的任务只由工作线程按顺序执行
+        IOManager iom(2, true, "priority", options);
+        s_gate = false;
+        s_done = 0;
+        auto record = [&order](int p) {
+            order.push_back(p);
+            ++s_done;
+        };
+        iom.add_task(hold);
+        iom.add_task(std::bind(record, PRIORITY_BACKGROUND), -1, PRIORITY_BACKGROUND);
+        for (int i = 0; i < 100; ++i) iom.add_task(std::bind(record, PRIORITY_NORMAL));
+        iom.add_task(
+            [&]() {
+                record(PRIORITY_HIGH);
+                // 不指定优先级时沿用当前协程的
+                iom.add_task([&child]() {
+                    child = Fiber::GetCurrent()->getPriority();
+                    ++s_done;
+                });
+            },
+            -1, PRIORITY_HIGH);
+        s_gate = true;
+        wait_done(103);
+        iom.stop();
+    }
+    qc_assert(order.size() == 102);
+    qc_assert(order.front() == PRIORITY_HIGH);
+    qc_assert(order.back() == PRIORITY_BACKGROUND);
+    qc_assert(child == PRIORITY_HIGH);
+    std::cout << "order: high first, background last" << std::endl;
+}
+
+/// @brief 高优先级任务源源不断时,后台任务等待超过老化时间后也能执行
+void test_aging() {
+    SchedulerOptions options;
+    options.priority_aging_us = 2000;
+    uint64_t aged_before = Metrics::GetSnapshot().totals[Metrics::PRIORITY_AGED];
+    std::atomic<uint64_t> bg_ns{0};
+    std::atomic<uint64_t> chain_end_ns{0};
+    {
+        IOManager iom(2, true, "priority", options);
+        s_gate = false;
+        s_done = 0;
+        iom.add_task(hold);
+        iom.add_task(
+            [&bg_ns]() {
+                bg_ns = GetMonotonicNS();
+                ++s_done;
+            },
+            -1, PRIORITY_BACKGROUND);
+        uint64_t deadline = GetMonotonicNS() + 100 * 1000 * 1000;
+        // 每个高优先级任务结束前再添加一个(沿用高优先级),直到deadline
+        std::function<void()> chain = [&]() {
+            busy(200 * 1000);
+            if (GetMonotonicNS() < deadline) {
+                iom.add_task(chain);
+                return;
+            }
+            chain_end_ns = GetMonotonicNS();
+            ++s_done;
+        };
+        iom.add_task(chain, -1, PRIORITY_HIGH);
+        s_gate = true;
+        wait_done(2);
+        iom.stop();
+    }
+    qc_assert(bg_ns && chain_end_ns);
+    qc_assert(bg_ns < chain_end_ns);
+    qc_assert(Metrics::GetSnapshot().totals[Metrics::PRIORITY_AGED] > aged_before);
+    std::cout << "aging: background ran " << (chain_end_ns - bg_ns) / 1000000
+              << " ms before the high priority chain ended" << std::endl;
+}
+
+/// @brief 协程挂起后被唤醒,重新入队时保持原来的优先级
+void test_wakeup() {
+    TaskPriority after = PRIORITY_INHERIT;
+    {
+        IOManager iom(2, true, "priority");
+        s_done = 0;
+        iom.add_task(
+            [&after]() {
+                usleep(1000);
+                after = Fiber::GetCurrent()->getPriority();
+                ++s_done;
+            },
+            -1, PRIORITY_HIGH);
+        wait_done(1);
+        iom.stop();
+    }
+    qc_assert(after == PRIORITY_HIGH);
+    std::cout << "wakeup: priority kept after sleep" << std::endl;
+}
+
+int main() {
+    test_order();
+    test_aging();
+    test_wakeup();
+
+    std::string dump = Metrics::Dump();
+    qc_assert(dump.find("priority=\"high\"") != std::string::npos);
+    qc_assert(dump.find("priority=\"background\"") != std::string::npos);
+    std::cout << "metrics: per-priority sched latency exported" << std::endl;
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iostream>
+
+#include "iomanager.hpp"
+#include "metrics.hpp"
+
+using namespace qc;
+
+static const uint64_t HOG_NS = 100 * 1000 * 1000;
+static const uint64_t SLICE_US = 2000;
+
+static std::atomic<int> s_done{0};
+
+/// @brief 纯计算的循环,只在maybe_yield处可能让出
+void compute_hog() {
+    uint64_t start = GetMonotonicNS();
+    int yields = 0;
+    while (GetMonotonicNS() - start < HOG_NS) {
+        if (maybe_yield()) ++yields;
+    }
+    std::cout << "compute hog yielded " << yields << " times" << std::endl;
+    ++s_done;
+}
+
+/// @brief 一直在做立即完成的IO(从一端写,另一端马上读出来,不会挂起),在hook的IO调用处让出
+void io_hog(int wfd, int rfd) {
+    uint64_t start = GetMonotonicNS();
+    char c = 'x';
+    while (GetMonotonicNS() - start < HOG_NS) {
+        qc_assert(write(wfd, &c, 1) == 1);
+        qc_assert(read(rfd, &c, 1) == 1);
+    }
+    close(wfd);
+    close(rfd);
+    ++s_done;
+}
+
+/**
+ * @brief 等到hog开始运行之后添加一个短任务,返回它从入队到执行的延迟(毫秒)
+ * @details 1个工作线程 + 调用线程,调用线程直到stop才参与调度,短任务只能等工作线程上的hog让出
+ */
+uint64_t probe_behind(std::function<void()> hog, uint64_t slice_us) {
+    SchedulerOptions options;
+    options.time_slice_us = slice_us;
+    std::atomic<uint64_t> latency_ns{0};
+    {
+        IOManager iom(2, true, "preempt", options);
+        s_done = 0;
+        std::atomic<bool> started{false};
+        iom.add_task([&]() {
+            started = true;
+            hog();
+        });
+        while (!started) usleep(100);
+        uint64_t begin = GetMonotonicNS();
+        iom.add_task([&]() {
+            latency_ns = GetMonotonicNS() - begin;
+            ++s_done;
+        });
+        while (s_done < 2) usleep(1000);
+        iom.stop();
+    }
+    return latency_ns / 1000000;
+}
+
+int main() {
+    uint64_t preemptions = Metrics::GetSnapshot().totals[Metrics::PREEMPTIONS];
+
+    uint64_t ms = probe_behind(compute_hog, 0);
+    std::cout << "no time slice: probe waited " << ms << " ms" << std::endl;
+    qc_assert(ms * 1000 * 1000 >= HOG_NS / 2);
+
+    ms = probe_behind(compute_hog, SLICE_US);
+    std::cout << "compute hog, 2ms slice: probe waited " << ms << " ms" << std::endl;
+    qc_assert(ms * 1000 * 1000 < HOG_NS / 2);
+
+    int fds[2];
+    qc_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    ms = probe_behind(std::bind(io_hog, fds[1], fds[0]), SLICE_US);
+    std::cout << "io hog, 2ms slice: probe waited " << ms << " ms" << std::endl;
+    qc_assert(ms * 1000 * 1000 < HOG_NS / 2);
+
+    preemptions = Metrics::GetSnapshot().totals[Metrics::PREEMPTIONS] - preemptions;
+    std::cout << "preemptions = " << preemptions << std::endl;
+    qc_assert(preemptions >= 2);
+    return 0;
+}
@@ -0,0 +1,80 @@
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iostream>
+
+#include "iomanager.hpp"
+#include "metrics.hpp"
+#include "mutex.hpp"
+#include "profiler.hpp"
+
+using namespace qc;
+
+static const uint64_t BLOCK_MS = 300;
+static const uint64_t THRESHOLD_US = 20 * 1000;
+
+static Mutex s_lock;
+static std::atomic<pid_t> s_blocked_tid{0};
+static std::atomic<int> s_done{0};
+
+/// @brief 在没有hook的Mutex上阻塞,直到主线程释放
+__attribute__((noinline)) void blocked_in_lock() {
+    s_blocked_tid = syscall(SYS_gettid);
+    Mutex::Lock lock(s_lock);
+    ++s_done;
+}
+
+static uint64_t counter(Metrics::Counter c) { return Metrics::GetSnapshot().totals[c]; }
+
+/**
+ * @brief 唯一的工作线程阻塞在Mutex上时添加一个短任务,返回它从入队到执行的延迟(毫秒)
+ * @details 1个工作线程 + 调用线程,调用线程直到stop才参与调度
+ */
+uint64_t probe_while_blocked(size_t compensation, std::string *stack) {
+    SchedulerOptions options;
+    options.block_threshold_us = THRESHOLD_US;
+    options.block_compensation = compensation;
+    options.block_capture_stack = true;
+    std::atomic<uint64_t> latency_ns{0};
+    {
+        IOManager iom(2, true, "watchdog", options);
+        s_done = 0;
+        s_blocked_tid = 0;
+        s_lock.lock();
+        iom.add_task(blocked_in_lock);
+        while (!s_blocked_tid) usleep(100);
+        usleep(1000);
+        if (stack) *stack = Profiler::CaptureStack(s_blocked_tid);
+
+        uint64_t begin = GetMonotonicNS();
+        iom.add_task([&]() {
+            latency_ns = GetMonotonicNS() - begin;
+            ++s_done;
+        });
+        usleep(BLOCK_MS * 1000);
+        s_lock.unlock();
+        while (s_done < 2) usleep(1000);
+        iom.stop();
+    }
+    return latency_ns / 1000000;
+}
+
+int main() {
+    uint64_t blocked = counter(Metrics::BLOCKED_WORKERS);
+    std::string stack;
+    uint64_t ms = probe_while_blocked(0, &stack);
+    std::cout << "report only: probe waited " << ms << " ms" << std::endl;
+    std::cout << "captured stack:" << std::endl << stack << std::flush;
+    qc_assert(ms >= BLOCK_MS / 2);
+    qc_assert(stack.find("blocked_in_lock") != std::string::npos);
+    qc_assert(counter(Metrics::BLOCKED_WORKERS) - blocked == 1);
+    qc_assert(counter(Metrics::COMPENSATION_WORKERS) == 0);
+
+    ms = probe_while_blocked(1, nullptr);
+    std::cout << "compensation: probe waited " << ms << " ms" << std::endl;
+    qc_assert(ms < BLOCK_MS / 2);
+    qc_assert(counter(Metrics::BLOCKED_WORKERS) - blocked == 2);
+    qc_assert(counter(Metrics::COMPENSATION_WORKERS) == 1);
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iostream>
+#include <set>
+
+#include "iomanager.hpp"
+#include "metrics.hpp"
+
+using namespace qc;
+
+static const int BURST = 100;
+static const uint64_t TASK_NS = 2 * 1000 * 1000;
+static const uint64_t COOLDOWN_US = 100 * 1000;
+
+static std::atomic<int> s_done{0};
+
+static void busy(uint64_t ns) {
+    uint64_t start = GetMonotonicNS();
+    while (GetMonotonicNS() - start < ns) {
+    }
+}
+
+static uint64_t counter(Metrics::Counter c) { return Metrics::GetSnapshot().totals[c]; }
+
+/// @brief 这个调度器当前的工作线程数(qc_worker_threads仪表)
+static int64_t worker_threads() {
+    for (auto &g : Metrics::GetSnapshot().gauges) {
+        if (g.first == "qc_worker_threads{scheduler=\"elastic\"}") return g.second;
+    }
+    return -1;
+}
+
+int main() {
+    SchedulerOptions options;
+    options.max_threads = 4;
+    options.scale_latency_us = 1000;
+    options.scale_cooldown_us = COOLDOWN_US;
+
+    // 1个常驻工作线程 + 调用线程,调用线程直到stop才参与调度
+    IOManager iom(2, true, "elastic", options);
+    std::atomic<pid_t> fixed_tid{0};
+    iom.add_task([&]() { fixed_tid = syscall(SYS_gettid); });
+    while (!fixed_tid) usleep(100);
+    qc_assert(worker_threads() == 2);
+
+    // 一批计算任务,常驻线程一个一个执行要200ms,排队延迟远超目标
+    std::atomic<int> pinned_ok{0};
+    for (int i = 0; i < BURST; ++i) {
+        iom.add_task([]() {
+            busy(TASK_NS);
+            ++s_done;
+        });
+        // 指定给常驻线程的任务不受伸缩影响
+        if (i % 10 == 0) {
+            iom.add_task(
+                [&]() {
+                    if (syscall(SYS_gettid) == fixed_tid) ++pinned_ok;
+                    ++s_done;
+                },
+                fixed_tid);
+        }
+    }
+    int64_t peak = 0;
+    while (s_done < BURST + BURST / 10) {
+        peak = std::max(peak, worker_threads());
+        usleep(1000);
+    }
+    uint64_t spawns = counter(Metrics::ELASTIC_SPAWNS);
+    std::cout << "burst: peak " << peak << " threads, " << spawns << " elastic spawns" << std::endl;
+    qc_assert(spawns >= 1);
+    qc_assert(peak > 2 && peak <= 4);
+    qc_assert(pinned_ok == BURST / 10);
+
+    // 空闲超过冷却时间后退回常驻线程数
+    uint64_t deadline = GetMonotonicNS() + 20 * COOLDOWN_US * 1000;
+    while (worker_threads() != 2 && GetMonotonicNS() < deadline) usleep(10 * 1000);
+    std::cout << "idle: " << worker_threads() << " threads, " << counter(Metrics::ELASTIC_RETIRES)
+              << " elastic retires" << std::endl;
+    qc_assert(worker_threads() == 2);
+    qc_assert(counter(Metrics::ELASTIC_RETIRES) == spawns);
+
+    iom.stop();
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "percore.hpp"
+
+using namespace qc;
+
+static const size_t CORES = 3;
+
+/// @brief 消息在目标核上执行,同一个发送方的消息按顺序执行
+void test_submit(PerCore &pc) {
+    const int N = 1000;
+    std::vector<int> seen[CORES];
+    std::atomic<int> done{0};
+    std::atomic<bool> wrong_core{false};
+    for (int i = 0; i < N; ++i) {
+        size_t c = i % CORES;
+        pc.submit(c, [&, c, i]() {
+            if (pc.currentCore() != (int)c) wrong_core = true;
+            seen[c].push_back(i);
+            ++done;
+        });
+    }
+    while (done < N) usleep(1000);
+    qc_assert(!wrong_core);
+    for (size_t c = 0; c < CORES; ++c) {
+        for (size_t k = 1; k < seen[c].size(); ++k) qc_assert(seen[c][k - 1] < seen[c][k]);
+    }
+    qc_assert(pc.currentCore() == -1);
+    std::cout << "submit: " << N << " messages ran in order on their cores" << std::endl;
+}
+
+/// @brief 多个线程同时往同一个核发消息,一条不丢
+void test_mpsc(PerCore &pc) {
+    const int THREADS = 4;
+    const int N = 20000;
+    std::atomic<int> done{0};
+    std::vector<std::thread> producers;
+    for (int t = 0; t < THREADS; ++t) {
+        producers.emplace_back([&]() {
+            for (int i = 0; i < N; ++i) pc.submit(0, [&done]() { ++done; });
+        });
+    }
+    for (auto &t : producers) t.join();
+    while (done < THREADS * N) usleep(1000);
+    std::cout << "mpsc: " << THREADS * N << " messages from " << THREADS << " threads" << std::endl;
+}
+
+/// @brief invoke挂起调用方的协程,在目标核上执行完再回来
+void test_invoke(PerCore &pc) {
+    std::atomic<int> done{0};
+    std::atomic<bool> ok{true};
+    for (size_t from = 0; from < CORES; ++from) {
+        pc.core(from)->add_task([&, from]() {
+            for (size_t to = 0; to < CORES; ++to) {
+                int where = -1;
+                pc.invoke(to, [&]() { where = pc.currentCore(); });
+                if (where != (int)to || pc.currentCore() != (int)from) ok = false;
+            }
+            ++done;
+        });
+    }
+    while (done < (int)CORES) usleep(1000);
+    qc_assert(ok);
+
+    // 不在协程中时阻塞等待
+    int where = -1;
+    pc.invoke(1, [&]() { where = pc.currentCore(); });
+    qc_assert(where == 1);
+
+    std::atomic<int> hits{0};
+    pc.broadcast([&]() { hits += 1 << pc.currentCore(); });
+    while (hits != (1 << CORES) - 1) usleep(1000);
+    std::cout << "invoke: results come back to the calling core" << std::endl;
+}
+
+/// @brief 每个连接在接受它的核上处理,回复处理它的核
+void test_listen(PerCore &pc) {
+    int port = pc.listen("127.0.0.1", 0, [&pc](int fd) {
+        char c = '0' + pc.currentCore();
+        char buf[1];
+        if (recv(fd, buf, 1, 0) == 1) send(fd, &c, 1, 0);
+        close(fd);
+    });
+    qc_assert(port > 0);
+
+    const int CONNS = 64;
+    int per_core[CORES] = {0};
+    for (int i = 0; i < CONNS; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        inet_aton("127.0.0.1", &addr.sin_addr);
+        qc_assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+        char c = 'x';
+        qc_assert(send(fd, &c, 1, 0) == 1);
+        qc_assert(recv(fd, &c, 1, 0) == 1);
+        qc_assert(c >= '0' && c < (char)('0' + CORES));
+        ++per_core[c - '0'];
+        close(fd);
+    }
+    std::cout << "listen: connections per core";
+    for (size_t c = 0; c < CORES; ++c) std::cout << " " << per_core[c];
+    std::cout << std::endl;
+    // SO_REUSEPORT按四元组散列,64个连接不会都落在同一个核上
+    int used = 0;
+    for (size_t c = 0; c < CORES; ++c) used += per_core[c] > 0;
+    qc_assert(used > 1);
+}
+
+/// @brief fd在核0上等待读,核1上关闭: 事件按注册它的IOManager取消,等待的协程在核0上醒来
+void test_cross_close(PerCore &pc) {
+    int sv[2];
+    qc_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    std::atomic<int> result{0};
+    pc.core(0)->add_task([&]() {
+        // hook登记之后recv才会挂起协程
+        FdMgr::GetInstance()->get(sv[0], true);
+        char c;
+        ssize_t n = recv(sv[0], &c, 1, 0);
+        result = (n == -1 && pc.currentCore() == 0) ? 1 : -1;
+    });
+    usleep(50 * 1000);
+    pc.invoke(1, [&]() { close(sv[0]); });
+    while (!result) usleep(1000);
+    qc_assert(result == 1);
+    close(sv[1]);
+    std::cout << "cross close: waiter on core 0 woken by close on core 1" << std::endl;
+}
+
+int main() {
+    PerCore pc(CORES, "percore");
+    test_submit(pc);
+    test_mpsc(pc);
+    test_invoke(pc);
+    test_listen(pc);
+    test_cross_close(pc);
+    pc.stop();
+    return 0;
+}
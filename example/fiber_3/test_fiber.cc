@@ -17,10 +17,10 @@ void test_fiber() {
     Fiber::ptr cur = Fiber::GetThis();
     cout << "[fiber] : get fiber succ." << endl;
     // 使用智能指针,创建对象就需要使用只能指针的形式
-    // Fiber::ptr fiber(new Fiber(fiber_func, 0, true));
+    // Fiber::ptr fiber = Fiber::Create(fiber_func, 0, true);
 
     // 
-    Fiber *fiber = new Fiber(fiber_func, 0);
+    Fiber::ptr fiber = Fiber::Create(fiber_func, 0);
     fiber->resume();
 
     cout << "[main fiber] : " << cur->git_id() << " running." << endl;
@@ -27,7 +27,7 @@ int main() {
     sche.add_task(test_fiber_1);
     sche.add_task(test_fiber_2);
 
-    Fiber::ptr fiber(new Fiber(&test_fiber_3));
+    Fiber::ptr fiber = Fiber::Create(&test_fiber_3);
 
     sche.add_task(fiber);
 
@@ -0,0 +1,136 @@
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include "iomanager.hpp"
+#include "resolver.hpp"
+
+using namespace qc;
+
+/// @brief 本地stub DNS服务器: stub.test -> 10.1.2.3 (TTL 1s), 其余名字返回NXDOMAIN
+static int s_dns_sock = -1;
+static int s_query_count = 0;
+
+static std::string read_qname(const uint8_t *buf, size_t len, size_t &off) {
+    std::string name;
+    while (off < len && buf[off]) {
+        if (!name.empty()) name += ".";
+        name.append((const char *)buf + off + 1, buf[off]);
+        off += buf[off] + 1;
+    }
+    ++off;
+    return name;
+}
+
+void stub_dns_server() {
+    uint8_t buf[512];
+    while (true) {
+        sockaddr_in from;
+        socklen_t len = sizeof(from);
+        ssize_t n = recvfrom(s_dns_sock, buf, sizeof(buf), 0, (sockaddr *)&from, &len);
+        if (n <= 12) break;  // socket被关闭
+        ++s_query_count;
+
+        size_t off = 12;
+        std::string name = read_qname(buf, n, off);
+        uint16_t qtype = (buf[off] << 8) | buf[off + 1];
+        off += 4;
+
+        std::string resp((const char *)buf, off);
+        resp[2] = (char)0x81;  // QR RD
+        resp[3] = (char)0x80;  // RA
+        if (name == "stub.test" && qtype == 1) {
+            resp[7] = 1;  // ANCOUNT
+            const uint8_t answer[] = {0xc0, 0x0c, 0, 1, 0, 1, 0, 0, 0, 1, 0, 4, 10, 1, 2, 3};
+            resp.append((const char *)answer, sizeof(answer));
+        } else if (name != "stub.test") {
+            resp[3] |= 3;  // NXDOMAIN
+        }
+        sendto(s_dns_sock, resp.data(), resp.size(), 0, (sockaddr *)&from, len);
+    }
+    std::cout << "stub dns server exit" << std::endl;
+}
+
+void test_resolver() {
+    Resolver *resolver = ResolverMgr::GetInstance();
+    std::vector<ResolvedAddr> addrs;
+
+    // 第一次走stub server,第二次命中TTL缓存
+    qc_assert(resolver->resolve("stub.test", AF_INET, addrs) == 0);
+    qc_assert(addrs.size() == 1 && addrs[0].addr.v4.s_addr == inet_addr("10.1.2.3"));
+    qc_assert(resolver->resolve("STUB.test", AF_INET, addrs) == 0);
+    qc_assert(s_query_count == 1);
+
+    // TTL过期后重新查询
+    sleep(2);
+    qc_assert(resolver->resolve("stub.test", AF_INET, addrs) == 0);
+    qc_assert(s_query_count == 2);
+
+    // 不存在的名字,否定结果也会被缓存
+    qc_assert(resolver->resolve("missing.test", AF_INET, addrs) == EAI_NONAME);
+    qc_assert(resolver->resolve("missing.test", AF_INET, addrs) == EAI_NONAME);
+    qc_assert(s_query_count == 3);
+
+    // hosts表不需要查询
+    qc_assert(resolver->resolve("myhost", AF_INET, addrs) == 0);
+    qc_assert(addrs[0].addr.v4.s_addr == inet_addr("192.0.2.7"));
+    qc_assert(s_query_count == 3);
+
+    // hook之后的getaddrinfo/gethostbyname
+    struct addrinfo hints, *res = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    qc_assert(getaddrinfo("stub.test", "80", &hints, &res) == 0);
+    sockaddr_in *sin = (sockaddr_in *)res->ai_addr;
+    qc_assert(sin->sin_addr.s_addr == inet_addr("10.1.2.3") && ntohs(sin->sin_port) == 80);
+    freeaddrinfo(res);
+
+    struct hostent *host = gethostbyname("alias1");
+    qc_assert(host && ((in_addr *)host->h_addr_list[0])->s_addr == inet_addr("192.0.2.7"));
+
+    // 缓存满时淘汰最早过期的,外部输入的名字不会让缓存无限增长
+    resolver->setCacheCapacity(2);
+    int before = s_query_count;
+    qc_assert(resolver->resolve("a.test", AF_INET, addrs) == EAI_NONAME);
+    qc_assert(resolver->resolve("b.test", AF_INET, addrs) == EAI_NONAME);
+    qc_assert(resolver->resolve("c.test", AF_INET, addrs) == EAI_NONAME);
+    qc_assert(resolver->resolve("c.test", AF_INET, addrs) == EAI_NONAME);
+    qc_assert(s_query_count == before + 3);
+    qc_assert(resolver->resolve("a.test", AF_INET, addrs) == EAI_NONAME);
+    qc_assert(s_query_count == before + 4);
+
+    std::cout << "resolver test ok, queries = " << s_query_count << std::endl;
+    close(s_dns_sock);
+}
+
+int main() {
+    std::ofstream("/tmp/qc_test_hosts") << "192.0.2.7 myhost alias1\n";
+
+    IOManager iom(1, true, "resolver");
+    iom.add_task([]() {
+        s_dns_sock = socket(AF_INET, SOCK_DGRAM, 0);
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        qc_assert(bind(s_dns_sock, (sockaddr *)&addr, sizeof(addr)) == 0);
+        socklen_t len = sizeof(addr);
+        getsockname(s_dns_sock, (sockaddr *)&addr, &len);
+
+        Resolver *resolver = ResolverMgr::GetInstance();
+        resolver->setNameservers({addr});
+        resolver->setTimeout(1000);
+        resolver->loadHosts("/tmp/qc_test_hosts");
+
+        IOManager::GetThis()->add_task(stub_dns_server);
+        IOManager::GetThis()->add_task(test_resolver);
+    });
+    iom.stop();
+    return 0;
+}
@@ -0,0 +1,46 @@
+#include <unistd.h>
+
+#include <iostream>
+
+#include "iomanager.hpp"
+#include "metrics.hpp"
+
+using namespace qc;
+
+void short_task() {}
+
+void sleep_task() {
+    // hook之后的usleep,会经过定时器和epoll
+    usleep(10 * 1000);
+}
+
+void busy_task() {
+    // 没有让出的忙等,会被标记为长任务
+    uint64_t start = GetMonotonicNS();
+    while (GetMonotonicNS() - start < 5 * 1000 * 1000) {
+    }
+}
+
+int main() {
+    {
+        IOManager iom(2, true, "metrics");
+        iom.setLongRunThreshold(2 * 1000 * 1000);
+        for (int i = 0; i < 1000; ++i) iom.add_task(short_task);
+        for (int i = 0; i < 10; ++i) iom.add_task(sleep_task);
+        iom.add_task(busy_task);
+        iom.stop();
+    }
+
+    Metrics::Snapshot snap = Metrics::GetSnapshot();
+    qc_assert(snap.totals[Metrics::TASKS_EXECUTED] >= 1011);
+    qc_assert(snap.totals[Metrics::TIMER_INSERTS] >= 10);
+    qc_assert(snap.totals[Metrics::TIMER_FIRES] >= 10);
+    qc_assert(snap.sched_latency.count() >= 1011);
+    // sleep_task在usleep处让出一次,被resume两次
+    qc_assert(snap.run_duration.count() >= 1021);
+    qc_assert(snap.totals[Metrics::LONG_RUNS] == 1);
+    qc_assert(snap.run_duration.max() >= 5 * 1000 * 1000);
+
+    std::cout << Metrics::Dump();
+    return 0;
+}
@@ -0,0 +1,64 @@
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+#include "fd_manager.hpp"
+#include "iomanager.hpp"
+#include "trace.hpp"
+
+using namespace qc;
+
+static int s_fds[2];
+
+void reader() {
+    char buf[16];
+    // 没有数据时会注册读事件让出,由writer写入后被唤醒
+    int n = read(s_fds[0], buf, sizeof(buf));
+    qc_assert(n == 5);
+}
+
+void writer() {
+    usleep(10 * 1000);
+    int n = write(s_fds[1], "hello", 5);
+    qc_assert(n == 5);
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "fiber.qctrace";
+    qc_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, s_fds) == 0);
+    // socketpair没有被hook,手动登记后读写才会走协程的IO等待
+    FdMgr::GetInstance()->get(s_fds[0], true);
+    FdMgr::GetInstance()->get(s_fds[1], true);
+
+    Tracer::Start();
+    {
+        IOManager iom(2, true, "trace");
+        iom.add_task(reader);
+        iom.add_task(writer);
+        iom.stop();
+    }
+    Tracer::Stop();
+
+    qc_assert(Tracer::Dump(path));
+    std::cout << "trace written to " << path << ", convert with tools/trace2json" << std::endl;
+
+    // 反复创建退出的线程(补偿线程,弹性线程)复用退出线程的环,不会每个线程留一个
+    const int THREADS = 64;
+    Tracer::Start(1024);
+    for (int i = 0; i < THREADS; ++i) {
+        std::thread([]() { Tracer::Emit(Tracer::TICKLE, 0); }).join();
+    }
+    Tracer::Stop();
+    std::string churn = std::string(path) + ".churn";
+    qc_assert(Tracer::Dump(churn));
+    Tracer::FileHeader fh;
+    std::ifstream ifs(churn, std::ios::binary);
+    qc_assert(ifs.read((char *)&fh, sizeof(fh)));
+    std::cout << THREADS << " short-lived threads left " << fh.threads << " rings" << std::endl;
+    qc_assert(fh.threads < 32);
+    unlink(churn.c_str());
+    return 0;
+}
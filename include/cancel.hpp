@@ -0,0 +1,110 @@
+/**
+ * @file cancel.hpp
+ * @author qc
+ * @brief 取消令牌和协程组
+ * @details CancelToken挂在协程上(Fiber::setCancelToken),被取消(显式cancel或者到达deadline)后,
+ *          这个协程中挂起的hook IO,sleep和Future等待会立即返回ECANCELED,之后新的等待也直接失败.
+ *          令牌可以有父令牌,父令牌取消时子令牌跟着取消.
+ *          FiberGroup在同一个令牌下启动一组子协程,组内再创建的FiberGroup以当前协程的令牌为父,
+ *          这样客户端断开时取消最外层的组,整棵调用树上的等待都会被唤醒.
+ * @version 0.1
+ * @date 2024-07-16
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "future.hpp"
+#include "mutex.hpp"
+#include "noncopyable.hpp"
+#include "scheduler.hpp"
+#include "timer.hpp"
+
+namespace qc {
+
+class CancelToken : public std::enable_shared_from_this<CancelToken>, Noncopyable {
+public:
+    typedef std::shared_ptr<CancelToken> ptr;
+    typedef Mutex MutexType;
+
+    /// @param parent 父令牌取消时这个令牌也被取消
+    static ptr Create(const ptr &parent = nullptr);
+
+    ~CancelToken();
+
+    bool isCancelled() const { return m_cancelled.load(std::memory_order_acquire); }
+    /// @brief 取消,在调用线程上执行所有取消回调,重复调用无效
+    void cancel();
+    /**
+     * @brief 登记取消回调
+     * @return 用于removeCallback的id;已经取消时不登记也不调用cb,返回0
+     */
+    uint64_t onCancel(std::function<void()> cb);
+
+    void removeCallback(uint64_t id);
+    /**
+     * @brief ms毫秒后自动取消
+     * @details 定时器挂在当前线程的IOManager上,令牌要在IOManager之前销毁
+     */
+    void setDeadline(uint64_t ms);
+    /// @brief 当前协程的令牌,没有时返回nullptr
+    static ptr GetCurrent();
+
+private:
+    CancelToken() = default;
+
+private:
+    std::atomic<bool> m_cancelled{false};
+    MutexType m_mutex;
+    uint64_t m_nextId = 0;
+    std::map<uint64_t, std::function<void()>> m_callbacks;
+    /// @brief 父令牌以及登记在父令牌上的回调id
+    ptr m_parent;
+    uint64_t m_parentCbId = 0;
+    /// @brief deadline定时器
+    Timer::ptr m_deadline;
+};
+
+/**
+ * @brief 一组共享取消令牌的子协程
+ * @details 析构时等待所有子协程结束(不会自动取消)
+ */
+class FiberGroup : Noncopyable {
+public:
+    typedef Mutex MutexType;
+
+    /// @brief 令牌的父令牌是创建者所在协程的令牌
+    FiberGroup(Scheduler *scheduler = Scheduler::GetThis());
+
+    ~FiberGroup();
+    /// @brief 在组的令牌下启动一个子协程
+    void spawn(std::function<void()> cb);
+    /// @brief 取消组内所有子协程
+    void cancel() { m_token->cancel(); }
+    /// @brief ms毫秒后取消整个组
+    void setDeadline(uint64_t ms) { m_token->setDeadline(ms); }
+
+    bool isCancelled() const { return m_token->isCancelled(); }
+    /**
+     * @brief 等待目前所有的子协程结束,不受当前协程被取消的影响
+     * @details 子协程抛出的第一个异常在这里重新抛出
+     */
+    void join();
+
+    const CancelToken::ptr &getToken() const { return m_token; }
+
+private:
+    Scheduler *m_scheduler;
+    CancelToken::ptr m_token;
+    MutexType m_mutex;
+    std::vector<Future<void>> m_children;
+};
+
+}  // namespace qc
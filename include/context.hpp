@@ -0,0 +1,41 @@
+/**
+ * @file context.hpp
+ * @author qc
+ * @brief 协程上下文切换
+ * @details x86_64和aarch64上用汇编实现: 被调用者保存的寄存器压在协程自己的栈上,上下文只是一个栈指针,
+ *          切换时不像swapcontext那样保存整个ucontext_t(接近1KB)和调用rt_sigprocmask.
+ *          协程之间不切换信号掩码,信号掩码是线程的.
+ *          其它架构(或者定义了QC_FIBER_UCONTEXT)退化为ucontext,ucontext_t放在栈顶.
+ * @version 0.1
+ * @date 2024-07-20
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#pragma once
+
+#include <cstddef>
+
+#if !defined QC_FIBER_UCONTEXT && !defined __x86_64__ && !defined __aarch64__
+#define QC_FIBER_UCONTEXT 1
+#endif
+
+namespace qc {
+
+/// @brief 挂起时指向保存的上下文,正在运行的上下文的值没有意义
+typedef void *Context;
+
+/**
+ * @brief 在[stack, stack + size)上准备一个新的上下文,第一次切换进去时调用fn
+ * @details fn不能返回,协程结束时要切换出去且不再被切换回来
+ */
+void MakeContext(Context *ctx, void *stack, size_t size, void (*fn)());
+/**
+ * @brief 线程上没有自己栈的上下文(线程主协程)在第一次被切换出去之前调用
+ * @details 汇编实现时什么也不做;ucontext实现时给它分配一个线程局部的ucontext_t
+ */
+void InitThreadContext(Context *ctx);
+/// @brief 保存当前上下文到*from,切换到to
+void SwapContext(Context *from, Context to);
+
+}  // namespace qc
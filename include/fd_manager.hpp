@@ -11,17 +11,42 @@
 
 #pragma once
 
+#include <atomic>
+#include <functional>
 #include <memory>
 #include <vector>
+#include "fiber.hpp"
 #include "mutex.hpp"
 #include "singleton.hpp"
 #include "thread.hpp"
 
 namespace qc {
 
-class FdCtx : public std::enable_shared_from_this<FdCtx> {
+class Scheduler;
+class IOManager;
+
+enum Event {
+        NONE = 0x0,
+        READ = 0x1,
+        WRITE = 0x4
+};
+
+/**
+ * @brief 文件句柄上下文
+ * @details hook需要的句柄属性和IOManager需要的事件上下文合并在一起,
+ *          hook和reactor只需要一次FdManager查找就能拿到同一个对象.
+ *          每个fd号对应一个固定的FdCtx,close之后原地复用,对象在FdManager析构前不会释放.
+ */
+class FdCtx {
+    friend class FdManager;
+    friend class IOManager;
 public:
-    typedef std::shared_ptr<FdCtx> ptr;
+    typedef Mutex MutexType;
+    struct EventContext {
+        Scheduler *scheduler = nullptr;
+        Fiber::ptr fiber = nullptr;
+        TaskFunc cb = nullptr;
+    };
 
     FdCtx(int fd);
     ~FdCtx();
@@ -29,6 +54,8 @@ public:
     bool isInit() const { return m_isInit; }
     bool isSocket() const { return m_isSocket; }
     bool isClose() const { return m_isClosed; }
+    /// @brief 是否由hook登记过(socket/accept或者手动get(fd, true))
+    bool isRegistered() const { return m_registered.load(std::memory_order_acquire); }
     
     // 用户主动设置非阻塞
     void setUserNonblock(bool v) { m_userNonblock = v; }
@@ -42,6 +69,13 @@ public:
     void setTimeout (int type, uint64_t v);
 
     uint64_t getTimeout(int type);
+
+    // 获取事件上下文
+    EventContext &getEventContext(Event event);
+
+    void resetEventContext(EventContext &ctx);
+
+    void triggerEvent(Event event);
 private:
 
     bool init();
@@ -57,6 +91,13 @@ private:
     bool m_userNonblock : 1;
     /// @brief 是否关闭
     bool m_isClosed : 1;
+    /// @brief 是否被hook登记,del之后置为false,槽位本身保留
+    std::atomic<bool> m_registered{false};
+    /**
+     * @brief 是否已经由忙轮询的IOManager设置过SO_BUSY_POLL
+     * @details 在m_mutex下写,而上面的位域会被hook不加锁地改写;和它们共用一个内存位置就是数据竞争,所以单独放
+     */
+    std::atomic<bool> m_busyPoll{false};
     /// @brief 文件句柄
     int m_fd;
     /// @brief 读超时时间毫秒
@@ -64,21 +105,62 @@ private:
     /// @brief 写超时时间毫秒
     uint64_t m_sendTimeout;
 
+    /// @brief 已注册到IOManager的事件
+    Event m_events = NONE;
+    /**
+     * @brief 注册了m_events的IOManager,m_events为NONE时为nullptr
+     * @details 上下文是全进程共享的,而事件属于某一个IOManager的epoll;删除和取消事件都要通过它,
+     *          不能用当前线程的IOManager.从nullptr改为某个IOManager用CAS,改回nullptr在事件都删除之后.
+     *          它是单线程的IOManager时,事件只在它的线程上访问,不加m_mutex
+     */
+    std::atomic<IOManager *> m_owner{nullptr};
+    EventContext m_read;
+    EventContext m_write;
+    /// @brief 事件的锁 共享资源是Event,m_owner是单线程的IOManager时不使用
+    MutexType m_mutex;
 };
 
+/**
+ * @brief 文件句柄管理
+ * @details 两级表: 按CHUNK_SIZE分块,块一旦分配就不再移动,查找只需要两次acquire load,
+ *          不加锁也不拷贝shared_ptr.只有第一次创建块/上下文时才加锁.
+ *          块目录的大小在构造时按进程能打开的最大fd号确定(RLIMIT_NOFILE的硬限制和fs.nr_open),
+ *          之后不再变化;超出的fd(之后又调高了限制)不经过hook,第一次遇到时记一条错误日志.
+ */
 class FdManager {
 public:
-    typedef RWMutex RWMutexType;
+    typedef Mutex MutexType;
 
     FdManager();
-
-    FdCtx::ptr get(int fd, bool auto_create = false);
-
+    ~FdManager();
+
+    /**
+     * @brief 获取hook使用的句柄上下文
+     * @param auto_create 没有登记时是否登记(会fstat并把socket设置为非阻塞)
+     * @return 未登记时返回nullptr,返回的指针在FdManager生命周期内一直有效
+     */
+    FdCtx* get(int fd, bool auto_create = false);
+
+    /**
+     * @brief 获取fd对应的槽位,IOManager使用,不关心是否被hook登记
+     * @param auto_create 槽位不存在时是否创建
+     */
+    FdCtx* getSlot(int fd, bool auto_create = false);
+
+    /// @brief 取消hook登记,槽位保留给之后复用同一个fd号
     void del(int fd);
 private:
-    RWMutexType m_mutex;
+    static const int CHUNK_BITS = 10;
+    static const int CHUNK_SIZE = 1 << CHUNK_BITS;
+    /// @brief 读不到限制时至少覆盖的fd数
+    static const int DEFAULT_MAX_FDS = 1 << 20;
+
+    /// @brief 只在创建块和上下文时使用
+    MutexType m_mutex;
 
-    std::vector<FdCtx::ptr> m_datas;
+    /// @brief 块目录的长度
+    int m_maxChunks;
+    std::atomic<std::atomic<FdCtx*>*> *m_chunks;
 };
 
 // 文件句柄单例模式
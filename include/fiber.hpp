@@ -10,32 +10,76 @@
  */
 #pragma once
 
-#include <ucontext.h>
+#include <cstdint>
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <typeinfo>
 
+#include "context.hpp"
+#include "intrusive_ptr.hpp"
 #include "qc.hpp"
+#include "task_func.hpp"
 
 // 默认一个协程栈的大小为128KB
 #define DEFAULT_STACKSIZE 128 * 1024
 
 namespace qc {
 
-class Fiber : public std::enable_shared_from_this<Fiber> {
+class CancelToken;
+class Fiber;
+
+/**
+ * @brief 任务优先级,调度器先执行数值小的
+ * @details 等待过久的低优先级任务会被提前执行,见SchedulerOptions::priority_aging_us
+ */
+enum TaskPriority : int8_t {
+    /// @brief 不指定: 协程任务沿用协程自己的优先级,回调任务沿用添加它的协程的优先级
+    PRIORITY_INHERIT = -1,
+    /// @brief 健康检查,控制面等少量对延迟敏感的任务
+    PRIORITY_HIGH = 0,
+    PRIORITY_NORMAL,
+    /// @brief 批量处理等可以推迟的任务
+    PRIORITY_BACKGROUND,
+    PRIORITY_COUNT
+};
+
+/// @brief 任务协程和它的栈在同一块内存里,计数归零时析构协程并释放整块内存
+struct FiberDeleter {
+    void operator()(Fiber *fiber) const;
+};
+
+/**
+ * @details 引用计数是侵入式的(见intrusive_ptr.hpp),从裸指针(比如GetCurrent())可以直接构造Fiber::ptr.
+ *          只是在本协程里调用yield不需要持有引用: 协程挂起期间由登记它的地方(事件,定时器,等待队列)持有.
+ *          任务协程由Create创建,控制块放在自己栈的顶端(栈向下增长,溢出不会先踩到控制块),不单独分配.
+ *          第一条cache line只放每次切换都要访问的字段,回调和栈信息等只在创建,开始和结束时访问.
+ */
+class alignas(64) Fiber : public RefCounted<Fiber, FiberDeleter> {
+    friend struct FiberDeleter;
 public:
-    typedef std::shared_ptr<Fiber> ptr;
+    typedef IntrusivePtr<Fiber> ptr;
 public:
     enum STATE { READY = 0, RUNNING = 1, TERM = 2 };
     ~Fiber();
 private:
     /// @brief 线程主协程才会调用这个函数
     Fiber();
+    /// @brief 一般协程,由Create在栈内存[stack, this)的顶端构造
+    Fiber(TaskFunc cb, void *stack, size_t stacksize, int node, bool run_in_scheduler);
 public:
-    /// @brief 一般协程
-    Fiber(std::function<void()> cb, size_t stacksize = 0, bool run_in_scheduler = true);
-
-    void reset(std::function<void()> cb);
+    /**
+     * @brief 创建一般协程
+     * @param stacksize 栈内存的大小(包括放在顶端的控制块),0表示DEFAULT_STACKSIZE
+     * @param run_in_scheduler 是否和调度器的调度协程切换,否则和线程主协程切换
+     */
+    static ptr Create(TaskFunc cb, size_t stacksize = 0, bool run_in_scheduler = true);
+
+    /**
+     * @brief 复用一个TERM状态的协程执行新的回调,不重新分配栈
+     * @details 协程id保持不变,IO等待序号继续递增,过期的超时定时器不会误伤新的等待
+     */
+    void reset(TaskFunc cb);
 
     void resume();
 
@@ -45,10 +89,42 @@ public:
 
     STATE getState() const { return m_state; }
 
+    size_t getStackSize() const { return m_stacksize; }
+    /// @brief 栈所在的NUMA节点,-1表示没有指定节点
+    int getStackNode() const { return m_stackNode; }
+    /// @brief 是否是由调度器调度的任务协程
+    bool isRunInScheduler() const { return m_runInScheduler; }
+    /// @brief 调度器每次resume之前设置为这次任务的优先级,唤醒时重新入队沿用它
+    TaskPriority getPriority() const { return m_priority; }
+
+    void setPriority(TaskPriority priority) { m_priority = priority; }
+    /// @brief 入口回调的类型,运行结束后回调被清空,返回typeid(void)
+    const std::type_info &getCbType() const { return m_cb.target_type(); }
+    /// @brief 入口回调是普通函数指针时返回函数地址,否则返回nullptr
+    const void *getCbFunction() const {
+        auto fn = m_cb.target<void (*)()>();
+        return fn ? (const void *)*fn : nullptr;
+    }
+
+    /// @brief 开始一次IO等待,清空上次的等待结果并返回本次等待的序号
+    uint64_t beginWait() { m_waitErr = 0; return ++m_waitSeq; }
+
+    uint64_t getWaitSeq() const { return m_waitSeq; }
+    /// @brief 由超时定时器写入等待失败的原因(如ETIMEDOUT)
+    void setWaitError(int err) { m_waitErr = err; }
+
+    int getWaitError() const { return m_waitErr; }
+    /// @brief 协程的取消令牌,令牌被取消后这个协程的hook等待返回ECANCELED
+    const std::shared_ptr<CancelToken> &getCancelToken() const { return m_cancelToken; }
+
+    void setCancelToken(std::shared_ptr<CancelToken> token) { m_cancelToken = std::move(token); }
+
 public:
     static void SetThis(Fiber* f);
 
     static ptr GetThis();
+    /// @brief 当前协程的裸指针,没有时返回nullptr而不创建主协程(可以在信号处理函数中调用)
+    static Fiber *GetCurrent();
 
     static uint64_t TotalFibers();
     /// @brief 协程入口函数
@@ -57,20 +133,31 @@ public:
     static uint64_t GetFiberId(); 
 
 private:
-    /// @brief 协程id
-    uint64_t m_id           = 0;
-    /// @brief 当前协程上下文
-    ucontext_t m_ctx;
+    /// @brief 挂起时保存的上下文(栈指针),计数在基类中,和它在同一条cache line
+    Context m_ctx           = nullptr;
     /// @brief 当前协程状态
     STATE m_state           = READY;
-    /// @brief 当前栈大小
-    size_t m_stacksize      = 0;
-    /// @brief 栈指针
-    void *m_stack           = nullptr;
-    /// @brief 回调函数,这里只支持无参且返回类型为void的,之后可以使用bind绑定各种参数
-    std::function<void()> m_cb;
     /// @brief 是否参与调度器调度
-    bool m_runInScheduler;
+    bool m_runInScheduler   = false;
+    /// @brief 调度优先级
+    TaskPriority m_priority = PRIORITY_NORMAL;
+    /// @brief 最近一次IO等待的错误码,0表示事件正常到达
+    int m_waitErr           = 0;
+    /// @brief 协程id
+    uint64_t m_id           = 0;
+    /// @brief IO等待序号,用来区分同一个协程在同一个fd上的前后两次等待
+    uint64_t m_waitSeq      = 0;
+
+    /// @brief 回调函数,这里只支持无参且返回类型为void的,之后可以使用bind绑定各种参数
+    alignas(64) TaskFunc m_cb;
+    /// @brief 栈内存的起始地址,控制块在它的顶端;线程主协程为nullptr
+    void *m_stack           = nullptr;
+    /// @brief 栈内存的大小
+    size_t m_stacksize      = 0;
+    /// @brief 栈所在的NUMA节点,-1表示由malloc分配
+    int m_stackNode         = -1;
+    /// @brief 取消令牌,协程结束时清空
+    std::shared_ptr<CancelToken> m_cancelToken;
 };
 
 }  // namespace qc
\ No newline at end of file
@@ -0,0 +1,255 @@
+/**
+ * @file future.hpp
+ * @author qc
+ * @brief 协程版的future/promise
+ * @details Future<T>::get()在任务协程中只挂起当前协程,结果到达后由设置结果的一方把协程重新放回原来的调度器;
+ *          不在协程中(比如Main线程)调用时才会阻塞线程.
+ *          async(f)把f作为任务交给调度器执行并返回它的Future,when_all/when_any把多个Future合成一个,
+ *          用来替代共享状态+Semaphore的扇出/扇入写法.
+ *          协程带有取消令牌(见cancel.hpp)时,令牌被取消会让get()抛出std::system_error(ECANCELED),
+ *          async启动的任务继承调用者的令牌.
+ * @version 0.1
+ * @date 2024-07-14
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#include "mutex.hpp"
+#include "scheduler.hpp"
+
+namespace qc {
+
+namespace detail {
+
+/// @brief 与值类型无关的部分: 完成标记,异常,等待者和完成回调
+class FutureStateBase : public std::enable_shared_from_this<FutureStateBase> {
+public:
+    typedef Mutex MutexType;
+
+    virtual ~FutureStateBase() = default;
+
+    bool isReady();
+    /**
+     * @brief 等待完成: 在任务协程中挂起协程,否则阻塞当前线程
+     * @return 是否已经完成,协程的取消令牌被取消时提前返回false
+     */
+    bool wait();
+    /// @brief 完成时调用cb(在设置结果的线程上),已经完成时立即调用
+    void onReady(std::function<void()> cb);
+
+    void setException(std::exception_ptr e);
+
+protected:
+    /// @brief 调用者持有锁并已经写入结果,标记完成,解锁后唤醒所有等待者
+    void complete(MutexType::Lock &lock);
+    /// @brief 已经完成时抛出std::logic_error
+    void checkNotReady();
+    /// @brief 等待完成,被取消时抛出std::system_error(ECANCELED),有异常时重新抛出
+    void waitOrThrow();
+    /// @brief 有异常时重新抛出
+    void rethrowIfFailed();
+    /// @brief 摘掉fiber对应的等待者,已经被完成方摘走时返回false
+    bool removeWaiter(Fiber *fiber);
+
+protected:
+    struct Waiter {
+        /// @brief 协程等待者
+        Scheduler *scheduler = nullptr;
+        Fiber::ptr fiber;
+        /// @brief 线程等待者
+        Semaphore *sem = nullptr;
+    };
+
+    MutexType m_mutex;
+    bool m_ready = false;
+    std::exception_ptr m_exception;
+    std::vector<Waiter> m_waiters;
+    std::vector<std::function<void()>> m_callbacks;
+};
+
+template <class T>
+class FutureState : public FutureStateBase {
+public:
+    template <class V>
+    void setValue(V &&v) {
+        MutexType::Lock lock(m_mutex);
+        checkNotReady();
+        m_value.emplace(std::forward<V>(v));
+        complete(lock);
+    }
+
+    T take() {
+        waitOrThrow();
+        return std::move(*m_value);
+    }
+
+private:
+    std::optional<T> m_value;
+};
+
+template <>
+class FutureState<void> : public FutureStateBase {
+public:
+    void setValue() {
+        MutexType::Lock lock(m_mutex);
+        checkNotReady();
+        complete(lock);
+    }
+
+    void take() { waitOrThrow(); }
+};
+
+}  // namespace detail
+
+template <class T>
+class Promise;
+
+/// @brief 只能移动,get()只能调用一次
+template <class T>
+class Future {
+    friend class Promise<T>;
+public:
+    Future() = default;
+    Future(Future &&) = default;
+    Future &operator=(Future &&) = default;
+    Future(const Future &) = delete;
+    Future &operator=(const Future &) = delete;
+
+    bool valid() const { return (bool)m_state; }
+
+    bool isReady() const { return m_state->isReady(); }
+    /// @brief 等待结果到达但不取出,被取消时返回false
+    bool wait() const { return m_state->wait(); }
+    /// @brief 等待并取出结果,Promise设置的异常在这里重新抛出,等待被取消时抛出std::system_error(ECANCELED)
+    T get() {
+        std::shared_ptr<detail::FutureState<T>> state;
+        state.swap(m_state);
+        return state->take();
+    }
+    /// @brief 结果到达时调用cb,供when_all/when_any使用
+    void onReady(std::function<void()> cb) const { m_state->onReady(std::move(cb)); }
+
+private:
+    explicit Future(std::shared_ptr<detail::FutureState<T>> state) : m_state(std::move(state)) {}
+
+private:
+    std::shared_ptr<detail::FutureState<T>> m_state;
+};
+
+/// @brief 可以拷贝,所有拷贝共享同一个结果,只能设置一次
+template <class T>
+class Promise {
+public:
+    Promise() : m_state(std::make_shared<detail::FutureState<T>>()) {}
+
+    Future<T> get_future() const { return Future<T>(m_state); }
+
+    template <class V = T, class = typename std::enable_if<!std::is_void<V>::value>::type>
+    void set_value(V v) {
+        m_state->setValue(std::move(v));
+    }
+
+    template <class V = T, class = typename std::enable_if<std::is_void<V>::value>::type>
+    void set_value() {
+        m_state->setValue();
+    }
+
+    void set_exception(std::exception_ptr e) { m_state->setException(e); }
+
+private:
+    std::shared_ptr<detail::FutureState<T>> m_state;
+};
+
+namespace detail {
+
+template <class R, class F>
+void Fulfill(Promise<R> &promise, F &f) {
+    try {
+        if constexpr (std::is_void<R>::value) {
+            f();
+            promise.set_value();
+        } else {
+            promise.set_value(f());
+        }
+    } catch (...) {
+        promise.set_exception(std::current_exception());
+    }
+}
+
+}  // namespace detail
+
+/// @brief 把f作为任务交给scheduler执行,f抛出的异常在Future::get()中重新抛出
+template <class F>
+auto async(Scheduler *scheduler, F f) -> Future<decltype(f())> {
+    typedef decltype(f()) R;
+    qc_assert(scheduler);
+    Promise<R> promise;
+    Future<R> future = promise.get_future();
+    // 子任务继承当前协程的取消令牌
+    Fiber *cur = Fiber::GetCurrent();
+    std::shared_ptr<CancelToken> token = cur ? cur->getCancelToken() : nullptr;
+    scheduler->add_task([promise, f, token]() mutable {
+        Fiber *self = Fiber::GetCurrent();
+        self->setCancelToken(token);
+        detail::Fulfill(promise, f);
+        self->setCancelToken(nullptr);
+    });
+    return future;
+}
+
+/// @brief 在当前线程的调度器上执行f
+template <class F>
+auto async(F f) -> Future<decltype(f())> {
+    return async(Scheduler::GetThis(), std::move(f));
+}
+
+/// @brief 所有future都完成时完成,结果仍然从各自的future中get
+template <class T>
+Future<void> when_all(std::vector<Future<T>> &futures) {
+    struct Context {
+        std::atomic<size_t> left;
+        Promise<void> promise;
+    };
+    auto ctx = std::make_shared<Context>();
+    ctx->left = futures.size();
+    Future<void> ret = ctx->promise.get_future();
+    if (futures.empty()) ctx->promise.set_value();
+    for (auto &f : futures) {
+        f.onReady([ctx]() {
+            if (ctx->left.fetch_sub(1) == 1) ctx->promise.set_value();
+        });
+    }
+    return ret;
+}
+
+/// @brief 任意一个future完成时完成,结果为它在futures中的下标
+template <class T>
+Future<size_t> when_any(std::vector<Future<T>> &futures) {
+    struct Context {
+        std::atomic<bool> done{false};
+        Promise<size_t> promise;
+    };
+    if (futures.empty()) throw std::invalid_argument("when_any on empty futures");
+    auto ctx = std::make_shared<Context>();
+    Future<size_t> ret = ctx->promise.get_future();
+    for (size_t i = 0; i < futures.size(); ++i) {
+        futures[i].onReady([ctx, i]() {
+            if (!ctx->done.exchange(true)) ctx->promise.set_value(i);
+        });
+    }
+    return ret;
+}
+
+}  // namespace qc
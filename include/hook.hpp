@@ -11,6 +11,7 @@
 #pragma once 
 
 #include <fcntl.h>
+#include <netdb.h>
 #include <stdint.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
@@ -97,5 +98,13 @@ extern getsockopt_fun getsockopt_f;
 typedef int (*setsockopt_fun)(int sockfd, int level, int optname, const void *optval, socklen_t optlen);
 extern setsockopt_fun setsockopt_f;
 
+// dns
+typedef int (*getaddrinfo_fun)(const char *node, const char *service, const struct addrinfo *hints,
+                               struct addrinfo **res);
+extern getaddrinfo_fun getaddrinfo_f;
+
+typedef struct hostent *(*gethostbyname_fun)(const char *name);
+extern gethostbyname_fun gethostbyname_f;
+
 extern int connect_with_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen, uint64_t timeout_ms);
 }
@@ -0,0 +1,129 @@
+/**
+ * @file intrusive_ptr.hpp
+ * @author qc
+ * @brief 侵入式引用计数
+ * @details 计数放在对象里,从裸指针就能重新得到一个持有者,不需要shared_from_this的weak_ptr::lock(CAS循环),
+ *          也没有单独分配的控制块.计数仍然是原子的: 协程会在线程之间迁移(偷任务,在别的线程上被唤醒).
+ * @version 0.1
+ * @date 2024-07-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace qc {
+
+/**
+ * @brief 引用计数基类,计数归零时用Deleter释放
+ * @tparam T 派生类,用于在基类中释放派生类对象而不需要虚析构函数
+ * @tparam Deleter 对象不是单独new出来的时候(比如和别的内存一起分配)自定义释放方式
+ */
+template <class T, class Deleter = std::default_delete<T>>
+class RefCounted {
+public:
+    void addRef() const { m_refs.fetch_add(1, std::memory_order_relaxed); }
+
+    void release() const {
+        if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            Deleter()(const_cast<T *>(static_cast<const T *>(this)));
+        }
+    }
+
+    uint32_t refCount() const { return m_refs.load(std::memory_order_relaxed); }
+
+protected:
+    RefCounted() = default;
+    ~RefCounted() = default;
+
+    RefCounted(const RefCounted &) = delete;
+    RefCounted &operator=(const RefCounted &) = delete;
+
+private:
+    mutable std::atomic<uint32_t> m_refs{0};
+};
+
+/// @brief 持有RefCounted对象的智能指针,接口和std::shared_ptr常用的部分一致
+template <class T>
+class IntrusivePtr {
+public:
+    IntrusivePtr() noexcept = default;
+
+    IntrusivePtr(std::nullptr_t) noexcept {}
+    /// @brief 从裸指针构造,增加计数(新对象计数从0开始)
+    explicit IntrusivePtr(T *p) : m_ptr(p) {
+        if (m_ptr) m_ptr->addRef();
+    }
+
+    IntrusivePtr(const IntrusivePtr &rhs) : m_ptr(rhs.m_ptr) {
+        if (m_ptr) m_ptr->addRef();
+    }
+
+    IntrusivePtr(IntrusivePtr &&rhs) noexcept : m_ptr(rhs.m_ptr) { rhs.m_ptr = nullptr; }
+
+    ~IntrusivePtr() {
+        if (m_ptr) m_ptr->release();
+    }
+
+    IntrusivePtr &operator=(const IntrusivePtr &rhs) {
+        IntrusivePtr(rhs).swap(*this);
+        return *this;
+    }
+
+    IntrusivePtr &operator=(IntrusivePtr &&rhs) noexcept {
+        IntrusivePtr(std::move(rhs)).swap(*this);
+        return *this;
+    }
+
+    IntrusivePtr &operator=(std::nullptr_t) noexcept {
+        reset();
+        return *this;
+    }
+
+    void reset() noexcept { IntrusivePtr().swap(*this); }
+
+    void reset(T *p) { IntrusivePtr(p).swap(*this); }
+
+    void swap(IntrusivePtr &rhs) noexcept { std::swap(m_ptr, rhs.m_ptr); }
+
+    T *get() const noexcept { return m_ptr; }
+
+    T &operator*() const noexcept { return *m_ptr; }
+
+    T *operator->() const noexcept { return m_ptr; }
+
+    explicit operator bool() const noexcept { return m_ptr != nullptr; }
+
+    long use_count() const noexcept { return m_ptr ? m_ptr->refCount() : 0; }
+
+private:
+    T *m_ptr = nullptr;
+};
+
+template <class T, class U>
+inline bool operator==(const IntrusivePtr<T> &a, const IntrusivePtr<U> &b) noexcept {
+    return a.get() == b.get();
+}
+
+template <class T, class U>
+inline bool operator!=(const IntrusivePtr<T> &a, const IntrusivePtr<U> &b) noexcept {
+    return a.get() != b.get();
+}
+
+template <class T>
+inline bool operator==(const IntrusivePtr<T> &a, std::nullptr_t) noexcept {
+    return !a;
+}
+
+template <class T>
+inline bool operator!=(const IntrusivePtr<T> &a, std::nullptr_t) noexcept {
+    return static_cast<bool>(a);
+}
+
+}  // namespace qc
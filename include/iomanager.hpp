@@ -10,69 +10,67 @@
  */
 
 #pragma once
+#include <sys/epoll.h>
+
+#include "fd_manager.hpp"
 #include "scheduler.hpp"
 #include "timer.hpp"
 
 namespace qc {
 
-enum Event {
-        NONE = 0x0,
-        READ = 0x1,
-        WRITE = 0x4
-};
-
-class FdContext {
-    friend class IOManager;
-public:
-    typedef Mutex MutexType;
-    struct EventContext {
-        Scheduler *scheduler = nullptr;
-        Fiber::ptr fiber = nullptr;
-        std::function<void()> cb = nullptr;
-    };
-    // 获取事件上下文
-    EventContext &getEventContext(Event event);
-
-    void resetEventContext(EventContext &ctx);
+/// @brief 事件上下文和hook的句柄上下文是同一个对象,见fd_manager.hpp
+typedef FdCtx FdContext;
 
-    void triggerEvent(Event event);
-
-private:
-    int m_fd;
-    Event m_events = NONE;
-    EventContext m_read;
-    EventContext m_write;
-    /// @brief 事件的锁 共享资源是Event
-    MutexType m_mutex;
-};
-
-class IOManager : public Scheduler, public TimerManager {
+/**
+ * @brief final: 通过IOManager指针或者在IOManager成员函数中调用tickle,stopping等时编译器可以直接调用
+ * @details 调度循环用Scheduler::runLoop<IOManager, ...>实例,idle,tickle和pollEvents也是直接调用
+ */
+class IOManager final : public Scheduler, public TimerManager {
+    friend class Scheduler;
 public:
     typedef std::shared_ptr<IOManager> ptr;
-    typedef RWMutex RWMutexType;
     
-    IOManager(size_t threads = 1, bool use_caller = true , const std::string &name = "IOManager");
+    IOManager(size_t threads = 1, bool use_caller = true , const std::string &name = "IOManager",
+              const SchedulerOptions &options = SchedulerOptions());
 
     ~IOManager();
 
-    void contextResize(size_t size) {
-        m_fdContexts.resize(size);
-        for (size_t i = 0; i < size; ++i) {
-            if (!m_fdContexts[i]) {
-                m_fdContexts[i] = new FdContext;
-                m_fdContexts[i]->m_fd = i;
-            }
-        }
-    }
 public:
 
-    int addEvent(int fd, Event event, std::function<void()> cb);
+    /**
+     * @brief 注册事件,cb为空时把当前协程作为事件的执行体
+     * @details 单线程的IOManager(见Scheduler::isOwnerOnly)只在自己的线程上访问事件,不加锁.
+     *          在其他线程上注册,删除和取消时交给它的线程执行,等它执行完
+     */
+    int addEvent(int fd, Event event, TaskFunc cb = nullptr);
+    /**
+     * @brief 注册事件,触发时把已经挂起的fiber放回调度器
+     * @details 在YieldThen的回调中代替协程登记: 协程自己先登记再yield时,事件可能在别的线程上马上触发,
+     *          在协程真正切换出去之前就被resume
+     */
+    int addEventFor(int fd, Event event, Fiber::ptr fiber);
 
     bool delEvent(int fd, Event event);
 
     bool cancelEvent(int fd, Event event);
 
+    /**
+     * @brief 取消一次协程等待
+     * @details 只有当前挂在fd事件上的仍是(fiber_id, wait_seq)这次等待时才取消,
+     *          并把err写入该协程,用于hook中的超时,过期的定时器不会误伤之后的等待.
+     *          事件在其他线程的单线程IOManager上时交给那个线程校验和取消,不等待,返回false
+     */
+    bool cancelWait(int fd, Event event, uint64_t fiber_id, uint64_t wait_seq, int err);
+
     bool cancelAll(int fd);
+    /**
+     * @brief 空闲线程阻塞到epoll_wait之前自旋等待任务的最长时间(纳秒),0表示不自旋
+     * @details 实际的自旋窗口在1us到max_ns之间自适应: 自旋等到了任务就加倍,白白自旋就减半.
+     *          默认多核机器上为50us,单核机器上不自旋
+     */
+    void setIdleSpin(uint64_t max_ns) { m_idleSpinNs = max_ns; }
+
+    uint64_t getIdleSpin() const { return m_idleSpinNs; }
 
 public:
     void tickle() override;
@@ -85,16 +83,67 @@ public:
 
     void OnTimerInsertedAtFront() override;
 
+protected:
+    void pollEvents() override;
+
+    bool isTimerThread() const override { return onOwnerThread(); }
+
+    void runOnTimerThread(TaskFunc fn) override { add_task(std::move(fn), -1, PRIORITY_HIGH); }
+
+private:
+    int addEventImpl(int fd, Event event, TaskFunc cb, Fiber::ptr fiber);
+    /// @brief 调用方持有fd_ctx->m_mutex,或者在单线程IOManager自己的线程上
+    int addEventLocked(FdContext *fd_ctx, Event event, TaskFunc cb, Fiber::ptr fiber,
+                       Scheduler *scheduler);
+    /// @brief 触发并删除fd_ctx上的event,调用方需持有fd_ctx->m_mutex
+    void cancelEventNolock(FdContext *fd_ctx, Event event);
+    /**
+     * @brief 找到注册fd_ctx上事件的IOManager,按它的锁策略执行op(fd_ctx, owner)
+     * @details 多线程的IOManager加fd_ctx->m_mutex;单线程的IOManager在自己的线程上不加锁,
+     *          在其他线程上把这次调用交给它的线程,wait时等它执行完.没有注册事件时返回false
+     */
+    template <class Op>
+    static bool withOwner(FdContext *fd_ctx, bool wait, Op op);
+    /**
+     * @brief 在这个单线程IOManager的线程上执行fn,等待并返回它的结果
+     * @param suspend 在任务协程中时挂起当前协程等待,否则(或者为false时)阻塞当前线程
+     */
+    bool callOnOwner(std::function<bool()> fn, bool suspend = true);
+    /// @brief 处理epoll返回的一个fd的事件,返回调度的任务数,调用方持有fd_ctx->m_mutex
+    int processFdEvents(FdContext *fd_ctx, uint32_t events);
+    /**
+     * @brief epoll_wait一次,把到期的定时器和就绪的事件交给调度器
+     * @return 调度的任务数,epoll_wait出错时返回-1
+     */
+    int processEvents(epoll_event *events, int max_events, int timeout_ms);
+    /**
+     * @brief 阻塞之前自旋等待任务,等到了返回true
+     * @param stale 同busyPollForWork,任务数变化之前不把这些取不到的任务当成等到了
+     */
+    bool spinForWork(epoll_event *events, int max_events, size_t &stale);
+    /**
+     * @brief 忙轮询线程的空闲循环,有任务或者正在停止时返回
+     * @param stale 上次让出之后仍然取不到的任务数(指定给其他线程的任务),任务数变化之前不再为它们返回
+     * @return 同processEvents
+     */
+    int busyPollForWork(epoll_event *events, int max_events, size_t &stale);
+    /// @brief 有空闲线程时写管道唤醒一个,不管是否有线程在自旋或忙轮询
+    void wakeUp();
+
 private:
     int m_epfd;
     /// @brief 这里使用管道触发事件,Lars中每个消息队列单独设置了一个eventfd来触发事件,每个消息队列中都有一个epoll类
     int m_tickleFds[2];
 
     std::atomic<size_t> m_pendingEventCount {0};
-
-    std::vector<FdContext*> m_fdContexts;
-
-    RWMutexType m_mutex;
+    /// @brief 最长自旋时间(纳秒)
+    std::atomic<uint64_t> m_idleSpinNs {0};
+    /// @brief 正在自旋的线程数,不为0时tickle不用写管道
+    std::atomic<size_t> m_spinning {0};
+    /// @brief 正在忙轮询的线程数,同m_spinning
+    std::atomic<size_t> m_busyPolling {0};
+    /// @brief 注册到Metrics的仪表
+    std::vector<uint64_t> m_gaugeIds;
 };
 
 
@@ -0,0 +1,71 @@
+/**
+ * @file log.hpp
+ * @author qc
+ * @brief 异步日志
+ * @details 每个线程一个无锁的单生产者环形缓冲区,日志在调用线程格式化后写入环中,
+ *          由后台线程统一刷到文件或fd,调用线程不会因为写日志而阻塞或者拿全局锁.
+ *          低于QC_LOG_LEVEL的日志在编译期就被去掉,release构建中调度热路径上的调试日志没有任何开销.
+ * @version 0.1
+ * @date 2024-07-09
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace qc {
+
+/// @brief 日志级别
+class LogLevel {
+public:
+    enum Level {
+        DEBUG = 0,
+        INFO = 1,
+        WARN = 2,
+        ERROR = 3,
+        OFF = 4
+    };
+
+    static const char *ToString(Level level);
+};
+
+/// @brief 编译期日志级别,低于这个级别的日志不会被编译进去,调试时可以-DQC_LOG_LEVEL=0
+#ifndef QC_LOG_LEVEL
+#define QC_LOG_LEVEL 1
+#endif
+
+class Logger {
+public:
+    /// @brief 运行时日志级别(不能低于编译期级别)
+    static void SetLevel(LogLevel::Level level);
+
+    static LogLevel::Level GetLevel();
+    /// @brief 日志追加写入到文件,之前由SetFile打开的文件被关闭
+    static bool SetFile(const std::string &path);
+    /// @brief 日志写入到fd,默认为标准错误;fd由调用方负责关闭
+    static void SetFd(int fd);
+    /// @brief 同步把所有线程缓冲区中的日志刷出
+    static void Flush();
+    /// @brief 因为缓冲区满而丢弃的日志条数
+    static uint64_t GetDropped();
+
+    /// @brief 格式化一条日志写入当前线程的缓冲区,缓冲区满时丢弃,不会阻塞
+    static void Log(LogLevel::Level level, const char *file, int line, const char *fmt, ...)
+        __attribute__((format(printf, 4, 5)));
+};
+
+}  // namespace qc
+
+#define QC_LOG(level, fmt, ...)                                                  \
+    do {                                                                         \
+        if ((level) >= QC_LOG_LEVEL && (level) >= qc::Logger::GetLevel())        \
+            qc::Logger::Log(level, __FILE__, __LINE__, fmt, ##__VA_ARGS__);      \
+    } while (0)
+
+#define QC_LOG_DEBUG(fmt, ...) QC_LOG(qc::LogLevel::DEBUG, fmt, ##__VA_ARGS__)
+#define QC_LOG_INFO(fmt, ...) QC_LOG(qc::LogLevel::INFO, fmt, ##__VA_ARGS__)
+#define QC_LOG_WARN(fmt, ...) QC_LOG(qc::LogLevel::WARN, fmt, ##__VA_ARGS__)
+#define QC_LOG_ERROR(fmt, ...) QC_LOG(qc::LogLevel::ERROR, fmt, ##__VA_ARGS__)
@@ -0,0 +1,196 @@
+/**
+ * @file metrics.hpp
+ * @author qc
+ * @brief 运行时指标: 调度器,reactor和定时器的计数器/直方图/仪表
+ * @details 每个线程一份按cache line对齐的计数器,只由所属线程写(普通的load+store,没有lock前缀指令),
+ *          Snapshot()时再把所有线程的数据汇总,Dump()输出可以被抓取的文本格式.
+ * @version 0.1
+ * @date 2024-07-10
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace qc {
+
+/// @brief 单调时钟,纳秒
+uint64_t GetMonotonicNS();
+
+/**
+ * @brief 对数线性直方图(HDR风格)
+ * @details 每个2的幂区间再分成8个子桶,相对误差不超过12.5%,覆盖整个uint64_t范围.
+ *          record只允许一个线程调用,其他线程可以并发读取.
+ */
+class Histogram {
+public:
+    static const int SUB_BITS = 3;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+    static const int BUCKETS = 2 * SUB_COUNT + (63 - SUB_BITS) * SUB_COUNT;
+
+    Histogram() = default;
+    Histogram(const Histogram &rhs) { merge(rhs); }
+    Histogram &operator=(const Histogram &rhs);
+
+    void record(uint64_t v) {
+        add(m_buckets[BucketIndex(v)], 1);
+        add(m_count, 1);
+        add(m_sum, v);
+        if (v > m_max.load(std::memory_order_relaxed)) m_max.store(v, std::memory_order_relaxed);
+    }
+
+    /// @brief 把rhs的数据累加进来(用于汇总,不能和record并发)
+    void merge(const Histogram &rhs);
+
+    void clear();
+
+    uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return m_sum.load(std::memory_order_relaxed); }
+    uint64_t max() const { return m_max.load(std::memory_order_relaxed); }
+    /// @brief p取值[0, 100],返回对应桶的上界
+    uint64_t percentile(double p) const;
+
+    static int BucketIndex(uint64_t v);
+    /// @brief 桶的上界(包含)
+    static uint64_t BucketHigh(int idx);
+
+private:
+    /// @brief 单写者累加,不需要原子的读改写
+    static void add(std::atomic<uint64_t> &c, uint64_t n) {
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> m_buckets[BUCKETS] = {};
+    std::atomic<uint64_t> m_count{0};
+    std::atomic<uint64_t> m_sum{0};
+    std::atomic<uint64_t> m_max{0};
+};
+
+class Metrics {
+public:
+    enum Counter {
+        /// @brief 执行完的任务数
+        TASKS_EXECUTED = 0,
+        /// @brief 协程切换次数(resume)
+        CONTEXT_SWITCHES,
+        /// @brief 发出的tickle
+        TICKLES_SENT,
+        /// @brief 在epoll中收到的tickle
+        TICKLES_RECEIVED,
+        /// @brief epoll_wait调用次数
+        EPOLL_WAITS,
+        /// @brief epoll_wait返回的事件数
+        EPOLL_EVENTS,
+        /// @brief 定时器插入
+        TIMER_INSERTS,
+        /// @brief 定时器取消
+        TIMER_CANCELS,
+        /// @brief 定时器触发
+        TIMER_FIRES,
+        /// @brief 一次运行超过阈值没有让出的任务
+        LONG_RUNS,
+        /// @brief 从其他工作线程的本地队列偷到的任务
+        STEALS,
+        /// @brief 其中从其他NUMA节点偷到的
+        REMOTE_STEALS,
+        /// @brief 空闲线程自旋期间等到了任务
+        IDLE_SPIN_HITS,
+        /// @brief 自旋没有等到任务,之后阻塞在epoll_wait
+        IDLE_SPIN_MISSES,
+        /// @brief 回调任务从工作线程的协程池中拿到了协程
+        FIBER_POOL_HITS,
+        /// @brief 协程池为空,新建了协程
+        FIBER_POOL_MISSES,
+        /// @brief 低优先级任务等待超过老化时间,先于高优先级任务执行
+        PRIORITY_AGED,
+        /// @brief 任务超过时间片后在检查点让出
+        PREEMPTIONS,
+        /// @brief 工作线程在同一个任务中停留超过阈值(阻塞在没有hook的调用上),每次只记一次
+        BLOCKED_WORKERS,
+        /// @brief 为阻塞的工作线程补偿创建的临时工作线程
+        COMPENSATION_WORKERS,
+        /// @brief 排队延迟超过目标时增加的弹性线程
+        ELASTIC_SPAWNS,
+        /// @brief 空闲超过冷却时间退出的弹性线程
+        ELASTIC_RETIRES,
+        COUNTER_MAX
+    };
+    /// @brief 任务优先级的个数,和TaskPriority一致
+    static const int PRIORITY_LEVELS = 3;
+
+    /// @brief 单个线程的指标,占用独立的cache line避免伪共享
+    struct alignas(64) ThreadMetrics {
+        pid_t tid = 0;
+        std::string name;
+        std::atomic<uint64_t> counters[COUNTER_MAX] = {};
+        /// @brief 任务从入队到开始执行的延迟(纳秒)
+        Histogram sched_latency;
+        /// @brief 按优先级分开的调度延迟
+        Histogram priority_sched_latency[PRIORITY_LEVELS];
+        /// @brief 任务每次被resume到让出/结束的时长(纳秒)
+        Histogram run_duration;
+    };
+
+    struct ThreadSnapshot {
+        pid_t tid;
+        std::string name;
+        uint64_t counters[COUNTER_MAX];
+        Histogram sched_latency;
+        Histogram run_duration;
+    };
+
+    struct Snapshot {
+        /// @brief 存活的线程;已经退出的线程合成一项,tid为0,name为exited
+        std::vector<ThreadSnapshot> threads;
+        /// @brief 所有线程的合计
+        uint64_t totals[COUNTER_MAX] = {};
+        Histogram sched_latency;
+        /// @brief 按优先级分开的调度延迟,只有所有线程的合计
+        Histogram priority_sched_latency[PRIORITY_LEVELS];
+        Histogram run_duration;
+        /// @brief 仪表(队列深度等)的当前值
+        std::vector<std::pair<std::string, int64_t>> gauges;
+    };
+
+    static const char *CounterName(Counter c);
+
+    /// @brief 当前线程的指标,第一次调用时注册
+    static ThreadMetrics *Local();
+
+    static void Inc(Counter c, uint64_t n = 1) {
+        std::atomic<uint64_t> &v = Local()->counters[c];
+        v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static void RecordSchedLatency(uint64_t ns, int priority) {
+        ThreadMetrics *m = Local();
+        m->sched_latency.record(ns);
+        m->priority_sched_latency[priority].record(ns);
+    }
+
+    static void RecordRunDuration(uint64_t ns) { Local()->run_duration.record(ns); }
+
+    /**
+     * @brief 注册一个仪表,Snapshot时调用fn取值
+     * @param name 带标签的完整名字,如 qc_queue_depth{scheduler="main"}
+     * @return 用于RemoveGauge的id
+     */
+    static uint64_t AddGauge(const std::string &name, std::function<int64_t()> fn);
+
+    static void RemoveGauge(uint64_t id);
+
+    static Snapshot GetSnapshot();
+    /// @brief Prometheus文本格式
+    static std::string Dump();
+};
+
+}  // namespace qc
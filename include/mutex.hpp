@@ -59,10 +59,7 @@ public:
         m_mutex.lock();
         m_locked = true;
     }
-    ~ScopedLockImpl() {
-        m_mutex.unlock();
-        m_locked = false;
-    }
+    ~ScopedLockImpl() { unlock(); }
     void lock() {
         if (m_locked == false) {
             m_mutex.lock();
@@ -0,0 +1,45 @@
+/**
+ * @file numa.hpp
+ * @author qc
+ * @brief CPU/NUMA拓扑和节点本地内存分配
+ * @details 拓扑从/sys/devices/system/node读取,不依赖libnuma;读不到时当作只有一个节点0,包含所有在线cpu.
+ *          节点本地分配用mmap+mbind(MPOL_PREFERRED),内核不支持时退化为普通mmap(按首次访问分配).
+ * @version 0.1
+ * @date 2024-07-17
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace qc {
+
+class Numa {
+public:
+    /// @brief NUMA节点数,至少为1
+    static int NodeCount();
+    /// @brief cpu所在的节点,未知时返回0
+    static int NodeOfCpu(int cpu);
+    /// @brief 节点上的在线cpu
+    static const std::vector<int> &CpusOfNode(int node);
+    /// @brief 把当前线程绑定到一个cpu上
+    static bool BindThisThread(int cpu);
+    /// @brief 当前线程正在运行的cpu
+    static int CurrentCpu();
+    /**
+     * @brief 当前线程的首选节点
+     * @details 调度器在NUMA模式下给工作线程设置,协程栈等按这个节点分配;-1表示不指定
+     */
+    static int GetPreferredNode();
+
+    static void SetPreferredNode(int node);
+    /// @brief 按页分配size字节,优先放在node上;node < 0时不指定节点.失败返回nullptr
+    static void *Alloc(size_t size, int node);
+
+    static void Free(void *ptr, size_t size);
+};
+
+}  // namespace qc
@@ -0,0 +1,123 @@
+/**
+ * @file percore.hpp
+ * @author qc
+ * @brief 每核一个IOManager的无共享运行时
+ * @details 每个核上一个绑定到该核的单线程IOManager.监听socket每个核一个(SO_REUSEPORT),由内核把连接分给各个核,
+ *          连接上的协程一直留在接受它的核上: 没有偷任务,没有跨线程唤醒,数据按核分片后也不需要加锁.
+ *          核之间少数需要共享的操作显式地发消息(submit/invoke),每个核一个无锁的多生产者单消费者队列.
+ *          每个核的调度器只有一个工作线程(见Scheduler::isOwnerOnly),核自己的线程上的热路径不加锁:
+ *          - 核上产生的任务,唤醒的协程和超过时间片让出的协程都放进不加锁的本地队列;
+ *          - fd事件(FdCtx)和定时器在核自己的线程上用NullMutex/NullRWMutex;
+ *          - FdManager的锁只在第一次见到某个fd时使用,之后的查找不加锁.
+ *          只有来自其他线程的操作才会拿调度器全局队列的锁: submit/invoke在消息队列从空变为非空时add_task,
+ *          其他核关闭这个核上的fd,取消令牌取消这个核上的等待或者定时器时,操作作为任务交给这个核执行
+ *          (关闭时调用方等它执行完).全局队列里还有这种任务时,让出的协程排到它们后面.
+ * @version 0.1
+ * @date 2024-07-23
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "iomanager.hpp"
+#include "noncopyable.hpp"
+#include "task_func.hpp"
+
+namespace qc {
+
+/**
+ * @brief 无锁的多生产者单消费者消息队列
+ * @details Vyukov的MPSC链表队列: 入队只有一次exchange和一次store,没有CAS重试.
+ *          生产者exchange之后,链接之前,消费者暂时看不到它和它之后的消息,会在下一次取到
+ */
+class MessageQueue : public Noncopyable {
+public:
+    MessageQueue();
+
+    ~MessageQueue();
+    /// @brief 任意线程都可以调用
+    void push(TaskFunc fn);
+    /// @brief 只由消费者调用,没有消息时返回false
+    bool pop(TaskFunc &fn);
+
+private:
+    struct Node {
+        std::atomic<Node *> next{nullptr};
+        TaskFunc fn;
+    };
+    /// @brief 最后入队的节点,生产者之间竞争
+    alignas(64) std::atomic<Node *> m_head;
+    /// @brief 已经取过的哨兵节点,消费者独占
+    alignas(64) Node *m_tail;
+};
+
+class PerCore : public Noncopyable {
+public:
+    /// @brief 新连接的处理函数,在接受连接的核上的新协程中执行,负责关闭fd
+    typedef std::function<void(int fd)> ConnHandler;
+
+    /**
+     * @param cores 核数,0表示进程可以使用的所有cpu;超过cpu数时轮流绑定
+     * @param options 每个核的IOManager的选项: cpus换成所在的核,不创建补偿线程和弹性线程
+     */
+    explicit PerCore(size_t cores = 0, const std::string &name = "core",
+                     const SchedulerOptions &options = SchedulerOptions());
+    /// @brief 还没有stop时先stop
+    ~PerCore();
+
+    size_t size() const { return m_cores.size(); }
+
+    IOManager *core(size_t i) const { return m_cores[i]->iom; }
+    /// @brief 当前线程所在核的下标,不在这个运行时的核上时返回-1
+    int currentCore() const;
+
+    /**
+     * @brief 把fn发到第core个核上执行,不等待
+     * @details 队列从空变为非空时才在目标核上add_task一个取消息的任务,连续发来的消息只有第一个经过调度器的队列.
+     *          同一个核上的消息在同一个协程中依次执行,fn不应该阻塞
+     */
+    void submit(size_t core, TaskFunc fn);
+    /**
+     * @brief 在第core个核上执行fn,当前协程挂起到fn执行完再继续
+     * @details 结果通过fn捕获的引用带回.已经在目标核上时直接执行;不在协程中时阻塞当前线程等待
+     */
+    void invoke(size_t core, TaskFunc fn);
+    /// @brief 在每个核上各执行一次fn,不等待
+    void broadcast(const std::function<void()> &fn);
+
+    /**
+     * @brief 每个核上各建一个SO_REUSEPORT的监听socket并在一个协程中accept
+     * @param port 0表示由第一个socket随机选择,其余的核监听同一个端口
+     * @return 监听的端口,失败返回-1
+     */
+    int listen(const std::string &ip, uint16_t port, ConnHandler handler, int backlog = 1024);
+
+    /**
+     * @brief 关闭监听socket,停止所有核
+     * @details 和IOManager::stop一样,等到所有连接都不再等待IO事件才返回
+     */
+    void stop();
+
+private:
+    struct alignas(64) Core {
+        IOManager *iom = nullptr;
+        MessageQueue inbox;
+        /// @brief 是否已经add_task了取消息的任务
+        std::atomic<bool> scheduled{false};
+        std::vector<int> listenFds;
+    };
+    /// @brief 在目标核上取出并执行所有消息
+    void drain(Core *core);
+
+private:
+    std::vector<Core *> m_cores;
+    bool m_stopped = false;
+};
+
+}  // namespace qc
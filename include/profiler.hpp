@@ -0,0 +1,68 @@
+/**
+ * @file profiler.hpp
+ * @author qc
+ * @brief 感知协程的采样profiler
+ * @details 任务协程跑在makecontext创建的独立栈上,perf的栈回溯到Fiber::MainFunc就断了,CPU时间没法归到请求上.
+ *          这里用ITIMER_PROF按CPU时间周期性发送SIGPROF,在信号处理函数中记录当前协程id,入口回调和回溯出的栈
+ *          (在协程栈上回溯,到协程入口为止),写入预先分配好的样本数组,整个过程不分配内存也不加锁.
+ *          停止后按协程入口聚合成folded stacks,可以直接交给flamegraph.pl或speedscope.
+ *          可执行文件用-rdynamic链接时才能解析出其中的函数名,否则输出地址.
+ *          SIGPROF处理函数只在采样或者CaptureStack期间安装(SA_RESTART),不是自己的信号交给原来的处理函数,
+ *          最后一个使用者离开时恢复原来的处理函数;原来是默认处理时保留安装,避免还在路上的信号终止进程.
+ * @version 0.1
+ * @date 2024-07-12
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <string>
+
+namespace qc {
+
+class Profiler {
+public:
+    /// @brief 单个样本最多记录的栈帧
+    static const int MAX_DEPTH = 64;
+
+    /**
+     * @brief 开始采样,清空之前的样本
+     * @param hz 每秒CPU时间的采样次数
+     * @param max_samples 样本上限,超出后丢弃
+     * @return 已经在采样或者安装信号处理失败时返回false
+     */
+    static bool Start(int hz = 100, size_t max_samples = 10000);
+    /// @brief 停止采样,等正在写样本的信号处理函数结束才返回;样本保留到下一次Start
+    static void Stop();
+
+    static bool IsRunning();
+    /// @brief 已经记录的样本数
+    static uint64_t GetSamples();
+    /// @brief 因为样本数组满而丢弃的样本数
+    static uint64_t GetDropped();
+
+    /**
+     * @brief 输出folded stacks,每行"入口;外层帧;...;内层帧 次数"
+     * @param per_fiber 为true时最外层再按协程id区分,否则同一个入口的协程合并
+     */
+    static std::string DumpFolded(bool per_fiber = false);
+
+    static bool WriteFolded(const std::string &path, bool per_fiber = false);
+
+    /**
+     * @brief 抓取本进程另一个线程当前的调用栈,每行"#序号 函数名"
+     * @details 用tgkill给目标线程发SIGPROF,由同一个信号处理函数回溯;不需要Start.
+     *          目标线程阻塞在不可重启的系统调用(nanosleep等)上时,信号会让这次调用提前返回EINTR;
+     *          处于不可中断睡眠(D状态)的线程在超时之前处理不了信号
+     * @param tid 线程id(gettid)
+     * @param timeout_ms 等待目标线程处理信号的时间
+     * @return 超时或者发送信号失败时返回空串
+     */
+    static std::string CaptureStack(pid_t tid, int timeout_ms = 100);
+};
+
+}  // namespace qc
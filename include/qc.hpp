@@ -44,5 +44,14 @@ namespace qc {
 #define qc_unlikely(x) (x)
 #endif
 
+/// @brief 自旋等待时提示cpu降低功耗,超线程让出流水线给另一个线程
+#if defined __x86_64__ || defined __i386__
+#define qc_cpu_relax() __builtin_ia32_pause()
+#elif defined __aarch64__
+#define qc_cpu_relax() asm volatile("yield" ::: "memory")
+#else
+#define qc_cpu_relax() do {} while (0)
+#endif
+
 
 }
\ No newline at end of file
@@ -0,0 +1,127 @@
+/**
+ * @file resolver.hpp
+ * @author qc
+ * @brief 协程友好的DNS解析器
+ * @details glibc的getaddrinfo内部使用阻塞的UDP IO,在协程中调用会把整个工作线程卡住直到解析超时.
+ *          这里自己实现一个简单的stub resolver: 解析/etc/resolv.conf和/etc/hosts,
+ *          通过hook后的UDP socket发送查询(等待期间只挂起当前协程),并带有进程内的TTL缓存.
+ * @version 0.1
+ * @date 2024-07-08
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mutex.hpp"
+#include "singleton.hpp"
+
+namespace qc {
+
+/// @brief 解析得到的一个地址
+struct ResolvedAddr {
+    /// @brief AF_INET 或 AF_INET6
+    int family = AF_INET;
+    union {
+        in_addr v4;
+        in6_addr v6;
+    } addr;
+};
+
+class Resolver {
+public:
+    typedef std::shared_ptr<Resolver> ptr;
+    typedef RWMutex RWMutexType;
+
+    /// @brief 默认加载系统的/etc/resolv.conf和/etc/hosts
+    Resolver();
+
+    /// @brief 加载resolv.conf(nameserver/search/domain/options timeout,attempts,ndots)
+    bool loadResolvConf(const std::string &path = "/etc/resolv.conf");
+    /// @brief 加载hosts文件,会覆盖之前加载的hosts表
+    bool loadHosts(const std::string &path = "/etc/hosts");
+
+    /// @brief 手动指定DNS服务器(测试时指向本地的stub server)
+    void setNameservers(const std::vector<sockaddr_in> &servers);
+    /// @brief 单次查询的超时时间(毫秒)
+    void setTimeout(uint64_t ms);
+    /// @brief 每个服务器的重试次数
+    void setAttempts(int attempts);
+    /// @brief 缓存的最大条数(包括否定缓存),默认4096,至少为1
+    void setCacheCapacity(size_t capacity);
+
+    /**
+     * @brief 解析主机名
+     * @param host 主机名,数字形式的地址直接返回
+     * @param family AF_INET/AF_INET6/AF_UNSPEC
+     * @param addrs 解析结果
+     * @return 0表示成功,否则为EAI_*错误码
+     */
+    int resolve(const std::string &host, int family, std::vector<ResolvedAddr> &addrs);
+
+    /// @brief 清空TTL缓存
+    void clearCache();
+
+private:
+    /// @brief 依次向每个nameserver查询一条记录
+    int query(const std::string &name, uint16_t qtype, std::vector<ResolvedAddr> &addrs,
+              uint32_t &ttl);
+    /// @brief 按search列表展开后依次查询
+    int lookup(const std::string &host, uint16_t qtype, std::vector<ResolvedAddr> &addrs,
+               uint32_t &ttl);
+
+private:
+    /// @brief 写入一条缓存,先清掉已经过期的,仍然满时淘汰最早过期的.需要持有写锁
+    void insertCacheLocked(const std::string &key, int result, uint64_t expire,
+                           const std::vector<ResolvedAddr> &addrs);
+
+private:
+    /// @brief 过期时间 -> key,按过期时间清理和淘汰
+    typedef std::multimap<uint64_t, std::string> ExpiryIndex;
+
+    struct CacheEntry {
+        /// @brief 0或者EAI_NONAME(否定缓存)
+        int result = 0;
+        /// @brief 过期时间(GetElapsedMS)
+        uint64_t expire = 0;
+        std::vector<ResolvedAddr> addrs;
+        /// @brief 在m_expiry中的位置
+        ExpiryIndex::iterator expiry;
+    };
+
+    /// @brief DNS服务器
+    std::vector<sockaddr_in> m_servers;
+    /// @brief 搜索域
+    std::vector<std::string> m_search;
+    /// @brief 单次查询超时时间
+    uint64_t m_timeout = 5000;
+    /// @brief 重试次数
+    int m_attempts = 2;
+    /// @brief 名字中的点数小于ndots时先尝试搜索域
+    int m_ndots = 1;
+    /// @brief hosts表
+    std::unordered_map<std::string, std::vector<ResolvedAddr>> m_hosts;
+    /**
+     * @brief TTL缓存,key为"family:host"
+     * @details 名字可能来自外部输入(网关代理任意域名),否定缓存也占条目,所以限制条数
+     */
+    std::unordered_map<std::string, CacheEntry> m_cache;
+    ExpiryIndex m_expiry;
+    size_t m_cacheCapacity = 4096;
+    /// @brief 保护上面所有成员
+    RWMutexType m_mutex;
+};
+
+// DNS解析器单例
+typedef Singleton<Resolver> ResolverMgr;
+
+}  // namespace qc
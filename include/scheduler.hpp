@@ -10,10 +10,14 @@
  */
 
 #pragma once
+#include <deque>
 #include <list>
+#include <vector>
 
 #include "qc.hpp"
 #include "fiber.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
 #include "mutex.hpp"
 #include "thread.hpp"
 namespace qc {
@@ -24,7 +28,7 @@ public:
     ScheduleTask() { thread = -1; }
 
     ScheduleTask(Fiber::ptr f, int thr) {
-        fiber = f;
+        fiber = std::move(f);
         thread = thr;
     }
 
@@ -33,8 +37,8 @@ public:
         thread = thr;
     }
 
-    ScheduleTask(std::function<void()> f, int thr) {
-        cb = f;
+    ScheduleTask(TaskFunc f, int thr) {
+        cb = std::move(f);
         thread = thr;
     }
 
@@ -44,20 +48,111 @@ public:
         cb = nullptr;
     }
 
+private:
+    /// @brief 协程任务取协程自己的优先级,回调任务取当前协程的,不在协程中时为PRIORITY_NORMAL
+    TaskPriority inheritPriority() const {
+        if (fiber) return fiber->getPriority();
+        Fiber *cur = Fiber::GetCurrent();
+        return cur ? cur->getPriority() : PRIORITY_NORMAL;
+    }
+
 private:
     Fiber::ptr fiber;
-    std::function<void()> cb;
+    TaskFunc cb;
     int thread;
+    TaskPriority priority = PRIORITY_NORMAL;
+    /// @brief 入队时间(GetMonotonicNS),用来统计调度延迟和优先级老化
+    uint64_t enqueue_ns = 0;
 };
 
+/// @brief 调度器的创建选项,IOManager在构造函数中就会启动线程,所以放置策略只能在构造时给出
+struct SchedulerOptions {
+    /// @brief 第i个工作线程绑定到cpus[i % cpus.size()]上,空表示不绑定
+    std::vector<int> cpus;
+    /**
+     * @brief NUMA感知
+     * @details 没有指定cpus时把工作线程轮流分布到各节点的cpu上并绑定;
+     *          工作线程的本地队列和协程栈分配在所在的节点上
+     */
+    bool numa_aware = false;
+    /**
+     * @brief 忙轮询的工作线程下标(不包括use_caller的调用线程),只对IOManager有效
+     * @details 这些线程空闲时从不阻塞: 循环检查任务队列并epoll_wait(0),定时器也在循环中检查.
+     *          会一直占满所在的cpu,应该配合cpus绑定到独占的核上;其他线程照常阻塞在epoll_wait
+     */
+    std::vector<size_t> busy_poll;
+    /// @brief 忙轮询线程上等待的socket设置的SO_BUSY_POLL(微秒),0表示不设置
+    int busy_poll_us = 0;
+    /**
+     * @brief 每个工作线程缓存的运行结束的协程数,0表示不缓存
+     * @details 回调任务优先从池中取协程reset,省掉协程对象和栈的分配;每个协程占一个默认大小(128KB)的栈
+     */
+    size_t fiber_pool_size = 16;
+    /**
+     * @brief 优先级老化时间(微秒),0表示严格按优先级
+     * @details 排在队头的低优先级任务等待超过这个时间后,先于高优先级任务执行,避免被持续的高优先级任务饿死
+     */
+    uint64_t priority_aging_us = 20 * 1000;
+    /**
+     * @brief 时间片(微秒),0表示不限制
+     * @details 开启后由一个监视线程检查各工作线程上当前任务的连续运行时间,超过时间片的打上标记,
+     *          任务在下一个检查点(maybe_yield或者hook的IO调用)让出并排到队尾.
+     *          不会在任意位置打断任务,不检查的计算循环仍然会一直占着线程
+     */
+    uint64_t time_slice_us = 0;
+    /**
+     * @brief 阻塞检测阈值(微秒),0表示不检测
+     * @details 由同一个监视线程检查: 工作线程停在同一个任务中超过阈值(调用了没有hook的阻塞接口,
+     *          比如文件IO,Mutex,或者长时间的计算)时,打印协程id,线程状态和抓取到的调用栈,每次阻塞只报告一次
+     */
+    uint64_t block_threshold_us = 0;
+    /**
+     * @brief 报告阻塞时是否抓取调用栈,见Profiler::CaptureStack
+     * @details 抓取时要临时接管SIGPROF,和程序自己的profiler(gperftools等)共用这个信号,所以默认关闭
+     */
+    bool block_capture_stack = false;
+    /**
+     * @brief 同时存在的补偿线程数上限,0表示只报告不补偿
+     * @details 工作线程阻塞时临时增加一个工作线程继续处理队列,阻塞的线程回到调度之后临时线程退出.
+     *          临时线程没有本地队列: 从全局队列取任务,从其他工作线程偷,产生的任务放进全局队列
+     */
+    size_t block_compensation = 0;
+    /**
+     * @brief 工作线程数上限(包括use_caller的调用线程),不大于构造时的线程数表示线程数固定
+     * @details 构造时的线程数是下限,这些线程一直存在,指定给它们的任务不受伸缩影响.
+     *          排队最久的任务连续两次检查都等待超过scale_latency_us且没有空闲线程时,监视线程增加一个弹性线程;
+     *          弹性线程和补偿线程一样没有本地队列,空闲超过scale_cooldown_us后退出.
+     *          不要用add_task把任务指定给弹性线程,它退出后这样的任务没有人执行
+     */
+    size_t max_threads = 0;
+    /// @brief 目标排队延迟(微秒)
+    uint64_t scale_latency_us = 2000;
+    /// @brief 弹性线程空闲多久之后退出(微秒)
+    uint64_t scale_cooldown_us = 1000 * 1000;
+};
+
+/**
+ * @brief 协作式抢占的检查点
+ * @details 开启了时间片(SchedulerOptions::time_slice_us)时,当前任务连续运行超过时间片且还有其他任务在排队,
+ *          就把当前协程放回队尾并让出;没有超时时只有两次load,可以放在计算密集的循环里.
+ *          hook的IO调用在开始时也会检查一次
+ * @return 是否让出过
+ */
+bool maybe_yield();
+
+class IOManager;
+
 class Scheduler {
+    friend bool maybe_yield();
+    friend class IOManager;
 public:
     typedef std::shared_ptr<Scheduler> ptr;
     typedef Mutex MutexType;
 
 public:
     Scheduler(size_t threads = 1, bool use_caller = true,
-              const std::string &name = "Scheduler");
+              const std::string &name = "Scheduler",
+              const SchedulerOptions &options = SchedulerOptions());
 
     virtual ~Scheduler();
 
@@ -74,52 +169,201 @@ public:
      * @tparam Fiber_Cb 任务类可以是协程对象或函数指针
      * @param task 任务
      * @param thread 指定的线程执行,-1表示任意线程
+     * @param priority 优先级,默认沿用协程或者当前协程的优先级
      */
     template <class Fiber_Cb>
-    void add_task(Fiber_Cb task, int thread = -1) {
-        bool need_tickle = false;
-        {
-            MutexType::Lock lock(_mutex);
-            need_tickle = add_task_nolock(task, thread);
-        }
-        if (need_tickle) tickle();
+    void add_task(Fiber_Cb task, int thread = -1, TaskPriority priority = PRIORITY_INHERIT) {
+        ScheduleTask t(std::move(task), thread);
+        t.priority = priority == PRIORITY_INHERIT ? t.inheritPriority() : priority;
+        t.enqueue_ns = GetMonotonicNS();
+        if (push(t)) tickle();
     }
 
-    template<class Fiber_Cb>
-    bool add_task_nolock(Fiber_Cb t, int thread) {
-        bool need_tickle = false;
-        if (_queue.empty()) need_tickle = true;
-        ScheduleTask task(t, thread);
-        _queue.push_back(task);
-        std::cout << "add task sucess" << std::endl;
-        return need_tickle;
-    }
-
-    /// @brief 协程调度函数
+    /**
+     * @brief 协程调度函数
+     * @details 线程开始调度时按实际类型和本地队列的锁策略选一个runLoop的实例,之后不再判断
+     */
     void run();
+    /// @brief 设置长任务阈值(纳秒): 任务一次运行超过阈值还没有让出时打印警告,0表示不检查
+    void setLongRunThreshold(uint64_t ns) { _longRunThreshold = ns; }
+
+    uint64_t getLongRunThreshold() const { return _longRunThreshold; }
 
 protected:
     /// @brief 空闲协程
     virtual void idle();
     /// @brief 通知调度器由任务
     virtual void tickle();
-    /// @brief 返回是否可以停止
+    /**
+     * @brief 返回是否可以停止
+     * @details 不加锁: 只看停止标记和任务计数,空闲线程每次循环都会调用
+     */
     virtual bool stopping();
     /// @brief 设置当前协程调度器
     void setThis();
     /// @brief 当前是否有空闲协程
     bool hasIdleThreads() { return _idleThreadCount > 0; }
+    /**
+     * @brief 队列中是否有任务,不加锁,用于空闲线程自旋
+     * @details 计数在入队时增加(seq_cst),配合tickle中对自旋线程数的检查不会丢失唤醒
+     */
+    bool hasPendingTasks() const { return getPendingTasks() > 0; }
+
+    size_t getPendingTasks() const {
+        size_t n = 0;
+        for (int p = 0; p < PRIORITY_COUNT; ++p) n += _pendingTasks[p].load();
+        return n;
+    }
+    /// @brief 参与调度的线程数,包括use_caller的调用线程
+    size_t getThreadCount() const { return _threads_count + (_use_caller ? 1 : 0); }
+    /// @brief 当前线程是否是这个调度器的忙轮询线程
+    bool isBusyPollThread() const;
+    /// @brief 当前线程是否是补偿阻塞的临时工作线程
+    bool isTemporaryWorker() const;
+    /// @brief 当前线程是否是应该退出的临时工作线程,idle看到后结束
+    bool isRetiring() const;
+    /// @brief 是否只有一个线程访问这个调度器的数据,见_ownerOnlyQueues
+    bool isOwnerOnly() const { return _ownerOnlyQueues; }
+    /**
+     * @brief 当前线程是否是单线程调度器的那个线程
+     * @details use_caller时包括run之前和stop之后的调用线程,那时也没有别的线程在调度
+     */
+    bool onOwnerThread() const;
+
+    const SchedulerOptions &getOptions() const { return _options; }
+    /**
+     * @brief 连续执行一批任务之后调用
+     * @details 没有空闲线程时没有人在epoll_wait,IOManager在这里非阻塞地收一次IO事件和到期定时器
+     */
+    virtual void pollEvents() {}
+    /// @brief 任务从resume返回后记录运行时长,超过阈值时标记出来
+    void traceRun(uint64_t fiber_id, const std::type_info &cb_type, uint64_t start_ns);
 
 public:
     static Fiber* GetMainFiber();
 
     static Scheduler *GetThis();
+    /**
+     * @brief 让出当前任务协程,切回调度协程之后再执行cb
+     * @details 把当前协程登记到别处等待唤醒时,如果先登记再yield,唤醒方可能在另一个线程上
+     *          resume一个还没有真正挂起的协程;放到cb里登记,登记时协程一定已经挂起了.
+     */
+    static void YieldThen(TaskFunc cb);
+
+private:
+    /**
+     * @brief 工作线程的本地队列
+     * @details 工作线程自己add_task的任务放在这里,只有自己从头部取,其他线程空闲时从尾部偷.
+     *          每个优先级一个队列
+     */
+    struct alignas(64) Worker {
+        MutexType mutex;
+        std::deque<ScheduleTask> queue[PRIORITY_COUNT];
+        /// @brief 绑定的cpu,-1表示没有绑定
+        int cpu = -1;
+        int node = 0;
+        /// @brief 由Numa::Alloc分配在node上
+        bool onNode = false;
+        /// @brief 空闲时忙轮询,见SchedulerOptions::busy_poll
+        bool busyPoll = false;
+        /// @brief 当前任务这次resume的开始时间,没有在运行任务时为0;只在开启时间片或阻塞检测时记录
+        std::atomic<uint64_t> runStart{0};
+        /// @brief 心跳: 开始执行的任务数,和runStart一起记录
+        std::atomic<uint64_t> heartbeat{0};
+        /// @brief 当前任务的协程id
+        std::atomic<uint64_t> runFiber{0};
+        /// @brief 所在线程的id,用于抓取调用栈
+        std::atomic<pid_t> tid{0};
+        /// @brief 监视线程发现超过时间片的任务时写入它的runStart,和runStart相等表示当前任务应该让出
+        std::atomic<uint64_t> preemptStart{0};
+        /// @brief 运行结束的协程,只有所属线程访问,不加锁
+        std::vector<Fiber::ptr> fiberPool;
+        /// @brief 偷任务的顺序,同节点的在前
+        std::vector<Worker *> victims;
+        /// @brief 补偿阻塞或者弹性伸缩的临时工作线程,不在_workers中
+        bool temporary = false;
+        /// @brief 临时工作线程开始空闲的时间,在执行任务时为0
+        std::atomic<uint64_t> idleSince{0};
+        /// @brief 通知临时工作线程退出
+        std::atomic<bool> retire{false};
+        /// @brief 临时工作线程的run已经返回,可以join
+        std::atomic<bool> exited{false};
+        /// @brief 临时工作线程
+        Thread::ptr thread;
+        /// @brief 以下只有监视线程访问: 已经报告过的那次阻塞的heartbeat
+        uint64_t reportedBeat = 0;
+        /// @brief 临时工作线程为哪个工作线程的哪次阻塞创建,弹性线程为nullptr
+        Worker *blockedOn = nullptr;
+        uint64_t blockedBeat = 0;
+    };
+
+    /**
+     * @brief 放入当前工作线程的本地队列或全局队列,返回是否需要tickle
+     * @param local 是否允许放入本地队列
+     */
+    bool push(ScheduleTask &task, bool local = true);
+    /**
+     * @brief 超过时间片让出的协程放到全局队列的队尾,排在本地队列里的任务(包括它自己)不会总是先于全局队列
+     * @details 单线程调度器上全局队列为空时放回本地队列
+     */
+    void requeue(Fiber::ptr fiber);
+    /**
+     * @brief 调度循环
+     * @details Derived是IOManager(final)时,idle,tickle和pollEvents直接调用,不经过虚函数表;
+     *          Derived是Scheduler时仍然是虚函数调用,其他子类都走这个实例.
+     *          LockPolicy是本地队列的锁策略(见_ownerOnlyQueues),取任务时不再每次判断
+     */
+    template <class Derived, class LockPolicy>
+    void runLoop();
+    /// @brief 从本地队列头部取,只取入队时间不晚于deadline的
+    template <class LockPolicy>
+    bool popLocal(Worker *self, int priority, uint64_t deadline, ScheduleTask &task, bool &tickle_me);
+    /// @brief 放入self的本地队列,返回放入前队列是否为空
+    template <class LockPolicy>
+    bool pushLocal(Worker *self, ScheduleTask &task);
+    /**
+     * @brief 取一个任务,本地队列按LockPolicy加锁
+     * @details 先取等待超过老化时间的低优先级任务,然后从高到低每个优先级依次看本地队列,全局队列,再从其他工作线程偷
+     */
+    template <class LockPolicy>
+    bool popWith(Worker *self, ScheduleTask &task, bool &tickle_me);
+    /// @brief 从全局队列取第一个可以在当前线程执行且入队时间不晚于deadline的
+    bool popGlobal(int priority, uint64_t deadline, ScheduleTask &task, bool &tickle_me);
+
+    bool steal(Worker *self, int priority, ScheduleTask &task);
+    /// @brief start()中创建工作线程的本地队列,确定绑定的cpu和偷任务的顺序
+    void createWorkers();
+    /// @brief 为回调任务准备协程: 优先从self的协程池中取,池空或者不是工作线程时新建
+    Fiber::ptr acquireFiber(Worker *self, TaskFunc &cb);
+    /// @brief 任务协程从resume返回后调用,运行结束且没有别人持有时放回self的协程池
+    void releaseFiber(Worker *self, Fiber::ptr &fiber);
+    /// @brief 开始resume一个任务之前,给监视线程记录心跳,协程id和开始时间
+    void beginRun(Worker *self, uint64_t fiber_id, uint64_t start_ns) {
+        self->runFiber.store(fiber_id, std::memory_order_relaxed);
+        self->heartbeat.store(self->heartbeat.load(std::memory_order_relaxed) + 1,
+                              std::memory_order_relaxed);
+        self->runStart.store(start_ns, std::memory_order_release);
+    }
+    /// @brief 监视线程: 给超过时间片的任务打上让出标记,检查阻塞的工作线程
+    void monitor();
+    /// @brief 工作线程在开始于start的任务中停留超过了阈值,报告并按需补偿
+    void reportBlocked(Worker *w, uint64_t start, uint64_t now);
+    /// @brief 为阻塞在第beat个任务中的工作线程创建临时工作线程,blocked为nullptr时创建弹性线程
+    void spawnTempWorker(Worker *blocked, uint64_t beat);
+    /// @brief 通知阻塞已经结束的补偿线程和空闲超过冷却时间的弹性线程退出,回收已经退出的
+    void reapTempWorkers(uint64_t now);
+    /// @brief 排队延迟持续超过目标时增加一个弹性线程
+    void scaleUp(uint64_t now);
+    /// @brief 所有队列中排在最前面的任务已经等待的时间
+    uint64_t oldestWait(uint64_t now);
+    /// @brief 全局队列中是否有指定给线程tid的任务
+    bool hasTasksFor(pid_t tid);
 
 private:
     /// @brief 调度器名称
     std::string _name;
-    /// @brief 任务队列
-    std::list<ScheduleTask> _queue;
+    /// @brief 全局任务队列: 调度器之外的线程添加的任务和指定线程的任务,每个优先级一个
+    std::list<ScheduleTask> _queue[PRIORITY_COUNT];
     /// @brief 互斥锁
     MutexType _mutex;
     /// @brief 线程池
@@ -132,6 +376,8 @@ private:
     std::atomic<size_t> _activeThreadCount{0};
     /// @brief 空闲线程数量
     std::atomic<size_t> _idleThreadCount{0};
+    /// @brief 所有队列中每个优先级的任务数,取任务时跳过空的优先级
+    std::atomic<size_t> _pendingTasks[PRIORITY_COUNT] = {};
     /// @brief 是否使用use caller
     bool _use_caller;
     /// @brief 使用use_caller时的Main线程主协程(根协程)
@@ -139,7 +385,33 @@ private:
     /// @brief 使用use_caller时调度器所在线程的id
     long int _rootThread = 0;
     /// @brief 是否正在停止
-    bool _stopping = false;
+    std::atomic<bool> _stopping{false};
+    /**
+     * @brief 本地队列是否只有所属线程访问
+     * @details 只有一个工作线程,也不会有补偿线程和弹性线程时,没有人来偷任务,本地队列的存取用NullMutex策略
+     *          (比如PerCore的每个核).构造之后不再变化.用哪种策略是运行时按这个标记选的分支.
+     *          IOManager按同一个标记在所属线程上不给定时器和fd事件加锁,其他线程的操作转给所属线程;
+     *          全局队列的锁照常使用,其他线程提交任务时需要它
+     */
+    bool _ownerOnlyQueues = false;
+    /// @brief 这个调度器是IOManager时指向它自己,IOManager::GetThis不用dynamic_cast
+    IOManager *_ioManager = nullptr;
+    /// @brief 注册到Metrics的仪表
+    std::vector<uint64_t> _gaugeIds;
+    /// @brief 长任务阈值(纳秒),默认100ms
+    std::atomic<uint64_t> _longRunThreshold{100 * 1000 * 1000};
+    /// @brief 工作线程的本地队列,use_caller时第0个属于调用线程,start()之后不再变化
+    std::vector<Worker *> _workers;
+    SchedulerOptions _options;
+    /// @brief 监视线程,只在需要时创建
+    Thread::ptr _monitor;
+    /// @brief 临时工作线程,只有监视线程和stop()(监视线程结束后)访问
+    std::vector<Worker *> _tempWorkers;
+    /// @brief 临时工作线程数,用于仪表
+    std::atomic<size_t> _tempWorkerCount{0};
+    /// @brief 排队延迟连续超过目标的检查次数,只有监视线程访问
+    uint32_t _slowChecks = 0;
+    std::atomic<bool> _monitorStop{false};
 };
 
 }  // namespace qc
\ No newline at end of file
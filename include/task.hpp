@@ -0,0 +1,268 @@
+/**
+ * @file task.hpp
+ * @author qc
+ * @brief C++20无栈协程前端
+ * @details Task<T>是惰性启动的无栈协程,co_await时才开始执行,结束时直接切回等待它的协程.
+ *          readable/writable/sleep_for/async_recv/async_send这些awaiter挂到IOManager::addEvent和
+ *          TimerManager::add_timer上,事件到达后把恢复协程的回调作为普通任务交给同一个调度器,
+ *          所以无栈协程和Fiber跑在同一批工作线程上.每个挂起的操作只占一个协程帧,而不是一个128KB的栈.
+ *          co_spawn把顶层Task交给调度器并返回Future,Fiber中可以直接get()等待结果.
+ *          只有头文件,使用者需要用-std=c++20编译.
+ * @version 0.1
+ * @date 2024-07-15
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#pragma once
+
+#if __cplusplus < 202002L
+#error "task.hpp requires -std=c++20"
+#endif
+
+#include <cerrno>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <utility>
+
+#include "future.hpp"
+#include "hook.hpp"
+#include "iomanager.hpp"
+
+namespace qc {
+
+template <class T = void>
+class Task;
+
+namespace detail {
+
+struct TaskPromiseBase {
+    /// @brief 在结束时切回等待这个Task的协程
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+
+        template <class P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+            std::coroutine_handle<> cont = h.promise().continuation;
+            return cont ? cont : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() { exception = std::current_exception(); }
+
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+};
+
+template <class T>
+struct TaskPromise : TaskPromiseBase {
+    Task<T> get_return_object();
+
+    template <class V>
+    void return_value(V &&v) {
+        value.emplace(std::forward<V>(v));
+    }
+
+    T result() {
+        if (exception) std::rethrow_exception(exception);
+        return std::move(*value);
+    }
+
+    std::optional<T> value;
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object();
+
+    void return_void() {}
+
+    void result() {
+        if (exception) std::rethrow_exception(exception);
+    }
+};
+
+}  // namespace detail
+
+/// @brief 只能移动,析构时销毁协程帧
+template <class T>
+class Task {
+public:
+    typedef detail::TaskPromise<T> promise_type;
+    typedef std::coroutine_handle<promise_type> handle_type;
+
+    Task() = default;
+    explicit Task(handle_type h) : m_handle(h) {}
+    Task(Task &&rhs) noexcept : m_handle(std::exchange(rhs.m_handle, nullptr)) {}
+    Task &operator=(Task &&rhs) noexcept {
+        if (this != &rhs) {
+            if (m_handle) m_handle.destroy();
+            m_handle = std::exchange(rhs.m_handle, nullptr);
+        }
+        return *this;
+    }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+
+    ~Task() {
+        if (m_handle) m_handle.destroy();
+    }
+
+    bool done() const { return !m_handle || m_handle.done(); }
+
+    /// @brief co_await时启动,结束后返回结果或重新抛出异常
+    auto operator co_await() && noexcept {
+        struct Awaiter {
+            bool await_ready() noexcept { return !handle || handle.done(); }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) noexcept {
+                handle.promise().continuation = cont;
+                return handle;
+            }
+
+            T await_resume() { return handle.promise().result(); }
+
+            handle_type handle;
+        };
+        return Awaiter{m_handle};
+    }
+
+private:
+    handle_type m_handle;
+};
+
+namespace detail {
+
+template <class T>
+inline Task<T> TaskPromise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+/// @brief 立即开始,结束时自己销毁,co_spawn用它把结果写进Promise
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+template <class T>
+DetachedTask RunDetached(Task<T> task, Promise<T> promise) {
+    try {
+        if constexpr (std::is_void<T>::value) {
+            co_await std::move(task);
+            promise.set_value();
+        } else {
+            promise.set_value(co_await std::move(task));
+        }
+    } catch (...) {
+        promise.set_exception(std::current_exception());
+    }
+}
+
+/**
+ * @brief 等待fd上的事件
+ * @details 登记成功之后事件可能马上在另一个线程上到达并恢复协程,
+ *          所以await_suspend在addEvent之后不能再访问awaiter
+ */
+struct EventAwaiter {
+    bool await_ready() noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+        IOManager *iom = IOManager::GetThis();
+        qc_assert(iom);
+        result = 0;
+        if (iom->addEvent(fd, event, [h]() { h.resume(); })) {
+            result = -EBADF;
+            return false;
+        }
+        return true;
+    }
+
+    int await_resume() noexcept { return result; }
+
+    int fd;
+    Event event;
+    int result = 0;
+};
+
+struct SleepAwaiter {
+    bool await_ready() noexcept { return ms == 0; }
+
+    void await_suspend(std::coroutine_handle<> h) {
+        IOManager *iom = IOManager::GetThis();
+        qc_assert(iom);
+        iom->add_timer(ms, [h]() { h.resume(); });
+    }
+
+    void await_resume() noexcept {}
+
+    uint64_t ms;
+};
+
+}  // namespace detail
+
+/// @brief 等待fd可读,成功返回0,fd无效返回-EBADF
+inline detail::EventAwaiter readable(int fd) { return detail::EventAwaiter{fd, READ}; }
+/// @brief 等待fd可写
+inline detail::EventAwaiter writable(int fd) { return detail::EventAwaiter{fd, WRITE}; }
+/// @brief 挂起ms毫秒,不占用线程
+inline detail::SleepAwaiter sleep_for(uint64_t ms) { return detail::SleepAwaiter{ms}; }
+
+/**
+ * @brief 非阻塞fd上的recv,数据未就绪时挂起协程
+ * @return 读到的字节数,失败返回-errno(协程可能在别的线程上恢复,错误码不经过errno传递)
+ */
+inline Task<ssize_t> async_recv(int fd, void *buf, size_t len, int flags = 0) {
+    while (true) {
+        ssize_t n = recv_f(fd, buf, len, flags);
+        if (n >= 0) co_return n;
+        int err = errno;
+        if (err == EINTR) continue;
+        if (err != EAGAIN) co_return -err;
+        int rt = co_await readable(fd);
+        if (rt) co_return rt;
+    }
+}
+
+/// @brief 非阻塞fd上的send,缓冲区满时挂起协程,返回值同async_recv
+inline Task<ssize_t> async_send(int fd, const void *buf, size_t len, int flags = 0) {
+    while (true) {
+        ssize_t n = send_f(fd, buf, len, flags);
+        if (n >= 0) co_return n;
+        int err = errno;
+        if (err == EINTR) continue;
+        if (err != EAGAIN) co_return -err;
+        int rt = co_await writable(fd);
+        if (rt) co_return rt;
+    }
+}
+
+/// @brief 在scheduler上启动task,返回它的结果
+template <class T>
+Future<T> co_spawn(Scheduler *scheduler, Task<T> task) {
+    qc_assert(scheduler);
+    Promise<T> promise;
+    Future<T> future = promise.get_future();
+    // std::function要求可拷贝,Task只能移动,用shared_ptr包一层
+    auto holder = std::make_shared<Task<T>>(std::move(task));
+    scheduler->add_task([holder, promise]() { detail::RunDetached(std::move(*holder), promise); });
+    return future;
+}
+
+}  // namespace qc
@@ -0,0 +1,188 @@
+/**
+ * @file task_func.hpp
+ * @author qc
+ * @brief 只能移动的任务回调,小对象直接放在内部缓冲区
+ * @details 调度路径上(add_task,协程入口,IO事件和定时器回调)代替std::function<void()>:
+ *          libstdc++的std::function只能内联两个指针大小的对象,再大的捕获每次都要new,
+ *          而且它要求可拷贝,沿途容易发生拷贝.
+ *          TaskFunc只能移动,大小不超过QC_TASK_INLINE_SIZE(默认64字节)且可以noexcept移动的对象放在内部,
+ *          其余的才在堆上分配.
+ * @version 0.1
+ * @date 2024-07-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+
+/// @brief TaskFunc内部缓冲区的字节数,可以在编译时用-D修改
+#ifndef QC_TASK_INLINE_SIZE
+#define QC_TASK_INLINE_SIZE 64
+#endif
+
+namespace qc {
+
+template <size_t InlineSize>
+class BasicTaskFunc {
+    static_assert(InlineSize >= sizeof(void *), "inline storage must hold a pointer");
+
+public:
+    static const size_t INLINE_SIZE = InlineSize;
+
+    BasicTaskFunc() noexcept = default;
+
+    BasicTaskFunc(std::nullptr_t) noexcept {}
+    /// @brief 从任意无参可调用对象构造,空的std::function和空函数指针得到空的TaskFunc
+    template <class F, class D = typename std::decay<F>::type,
+              class = typename std::enable_if<!std::is_same<D, BasicTaskFunc>::value &&
+                                              std::is_invocable_r<void, D &>::value>::type>
+    BasicTaskFunc(F &&f) {
+        if (IsNull(f)) return;
+        if constexpr (Fits<D>::value) {
+            new (m_storage) D(std::forward<F>(f));
+            m_ops = &Inline<D>::ops;
+        } else {
+            *reinterpret_cast<D **>(m_storage) = new D(std::forward<F>(f));
+            m_ops = &Heap<D>::ops;
+        }
+    }
+
+    BasicTaskFunc(BasicTaskFunc &&rhs) noexcept { moveFrom(rhs); }
+
+    BasicTaskFunc &operator=(BasicTaskFunc &&rhs) noexcept {
+        if (this != &rhs) {
+            reset();
+            moveFrom(rhs);
+        }
+        return *this;
+    }
+
+    BasicTaskFunc &operator=(std::nullptr_t) noexcept {
+        reset();
+        return *this;
+    }
+
+    BasicTaskFunc(const BasicTaskFunc &) = delete;
+    BasicTaskFunc &operator=(const BasicTaskFunc &) = delete;
+
+    ~BasicTaskFunc() { reset(); }
+
+    explicit operator bool() const noexcept { return m_ops != nullptr; }
+
+    void operator()() { m_ops->invoke(m_storage); }
+
+    void swap(BasicTaskFunc &rhs) noexcept {
+        BasicTaskFunc tmp(std::move(rhs));
+        rhs = std::move(*this);
+        *this = std::move(tmp);
+    }
+    /// @brief 和std::function::target_type一样,空时返回typeid(void)
+    const std::type_info &target_type() const noexcept { return m_ops ? m_ops->type() : typeid(void); }
+    /// @brief 保存的对象类型是T时返回它的地址,否则返回nullptr
+    template <class T>
+    T *target() noexcept {
+        if (!m_ops || m_ops->type() != typeid(T)) return nullptr;
+        return static_cast<T *>(m_ops->get(m_storage));
+    }
+
+    template <class T>
+    const T *target() const noexcept {
+        return const_cast<BasicTaskFunc *>(this)->template target<T>();
+    }
+
+private:
+    struct Ops {
+        void (*invoke)(void *storage);
+        /// @brief 把src中的对象移动到未初始化的dst,并析构src中的对象
+        void (*relocate)(void *dst, void *src);
+        void (*destroy)(void *storage);
+        void *(*get)(void *storage);
+        const std::type_info &(*type)();
+    };
+
+    template <class D>
+    struct Fits
+        : std::integral_constant<bool, sizeof(D) <= InlineSize &&
+                                           alignof(D) <= alignof(std::max_align_t) &&
+                                           std::is_nothrow_move_constructible<D>::value> {};
+
+    template <class D>
+    struct Inline {
+        static void invoke(void *s) { (*static_cast<D *>(s))(); }
+        static void relocate(void *dst, void *src) {
+            new (dst) D(std::move(*static_cast<D *>(src)));
+            static_cast<D *>(src)->~D();
+        }
+        static void destroy(void *s) { static_cast<D *>(s)->~D(); }
+        static void *get(void *s) { return s; }
+        static const std::type_info &type() { return typeid(D); }
+        static constexpr Ops ops = {&invoke, &relocate, &destroy, &get, &type};
+    };
+
+    /// @brief 放不进缓冲区的对象,缓冲区里只存指针
+    template <class D>
+    struct Heap {
+        static D *&ptr(void *s) { return *static_cast<D **>(s); }
+        static void invoke(void *s) { (*ptr(s))(); }
+        static void relocate(void *dst, void *src) { ptr(dst) = ptr(src); }
+        static void destroy(void *s) { delete ptr(s); }
+        static void *get(void *s) { return ptr(s); }
+        static const std::type_info &type() { return typeid(D); }
+        static constexpr Ops ops = {&invoke, &relocate, &destroy, &get, &type};
+    };
+
+    template <class F>
+    struct IsStdFunction : std::false_type {};
+    template <class R, class... Args>
+    struct IsStdFunction<std::function<R(Args...)>> : std::true_type {};
+
+    /**
+     * @brief 只有函数指针,成员指针和std::function才可能为空
+     * @details 函数引用和无捕获的lambda也能和nullptr比较,但永远不为空,比较只会引来-Wnonnull-compare/-Waddress
+     */
+    template <class F>
+    static bool IsNull(const F &f) {
+        if constexpr (std::is_pointer<F>::value || std::is_member_pointer<F>::value ||
+                      IsStdFunction<F>::value)
+            return f == nullptr;
+        else return false;
+    }
+
+    void moveFrom(BasicTaskFunc &rhs) noexcept {
+        if (!rhs.m_ops) return;
+        rhs.m_ops->relocate(m_storage, rhs.m_storage);
+        m_ops = rhs.m_ops;
+        rhs.m_ops = nullptr;
+    }
+
+    void reset() noexcept {
+        if (!m_ops) return;
+        m_ops->destroy(m_storage);
+        m_ops = nullptr;
+    }
+
+private:
+    const Ops *m_ops = nullptr;
+    alignas(std::max_align_t) unsigned char m_storage[InlineSize];
+};
+
+template <size_t N>
+inline bool operator==(const BasicTaskFunc<N> &f, std::nullptr_t) noexcept {
+    return !f;
+}
+
+template <size_t N>
+inline bool operator!=(const BasicTaskFunc<N> &f, std::nullptr_t) noexcept {
+    return static_cast<bool>(f);
+}
+
+typedef BasicTaskFunc<QC_TASK_INLINE_SIZE> TaskFunc;
+
+}  // namespace qc
@@ -17,6 +17,8 @@
 #include <functional>
 #include <string>
 
+#include "mutex.hpp"
+
 namespace qc {
 
 /**
@@ -54,13 +56,17 @@ private:
 
 private:
     /// @brief 线程号
-    pid_t m_pid;
+    pid_t m_pid = 0;
     /// @brief 线程标识符
     pthread_t m_tid;
     /// @brief 回调函数
     std::function<void()> m_cb;
     /// @brief 名称
     std::string m_name;
+    /// @brief 等待线程真正跑起来,保证构造函数返回后m_pid有效
+    Semaphore m_semaphore;
+    /// @brief 是否已经join
+    bool m_joined = false;
     
 
 };
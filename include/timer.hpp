@@ -11,6 +11,7 @@
  */
 #pragma once
 
+#include <atomic>
 #include <ctime>
 #include <functional>
 #include <memory>
@@ -19,6 +20,7 @@
 
 #include "mutex.hpp"
 #include "noncopyable.hpp"
+#include "task_func.hpp"
 namespace qc {
 
 class TimerManager;
@@ -31,19 +33,33 @@ class Timer : public std::enable_shared_from_this<Timer> {
 public:
     typedef std::shared_ptr<Timer> ptr;
 
+    /**
+     * @details 定时器属于单线程的IOManager而当前不在它的线程上时,取消转给那个线程执行,
+     *          返回转交时是否还在等待触发;cancel,reset和refresh都一样
+     */
     bool cancel();
 
     bool reset(uint64_t ms, bool from_now);
 
     bool refresh();
+    /// @brief 是否还在等待触发: 已经触发(回调已经交给调度器)或者已经取消时返回false,任意线程都可以调用
+    bool isPending() const { return m_pending.load(std::memory_order_acquire); }
 
 private:
-    Timer(uint64_t ms, std::function<void()> cb, bool recurring,
+    Timer(uint64_t ms, TaskFunc cb, bool recurring,
           TimerManager* manager);
 
     // 专门用来比较的
     Timer(uint64_t next);
 
+    /// @brief 以下在mutex(m_manager的读写锁或者NullRWMutex)下操作,见TimerManager::withLock
+    template <class RW>
+    bool cancelWith(RW &mutex);
+    template <class RW>
+    bool refreshWith(RW &mutex);
+    template <class RW>
+    bool resetWith(RW &mutex, uint64_t ms, bool from_now);
+
 private:
     /// @details 仿函数,定时器比较函数.
     class Comparator {
@@ -56,8 +72,12 @@ private:
     uint64_t m_ms = 0;
     /// @brief 精确的执行时间
     uint64_t m_next;
-    /// @brief 定时器对应的回调函数
-    std::function<void()> m_cb;
+    /// @brief 定时器对应的回调函数,为空表示已经触发或取消;一次性定时器触发时移交给调度器
+    TaskFunc m_cb;
+    /// @brief m_cb是否不为空,和m_cb一起修改,其他线程不加锁地读
+    std::atomic<bool> m_pending{false};
+    /// @brief 循环定时器的回调,每次触发投递一个共享它的包装,m_cb只是这个包装
+    std::shared_ptr<TaskFunc> m_shared;
     /// @brief 是否循环
     bool m_recurring;
     /// @brief 管理器
@@ -76,24 +96,48 @@ public:
     TimerManager();
     virtual ~TimerManager();
 
-    Timer::ptr add_timer(uint64_t ms, std::function<void()> cb, bool recurring = false);
+    Timer::ptr add_timer(uint64_t ms, TaskFunc cb, bool recurring = false);
 
     uint64_t getNextTimer();
 
-    void listExpiredCb(std::vector<std::function<void()>>& cbs);
+    void listExpiredCb(std::vector<TaskFunc>& cbs);
 
-    bool hasTimer() {
-        RWMutexType::ReadLock lock(m_mutex);
-        return m_timers.size();
-    }
+    bool hasTimer() const { return getTimerCount() > 0; }
+    /// @brief 定时器个数,任意线程都可以调用
+    size_t getTimerCount() const { return m_timerCount.load(std::memory_order_acquire); }
 
 protected:
     virtual void OnTimerInsertedAtFront() = 0;
-
-    void add_timer(Timer::ptr timer, RWMutex::WriteLock& lock);
+    /**
+     * @brief 定时器只由一个线程访问,不加锁
+     * @details 单线程的IOManager在启动线程之前设置: 所属线程上的操作用NullRWMutex,
+     *          其他线程上的添加,取消和重设交给所属线程执行(isTimerThread/runOnTimerThread).
+     *          getNextTimer和listExpiredCb只能在所属线程上调用
+     */
+    void setOwnerOnly(bool v) { m_ownerOnly = v; }
+    /// @brief 当前线程是否是定时器的所属线程,只在setOwnerOnly(true)之后调用
+    virtual bool isTimerThread() const { return true; }
+    /// @brief 把fn交给所属线程执行
+    virtual void runOnTimerThread(TaskFunc fn) { fn(); }
 
     bool detectClockRollover(uint64_t now_ms);
 
+private:
+    /**
+     * @brief 按锁策略执行op(mutex)
+     * @details 普通情况下传入m_mutex;setOwnerOnly(true)之后在所属线程上传入NullRWMutex,
+     *          在其他线程上把op交给所属线程执行并返回forwarded
+     */
+    template <class R, class Op>
+    R withLock(Op op, R forwarded);
+    /// @brief 调用方持有写锁,插入后解锁,插在最前面时通知
+    template <class Lock>
+    void insertTimer(Timer::ptr timer, Lock &lock);
+    template <class RW>
+    void listExpiredWith(RW &mutex, std::vector<TaskFunc> &cbs);
+    template <class RW>
+    uint64_t nextTimerWith(RW &mutex);
+
 private:
     /// @brief 小根堆放定时器
     std::set<Timer::ptr, Timer::Comparator> m_timers;
@@ -103,6 +147,10 @@ private:
     bool m_tickled = false;
     /// @brief 上次执行时间
     uint64_t m_previousTime = 0;
+    /// @brief m_timers.size()的副本,统计和IOManager::stopping不加锁地读
+    std::atomic<size_t> m_timerCount{0};
+    /// @brief 见setOwnerOnly
+    bool m_ownerOnly = false;
 };
 
 }  // namespace qc
\ No newline at end of file
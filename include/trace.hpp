@@ -0,0 +1,110 @@
+/**
+ * @file trace.hpp
+ * @author qc
+ * @brief 协程生命周期追踪
+ * @details 打开之后,协程的创建/切入/让出/结束,addEvent/triggerEvent,定时器触发和tickle
+ *          会写入每个线程自己的二进制环形缓冲区(写满后覆盖最旧的记录,只由所属线程写).
+ *          Dump()把所有线程的记录写到一个二进制文件,再用tools/trace2json转换成
+ *          Chrome trace JSON,在chrome://tracing或Perfetto中每个协程显示为一条轨道.
+ *          关闭时每个追踪点只有一次relaxed load和一个分支.
+ * @version 0.1
+ * @date 2024-07-11
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "qc.hpp"
+
+namespace qc {
+
+class Tracer {
+public:
+    enum Type : uint32_t {
+        /// @brief 协程创建,arg为栈大小(线程主协程为0)
+        FIBER_CREATE = 0,
+        /// @brief 协程被切入
+        FIBER_RESUME,
+        /// @brief 协程让出
+        FIBER_YIELD,
+        /// @brief 协程执行结束
+        FIBER_TERM,
+        /// @brief 当前协程在fd上注册事件,arg为 fd << 8 | event
+        EVENT_ADD,
+        /// @brief fd事件到达,fiber为被唤醒的协程(回调为0),arg同上
+        EVENT_TRIGGER,
+        /// @brief 定时器到期,arg为这次到期的个数
+        TIMER_FIRE,
+        /// @brief 发出tickle
+        TICKLE,
+        TYPE_MAX
+    };
+
+    /// @brief 追踪文件中的一条记录
+    struct Record {
+        /// @brief GetMonotonicNS()
+        uint64_t ts;
+        uint64_t fiber_id;
+        uint64_t arg;
+        uint32_t type;
+        uint32_t reserved;
+    };
+
+    /**
+     * @brief 追踪文件格式(小端,和本机结构体布局一致)
+     * @details FileHeader,之后每个线程一个ThreadHeader,紧跟count条Record
+     */
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t threads;
+    };
+
+    struct ThreadHeader {
+        int32_t tid;
+        char name[28];
+        uint64_t count;
+    };
+
+    static constexpr const char *MAGIC = "QCTRACE";
+    static const uint32_t VERSION = 1;
+
+    static const char *TypeName(Type t);
+
+    /**
+     * @brief 开始追踪,清空之前的记录
+     * @param records_per_thread 每个线程缓冲区的条数,会向上取整为2的幂;
+     *        已有的缓冲区由所属线程在下一次写入时按新的大小清空
+     */
+    static void Start(size_t records_per_thread = 64 * 1024);
+    /// @brief 停止追踪,已有的记录保留到下一次Start
+    static void Stop();
+
+    static bool IsEnabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+    static void Emit(Type type, uint64_t fiber_id, uint64_t arg = 0) {
+        if (qc_unlikely(IsEnabled())) Write(type, fiber_id, arg);
+    }
+
+    /**
+     * @brief 把这一次Start以来所有线程的记录写到path
+     * @details 只在Stop之后调用才有意义: 追踪中各线程不加锁地写自己的环,这时导出的记录可能正在被覆盖.
+     *          导出之后,已经退出的线程的环可以被新线程复用
+     */
+    static bool Dump(const std::string &path);
+
+private:
+    static void Write(Type type, uint64_t fiber_id, uint64_t arg);
+
+private:
+    static std::atomic<bool> s_enabled;
+};
+
+}  // namespace qc
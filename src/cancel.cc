@@ -0,0 +1,151 @@
+/**
+ * @file cancel.cc
+ * @author qc
+ * @brief 取消令牌和协程组实现
+ * @version 0.1
+ * @date 2024-07-16
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "cancel.hpp"
+
+#include <exception>
+
+#include "iomanager.hpp"
+#include "log.hpp"
+
+namespace qc {
+
+CancelToken::ptr CancelToken::Create(const ptr &parent) {
+    ptr token(new CancelToken);
+    if (parent) {
+        std::weak_ptr<CancelToken> weak(token);
+        token->m_parent = parent;
+        token->m_parentCbId = parent->onCancel([weak]() {
+            ptr child = weak.lock();
+            if (child) child->cancel();
+        });
+        if (!token->m_parentCbId) token->m_cancelled = true;
+    }
+    return token;
+}
+
+CancelToken::~CancelToken() {
+    if (m_parent && m_parentCbId) m_parent->removeCallback(m_parentCbId);
+    if (m_deadline) m_deadline->cancel();
+}
+
+void CancelToken::cancel() {
+    std::map<uint64_t, std::function<void()>> callbacks;
+    Timer::ptr deadline;
+    {
+        MutexType::Lock lock(m_mutex);
+        if (m_cancelled.exchange(true)) return;
+        callbacks.swap(m_callbacks);
+        deadline.swap(m_deadline);
+    }
+    // 从deadline的回调进来时定时器已经出队,cancel返回false
+    if (deadline) deadline->cancel();
+    for (auto &i : callbacks) i.second();
+}
+
+uint64_t CancelToken::onCancel(std::function<void()> cb) {
+    MutexType::Lock lock(m_mutex);
+    if (isCancelled()) return 0;
+    uint64_t id = ++m_nextId;
+    m_callbacks[id] = std::move(cb);
+    return id;
+}
+
+void CancelToken::removeCallback(uint64_t id) {
+    MutexType::Lock lock(m_mutex);
+    m_callbacks.erase(id);
+}
+
+void CancelToken::setDeadline(uint64_t ms) {
+    IOManager *iom = IOManager::GetThis();
+    qc_assert(iom);
+    std::weak_ptr<CancelToken> weak(shared_from_this());
+    Timer::ptr timer = iom->add_timer(ms, [weak]() {
+        ptr token = weak.lock();
+        if (token) token->cancel();
+    });
+    Timer::ptr old;
+    {
+        MutexType::Lock lock(m_mutex);
+        if (isCancelled()) {
+            old = timer;
+        } else {
+            old = m_deadline;
+            m_deadline = timer;
+        }
+    }
+    if (old) old->cancel();
+}
+
+CancelToken::ptr CancelToken::GetCurrent() {
+    Fiber *cur = Fiber::GetCurrent();
+    return cur ? cur->getCancelToken() : nullptr;
+}
+
+FiberGroup::FiberGroup(Scheduler *scheduler)
+    : m_scheduler(scheduler), m_token(CancelToken::Create(CancelToken::GetCurrent())) {
+    qc_assert(m_scheduler);
+}
+
+FiberGroup::~FiberGroup() {
+    try {
+        join();
+    } catch (const std::exception &e) {
+        QC_LOG_ERROR("FiberGroup child failed: %s", e.what());
+    } catch (...) {
+        QC_LOG_ERROR("FiberGroup child failed with unknown exception");
+    }
+}
+
+void FiberGroup::spawn(std::function<void()> cb) {
+    Promise<void> promise;
+    {
+        MutexType::Lock lock(m_mutex);
+        m_children.push_back(promise.get_future());
+    }
+    CancelToken::ptr token = m_token;
+    m_scheduler->add_task([token, cb, promise]() mutable {
+        Fiber *cur = Fiber::GetCurrent();
+        cur->setCancelToken(token);
+        detail::Fulfill(promise, cb);
+        cur->setCancelToken(nullptr);
+    });
+}
+
+void FiberGroup::join() {
+    // 等待本身不能被取消,否则被取消的父协程会在子协程还没退出时就返回
+    Fiber *cur = Fiber::GetCurrent();
+    CancelToken::ptr saved = cur ? cur->getCancelToken() : nullptr;
+    if (cur) cur->setCancelToken(nullptr);
+
+    std::exception_ptr error;
+    while (true) {
+        std::vector<Future<void>> children;
+        {
+            MutexType::Lock lock(m_mutex);
+            children.swap(m_children);
+        }
+        if (children.empty()) break;
+        when_all(children).get();
+        for (auto &f : children) {
+            try {
+                f.get();
+            } catch (...) {
+                if (!error) error = std::current_exception();
+            }
+        }
+    }
+
+    if (cur) cur->setCancelToken(saved);
+    if (error) std::rethrow_exception(error);
+}
+
+}  // namespace qc
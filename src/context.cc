@@ -0,0 +1,182 @@
+/**
+ * @file context.cc
+ * @author qc
+ * @brief 协程上下文切换实现
+ * @version 0.1
+ * @date 2024-07-20
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "context.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#include "qc.hpp"
+
+#ifdef QC_FIBER_UCONTEXT
+#include <ucontext.h>
+#endif
+
+namespace qc {
+
+#ifndef QC_FIBER_UCONTEXT
+
+extern "C" void qc_swap_context(Context *from, Context to);
+
+#if defined __x86_64__
+/**
+ * @details 栈上的布局(从低地址到高地址): mxcsr和x87控制字, r15, r14, r13, r12, rbx, rbp, 返回地址.
+ *          mxcsr和x87控制字也是被调用者保存的(舍入模式等),和boost.context一样一起保存.
+ */
+asm(R"(
+    .text
+    .globl qc_swap_context
+    .hidden qc_swap_context
+    .type qc_swap_context, @function
+    .align 16
+qc_swap_context:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    subq $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .size qc_swap_context, .-qc_swap_context
+    .section .note.GNU-stack,"",@progbits
+    .text
+)");
+
+/// @brief 新上下文的初始栈帧,和qc_swap_context压栈的顺序一致
+struct InitialFrame {
+    uint32_t mxcsr;
+    uint32_t fpucw;
+    uint64_t r15, r14, r13, r12, rbx, rbp;
+    /// @brief qc_swap_context的ret跳到这里
+    uint64_t entry;
+    /// @brief entry看到的返回地址,为0让栈回溯停在这里
+    uint64_t ret;
+};
+// ret之后rsp = top - 8,和call进入函数时一样是16字节对齐再减8
+static_assert(sizeof(InitialFrame) % 16 == 8, "entry must see a call-aligned stack");
+
+static void InitFrame(InitialFrame *frame, void (*fn)()) {
+    memset(frame, 0, sizeof(*frame));
+    // 默认的舍入模式和异常屏蔽位
+    frame->mxcsr = 0x1f80;
+    frame->fpucw = 0x037f;
+    frame->entry = (uint64_t)fn;
+}
+
+#elif defined __aarch64__
+/// @details 栈上的布局(从低地址到高地址): x19-x28, x29(fp), x30(lr), d8-d15
+asm(R"(
+    .text
+    .globl qc_swap_context
+    .hidden qc_swap_context
+    .type qc_swap_context, %function
+    .align 4
+qc_swap_context:
+    sub sp, sp, #160
+    stp x19, x20, [sp, #0]
+    stp x21, x22, [sp, #16]
+    stp x23, x24, [sp, #32]
+    stp x25, x26, [sp, #48]
+    stp x27, x28, [sp, #64]
+    stp x29, x30, [sp, #80]
+    stp d8, d9, [sp, #96]
+    stp d10, d11, [sp, #112]
+    stp d12, d13, [sp, #128]
+    stp d14, d15, [sp, #144]
+    mov x9, sp
+    str x9, [x0]
+    mov sp, x1
+    ldp x19, x20, [sp, #0]
+    ldp x21, x22, [sp, #16]
+    ldp x23, x24, [sp, #32]
+    ldp x25, x26, [sp, #48]
+    ldp x27, x28, [sp, #64]
+    ldp x29, x30, [sp, #80]
+    ldp d8, d9, [sp, #96]
+    ldp d10, d11, [sp, #112]
+    ldp d12, d13, [sp, #128]
+    ldp d14, d15, [sp, #144]
+    add sp, sp, #160
+    ret
+    .size qc_swap_context, .-qc_swap_context
+    .section .note.GNU-stack,"",%progbits
+    .text
+)");
+
+struct InitialFrame {
+    uint64_t x19_x28[10];
+    /// @brief 为0让栈回溯停在这里
+    uint64_t fp;
+    /// @brief qc_swap_context的ret跳到这里
+    uint64_t lr;
+    uint64_t d8_d15[8];
+};
+// ret之后sp = top,16字节对齐
+static_assert(sizeof(InitialFrame) % 16 == 0, "entry must see an aligned stack");
+
+static void InitFrame(InitialFrame *frame, void (*fn)()) {
+    memset(frame, 0, sizeof(*frame));
+    frame->lr = (uint64_t)fn;
+}
+#endif
+
+void MakeContext(Context *ctx, void *stack, size_t size, void (*fn)()) {
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+    InitialFrame *frame = (InitialFrame *)(top - sizeof(InitialFrame));
+    InitFrame(frame, fn);
+    *ctx = frame;
+}
+
+void InitThreadContext(Context *ctx) { *ctx = nullptr; }
+
+void SwapContext(Context *from, Context to) { qc_swap_context(from, to); }
+
+#else
+
+void MakeContext(Context *ctx, void *stack, size_t size, void (*fn)()) {
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)(alignof(ucontext_t) - 1);
+    ucontext_t *uc = (ucontext_t *)(top - sizeof(ucontext_t));
+    int rt = getcontext(uc);
+    qc_assert(rt == 0);
+    uc->uc_link = nullptr;
+    uc->uc_stack.ss_sp = stack;
+    uc->uc_stack.ss_size = (char *)uc - (char *)stack;
+    makecontext(uc, fn, 0);
+    *ctx = uc;
+}
+
+/// @brief 每个线程只有一个没有自己栈的协程(线程主协程)
+static thread_local ucontext_t t_thread_ctx;
+
+void InitThreadContext(Context *ctx) { *ctx = &t_thread_ctx; }
+
+void SwapContext(Context *from, Context to) {
+    int rt = swapcontext((ucontext_t *)*from, (ucontext_t *)to);
+    qc_assert(rt == 0);
+}
+
+#endif
+
+}  // namespace qc
@@ -11,10 +11,18 @@
 
 
 #include <fcntl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
 #include "fd_manager.hpp"
 #include "hook.hpp"
+#include "log.hpp"
+#include "scheduler.hpp"
+#include "trace.hpp"
 
 namespace qc {
 
@@ -27,7 +35,6 @@ FdCtx::FdCtx(int fd)
       m_fd(fd),
       m_recvTimeout(-1),
       m_sendTimeout(-1) {
-    init();
 }
 
 FdCtx::~FdCtx() {}
@@ -48,13 +55,15 @@ bool FdCtx::init() {
     }
 
     if (m_isSocket) {
-        int flags = fcntl(m_fd, F_GETFL, 0); // hook 之后的
-        if (!(flags & O_NONBLOCK)) fcntl(m_fd, F_SETFL, flags | O_NONBLOCK);
+        // 这里必须用原始的fcntl_f: 构造FdCtx时FdManager正持有写锁,hook后的fcntl会再去拿读锁导致死锁
+        int flags = fcntl_f(m_fd, F_GETFL, 0);
+        if (!(flags & O_NONBLOCK)) fcntl_f(m_fd, F_SETFL, flags | O_NONBLOCK);
         m_sysNonblock = true;
     } else m_sysNonblock = false;
 
     m_userNonblock = false;
     m_isClosed = false;
+    m_busyPoll = false;
     return m_isInit;
 }
 
@@ -68,31 +77,123 @@ uint64_t FdCtx::getTimeout(int type) {
     return type == SO_RCVTIMEO ? m_recvTimeout : m_sendTimeout;
 }
 
-FdManager::FdManager() { m_datas.resize(64); }
+FdCtx::EventContext &FdCtx::getEventContext(Event event) {
+    switch(event) {
+        case READ:
+            return m_read;
+        case WRITE:
+            return m_write;
+        default :
+            throw std::logic_error("getContext error : unknow event");
+    }
+}
+
+void FdCtx::resetEventContext(FdCtx::EventContext &ctx) {
+    ctx.cb = nullptr;
+    // 智能指针直接reset
+    ctx.fiber.reset();
+    ctx.scheduler = nullptr;
+}
 
-FdCtx::ptr FdManager::get(int fd, bool auto_create) {
-    if (-1 == fd) return nullptr;
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int)m_datas.size() <= fd) {
-        if (auto_create == false) return nullptr;
-    } else {
-        if (m_datas[fd] || !auto_create) return m_datas[fd];
+void FdCtx::triggerEvent(Event event) {
+    QC_LOG_DEBUG("triggerEvent fd = %d event : %d", m_fd, event);
+    qc_assert(m_events & event);
+    // 这里触发完之后不需要去除事件,因为一次触发对应一次删除
+    // m_events = (Event)(m_events & ~event);
+    EventContext &ctx = getEventContext(event);
+    Tracer::Emit(Tracer::EVENT_TRIGGER, ctx.fiber ? ctx.fiber->git_id() : 0,
+                 (uint64_t)m_fd << 8 | event);
+    if (ctx.cb) {
+        ctx.scheduler->add_task(std::move(ctx.cb));
+    } else ctx.scheduler->add_task(std::move(ctx.fiber));
+    resetEventContext(ctx);
+    return;
+}
+
+/**
+ * @details 进程的fd号不会超过RLIMIT_NOFILE的硬限制(非特权进程只能调到这里),
+ *          也不会超过内核的fs.nr_open;硬限制是无穷大时以后者为准
+ */
+static int64_t MaxOpenFds() {
+    int64_t nr_open = 0;
+    std::ifstream ifs("/proc/sys/fs/nr_open");
+    if (!(ifs >> nr_open)) nr_open = 0;
+
+    int64_t limit = 0;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        limit = rl.rlim_max == RLIM_INFINITY ? nr_open : (int64_t)rl.rlim_max;
+        if (nr_open > 0) limit = std::min(limit, nr_open);
+    }
+    return limit > 0 ? limit : nr_open;
+}
+
+FdManager::FdManager() {
+    int64_t max_fds = std::max<int64_t>(MaxOpenFds(), DEFAULT_MAX_FDS);
+    max_fds = std::min<int64_t>(max_fds, INT32_MAX);
+    m_maxChunks = (int)((max_fds + CHUNK_SIZE - 1) >> CHUNK_BITS);
+    m_chunks = new std::atomic<std::atomic<FdCtx*>*>[m_maxChunks];
+    for (int i = 0; i < m_maxChunks; ++i) m_chunks[i].store(nullptr, std::memory_order_relaxed);
+}
+
+FdManager::~FdManager() {
+    for (int i = 0; i < m_maxChunks; ++i) {
+        std::atomic<FdCtx*> *chunk = m_chunks[i].load(std::memory_order_relaxed);
+        if (!chunk) continue;
+        for (int j = 0; j < CHUNK_SIZE; ++j) delete chunk[j].load(std::memory_order_relaxed);
+        delete[] chunk;
+    }
+    delete[] m_chunks;
+}
+
+FdCtx* FdManager::getSlot(int fd, bool auto_create) {
+    if (qc_unlikely(fd < 0 || (fd >> CHUNK_BITS) >= m_maxChunks)) {
+        // 这个fd上的IO不会被hook,会阻塞工作线程;日志本身也可能走到这里,只记一次
+        static std::atomic<bool> s_warned{false};
+        if (fd >= 0 && !s_warned.exchange(true)) {
+            QC_LOG_ERROR("fd %d is beyond the fd table (%ld fds), its IO is not hooked", fd,
+                         (long)m_maxChunks * CHUNK_SIZE);
+        }
+        return nullptr;
+    }
+    std::atomic<FdCtx*> *chunk = m_chunks[fd >> CHUNK_BITS].load(std::memory_order_acquire);
+    FdCtx *ctx = chunk ? chunk[fd & (CHUNK_SIZE - 1)].load(std::memory_order_acquire) : nullptr;
+    if (qc_likely(ctx) || !auto_create) return ctx;
+
+    // 下面是第一次使用这个fd号,加锁创建块和上下文
+    MutexType::Lock lock(m_mutex);
+    chunk = m_chunks[fd >> CHUNK_BITS].load(std::memory_order_relaxed);
+    if (!chunk) {
+        chunk = new std::atomic<FdCtx*>[CHUNK_SIZE];
+        for (int i = 0; i < CHUNK_SIZE; ++i) chunk[i].store(nullptr, std::memory_order_relaxed);
+        m_chunks[fd >> CHUNK_BITS].store(chunk, std::memory_order_release);
+    }
+    ctx = chunk[fd & (CHUNK_SIZE - 1)].load(std::memory_order_relaxed);
+    if (!ctx) {
+        ctx = new FdCtx(fd);
+        chunk[fd & (CHUNK_SIZE - 1)].store(ctx, std::memory_order_release);
+    }
+    return ctx;
+}
+
+FdCtx* FdManager::get(int fd, bool auto_create) {
+    FdCtx *ctx = getSlot(fd, auto_create);
+    if (qc_likely(ctx && ctx->isRegistered())) return ctx;
+    if (!ctx || !auto_create) return nullptr;
+
+    MutexType::Lock lock(m_mutex);
+    if (!ctx->isRegistered()) {
+        // 同一个fd号被复用,重新获取句柄属性
+        ctx->m_isInit = false;
+        ctx->init();
+        ctx->m_registered.store(true, std::memory_order_release);
     }
-    lock.unlock();
-    // m_datas里没有auto_create为true
-
-    RWMutexType::WriteLock lock2(m_mutex);
-    FdCtx::ptr ctx(new FdCtx(fd));
-    if (fd >= (int)m_datas.size()) 
-        m_datas.resize(fd * 1.5);
-    m_datas[fd] = ctx;
     return ctx;
 }
 
 void FdManager::del(int fd) {
-    RWMutexType::WriteLock lock(m_mutex);
-    if ((int)m_datas.size() <= fd) return;
-    m_datas[fd].reset();
+    FdCtx *ctx = getSlot(fd);
+    if (ctx) ctx->m_registered.store(false, std::memory_order_release);
 }
 
 }  // namespace qc
\ No newline at end of file
@@ -10,9 +10,13 @@
  */
 
 #include "fiber.hpp"
+#include "metrics.hpp"
+#include "numa.hpp"
 #include "scheduler.hpp"
+#include "trace.hpp"
 
 #include <atomic>
+#include <new>
 
 namespace qc {
 
@@ -25,16 +29,20 @@ static std::atomic<uint64_t> s_fiber_id{0};
 static std::atomic<uint64_t> s_fiber_count{0};
 
 /**
- * @brief malloc栈内存分配器
+ * @brief 栈内存分配器
+ * @details 指定节点时(调度器NUMA模式下的工作线程)按页分配在该节点上,否则用malloc
  */
-class MallocStackAllocator {
+class StackAllocator {
 public:
-    static void *Alloc(size_t size) { return malloc(size); }
-    static void Dealloc(void *vp, size_t size) { return free(vp); }
+    static void *Alloc(size_t size, int node) {
+        return node >= 0 ? Numa::Alloc(size, node) : malloc(size);
+    }
+    static void Dealloc(void *vp, size_t size, int node) {
+        if (node >= 0) Numa::Free(vp, size);
+        else free(vp);
+    }
 };
 
-using StackAllocator = MallocStackAllocator;
-
 void Fiber::SetThis(Fiber *f) { t_fiber = f; }
 
 /// @brief 线程主协程
@@ -42,36 +50,36 @@ void Fiber::SetThis(Fiber *f) { t_fiber = f; }
 Fiber::Fiber() {
     SetThis(this);
     m_state = RUNNING;
-
-    int rt = getcontext(&m_ctx);
-    qc_assert(rt == 0);
+    InitThreadContext(&m_ctx);
 
     ++s_fiber_count;
     m_id = s_fiber_id++;
-    // makecontext(&m_ctx, MainFunc, 0);
+    Tracer::Emit(Tracer::FIBER_CREATE, m_id);
 }
 
-Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool run_in_scheduler)
-    : m_id(s_fiber_id++), m_cb(cb), m_runInScheduler(run_in_scheduler) {
+Fiber::Fiber(TaskFunc cb, void *stack, size_t stacksize, int node, bool run_in_scheduler)
+    : m_runInScheduler(run_in_scheduler), m_id(s_fiber_id++), m_cb(std::move(cb)),
+      m_stack(stack), m_stacksize(stacksize), m_stackNode(node) {
     ++s_fiber_count;
-    m_stacksize = stacksize ? stacksize : DEFAULT_STACKSIZE;
-    m_stack = StackAllocator::Alloc(m_stacksize);
-    int rt = getcontext(&m_ctx);
-    qc_assert(rt == 0);
-
-    // getcontext之后要设置m_ctx中的相关属性
-    m_ctx.uc_link = nullptr;
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
+    MakeContext(&m_ctx, m_stack, (char *)this - (char *)m_stack, MainFunc);
+    Tracer::Emit(Tracer::FIBER_CREATE, m_id, m_stacksize);
+}
 
-    makecontext(&m_ctx, MainFunc, 0);
+Fiber::ptr Fiber::Create(TaskFunc cb, size_t stacksize, bool run_in_scheduler) {
+    stacksize = stacksize ? stacksize : DEFAULT_STACKSIZE;
+    qc_assert(stacksize > 2 * sizeof(Fiber));
+    int node = Numa::GetPreferredNode();
+    void *stack = StackAllocator::Alloc(stacksize, node);
+    qc_assert(stack);
+    uintptr_t top = (uintptr_t)stack + stacksize - sizeof(Fiber);
+    void *mem = (void *)(top & ~(uintptr_t)(alignof(Fiber) - 1));
+    return ptr(new (mem) Fiber(std::move(cb), stack, stacksize, node, run_in_scheduler));
 }
 
 Fiber::~Fiber() {
     --s_fiber_count;
     if (m_stack) {
         qc_assert(m_state == TERM);
-        StackAllocator::Dealloc(m_stack, m_stacksize);
     } else {
         qc_assert(!m_cb);
         qc_assert(m_state == RUNNING);
@@ -81,39 +89,48 @@ Fiber::~Fiber() {
     }
 }
 
+void FiberDeleter::operator()(Fiber *fiber) const {
+    if (!fiber->m_stack) {
+        delete fiber;
+        return;
+    }
+    void *stack = fiber->m_stack;
+    size_t size = fiber->m_stacksize;
+    int node = fiber->m_stackNode;
+    fiber->~Fiber();
+    StackAllocator::Dealloc(stack, size, node);
+}
+
 Fiber::ptr Fiber::GetThis() {
-    if (t_fiber) return t_fiber->shared_from_this();
+    if (t_fiber) return ptr(t_fiber);
     // 下面创建线程的第一个协程
     Fiber::ptr main_fiber(new Fiber);
     qc_assert(t_fiber == main_fiber.get());
     // 这是创建的第一个协程,也就是Main线程主协程
     t_thread_fiber = main_fiber;
-    return t_fiber->shared_from_this();
+    return main_fiber;
 }
 
+Fiber *Fiber::GetCurrent() { return t_fiber; }
+
 uint64_t Fiber::TotalFibers() { return s_fiber_count; }
 
+/// @brief 当前线程还没有协程时返回0(日志等任意线程都可能调用)
 uint64_t Fiber::GetFiberId() {
-    qc_assert(t_fiber != nullptr);
+    if (!t_fiber) return 0;
     return t_fiber->m_id;
 }
 
 /// @brief 只有任务协程才可以被reset
 /// @param cb 
-void Fiber::reset(std::function<void()> cb) {
+void Fiber::reset(TaskFunc cb) {
     qc_assert(m_stack);
     // 为了简化状态只允许TERM状态的协程可以被重置
     qc_assert(m_state == TERM);
-    m_cb = cb;
-    // 这里需不需要重新获取上下文? 需要
-    int rt = getcontext(&m_ctx);
-    qc_assert(rt == 0);
-
-    m_ctx.uc_link = nullptr;
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
-
-    makecontext(&m_ctx, MainFunc, 0);
+    m_cb = std::move(cb);
+    m_cancelToken.reset();
+    // 上次运行结束时栈上的帧已经没用了,从入口重新开始
+    MakeContext(&m_ctx, m_stack, (char *)this - (char *)m_stack, MainFunc);
     m_state = READY;
 }
 
@@ -121,39 +138,41 @@ void Fiber::resume() {
     qc_assert(m_state == READY);
     SetThis(this);
     m_state = RUNNING;
+    Metrics::Inc(Metrics::CONTEXT_SWITCHES);
+    Tracer::Emit(Tracer::FIBER_RESUME, m_id);
     if (m_runInScheduler) {
         /// @brief 跑在调度器上,应该和线程主协程互换
-        swapcontext(&(Scheduler::GetMainFiber()->m_ctx) ,&m_ctx);
+        SwapContext(&(Scheduler::GetMainFiber()->m_ctx), m_ctx);
     } else {
         /// @brief 不跑在调度器上,和Main线程主协程互换
-        swapcontext(&(t_thread_fiber->m_ctx), &m_ctx);
+        SwapContext(&(t_thread_fiber->m_ctx), m_ctx);
     }
 }
 
 void Fiber::yield() {
     qc_assert(m_state == RUNNING || m_state == TERM);
     if (m_state != TERM) m_state = READY;
+    Tracer::Emit(m_state == TERM ? Tracer::FIBER_TERM : Tracer::FIBER_YIELD, m_id);
     /// @details 一个协程的yeild()操作必定会回到线程主协程,之后由线程主协程来判断调度下一个协程
     SetThis(t_thread_fiber.get());
     if (m_runInScheduler) {
-        swapcontext(&m_ctx, &(Scheduler::GetMainFiber()->m_ctx));
+        SwapContext(&m_ctx, Scheduler::GetMainFiber()->m_ctx);
     } else {
-        swapcontext(&m_ctx, &(t_thread_fiber->m_ctx)); 
+        SwapContext(&m_ctx, t_thread_fiber->m_ctx);
     }
 }
 
 /// @brief 只有任务协程才会有这个函数,Main线程主协程和线程主协程都没有回调函数,也就不会调用这个函数
+/// @details 不持有自己的引用,yield之后协程可能马上被调度器释放或者放回协程池
 void Fiber::MainFunc() {
-    ptr cur = GetThis();
+    Fiber *cur = t_fiber;
     qc_assert(cur);
 
     cur->m_cb();
     cur->m_cb = nullptr;
+    cur->m_cancelToken.reset();
     cur->m_state = TERM;
-
-    auto raw_ptr = cur.get();
-    cur.reset();
-    raw_ptr->yield();
+    cur->yield();
 }
 
 }  // namespace qc
\ No newline at end of file
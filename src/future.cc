@@ -0,0 +1,147 @@
+/**
+ * @file future.cc
+ * @author qc
+ * @brief future共享状态中与值类型无关的部分
+ * @version 0.1
+ * @date 2024-07-14
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "future.hpp"
+
+#include "cancel.hpp"
+
+namespace qc {
+namespace detail {
+
+bool FutureStateBase::isReady() {
+    MutexType::Lock lock(m_mutex);
+    return m_ready;
+}
+
+/**
+ * @details 任务协程中: 先让出,回到调度协程后再登记等待者,
+ *          这样唤醒方add_task时协程一定已经挂起(见Scheduler::YieldThen).
+ *          登记时如果已经完成,直接把协程放回调度器.
+ *          协程带有取消令牌时同时在令牌上登记回调,取消时把自己从等待者中摘掉并唤醒协程,
+ *          完成和取消都要先拿m_mutex摘等待者,所以只会有一方唤醒协程.
+ */
+bool FutureStateBase::wait() {
+    {
+        MutexType::Lock lock(m_mutex);
+        if (m_ready) return true;
+    }
+
+    Scheduler *scheduler = Scheduler::GetThis();
+    Fiber *cur = Fiber::GetCurrent();
+    if (scheduler && cur && cur->isRunInScheduler()) {
+        std::shared_ptr<CancelToken> token = cur->getCancelToken();
+        if (token && token->isCancelled()) return isReady();
+
+        std::shared_ptr<FutureStateBase> self = shared_from_this();
+        Fiber::ptr fiber(cur);
+        // 由调度协程在m_mutex下写入,协程恢复之前一定已经写完
+        uint64_t cancel_id = 0;
+        uint64_t *cancel_id_ptr = &cancel_id;
+        Scheduler::YieldThen([self, scheduler, fiber, token, cancel_id_ptr]() {
+            MutexType::Lock lock(self->m_mutex);
+            if (self->m_ready) {
+                lock.unlock();
+                scheduler->add_task(fiber);
+                return;
+            }
+            Waiter w;
+            w.scheduler = scheduler;
+            w.fiber = fiber;
+            self->m_waiters.push_back(w);
+            if (!token) return;
+
+            std::weak_ptr<FutureStateBase> weak(self);
+            *cancel_id_ptr = token->onCancel([weak, scheduler, fiber]() {
+                std::shared_ptr<FutureStateBase> state = weak.lock();
+                if (state && state->removeWaiter(fiber.get())) scheduler->add_task(fiber);
+            });
+            if (!*cancel_id_ptr) {
+                self->m_waiters.pop_back();
+                lock.unlock();
+                scheduler->add_task(fiber);
+            }
+        });
+        if (cancel_id) token->removeCallback(cancel_id);
+        return isReady();
+    }
+
+    Semaphore sem;
+    {
+        MutexType::Lock lock(m_mutex);
+        if (m_ready) return true;
+        Waiter w;
+        w.sem = &sem;
+        m_waiters.push_back(w);
+    }
+    sem.P();
+    return true;
+}
+
+bool FutureStateBase::removeWaiter(Fiber *fiber) {
+    MutexType::Lock lock(m_mutex);
+    for (auto it = m_waiters.begin(); it != m_waiters.end(); ++it) {
+        if (it->fiber.get() == fiber) {
+            m_waiters.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+void FutureStateBase::onReady(std::function<void()> cb) {
+    {
+        MutexType::Lock lock(m_mutex);
+        if (!m_ready) {
+            m_callbacks.push_back(std::move(cb));
+            return;
+        }
+    }
+    cb();
+}
+
+void FutureStateBase::setException(std::exception_ptr e) {
+    MutexType::Lock lock(m_mutex);
+    checkNotReady();
+    m_exception = e;
+    complete(lock);
+}
+
+void FutureStateBase::complete(MutexType::Lock &lock) {
+    m_ready = true;
+    std::vector<Waiter> waiters;
+    std::vector<std::function<void()>> callbacks;
+    waiters.swap(m_waiters);
+    callbacks.swap(m_callbacks);
+    lock.unlock();
+
+    for (auto &w : waiters) {
+        if (w.sem) w.sem->V();
+        else w.scheduler->add_task(w.fiber);
+    }
+    for (auto &cb : callbacks) cb();
+}
+
+void FutureStateBase::checkNotReady() {
+    if (m_ready) throw std::logic_error("promise already satisfied");
+}
+
+void FutureStateBase::waitOrThrow() {
+    if (!wait()) throw std::system_error(ECANCELED, std::generic_category(), "future wait cancelled");
+    rethrowIfFailed();
+}
+
+void FutureStateBase::rethrowIfFailed() {
+    // 完成之后m_exception不会再被修改,不需要加锁
+    if (m_exception) std::rethrow_exception(m_exception);
+}
+
+}  // namespace detail
+}  // namespace qc
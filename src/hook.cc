@@ -13,13 +13,19 @@
 
 #include <dlfcn.h>
 
+#include <atomic>
 #include <cstdarg>
+#include <cstring>
 #include <string>
+#include <vector>
 
+#include "cancel.hpp"
 #include "fd_manager.hpp"
 #include "fiber.hpp"
 #include "timer.hpp"
 #include "iomanager.hpp"
+#include "log.hpp"
+#include "resolver.hpp"
 namespace qc {
 // 当前线程是否启用hook
 static thread_local bool t_hook_enable = false;
@@ -46,7 +52,9 @@ static int g_tcp_connect_timeout = 5000;
     XX(fcntl)        \
     XX(ioctl)        \
     XX(getsockopt)   \
-    XX(setsockopt)
+    XX(setsockopt)   \
+    XX(getaddrinfo)  \
+    XX(gethostbyname)
 
 void hook_init() {
     static bool is_inited = false;
@@ -76,18 +84,36 @@ bool is_hook_enable() { return t_hook_enable; }
 
 void set_hook_enable(const bool flag) { t_hook_enable = flag; }
 
-struct timer_info {
-    int cnacelled = 0;
-};
+/**
+ * @details 协程挂起后可能在另一个线程上恢复,而__errno_location被声明为const,
+ *          编译器会把yield之前算出的errno地址继续用在yield之后,读写到原线程的errno.
+ *          所以do_io中的errno都通过这两个不参与过程间优化的函数访问.
+ */
+#if defined(__GNUC__) && !defined(__clang__)
+#define QC_NO_IPA __attribute__((noinline, noipa))
+#else
+#define QC_NO_IPA __attribute__((noinline))
+#endif
+static QC_NO_IPA int GetErrno() { return errno; }
+static QC_NO_IPA void SetErrno(int err) { errno = err; }
 
+/**
+ * @details 快路径: 先直接尝试一次系统调用,数据已经就绪时不做任何堆分配.
+ *          只有返回EAGAIN时才进入慢路径,等待状态记录在当前协程里(m_waitSeq/m_waitErr),
+ *          超时定时器只捕获(fd, event, fiber id, 等待序号),由IOManager::cancelWait校验后再取消,
+ *          因此不再需要shared_ptr<timer_info> + weak_ptr来判断等待是否还有效.
+ */
 template <typename OriginFun, typename... Args>
 static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name,
                      uint32_t event, int timeout_so, Args &&...args) {
     if (!t_hook_enable) {
         return fun(fd, std::forward<Args>(args)...);
     }
+    // 时间片的检查点: 超时的任务先让出再做IO
+    maybe_yield();
     // 为当前文件描述符创建上下文ctx
-    FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd);
+    // 无锁查找,返回的是固定槽位的裸指针,没有shared_ptr拷贝
+    FdCtx *ctx = FdMgr::GetInstance()->get(fd);
     if (!ctx) {
         return fun(fd, std::forward<Args>(args)...);
     }
@@ -100,58 +126,161 @@ static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name,
     if (!ctx->isSocket() || ctx->getUserNonblock()) {
         return fun(fd, std::forward<Args>(args)...);
     }
-    // 获取对应type的fd超时时间
-    uint64_t to = ctx->getTimeout(timeout_so);
-    std::shared_ptr<timer_info> tinfo(new timer_info);
-
-retry:
-    ssize_t n = fun(fd, std::forward<Args>(args)...);
-    while (n == -1 && errno == EINTR) {
-        // 读取操作被信号中断，继续尝试
-        n = fun(fd, std::forward<Args>(args)...);
-    }
-    if (n == -1 && errno == EAGAIN) {
-        // 数据未就绪
+
+    while (true) {
+        ssize_t n = fun(fd, std::forward<Args>(args)...);
+        while (n == -1 && GetErrno() == EINTR) {
+            // 读取操作被信号中断，继续尝试
+            n = fun(fd, std::forward<Args>(args)...);
+        }
+        if (qc_likely(n != -1 || GetErrno() != EAGAIN)) return n;
+
+        // 数据未就绪,下面是慢路径
         IOManager *iom = IOManager::GetThis();
-        Timer::ptr timer;
-        std::weak_ptr<timer_info> winfo(tinfo);
-
-        if (to != (uint64_t)-1) {
-            timer = iom->addConditionTimer(
-                to,
-                [winfo, fd, iom, event]() {
-                    auto t = winfo.lock();
-                    if (!t || t->cnacelled) {
-                        return;
-                    }
-                    t->cnacelled = ETIMEDOUT;
-                    iom->cancelEvent(fd, (Event)(event));
-                },
-                winfo);
+        if (!iom) return n;
+
+        Fiber *self = Fiber::GetCurrent();
+        const CancelToken::ptr &token = self->getCancelToken();
+        if (token && token->isCancelled()) {
+            SetErrno(ECANCELED);
+            return -1;
         }
 
-        int rt = iom->addEvent(fd, (Event)(event));
-        if (rt) {
-            std::cout << hook_fun_name << " addEvent(" << fd << ", " << event
-                      << ")";
-            if (timer) {
-                timer->cancel();
+        // 获取对应type的fd超时时间
+        uint64_t to = ctx->getTimeout(timeout_so);
+        uint64_t fiber_id = self->git_id();
+        uint64_t wait_seq = self->beginWait();
+
+        // 事件和超时定时器都在让出之后由调度协程登记,见IOManager::addEventFor.
+        // 回调运行时协程已经挂起,可以访问这里的局部变量;登记成功之后协程可能马上在别的线程上恢复并返回,
+        // 之后只能用回调自己的副本
+        Timer::ptr timer;
+        int rt = 0;
+        uint64_t cancel_id = 0;
+        CancelToken *raw_token = token.get();
+        Scheduler::YieldThen([&]() {
+            Fiber::ptr fiber(self);
+            IOManager *m = iom;
+            CancelToken::ptr tok = token;
+            int wait_fd = fd;
+            Event wait_event = (Event)event;
+            uint64_t id = fiber_id;
+            uint64_t seq = wait_seq;
+            Timer::ptr t;
+            if (to != (uint64_t)-1) {
+                t = m->add_timer(to, [m, wait_fd, wait_event, id, seq]() {
+                    m->cancelWait(wait_fd, wait_event, id, seq, ETIMEDOUT);
+                });
+                timer = t;
             }
-            return -1;
-        } else {
-            Fiber::GetThis()->yield();
-            if (timer) {
-                timer->cancel();
+            // 取消和超时走同一条路径,只是错误码不同
+            if (tok) {
+                cancel_id = tok->onCancel([m, wait_fd, wait_event, id, seq]() {
+                    m->cancelWait(wait_fd, wait_event, id, seq, ECANCELED);
+                });
+                // 登记前已经被取消
+                if (!cancel_id) {
+                    fiber->setWaitError(ECANCELED);
+                    m->add_task(std::move(fiber));
+                    return;
+                }
             }
-            if (tinfo->cnacelled) {
-                errno = tinfo->cnacelled;
-                return -1;
+            int r = m->addEventFor(wait_fd, wait_event, fiber);
+            if (r) {
+                rt = r;
+                m->add_task(std::move(fiber));
+                return;
             }
-            goto retry;
+            // 取消或者超时发生在登记事件之前时cancelWait什么也没做,这里补上;按等待序号校验,不会重复
+            if (tok && tok->isCancelled()) m->cancelWait(wait_fd, wait_event, id, seq, ECANCELED);
+            if (t && !t->isPending()) m->cancelWait(wait_fd, wait_event, id, seq, ETIMEDOUT);
+        });
+        if (rt) {
+            QC_LOG_ERROR("%s addEvent(%d, %u) error", hook_fun_name, fd, event);
+            if (timer) timer->cancel();
+            if (cancel_id) raw_token->removeCallback(cancel_id);
+            return -1;
+        }
+
+        if (timer) {
+            timer->cancel();
+        }
+        if (cancel_id) {
+            raw_token->removeCallback(cancel_id);
+        }
+        if (self->getWaitError()) {
+            SetErrno(self->getWaitError());
+            return -1;
+        }
+        // 被close唤醒
+        if (!ctx->isRegistered()) {
+            SetErrno(EBADF);
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief 挂起当前协程ms毫秒
+ * @return 0,被取消时返回ECANCELED
+ * @details 定时器在让出之后由调度协程登记,定时器在别的线程上触发时协程一定已经挂起.
+ *          有取消令牌时定时器和取消回调都可能唤醒协程,woken保证只唤醒一次.
+ */
+static int do_sleep(uint64_t ms) {
+    // 只有唤醒回调持有协程的引用
+    Fiber *cur = Fiber::GetCurrent();
+    IOManager *iom = IOManager::GetThis();
+    CancelToken::ptr token = cur->getCancelToken();
+    if (!token) {
+        auto wake = std::bind((void(Scheduler::*)(Fiber::ptr, int thread, TaskPriority)) &
+                                  IOManager::add_task,
+                              iom, Fiber::ptr(cur), -1, PRIORITY_INHERIT);
+        if (!cur->isRunInScheduler()) {
+            iom->add_timer(ms, wake);
+            cur->yield();
+            return 0;
         }
+        Scheduler::YieldThen([iom, ms, wake]() { iom->add_timer(ms, wake); });
+        return 0;
     }
+    if (token->isCancelled()) return ECANCELED;
 
-    return n;
+    struct SleepState {
+        Mutex mutex;
+        std::atomic<bool> woken{false};
+        Timer::ptr timer;
+        uint64_t cancel_id = 0;
+    };
+    auto state = std::make_shared<SleepState>();
+    cur->beginWait();
+    Fiber::ptr fiber(cur);
+    auto wake = [state, iom, fiber](int err) {
+        if (state->woken.exchange(true)) return;
+        fiber->setWaitError(err);
+        iom->add_task(fiber);
+    };
+    fiber.reset();
+    Scheduler::YieldThen([state, iom, token, ms, wake]() {
+        Mutex::Lock lock(state->mutex);
+        state->timer = iom->add_timer(ms, [wake]() { wake(0); });
+        state->cancel_id = token->onCancel([wake]() { wake(ECANCELED); });
+        if (!state->cancel_id) {
+            lock.unlock();
+            wake(ECANCELED);
+        }
+    });
+
+    Timer::ptr timer;
+    uint64_t cancel_id;
+    {
+        // 等调度协程登记完成
+        Mutex::Lock lock(state->mutex);
+        timer.swap(state->timer);
+        cancel_id = state->cancel_id;
+    }
+    timer->cancel();
+    if (cancel_id) token->removeCallback(cancel_id);
+    return cur->getWaitError();
 }
 
 extern "C" {
@@ -171,13 +300,10 @@ unsigned int sleep(unsigned int seconds) {
         return sleep_f(seconds);
     }
     // 允许hook,则直接让当前协程退出，seconds秒后再重启（by定时器）
-    Fiber::ptr fiber = Fiber::GetThis();
-    IOManager *iom = IOManager::GetThis();
-    iom->add_timer(seconds * 1000,
-                  std::bind((void(Scheduler::*)(Fiber::ptr, int thread)) &
-                                IOManager::add_task,
-                            iom, fiber, -1));
-    Fiber::GetThis()->yield();
+    if (do_sleep((uint64_t)seconds * 1000)) {
+        SetErrno(ECANCELED);
+        return seconds;
+    }
     return 0;
 }
 // usleep 在指定的微妙数内暂停线程运行
@@ -192,13 +318,10 @@ int usleep(useconds_t usec) {
     }
     // std::cout << "HOOK USLEEP REAL START" << std::endl;
     // 允许hook,则直接让当前协程退出，seconds秒后再重启（by定时器）
-    Fiber::ptr fiber = Fiber::GetThis();
-    IOManager *iom = IOManager::GetThis();
-    iom->add_timer(usec / 1000,
-                  std::bind((void(Scheduler::*)(Fiber::ptr, int thread)) &
-                                IOManager::add_task,
-                            iom, fiber, -1));
-    Fiber::GetThis()->yield();
+    if (do_sleep(usec / 1000)) {
+        SetErrno(ECANCELED);
+        return -1;
+    }
     return 0;
 }
 // nanosleep 在指定的纳秒数内暂停当前线程的执行
@@ -208,14 +331,11 @@ int nanosleep(const struct timespec *req, struct timespec *rem) {
         return nanosleep_f(req, rem);
     }
     // 允许hook,则直接让当前协程退出，seconds秒后再重启（by定时器）
-    Fiber::ptr fiber = Fiber::GetThis();
-    IOManager *iom = IOManager::GetThis();
     int timeout_s = req->tv_sec * 1000 + req->tv_nsec / 1000 / 1000;
-    iom->add_timer(timeout_s,
-                  std::bind((void(Scheduler::*)(Fiber::ptr, int thread)) &
-                                IOManager::add_task,
-                            iom, fiber, -1));
-    Fiber::GetThis()->yield();
+    if (do_sleep(timeout_s)) {
+        SetErrno(ECANCELED);
+        return -1;
+    }
     return 0;
 }
 
@@ -381,13 +501,15 @@ int close(int fd) {
         return close_f(fd);
     }
 
-    FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd);
+    // 没有被hook登记的fd也可能在IOManager上注册过事件,按槽位处理
+    FdCtx *ctx = FdMgr::GetInstance()->getSlot(fd);
     if (ctx) {
+        // 先取消登记再唤醒: 被唤醒的协程可能在close_f之前重试,看到取消登记就不会在还没关闭的fd上再次等待
+        FdMgr::GetInstance()->del(fd);
         auto iom = IOManager::GetThis();
         if (iom) {
             iom->cancelAll(fd);
         }
-        FdMgr::GetInstance()->del(fd);
     }
     return close_f(fd);
 }
@@ -398,7 +520,7 @@ int fcntl(int fd, int cmd, ... /* arg */) {
         case F_SETFL: {
             int arg = va_arg(va, int);
             va_end(va);
-            FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd);
+            FdCtx *ctx = FdMgr::GetInstance()->get(fd);
             if (!ctx || ctx->isClose() || !ctx->isSocket()) {
                 return fcntl_f(fd, cmd, arg);
             }
@@ -413,7 +535,7 @@ int fcntl(int fd, int cmd, ... /* arg */) {
         case F_GETFL: {
             va_end(va);
             int arg = fcntl_f(fd, cmd);
-            FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd);
+            FdCtx *ctx = FdMgr::GetInstance()->get(fd);
             if (!ctx || ctx->isClose() || !ctx->isSocket()) {
                 return arg;
             }
@@ -476,7 +598,7 @@ int ioctl(int d, unsigned long int request, ...) {
 
     if (FIONBIO == request) {
         bool user_nonblock = !!*(int *)arg;
-        FdCtx::ptr ctx = FdMgr::GetInstance()->get(d);
+        FdCtx *ctx = FdMgr::GetInstance()->get(d);
         if (!ctx || ctx->isClose() || !ctx->isSocket()) {
             return ioctl_f(d, request, arg);
         }
@@ -497,7 +619,7 @@ int setsockopt(int sockfd, int level, int optname, const void *optval,
     }
     if (level == SOL_SOCKET) {
         if (optname == SO_RCVTIMEO || optname == SO_SNDTIMEO) {
-            FdCtx::ptr ctx = FdMgr::GetInstance()->get(sockfd);
+            FdCtx *ctx = FdMgr::GetInstance()->get(sockfd);
             if (ctx) {
                 const timeval *v = (const timeval *)optval;
                 ctx->setTimeout(optname, v->tv_sec * 1000 + v->tv_usec / 1000);
@@ -506,5 +628,82 @@ int setsockopt(int sockfd, int level, int optname, const void *optval,
     }
     return setsockopt_f(sockfd, level, optname, optval, optlen);
 }
+
+/**
+ * @details 主机名交给Resolver解析(等待应答时只挂起当前协程),
+ *          得到的每个数字地址再交给原始getaddrinfo处理service/socktype等参数,
+ *          这样返回的链表和glibc完全一致,可以直接用freeaddrinfo释放.
+ */
+int getaddrinfo(const char *node, const char *service, const struct addrinfo *hints,
+                struct addrinfo **res) {
+    // 不需要走网络的情况直接用系统实现
+    if (!t_hook_enable || !IOManager::GetThis() || !node ||
+        (hints && (hints->ai_flags & AI_NUMERICHOST))) {
+        return getaddrinfo_f(node, service, hints, res);
+    }
+
+    std::vector<ResolvedAddr> addrs;
+    int rt = ResolverMgr::GetInstance()->resolve(node, hints ? hints->ai_family : AF_UNSPEC,
+                                                 addrs);
+    if (rt) return rt;
+
+    struct addrinfo numeric_hints;
+    memset(&numeric_hints, 0, sizeof(numeric_hints));
+    if (hints) numeric_hints = *hints;
+    bool canonname = numeric_hints.ai_flags & AI_CANONNAME;
+    numeric_hints.ai_flags = (numeric_hints.ai_flags | AI_NUMERICHOST) & ~AI_CANONNAME;
+
+    struct addrinfo *head = nullptr;
+    struct addrinfo **tail = &head;
+    char ip[INET6_ADDRSTRLEN];
+    for (auto &addr : addrs) {
+        inet_ntop(addr.family, &addr.addr, ip, sizeof(ip));
+        numeric_hints.ai_family = addr.family;
+        struct addrinfo *ai = nullptr;
+        rt = getaddrinfo_f(ip, service, &numeric_hints, &ai);
+        if (rt) {
+            freeaddrinfo(head);
+            return rt;
+        }
+        *tail = ai;
+        while (*tail) tail = &(*tail)->ai_next;
+    }
+    if (canonname && head) head->ai_canonname = strdup(node);
+    *res = head;
+    return 0;
+}
+
+struct hostent *gethostbyname(const char *name) {
+    if (!t_hook_enable || !IOManager::GetThis()) {
+        return gethostbyname_f(name);
+    }
+    // 和系统实现一样返回线程内的静态存储,下次调用前有效
+    static thread_local struct hostent s_host;
+    static thread_local std::string s_name;
+    static thread_local std::vector<in_addr> s_addrs;
+    static thread_local std::vector<char *> s_addr_list;
+    static thread_local char *s_aliases[1] = {nullptr};
+
+    std::vector<ResolvedAddr> addrs;
+    int rt = ResolverMgr::GetInstance()->resolve(name, AF_INET, addrs);
+    if (rt) {
+        h_errno = rt == EAI_AGAIN ? TRY_AGAIN : HOST_NOT_FOUND;
+        return nullptr;
+    }
+
+    s_name = name;
+    s_addrs.clear();
+    for (auto &addr : addrs) s_addrs.push_back(addr.addr.v4);
+    s_addr_list.clear();
+    for (auto &addr : s_addrs) s_addr_list.push_back((char *)&addr);
+    s_addr_list.push_back(nullptr);
+
+    s_host.h_name = (char *)s_name.c_str();
+    s_host.h_aliases = s_aliases;
+    s_host.h_addrtype = AF_INET;
+    s_host.h_length = sizeof(in_addr);
+    s_host.h_addr_list = s_addr_list.data();
+    return &s_host;
+}
 }
 }  // namespace qc
\ No newline at end of file
@@ -9,53 +9,30 @@
  *
  */
 
+#include "hook.hpp"
 #include "iomanager.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
 
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cstring>
+#include <thread>
 
 namespace qc {
 
-FdContext::EventContext &FdContext::getEventContext(Event event) {
-    switch(event) {
-        case READ:
-            return m_read;
-        case WRITE:
-            return m_write;
-        default :
-            throw std::logic_error("getContext error : unknow event");
-    }
-}
-
-void FdContext::resetEventContext(FdContext::EventContext &ctx) {
-    ctx.cb = nullptr;
-    // 智能指针直接reset
-    ctx.fiber.reset();
-    ctx.scheduler = nullptr;
-}
+/// @brief 多核机器上默认的最长自旋时间
+static const uint64_t DEFAULT_IDLE_SPIN_NS = 50 * 1000;
 
-void FdContext::triggerEvent(Event event) {
-    std::cout << "triggerEvent event : " << event << std::endl;
-    qc_assert(m_events & event);
-    // 这里触发完之后不需要去除事件,因为一次触发对应一次删除
-    // m_events = (Event)(m_events & ~event);
-    EventContext &ctx = getEventContext(event);
-    if (ctx.cb) {
-        std::cout << "ctx.cb is not nullptr" << std::endl;
-        if (ctx.scheduler == nullptr) std::cout << "ctx.scheduler is nullptr" << std::endl;
-        else std::cout << "ctx.scheduler is not nullptr" << std::endl;
-        ctx.scheduler->add_task(ctx.cb);
-    } else ctx.scheduler->add_task(ctx.fiber);
-    resetEventContext(ctx);
-    std::cout << " add_task in triggerEvent succ " << std::endl;
-    return;
-}
-
-IOManager::IOManager(size_t threads, bool use_caller, const std::string &name)
-    : Scheduler(threads, use_caller, name), TimerManager() {
+IOManager::IOManager(size_t threads, bool use_caller, const std::string &name,
+                     const SchedulerOptions &options)
+    : Scheduler(threads, use_caller, name, options), TimerManager() {
+    _ioManager = this;
     m_epfd = epoll_create(5000);
     // 返回一个文件描述符
     qc_assert(m_epfd > 0);
@@ -78,169 +55,354 @@ IOManager::IOManager(size_t threads, bool use_caller, const std::string &name)
     rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
     qc_assert(!rt);
 
-    contextResize(32);
+    std::string label = "{scheduler=\"" + name + "\"}";
+    m_gaugeIds.push_back(Metrics::AddGauge("qc_pending_events" + label,
+                                           [this]() { return (int64_t)m_pendingEventCount; }));
+    m_gaugeIds.push_back(Metrics::AddGauge("qc_timers" + label,
+                                           [this]() { return (int64_t)getTimerCount(); }));
+
+    // 单核时自旋只会抢走生产者的时间片
+    m_idleSpinNs = std::thread::hardware_concurrency() > 1 ? DEFAULT_IDLE_SPIN_NS : 0;
+
+    // 单线程时定时器和本地队列一样只由所属线程访问,要在线程启动之前设置
+    setOwnerOnly(isOwnerOnly());
+
     // 调用Scheduler中的start开始创建线程执行调度
     start();
 }
 
 void IOManager::tickle() {
+    // 有线程在自旋或忙轮询,它自己会看到新任务,省掉一次管道写和内核唤醒
+    if (m_spinning.load() > 0 || m_busyPolling.load() > 0) return;
+    wakeUp();
+}
+
+void IOManager::wakeUp() {
     if (!hasIdleThreads()) return;
     // 有空闲线程就往管道中写,触发读事件
     int rt = write(m_tickleFds[1], "1", 1);
     qc_assert(rt == 1);
+    Metrics::Inc(Metrics::TICKLES_SENT);
+    Tracer::Emit(Tracer::TICKLE, Fiber::GetFiberId());
+}
+
+/// @brief pollEvents每次最多收的事件数,事件多时剩下的留给下一次
+static const int POLL_EVENTS = 64;
+/// @brief 自适应自旋窗口的下限
+static const uint64_t IDLE_SPIN_MIN_NS = 1000;
+/// @brief 每个线程当前的自旋窗口
+static thread_local uint64_t t_spin_window = 0;
+/// @brief 忙轮询时每隔多少轮检查一次停止条件和时间
+static const uint32_t BUSY_POLL_CHECK = 64;
+/// @brief 有取不到的任务时,忙轮询线程叫醒其他线程的间隔
+static const uint64_t BUSY_POLL_WAKE_NS = 1000 * 1000;
+
+void IOManager::pollEvents() {
+    epoll_event events[POLL_EVENTS];
+    processEvents(events, POLL_EVENTS, 0);
+}
+
+/**
+ * @details 自旋期间每64次检查一次时间,同时非阻塞地收一次IO事件和定时器,
+ *          所以所有线程都在自旋时IO也不会被耽误.
+ *          最多一半的线程同时自旋;退出自旋(m_spinning减一)之后再检查一次队列:
+ *          入队方先增加任务计数再读m_spinning,两边都是seq_cst,
+ *          要么入队方看到没有自旋线程而写管道,要么这里看到新任务.
+ */
+bool IOManager::spinForWork(epoll_event *events, int max_events, size_t &stale) {
+    uint64_t max_ns = m_idleSpinNs.load(std::memory_order_relaxed);
+    if (!max_ns) return false;
+    if (m_spinning.load(std::memory_order_relaxed) >= (getThreadCount() + 1) / 2) return false;
+
+    uint64_t window = std::min(std::max(t_spin_window, IDLE_SPIN_MIN_NS), max_ns);
+    ++m_spinning;
+    uint64_t start = GetMonotonicNS();
+    bool found = false;
+    // 队列里只有指定给其他线程的任务时,任务数不变就不算等到了,否则会在idle和run之间空转
+    auto new_tasks = [this, &stale]() {
+        size_t pending = getPendingTasks();
+        if (pending == stale) return false;
+        stale = 0;
+        return pending > 0;
+    };
+    for (uint32_t i = 1;; ++i) {
+        if (new_tasks()) {
+            found = true;
+            break;
+        }
+        if ((i & 63) == 0) {
+            if (processEvents(events, max_events, 0) > 0 || new_tasks()) {
+                found = true;
+                break;
+            }
+            if (GetMonotonicNS() - start >= window) break;
+        }
+        qc_cpu_relax();
+    }
+    --m_spinning;
+    if (!found) found = new_tasks();
+
+    // 等到了就加倍,下次多等一会儿;白白自旋就减半
+    t_spin_window = found ? std::min(window * 2, max_ns) : std::max(window / 2, IDLE_SPIN_MIN_NS);
+    Metrics::Inc(found ? Metrics::IDLE_SPIN_HITS : Metrics::IDLE_SPIN_MISSES);
+    return found;
+}
+
+/**
+ * @details 每一轮非阻塞地收一次IO事件和到期定时器,再看一眼任务计数,都不需要系统调用之外的唤醒.
+ *          只有返回去执行任务时才退出m_busyPolling,回来时先计数再检查队列,和spinForWork一样不会丢失唤醒.
+ *          指定给其他线程的任务忙轮询线程取不到,而它在轮询时tickle不写管道,
+ *          所以这种任务还在时每隔BUSY_POLL_WAKE_NS写一次管道,直到任务的主人把它取走.
+ */
+int IOManager::busyPollForWork(epoll_event *events, int max_events, size_t &stale) {
+    ++m_busyPolling;
+    int rt = 0;
+    uint64_t last_wake = 0;
+    for (uint32_t i = 1;; ++i) {
+        rt = processEvents(events, max_events, 0);
+        if (rt != 0) break;
+        size_t pending = getPendingTasks();
+        if (pending != stale) {
+            stale = 0;
+            if (pending) break;
+        }
+        if ((i % BUSY_POLL_CHECK) == 0) {
+            if (stopping()) break;
+            if (stale) {
+                uint64_t now = GetMonotonicNS();
+                if (now - last_wake >= BUSY_POLL_WAKE_NS) {
+                    last_wake = now;
+                    wakeUp();
+                }
+            }
+        }
+        qc_cpu_relax();
+    }
+    --m_busyPolling;
+    return rt;
 }
 
-// 下面是核心函数
 /**
  * Q: 匿名管道是否有用?
  * A:
  * 每个线程空闲之后都会进入idle协程执行idle线程,在这里设定了超时时间,每次epoll_wait都会返回结
  *    处理完所有事件,也有可能没有事件,执行完就会将自己yield().让调度器去再处理任务
  *    也就是说每进行一次epoll_wait就会触发一次yield(),所以目前这里的tickle只是简单为了提示而已
+ *
+ * 阻塞到epoll_wait之前先自旋一小段时间(见spinForWork),负载高时任务往往在这段时间内就到了.
+ * 忙轮询线程(SchedulerOptions::busy_poll)不自旋也不阻塞,一直轮询到有任务为止.
  */
 void IOManager::idle() {
-    std::cout << "idle()" << std::endl;
+    QC_LOG_DEBUG("idle()");
     // 空闲线程执行这个函数,一直监听是否有事件到达
     const uint64_t MAX_EVENTS = 256;
     epoll_event *events = new epoll_event[MAX_EVENTS]{};
     // 下面使用智能指针将其包围起来,并且自定义析构
     std::shared_ptr<epoll_event> shared_events(
         events, [](epoll_event *ptr) { delete[] ptr; });
+    // 忙轮询线程从不阻塞,见busyPollForWork
+    const bool busy_poll = isBusyPollThread();
+    size_t stale = 0;
+    bool yielded_for_tasks = false;
 
     while (true) {
         // std::cout << "in while ..." << std::endl;
         if (stopping()) {
-            std::cout << "name = " << getName() << "idle stopping exit"
-                      << std::endl;
+            QC_LOG_DEBUG("name = %s idle stopping exit", getName().c_str());
+            // 其他线程可能在停止条件成立之前就进了epoll_wait,没有人再tickle它们,
+            // 这里依次唤醒,让它们也能看到停止条件,而不是等到epoll_wait超时;
+            // 还有线程在忙轮询时tickle不写管道,所以直接写
+            wakeUp();
             break;
         }
-        // 下面设定最大的阻塞事件
-        static const int MAX_TIMEOUT = 5000;
-
-        // 获取下次超时时间
-        uint64_t next_timeout = getNextTimer();
-
-        // rt == 0 超时
-        if (next_timeout == ~0ull) next_timeout = 6000;
-        else std::cout << "next_timeout = " << next_timeout << std::endl;
-        int rt = epoll_wait(m_epfd, events, MAX_EVENTS, std::min((int)next_timeout, MAX_TIMEOUT));
-        if (rt < 0) {
-            if (errno == EINTR) continue;
-            std::cout << "epoll_wait(" << m_epfd << ") (rt = " << rt
-                      << ") (errno = " << errno
-                      << " ) (errset : " << strerror(errno) << " )";
-            break;  // 直接当前协程结束执行
+        // 阻塞的工作线程已经恢复,临时工作线程退出
+        if (isRetiring()) break;
+
+        // 为队列中的任务让出之后又回到这里,说明剩下的任务不是给这个线程的
+        if (yielded_for_tasks && hasPendingTasks()) stale = getPendingTasks();
+        yielded_for_tasks = false;
+        if (busy_poll) {
+            if (busyPollForWork(events, MAX_EVENTS, stale) < 0) break;
+            yielded_for_tasks = hasPendingTasks();
+        } else if (spinForWork(events, MAX_EVENTS, stale)) {
+            yielded_for_tasks = true;
+        } else {
+            // 下面设定最大的阻塞事件
+            static const int MAX_TIMEOUT = 5000;
+            // 临时工作线程要及时看到退出标记,没有专门唤醒它的途径
+            static const int TEMP_WORKER_TIMEOUT = 10;
+            // 自旋时忽略了取不到的任务: 它们被主人取走的同时来了一个新任务,任务数不变,
+            // 而入队方看到这里在自旋没有写管道,所以这时只阻塞一小段时间
+            static const int STALE_TASKS_TIMEOUT = 1;
+            int max_timeout = isTemporaryWorker() ? TEMP_WORKER_TIMEOUT : MAX_TIMEOUT;
+            if (stale) max_timeout = std::min(max_timeout, STALE_TASKS_TIMEOUT);
+
+            // 获取下次超时时间
+            uint64_t next_timeout = getNextTimer();
+
+            // rt == 0 超时
+            if (next_timeout == ~0ull) next_timeout = 6000;
+            else QC_LOG_DEBUG("next_timeout = %lu", (unsigned long)next_timeout);
+            if (processEvents(events, MAX_EVENTS, std::min((int)next_timeout, max_timeout)) < 0)
+                break;  // 直接当前协程结束执行
         }
 
-        // 定时任务比较要紧放前面
-        std::vector<std::function<void()>> cbs;
-        listExpiredCb(cbs);
-        // std::cout << "after list size = " << cbs.size() << std::endl;
-        for (const auto &cb : cbs) {
-            add_task(cb);
-            // std::cout << "add_task succ" << std::endl;
+        // 处理完所有事件
+        Fiber::GetCurrent()->yield();
+    }
+}
+
+int IOManager::processEvents(epoll_event *events, int max_events, int timeout_ms) {
+    int rt;
+    do {
+        rt = epoll_wait(m_epfd, events, max_events, timeout_ms);
+    } while (rt < 0 && errno == EINTR);
+    Metrics::Inc(Metrics::EPOLL_WAITS);
+    if (rt > 0) Metrics::Inc(Metrics::EPOLL_EVENTS, rt);
+    if (rt < 0) {
+        QC_LOG_ERROR("epoll_wait(%d) (rt = %d) (errno = %d) (errstr : %s)", m_epfd, rt,
+                     errno, strerror(errno));
+        return -1;
+    }
+
+    // 定时任务比较要紧放前面
+    std::vector<TaskFunc> cbs;
+    listExpiredCb(cbs);
+    int scheduled = cbs.size();
+    // std::cout << "after list size = " << cbs.size() << std::endl;
+    for (auto &cb : cbs) {
+        add_task(std::move(cb));
+        // std::cout << "add_task succ" << std::endl;
+    }
+    cbs.clear();
+
+    for (int i = 0; i < rt; ++i) {
+        QC_LOG_DEBUG("get event");
+        epoll_event &event = events[i];
+        if (event.data.fd == m_tickleFds[0]) {
+            QC_LOG_DEBUG("tickle()..");
+            Metrics::Inc(Metrics::TICKLES_RECEIVED);
+            uint8_t dummy[256];
+            // 由于这里m_tickleFds的触发模式为ET,所以下面要用while一直读完才行
+            while (read(m_tickleFds[0], dummy, sizeof(dummy)) > 0);
+            continue;
         }
-        cbs.clear();
-
-        for (int i = 0; i < rt; ++i) {
-            std::cout << "get event" << std::endl;
-            epoll_event &event = events[i];
-            if (event.data.fd == m_tickleFds[0]) {
-                std::cout << "tickle().." << std::endl;
-                uint8_t dummy[256];
-                // 由于这里m_tickleFds的触发模式为ET,所以下面要用while一直读完才行
-                while (read(m_tickleFds[0], dummy, sizeof(dummy)) > 0);
-                continue;
-            }
 
-            FdContext *fd_ctx = (FdContext *)event.data.ptr;
+        FdContext *fd_ctx = (FdContext *)event.data.ptr;
+        // 事件都在这个IOManager上,单线程时只有本线程访问,不用加锁
+        if (isOwnerOnly()) {
+            scheduled += processFdEvents(fd_ctx, event.events);
+        } else {
             // 对事件操作要加锁
-            // 这里的问题,这里加了一次锁,后面del的时候还要加锁,加了两次锁
             FdContext::MutexType::Lock lock(fd_ctx->m_mutex);
+            scheduled += processFdEvents(fd_ctx, event.events);
+        }
+    }
+    return scheduled;
+}
 
-            /**
-             * EPOLLERR: 出错
-             * EPOLLHUP: 套接字对端关闭
-             * 触发这两种事件,应该同时触发fd的读和写事件,否则可能出现注册的事件永远执行不到的情况.
-             */
-            if (event.events & (EPOLLERR | EPOLLHUP)) {
-                event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->m_events;
-            }
-            int real_events = NONE;
-            if (event.events & EPOLLIN) real_events |= READ;
-            if (event.events & EPOLLOUT) real_events |= WRITE;
-
-            if ((fd_ctx->m_events & real_events) == NONE) continue;
-
-            // 剔除已经发生的事件
-            // int left_events = (fd_ctx->m_events & ~real_events);
-            // int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-
-            // // READ == EPOLLIN -> 0x001
-            // // WRITE == EPOLLOUT -> 0x004
-            // event.events = EPOLLET | left_events;
+int IOManager::processFdEvents(FdContext *fd_ctx, uint32_t events) {
+    // epoll_wait返回之后事件可能已经删除,fd又在别的IOManager上注册,这时它的事件不归这里管
+    if (fd_ctx->m_owner.load(std::memory_order_acquire) != this) return 0;
+    /**
+     * EPOLLERR: 出错
+     * EPOLLHUP: 套接字对端关闭
+     * 触发这两种事件,应该同时触发fd的读和写事件,否则可能出现注册的事件永远执行不到的情况.
+     */
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        events |= (EPOLLIN | EPOLLOUT) & fd_ctx->m_events;
+    }
+    int real_events = NONE;
+    if (events & EPOLLIN) real_events |= READ;
+    if (events & EPOLLOUT) real_events |= WRITE;
+
+    if ((fd_ctx->m_events & real_events) == NONE) return 0;
+
+    // 处理已经发生的事件: 在锁内触发并删除.先放锁再删除时,被唤醒的协程可能已经在别的线程上
+    // 又登记了同一个事件,删掉的就是它的新登记
+    int scheduled = 0;
+    if (real_events & READ) {
+        cancelEventNolock(fd_ctx, READ);
+        ++scheduled;
+    }
+    if (real_events & WRITE) {
+        cancelEventNolock(fd_ctx, WRITE);
+        ++scheduled;
+    }
+    return scheduled;
+}
 
-            // rt = epoll_ctl(m_epfd, op, fd_ctx->m_fd, &event);
-            // qc_assert(!rt);
+int IOManager::addEvent(int fd, Event event, TaskFunc cb) {
+    if (cb) return addEventImpl(fd, event, std::move(cb), nullptr);
+    Fiber::ptr fiber = Fiber::GetThis();
+    qc_assert(fiber->getState() == Fiber::RUNNING);
+    return addEventImpl(fd, event, nullptr, std::move(fiber));
+}
 
-            lock.unlock();
+int IOManager::addEventFor(int fd, Event event, Fiber::ptr fiber) {
+    qc_assert(fiber->getState() == Fiber::READY);
+    return addEventImpl(fd, event, nullptr, std::move(fiber));
+}
 
-            // 处理已经发生的事件
-            if (real_events & READ) {
-                fd_ctx->triggerEvent(READ);
-                delEvent(fd_ctx->m_fd, READ);
-                --m_pendingEventCount;
-            }
-            if (real_events & WRITE) {
-                fd_ctx->triggerEvent(WRITE);
-                delEvent(fd_ctx->m_fd, WRITE);
-                --m_pendingEventCount;
-            }
-        }
-        // 处理完所有事件
-        Fiber::ptr cur = Fiber::GetThis();
-        auto raw_ptr = cur.get();
-        cur.reset();
+int IOManager::addEventImpl(int fd, Event event, TaskFunc cb, Fiber::ptr fiber) {
+    // 槽位一旦创建就不会移动,不需要再加读写锁
+    FdContext *fd_ctx = FdMgr::GetInstance()->getSlot(fd, true);
+    if (!fd_ctx) return -1;
 
-        raw_ptr->yield();
+    Scheduler *scheduler = Scheduler::GetThis();
+    if (!isOwnerOnly()) {
+        FdContext::MutexType::Lock lock2(fd_ctx->m_mutex);
+        return addEventLocked(fd_ctx, event, std::move(cb), std::move(fiber), scheduler);
     }
-}
-
-int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
-    FdContext *fd_ctx = nullptr;
-    RWMutexType::ReadLock lock(m_mutex);
-    // 之前就有
-    if ((int)m_fdContexts.size() > fd) {
-        fd_ctx = m_fdContexts[fd];
-        lock.unlock();
-    } else {
-        lock.unlock();
-        RWMutexType::WriteLock lock2(m_mutex);
-        contextResize(fd * 1.5);
-        fd_ctx = m_fdContexts[fd];
-        fd_ctx->m_fd = fd;
+    if (onOwnerThread()) {
+        return addEventLocked(fd_ctx, event, std::move(cb), std::move(fiber), scheduler);
     }
 
-    int op = fd_ctx->m_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    // 其他线程上注册: 交给这个IOManager的线程并等它注册完,之后在这个线程上的删除和取消不会跑到注册前面.
+    // 事件触发时仍然回到调用方的调度器.登记的是当前协程时不能挂起它等待,否则事件触发和等待结束会各恢复它一次
+    bool suspend = !fiber || fiber.get() != Fiber::GetCurrent();
+    std::shared_ptr<TaskFunc> shared_cb = std::make_shared<TaskFunc>(std::move(cb));
+    bool ok = callOnOwner(
+        [this, fd_ctx, event, shared_cb, fiber, scheduler]() {
+            return addEventLocked(fd_ctx, event, std::move(*shared_cb), fiber, scheduler) == 0;
+        },
+        suspend);
+    return ok ? 0 : -1;
+}
 
+int IOManager::addEventLocked(FdContext *fd_ctx, Event event, TaskFunc cb, Fiber::ptr fiber,
+                              Scheduler *scheduler) {
+    int fd = fd_ctx->m_fd;
+    // 同一个fd的事件只能在一个epoll上,另一个事件还挂在别的IOManager上时拒绝.
+    // 单线程的IOManager不拿m_mutex,所以从nullptr改为自己要用CAS;确认是自己的之前不能读m_events
+    IOManager *owner = nullptr;
+    if (!fd_ctx->m_owner.compare_exchange_strong(owner, this) && owner != this) {
+        QC_LOG_ERROR("fd %d already has events on IOManager %s, add on %s rejected", fd,
+                     owner->getName().c_str(), getName().c_str());
+        return -1;
+    }
     //! 同一个fd不允许重复添加相同的事件
-    FdContext::MutexType::Lock lock2(fd_ctx->m_mutex);
     if (fd_ctx->m_events & event) throw std::logic_error("add same event type");
+    int op = fd_ctx->m_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+    // 忙轮询线程上等待的socket,让内核在读这个socket时也轮询网卡队列,失败(比如没有CAP_NET_ADMIN)不影响使用
+    int busy_poll_us = getOptions().busy_poll_us;
+    if (busy_poll_us > 0 && fd_ctx->isSocket() && isBusyPollThread() &&
+        !fd_ctx->m_busyPoll.exchange(true)) {
+        if (setsockopt_f(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us)))
+            QC_LOG_DEBUG("setsockopt(%d, SO_BUSY_POLL) errno = %s", fd, strerror(errno));
+    }
 
     fd_ctx->m_events = (Event)(fd_ctx->m_events | event);
     FdContext::EventContext &event_ctx = fd_ctx->getEventContext(event);
     qc_assert(!event_ctx.scheduler && !event_ctx.fiber && !event_ctx.cb);
-    // 赋值schuduler 和回调函数,如果回调函数为空,则把当前协程当成回调执行体
-    // ---
-    event_ctx.scheduler = Scheduler::GetThis();
+    // 赋值schuduler 和回调函数,如果回调函数为空,则把协程当成回调执行体
+    event_ctx.scheduler = scheduler;
     if (cb) {
         event_ctx.cb.swap(cb);
     } else {
-        // --===-- ?
-        event_ctx.fiber = Fiber::GetThis();
-        qc_assert(event_ctx.fiber->getState() == Fiber::RUNNING);
+        event_ctx.fiber.swap(fiber);
     }
-    // ---
 
     epoll_event epevent;
     epevent.events = fd_ctx->m_events | EPOLLET;
@@ -248,10 +410,11 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
 
     // fd 不存在
     int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    std::cout << "epoll_ctl return : " << rt << " errno = " << strerror(errno) << std::endl;
+    if (rt) QC_LOG_ERROR("epoll_ctl(%d, %d) return : %d errno = %s", fd, op, rt, strerror(errno));
     qc_assert(!rt);
 
     ++m_pendingEventCount;
+    Tracer::Emit(Tracer::EVENT_ADD, Fiber::GetFiberId(), (uint64_t)fd << 8 | event);
 
     // 添加完之后,由IOManager::idle()进行触发,触发完之后由其删除
 
@@ -264,56 +427,129 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
     return 0;
 }
 
-bool IOManager::delEvent(int fd, Event event) {
-    std::cout << "in delEvent" << std::endl;
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int)m_fdContexts.size() <= fd) return false;
-    FdContext *fd_ctx = m_fdContexts[fd];
-    lock.unlock();
-
-    std::cout << "before get FdContext::MutexType::Lock" << std::endl;
-    // 没拿到锁
-    FdContext::MutexType::Lock lock2(fd_ctx->m_mutex);
-    std::cout << "after get FdContext::MutexType::Lock" << std::endl;
-    if (!(fd_ctx->m_events & event)) {
-        std::cout << "del not exits event" << std::endl;
-        return false;
+/// @brief 单线程IOManager的线程上处理fd事件用的锁,不保护任何东西
+static NullMutex s_nullMutex;
+
+/**
+ * @details m_owner只在事件都删除之后改回nullptr,改回之前的所有修改对之后CAS拿到它的IOManager可见.
+ *          单线程的IOManager在自己的线程上时,别的线程只能把nullptr改为自己,改不了它,所以不用再检查
+ */
+template <class Op>
+bool IOManager::withOwner(FdContext *fd_ctx, bool wait, Op op) {
+    while (true) {
+        IOManager *owner = fd_ctx->m_owner.load(std::memory_order_acquire);
+        if (!owner) return false;
+        if (owner->isOwnerOnly()) {
+            if (owner->onOwnerThread()) {
+                NullMutex::Lock lock(s_nullMutex);
+                return op(fd_ctx, owner);
+            }
+            // 到那边时事件可能已经删除或者换了IOManager,重新找一遍
+            auto forward = [fd_ctx, op]() { return withOwner(fd_ctx, true, op); };
+            if (wait) return owner->callOnOwner(forward);
+            owner->runOnTimerThread([forward]() { forward(); });
+            return false;
+        }
+        FdContext::MutexType::Lock lock(fd_ctx->m_mutex);
+        if (fd_ctx->m_owner.load(std::memory_order_relaxed) == owner) return op(fd_ctx, owner);
     }
+}
 
-    // 清除指定的事件
-    Event real_event = (Event)(fd_ctx->m_events & ~event);
-    int op = real_event ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = real_event;
-    epevent.data.ptr = fd_ctx;
-    // epevent.data.fd = fd_ctx->m_fd;
+bool IOManager::callOnOwner(std::function<bool()> fn, bool suspend) {
+    bool result = false;
+    bool *out = &result;
+    Scheduler *scheduler = Scheduler::GetThis();
+    Fiber *cur = Fiber::GetCurrent();
+    if (suspend && scheduler && cur && cur->isRunInScheduler()) {
+        // 协程挂起之后再转交,结果写回时协程一定已经挂起,恢复时一定已经写完
+        Fiber::ptr fiber(cur);
+        Scheduler::YieldThen([this, fn, out, scheduler, fiber]() {
+            runOnTimerThread([fn, out, scheduler, fiber]() mutable {
+                *out = fn();
+                scheduler->add_task(std::move(fiber));
+            });
+        });
+        return result;
+    }
+    Semaphore sem;
+    runOnTimerThread([fn, out, &sem]() {
+        *out = fn();
+        sem.V();
+    });
+    sem.P();
+    return result;
+}
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    qc_assert(!rt);
+/// @details 事件可能是在别的IOManager上注册的,从注册它的IOManager的epoll中删除,计数也减在它上面
+bool IOManager::delEvent(int fd, Event event) {
+    FdContext *fd_ctx = FdMgr::GetInstance()->getSlot(fd);
+    if (!fd_ctx) return false;
 
-    --m_pendingEventCount;
+    return withOwner(fd_ctx, true, [fd, event](FdContext *fd_ctx, IOManager *owner) {
+        if (!(fd_ctx->m_events & event)) {
+            QC_LOG_DEBUG("del not exits event, fd = %d", fd);
+            return false;
+        }
 
-    // 清除FdContext中的EventContext
-    fd_ctx->m_events = real_event;
-    FdContext::EventContext &event_ctx = fd_ctx->getEventContext(event);
-    fd_ctx->resetEventContext(event_ctx);
+        // 清除指定的事件
+        Event real_event = (Event)(fd_ctx->m_events & ~event);
+        int op = real_event ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events = real_event;
+        epevent.data.ptr = fd_ctx;
+        // epevent.data.fd = fd_ctx->m_fd;
 
-    std::cout << "delEvent succ" << std::endl;
-    return true;
+        int rt = epoll_ctl(owner->m_epfd, op, fd, &epevent);
+        qc_assert(!rt);
+
+        --owner->m_pendingEventCount;
+
+        // 清除FdContext中的EventContext
+        fd_ctx->m_events = real_event;
+        FdContext::EventContext &event_ctx = fd_ctx->getEventContext(event);
+        fd_ctx->resetEventContext(event_ctx);
+        if (!real_event) fd_ctx->m_owner.store(nullptr, std::memory_order_release);
+
+        QC_LOG_DEBUG("delEvent succ, fd = %d", fd);
+        return true;
+    });
 }
 
 /// @brief
 /// 这里的取消是指不再监听对应文件描述符的事件,但之前向该文件描述符中注册的信息不会改变
 ///        也就是说并不会对FdContext中的EventContext进行操作,del就需要
 bool IOManager::cancelEvent(int fd, Event event) {
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int)m_fdContexts.size() <= fd) return false;
-    FdContext *fd_ctx = m_fdContexts[fd];
-    lock.unlock();
+    FdContext *fd_ctx = FdMgr::GetInstance()->getSlot(fd);
+    if (!fd_ctx) return false;
+
+    return withOwner(fd_ctx, true, [event](FdContext *fd_ctx, IOManager *owner) {
+        if (!(fd_ctx->m_events & event)) return false;
+        owner->cancelEventNolock(fd_ctx, event);
+        return true;
+    });
+}
 
-    FdContext::MutexType::Lock lock2(fd_ctx->m_mutex);
-    if (!(fd_ctx->m_events & event)) return false;
+bool IOManager::cancelWait(int fd, Event event, uint64_t fiber_id, uint64_t wait_seq, int err) {
+    FdContext *fd_ctx = FdMgr::GetInstance()->getSlot(fd);
+    if (!fd_ctx) return false;
 
+    // 从取消令牌的回调进来,不在这里等
+    return withOwner(fd_ctx, false, [=](FdContext *fd_ctx, IOManager *owner) {
+        if (!(fd_ctx->m_events & event)) return false;
+
+        // 事件上挂的已经不是这次等待了(已被唤醒,或者换成了别的协程/下一次等待)
+        FdContext::EventContext &event_ctx = fd_ctx->getEventContext(event);
+        if (!event_ctx.fiber || event_ctx.fiber->git_id() != fiber_id ||
+            event_ctx.fiber->getWaitSeq() != wait_seq)
+            return false;
+
+        event_ctx.fiber->setWaitError(err);
+        owner->cancelEventNolock(fd_ctx, event);
+        return true;
+    });
+}
+
+void IOManager::cancelEventNolock(FdContext *fd_ctx, Event event) {
     // 删除前触发一次事件
     fd_ctx->triggerEvent(event);
 
@@ -324,65 +560,64 @@ bool IOManager::cancelEvent(int fd, Event event) {
     epevent.events = real_event;
     epevent.data.ptr = fd_ctx;
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    qc_assert(fd_ctx->m_owner.load(std::memory_order_relaxed) == this);
+    int rt = epoll_ctl(m_epfd, op, fd_ctx->m_fd, &epevent);
     qc_assert(!rt);
     --m_pendingEventCount;
 
     fd_ctx->m_events = real_event;
-
-    return true;
+    if (!real_event) fd_ctx->m_owner.store(nullptr, std::memory_order_release);
 }
 
+/// @details hook的close在当前线程的IOManager上调用,事件按注册它的IOManager处理.
+///          它是别的线程的单线程IOManager时等那边取消完,close_f之后fd号才可能被复用
 bool IOManager::cancelAll(int fd) {
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int)m_fdContexts.size() <= fd) return false;
-    FdContext *fd_ctx = m_fdContexts[fd];
-    lock.unlock();
-
-    FdContext::MutexType::Lock lock2(fd_ctx->m_mutex);
-    if (!fd_ctx->m_events) return false;
-
-    // 取消之前触发一遍所有的事件
-    if (fd_ctx->m_events & READ) {
-        fd_ctx->triggerEvent(READ);
-        --m_pendingEventCount;
-    }
-    if (fd_ctx->m_events & WRITE) {
-        fd_ctx->triggerEvent(WRITE);
-        --m_pendingEventCount;
-    }
+    FdContext *fd_ctx = FdMgr::GetInstance()->getSlot(fd);
+    if (!fd_ctx) return false;
 
-    int op = EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = NONE;
-    epevent.data.ptr = fd_ctx;
+    return withOwner(fd_ctx, true, [fd](FdContext *fd_ctx, IOManager *owner) {
+        if (!fd_ctx->m_events) return false;
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    qc_assert(!rt);
+        // 取消之前触发一遍所有的事件
+        if (fd_ctx->m_events & READ) {
+            fd_ctx->triggerEvent(READ);
+            --owner->m_pendingEventCount;
+        }
+        if (fd_ctx->m_events & WRITE) {
+            fd_ctx->triggerEvent(WRITE);
+            --owner->m_pendingEventCount;
+        }
+
+        int op = EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events = NONE;
+        epevent.data.ptr = fd_ctx;
 
-    fd_ctx->m_events = NONE;
+        int rt = epoll_ctl(owner->m_epfd, op, fd, &epevent);
+        qc_assert(!rt);
 
-    // 之前的逻辑并没有对fd_ctx中的m_events进行操作,为什么这里就会变成NONE??
-    qc_assert(fd_ctx->m_events == NONE);
-    return true;
+        fd_ctx->m_events = NONE;
+        fd_ctx->m_owner.store(nullptr, std::memory_order_release);
+        return true;
+    });
 }
 
 IOManager::~IOManager() {
+    for (auto id : m_gaugeIds) Metrics::RemoveGauge(id);
     close(m_epfd);
     close(m_tickleFds[0]);
     close(m_tickleFds[1]);
-
-    for (size_t i = 0; i < m_fdContexts.size(); ++i) 
-        if (m_fdContexts[i]) delete m_fdContexts[i];
 }
 
 bool IOManager::stopping() {
-    return m_pendingEventCount == 0 && Scheduler::stopping() && this->m_timers.size() == 0;
+    return m_pendingEventCount == 0 && Scheduler::stopping() && getTimerCount() == 0;
 }
 
 
+/// @details 每次hook的调用都要取一次,用构造时记下的指针代替dynamic_cast
 IOManager* IOManager::GetThis() {
-    return dynamic_cast<IOManager*>(Scheduler::GetThis());
+    Scheduler *sched = Scheduler::GetThis();
+    return sched ? sched->_ioManager : nullptr;
 }
 
 void IOManager::OnTimerInsertedAtFront() {
@@ -0,0 +1,325 @@
+/**
+ * @file log.cc
+ * @author qc
+ * @brief 异步日志实现
+ * @version 0.1
+ * @date 2024-07-09
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "log.hpp"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+#include "fiber.hpp"
+#include "mutex.hpp"
+
+namespace qc {
+
+/// @brief 每条日志正文的最大长度,超出截断
+static const size_t LOG_MSG_SIZE = 200;
+/// @brief 每个线程环形缓冲区的条数,必须是2的幂
+static const uint64_t LOG_RING_SIZE = 512;
+/// @brief 后台线程没有日志可写时的休眠时间
+static const int LOG_FLUSH_INTERVAL_US = 10 * 1000;
+
+const char *LogLevel::ToString(LogLevel::Level level) {
+    switch (level) {
+        case DEBUG: return "DEBUG";
+        case INFO: return "INFO";
+        case WARN: return "WARN";
+        case ERROR: return "ERROR";
+        default: return "UNKNOWN";
+    }
+}
+
+struct LogRecord {
+    uint64_t time_us;
+    uint64_t fiber_id;
+    const char *file;
+    int line;
+    LogLevel::Level level;
+    uint32_t len;
+    char msg[LOG_MSG_SIZE];
+};
+
+/**
+ * @brief 单生产者单消费者环形缓冲区
+ * @details 生产者是所属线程,消费者是后台刷盘线程(或Flush的调用者,由LogState::flush_mutex串行化)
+ */
+class LogRing {
+public:
+    LogRing() : m_tid(syscall(SYS_gettid)) {}
+
+    LogRecord *reserve() {
+        uint64_t head = m_head.load(std::memory_order_relaxed);
+        if (head - m_tail.load(std::memory_order_acquire) >= LOG_RING_SIZE) return nullptr;
+        return &m_records[head & (LOG_RING_SIZE - 1)];
+    }
+
+    void commit() {
+        m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+public:
+    pid_t m_tid;
+    /// @brief 所属线程已经退出,刷完之后可以释放
+    std::atomic<bool> m_dead{false};
+    alignas(64) std::atomic<uint64_t> m_head{0};
+    alignas(64) std::atomic<uint64_t> m_tail{0};
+    LogRecord m_records[LOG_RING_SIZE];
+};
+
+/// @brief 全局日志状态,第一次写日志时创建后台线程
+struct LogState {
+    LogState() {
+        pthread_create(&flusher, nullptr, &LogState::FlushMain, this);
+    }
+
+    ~LogState() {
+        stop.store(true, std::memory_order_release);
+        pthread_join(flusher, nullptr);
+        flush();
+        destroyed = true;
+        for (auto ring : rings) delete ring;
+        rings.clear();
+    }
+
+    static void *FlushMain(void *arg) {
+        LogState *state = (LogState *)arg;
+        pthread_setname_np(pthread_self(), "qc_log");
+        while (!state->stop.load(std::memory_order_acquire)) {
+            if (!state->flush()) usleep(LOG_FLUSH_INTERVAL_US);
+        }
+        return nullptr;
+    }
+
+    LogRing *registerRing() {
+        LogRing *ring = new LogRing;
+        Mutex::Lock lock(rings_mutex);
+        rings.push_back(ring);
+        return ring;
+    }
+
+    /// @brief 把所有环中的日志写出,返回是否写出了内容
+    bool flush() {
+        Mutex::Lock lock(flush_mutex);
+        return flushLocked();
+    }
+    /// @brief 调用方持有flush_mutex
+    bool flushLocked();
+    /// @brief 写出buffer,调用方持有flush_mutex
+    void writeOut(const std::string &data);
+    /**
+     * @brief 换成新的fd
+     * @details 在flush_mutex内先刷完再换,换下来的fd没有人在写;是SetFile打开的就关闭
+     */
+    void setFd(int new_fd, bool owned) {
+        Mutex::Lock lock(flush_mutex);
+        flushLocked();
+        int old = fd.exchange(new_fd, std::memory_order_relaxed);
+        if (owns_fd && old != new_fd) ::close(old);
+        owns_fd = owned;
+    }
+
+    pthread_t flusher;
+    std::atomic<bool> stop{false};
+    std::atomic<int> fd{STDERR_FILENO};
+    /// @brief fd是否由SetFile打开,由flush_mutex保护
+    bool owns_fd = false;
+    std::atomic<int> level{QC_LOG_LEVEL};
+    /// @brief 累计丢弃条数
+    std::atomic<uint64_t> dropped{0};
+    /// @brief 上次刷盘之后新丢弃的条数
+    std::atomic<uint64_t> unreported{0};
+    /// @brief 保护rings的增删
+    Mutex rings_mutex;
+    /// @brief 串行化消费者
+    Mutex flush_mutex;
+    std::vector<LogRing *> rings;
+    std::string buffer;
+
+    static bool destroyed;
+};
+
+bool LogState::destroyed = false;
+
+static LogState &State() {
+    static LogState s_state;
+    return s_state;
+}
+
+/**
+ * @brief 所属线程的thread_local已经析构
+ * @details 比LocalRing更晚析构的thread_local对象在析构函数中还可能写日志,这时不能再登记新的环(没有人再标记它退出),
+ *          直接同步写出.bool没有析构函数,一直可用
+ */
+static thread_local bool t_ring_gone = false;
+
+/// @brief 线程退出时标记自己的环,由后台线程刷完后释放
+struct LocalRing {
+    ~LocalRing() {
+        if (ring) ring->m_dead.store(true, std::memory_order_release);
+        ring = nullptr;
+        t_ring_gone = true;
+    }
+    LogRing *ring = nullptr;
+};
+
+static thread_local LocalRing t_ring;
+
+static void FormatRecord(std::string &out, pid_t tid, const LogRecord &rec) {
+    char head[128];
+    time_t sec = rec.time_us / 1000000;
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    size_t n = strftime(head, sizeof(head), "%Y-%m-%d %H:%M:%S", &tm);
+    const char *file = strrchr(rec.file, '/');
+    file = file ? file + 1 : rec.file;
+    n += snprintf(head + n, sizeof(head) - n, ".%06lu [%s] tid=%d fiber=%lu ",
+                  (unsigned long)(rec.time_us % 1000000), LogLevel::ToString(rec.level), tid,
+                  (unsigned long)rec.fiber_id);
+    out.append(head, std::min(n, sizeof(head) - 1));
+    out.append(file);
+    out.push_back(':');
+    out.append(std::to_string(rec.line));
+    out.push_back(' ');
+    out.append(rec.msg, rec.len);
+    out.push_back('\n');
+}
+
+void LogState::writeOut(const std::string &data) {
+    const char *p = data.data();
+    size_t left = data.size();
+    while (left > 0) {
+        ssize_t n = ::write(fd.load(std::memory_order_relaxed), p, left);
+        if (n <= 0) break;
+        p += n;
+        left -= n;
+    }
+}
+
+bool LogState::flushLocked() {
+    std::vector<LogRing *> snapshot;
+    {
+        Mutex::Lock lock2(rings_mutex);
+        snapshot = rings;
+    }
+
+    buffer.clear();
+    std::vector<LogRing *> dead;
+    for (auto ring : snapshot) {
+        // 先读dead再读head,保证线程退出前写入的日志都能被看到
+        bool is_dead = ring->m_dead.load(std::memory_order_acquire);
+        uint64_t tail = ring->m_tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->m_head.load(std::memory_order_acquire);
+        for (; tail != head; ++tail) {
+            FormatRecord(buffer, ring->m_tid, ring->m_records[tail & (LOG_RING_SIZE - 1)]);
+        }
+        ring->m_tail.store(tail, std::memory_order_release);
+        if (is_dead) dead.push_back(ring);
+    }
+
+    uint64_t lost = unreported.exchange(0, std::memory_order_relaxed);
+    if (lost) buffer.append("[log] dropped " + std::to_string(lost) + " records\n");
+
+    writeOut(buffer);
+
+    if (!dead.empty()) {
+        Mutex::Lock lock2(rings_mutex);
+        for (auto ring : dead) {
+            for (auto it = rings.begin(); it != rings.end(); ++it) {
+                if (*it == ring) {
+                    rings.erase(it);
+                    break;
+                }
+            }
+            delete ring;
+        }
+    }
+    return !buffer.empty();
+}
+
+void Logger::SetLevel(LogLevel::Level level) {
+    State().level.store(level, std::memory_order_relaxed);
+}
+
+LogLevel::Level Logger::GetLevel() {
+    return (LogLevel::Level)State().level.load(std::memory_order_relaxed);
+}
+
+bool Logger::SetFile(const std::string &path) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    State().setFd(fd, true);
+    return true;
+}
+
+void Logger::SetFd(int fd) { State().setFd(fd, false); }
+
+void Logger::Flush() { State().flush(); }
+
+uint64_t Logger::GetDropped() { return State().dropped.load(std::memory_order_relaxed); }
+
+void Logger::Log(LogLevel::Level level, const char *file, int line, const char *fmt, ...) {
+    va_list ap;
+    if (qc_unlikely(LogState::destroyed)) {
+        // 进程退出阶段后台线程已经停止,直接写标准错误
+        va_start(ap, fmt);
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+        fputc('\n', stderr);
+        return;
+    }
+
+    LogState &state = State();
+    LogRecord local;
+    LogRecord *rec = nullptr;
+    if (qc_unlikely(t_ring_gone)) {
+        rec = &local;
+    } else {
+        if (qc_unlikely(!t_ring.ring)) t_ring.ring = state.registerRing();
+        rec = t_ring.ring->reserve();
+    }
+    if (!rec) {
+        state.dropped.fetch_add(1, std::memory_order_relaxed);
+        state.unreported.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->time_us = ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+    rec->fiber_id = Fiber::GetFiberId();
+    rec->file = file;
+    rec->line = line;
+    rec->level = level;
+    va_start(ap, fmt);
+    int n = vsnprintf(rec->msg, LOG_MSG_SIZE, fmt, ap);
+    va_end(ap);
+    rec->len = n < 0 ? 0 : std::min((size_t)n, LOG_MSG_SIZE - 1);
+    if (qc_likely(rec != &local)) {
+        t_ring.ring->commit();
+        return;
+    }
+    // 线程退出阶段,排在其他线程之后同步写出
+    Mutex::Lock lock(state.flush_mutex);
+    state.flushLocked();
+    std::string out;
+    FormatRecord(out, syscall(SYS_gettid), local);
+    state.writeOut(out);
+}
+
+}  // namespace qc
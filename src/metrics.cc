@@ -0,0 +1,328 @@
+/**
+ * @file metrics.cc
+ * @author qc
+ * @brief 运行时指标实现
+ * @version 0.1
+ * @date 2024-07-10
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "metrics.hpp"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <ctime>
+#include <map>
+#include <sstream>
+
+#include "fiber.hpp"
+#include "mutex.hpp"
+#include "thread.hpp"
+
+namespace qc {
+
+uint64_t GetMonotonicNS() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+Histogram &Histogram::operator=(const Histogram &rhs) {
+    if (this != &rhs) {
+        clear();
+        merge(rhs);
+    }
+    return *this;
+}
+
+int Histogram::BucketIndex(uint64_t v) {
+    if (v < 2 * SUB_COUNT) return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    int mantissa = (int)((v >> (e - SUB_BITS)) & (SUB_COUNT - 1));
+    return 2 * SUB_COUNT + (e - SUB_BITS - 1) * SUB_COUNT + mantissa;
+}
+
+uint64_t Histogram::BucketHigh(int idx) {
+    if (idx < 2 * SUB_COUNT) return idx;
+    int e = (idx - 2 * SUB_COUNT) / SUB_COUNT + SUB_BITS + 1;
+    uint64_t mantissa = (idx - 2 * SUB_COUNT) % SUB_COUNT;
+    uint64_t low = (SUB_COUNT + mantissa) << (e - SUB_BITS);
+    return low + (1ull << (e - SUB_BITS)) - 1;
+}
+
+void Histogram::merge(const Histogram &rhs) {
+    for (int i = 0; i < BUCKETS; ++i) {
+        uint64_t n = rhs.m_buckets[i].load(std::memory_order_relaxed);
+        if (n) add(m_buckets[i], n);
+    }
+    add(m_count, rhs.count());
+    add(m_sum, rhs.sum());
+    if (rhs.max() > max()) m_max.store(rhs.max(), std::memory_order_relaxed);
+}
+
+void Histogram::clear() {
+    for (int i = 0; i < BUCKETS; ++i) m_buckets[i].store(0, std::memory_order_relaxed);
+    m_count.store(0, std::memory_order_relaxed);
+    m_sum.store(0, std::memory_order_relaxed);
+    m_max.store(0, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::percentile(double p) const {
+    uint64_t total = count();
+    if (!total) return 0;
+    uint64_t target = (uint64_t)(total * p / 100.0);
+    if (target >= total) target = total - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+        seen += m_buckets[i].load(std::memory_order_relaxed);
+        if (seen > target) return std::min(BucketHigh(i), max());
+    }
+    return max();
+}
+
+namespace {
+
+struct MetricsRegistry {
+    /// @brief 存活线程的指标块属于线程,退出时才回收;这里只释放空闲的
+    ~MetricsRegistry() {
+        for (auto m : free) delete m;
+    }
+
+    Mutex mutex;
+    /// @brief 存活线程的指标
+    std::vector<Metrics::ThreadMetrics *> threads;
+    /// @brief 已经退出的线程的合计,线程退出时并入,累计值不会丢失
+    Metrics::ThreadMetrics exited;
+    /// @brief 退出线程清零后的指标块,新线程优先复用
+    std::vector<Metrics::ThreadMetrics *> free;
+    /**
+     * @brief 仪表的锁,GetSnapshot在持有它时调用仪表回调
+     * @details RemoveGauge也要拿它,返回之后不会再有人调用这个仪表,析构中的调度器可以放心释放回调捕获的this.
+     *          和mutex分开: 仪表回调里第一次写指标的线程要拿mutex注册
+     */
+    Mutex gauge_mutex;
+    uint64_t next_gauge_id = 0;
+    std::map<uint64_t, std::pair<std::string, std::function<int64_t()>>> gauges;
+};
+
+MetricsRegistry &Registry() {
+    static MetricsRegistry s_registry;
+    return s_registry;
+}
+
+}  // namespace
+
+static thread_local Metrics::ThreadMetrics *t_metrics = nullptr;
+/// @brief 所属线程的LocalMetrics已经析构,之后的指标记到退出线程的合计里
+static thread_local bool t_metrics_gone = false;
+
+/**
+ * @brief 线程退出时把指标并入退出线程的合计,清零后放回空闲列表
+ * @details 补偿线程和弹性线程来来去去,每个线程保留一份指标(约20KB)会一直增长
+ */
+struct LocalMetrics {
+    ~LocalMetrics() {
+        if (!m) return;
+        MetricsRegistry &reg = Registry();
+        Mutex::Lock lock(reg.mutex);
+        for (int i = 0; i < Metrics::COUNTER_MAX; ++i) {
+            uint64_t n = m->counters[i].load(std::memory_order_relaxed);
+            reg.exited.counters[i].store(reg.exited.counters[i].load(std::memory_order_relaxed) + n,
+                                         std::memory_order_relaxed);
+            m->counters[i].store(0, std::memory_order_relaxed);
+        }
+        reg.exited.sched_latency.merge(m->sched_latency);
+        m->sched_latency.clear();
+        for (int i = 0; i < Metrics::PRIORITY_LEVELS; ++i) {
+            reg.exited.priority_sched_latency[i].merge(m->priority_sched_latency[i]);
+            m->priority_sched_latency[i].clear();
+        }
+        reg.exited.run_duration.merge(m->run_duration);
+        m->run_duration.clear();
+        for (auto it = reg.threads.begin(); it != reg.threads.end(); ++it) {
+            if (*it == m) {
+                reg.threads.erase(it);
+                break;
+            }
+        }
+        reg.free.push_back(m);
+        m = nullptr;
+        t_metrics = nullptr;
+        t_metrics_gone = true;
+    }
+    Metrics::ThreadMetrics *m = nullptr;
+};
+
+static thread_local LocalMetrics t_local;
+
+static_assert(Metrics::PRIORITY_LEVELS == PRIORITY_COUNT, "one histogram per task priority");
+/// @brief 下标为TaskPriority
+static const char *s_priority_names[Metrics::PRIORITY_LEVELS] = {"high", "normal", "background"};
+
+const char *Metrics::CounterName(Counter c) {
+    switch (c) {
+#define XX(name, str) \
+        case name: return str;
+        XX(TASKS_EXECUTED, "qc_tasks_executed_total")
+        XX(CONTEXT_SWITCHES, "qc_context_switches_total")
+        XX(TICKLES_SENT, "qc_tickles_sent_total")
+        XX(TICKLES_RECEIVED, "qc_tickles_received_total")
+        XX(EPOLL_WAITS, "qc_epoll_waits_total")
+        XX(EPOLL_EVENTS, "qc_epoll_events_total")
+        XX(TIMER_INSERTS, "qc_timer_inserts_total")
+        XX(TIMER_CANCELS, "qc_timer_cancels_total")
+        XX(TIMER_FIRES, "qc_timer_fires_total")
+        XX(LONG_RUNS, "qc_long_runs_total")
+        XX(STEALS, "qc_steals_total")
+        XX(REMOTE_STEALS, "qc_remote_steals_total")
+        XX(IDLE_SPIN_HITS, "qc_idle_spin_hits_total")
+        XX(IDLE_SPIN_MISSES, "qc_idle_spin_misses_total")
+        XX(FIBER_POOL_HITS, "qc_fiber_pool_hits_total")
+        XX(FIBER_POOL_MISSES, "qc_fiber_pool_misses_total")
+        XX(PRIORITY_AGED, "qc_priority_aged_total")
+        XX(PREEMPTIONS, "qc_preemptions_total")
+        XX(BLOCKED_WORKERS, "qc_blocked_workers_total")
+        XX(COMPENSATION_WORKERS, "qc_compensation_workers_total")
+        XX(ELASTIC_SPAWNS, "qc_elastic_spawns_total")
+        XX(ELASTIC_RETIRES, "qc_elastic_retires_total")
+#undef XX
+        default: return "qc_unknown";
+    }
+}
+
+/**
+ * @details 线程退出之后(比如在其他thread_local的析构函数中)还写的指标直接记到退出线程的合计里,
+ *          这时可能有多个写者,偶尔丢几次累加,但不会再注册一份没有人回收的指标
+ */
+Metrics::ThreadMetrics *Metrics::Local() {
+    if (qc_likely(t_metrics)) return t_metrics;
+    MetricsRegistry &reg = Registry();
+    if (t_metrics_gone) return &reg.exited;
+    ThreadMetrics *m = nullptr;
+    {
+        Mutex::Lock lock(reg.mutex);
+        if (!reg.free.empty()) {
+            m = reg.free.back();
+            reg.free.pop_back();
+        }
+    }
+    if (!m) m = new ThreadMetrics;
+    m->tid = syscall(SYS_gettid);
+    m->name = Thread::GetName();
+    {
+        Mutex::Lock lock(reg.mutex);
+        reg.threads.push_back(m);
+    }
+    t_local.m = m;
+    t_metrics = m;
+    return m;
+}
+
+uint64_t Metrics::AddGauge(const std::string &name, std::function<int64_t()> fn) {
+    MetricsRegistry &reg = Registry();
+    Mutex::Lock lock(reg.gauge_mutex);
+    uint64_t id = ++reg.next_gauge_id;
+    reg.gauges[id] = std::make_pair(name, fn);
+    return id;
+}
+
+/// @details 正在进行的GetSnapshot持有gauge_mutex,等它调用完所有仪表才能删除
+void Metrics::RemoveGauge(uint64_t id) {
+    MetricsRegistry &reg = Registry();
+    Mutex::Lock lock(reg.gauge_mutex);
+    reg.gauges.erase(id);
+}
+
+Metrics::Snapshot Metrics::GetSnapshot() {
+    Snapshot snap;
+    MetricsRegistry &reg = Registry();
+    {
+        Mutex::Lock lock(reg.mutex);
+        snap.threads.reserve(reg.threads.size() + 1);
+        std::vector<ThreadMetrics *> blocks = reg.threads;
+        // 已经退出的线程合成一项
+        bool any_exited = false;
+        for (int i = 0; i < COUNTER_MAX && !any_exited; ++i) any_exited = reg.exited.counters[i].load();
+        if (any_exited || reg.exited.sched_latency.count() || reg.exited.run_duration.count()) {
+            blocks.push_back(&reg.exited);
+        }
+        for (auto m : blocks) {
+            ThreadSnapshot t;
+            t.tid = m == &reg.exited ? 0 : m->tid;
+            t.name = m == &reg.exited ? "exited" : m->name;
+            for (int i = 0; i < COUNTER_MAX; ++i) {
+                t.counters[i] = m->counters[i].load(std::memory_order_relaxed);
+                snap.totals[i] += t.counters[i];
+            }
+            t.sched_latency = m->sched_latency;
+            snap.sched_latency.merge(t.sched_latency);
+            for (int i = 0; i < PRIORITY_LEVELS; ++i) {
+                snap.priority_sched_latency[i].merge(m->priority_sched_latency[i]);
+            }
+            t.run_duration = m->run_duration;
+            snap.run_duration.merge(t.run_duration);
+            snap.threads.push_back(t);
+        }
+    }
+    snap.gauges.emplace_back("qc_fibers", (int64_t)Fiber::TotalFibers());
+    // 仪表回调里可能会拿调度器的锁,不能在注册表的锁内调用;持有gauge_mutex调用,RemoveGauge会等这里结束
+    Mutex::Lock lock(reg.gauge_mutex);
+    for (auto &g : reg.gauges) snap.gauges.emplace_back(g.second.first, g.second.second());
+    return snap;
+}
+
+static void DumpHistogram(std::ostream &os, const std::string &name, const std::string &labels,
+                          const Histogram &h) {
+    static const double quantiles[] = {50, 90, 99, 99.9};
+    std::string sep = labels.empty() ? "" : ",";
+    for (double q : quantiles) {
+        os << name << "{" << labels << sep << "quantile=\"" << q / 100 << "\"} "
+           << h.percentile(q) << "\n";
+    }
+    os << name << "_max{" << labels << "} " << h.max() << "\n";
+    os << name << "_sum{" << labels << "} " << h.sum() << "\n";
+    os << name << "_count{" << labels << "} " << h.count() << "\n";
+}
+
+std::string Metrics::Dump() {
+    Snapshot snap = GetSnapshot();
+    std::ostringstream os;
+    for (int i = 0; i < COUNTER_MAX; ++i) {
+        os << "# TYPE " << CounterName((Counter)i) << " counter\n";
+        for (auto &t : snap.threads) {
+            os << CounterName((Counter)i) << "{thread=\"" << t.name << "\",tid=\"" << t.tid
+               << "\"} " << t.counters[i] << "\n";
+        }
+    }
+    os << "# TYPE qc_sched_latency_ns summary\n";
+    for (auto &t : snap.threads) {
+        if (!t.sched_latency.count()) continue;
+        DumpHistogram(os, "qc_sched_latency_ns",
+                      "thread=\"" + t.name + "\",tid=\"" + std::to_string(t.tid) + "\"",
+                      t.sched_latency);
+    }
+    DumpHistogram(os, "qc_sched_latency_ns", "thread=\"all\"", snap.sched_latency);
+    for (int i = 0; i < PRIORITY_LEVELS; ++i) {
+        if (!snap.priority_sched_latency[i].count()) continue;
+        DumpHistogram(os, "qc_sched_latency_ns",
+                      std::string("thread=\"all\",priority=\"") + s_priority_names[i] + "\"",
+                      snap.priority_sched_latency[i]);
+    }
+    os << "# TYPE qc_run_duration_ns summary\n";
+    for (auto &t : snap.threads) {
+        if (!t.run_duration.count()) continue;
+        DumpHistogram(os, "qc_run_duration_ns",
+                      "thread=\"" + t.name + "\",tid=\"" + std::to_string(t.tid) + "\"",
+                      t.run_duration);
+    }
+    DumpHistogram(os, "qc_run_duration_ns", "thread=\"all\"", snap.run_duration);
+    for (auto &g : snap.gauges) {
+        os << g.first << " " << g.second << "\n";
+    }
+    return os.str();
+}
+
+}  // namespace qc
@@ -0,0 +1,147 @@
+/**
+ * @file numa.cc
+ * @author qc
+ * @brief CPU/NUMA拓扑和节点本地内存分配实现
+ * @version 0.1
+ * @date 2024-07-17
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "numa.hpp"
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+
+#include "log.hpp"
+
+namespace qc {
+
+static thread_local int t_preferred_node = -1;
+
+namespace {
+
+/// @brief 解析"0-3,8-11"格式的cpu列表
+std::vector<int> ParseCpuList(const std::string &s) {
+    std::vector<int> cpus;
+    size_t pos = 0;
+    while (pos < s.size()) {
+        size_t end = s.find(',', pos);
+        if (end == std::string::npos) end = s.size();
+        std::string item = s.substr(pos, end - pos);
+        int lo, hi;
+        if (sscanf(item.c_str(), "%d-%d", &lo, &hi) == 2) {
+            for (int i = lo; i <= hi; ++i) cpus.push_back(i);
+        } else if (sscanf(item.c_str(), "%d", &lo) == 1) {
+            cpus.push_back(lo);
+        }
+        pos = end + 1;
+    }
+    return cpus;
+}
+
+std::string ReadLine(const std::string &path) {
+    FILE *fp = fopen(path.c_str(), "r");
+    if (!fp) return "";
+    char buf[4096];
+    std::string line;
+    if (fgets(buf, sizeof(buf), fp)) line = buf;
+    fclose(fp);
+    while (!line.empty() && (line.back() == '\n' || line.back() == ' ')) line.pop_back();
+    return line;
+}
+
+struct Topology {
+    /// @brief 下标为节点号,没有cpu的节点(比如纯内存节点)为空
+    std::vector<std::vector<int>> nodeCpus;
+    /// @brief 下标为cpu号
+    std::vector<int> cpuNode;
+
+    Topology() {
+        std::vector<int> nodes = ParseCpuList(ReadLine("/sys/devices/system/node/online"));
+        for (int node : nodes) {
+            std::string path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+            if ((int)nodeCpus.size() <= node) nodeCpus.resize(node + 1);
+            nodeCpus[node] = ParseCpuList(ReadLine(path));
+        }
+        if (nodeCpus.empty()) {
+            std::vector<int> cpus = ParseCpuList(ReadLine("/sys/devices/system/cpu/online"));
+            if (cpus.empty()) {
+                long n = sysconf(_SC_NPROCESSORS_ONLN);
+                for (long i = 0; i < n; ++i) cpus.push_back(i);
+            }
+            nodeCpus.push_back(cpus);
+        }
+        for (size_t node = 0; node < nodeCpus.size(); ++node) {
+            for (int cpu : nodeCpus[node]) {
+                if ((int)cpuNode.size() <= cpu) cpuNode.resize(cpu + 1, 0);
+                cpuNode[cpu] = node;
+            }
+        }
+    }
+};
+
+const Topology &GetTopology() {
+    static Topology s_topology;
+    return s_topology;
+}
+
+}  // namespace
+
+int Numa::NodeCount() { return GetTopology().nodeCpus.size(); }
+
+int Numa::NodeOfCpu(int cpu) {
+    const Topology &t = GetTopology();
+    if (cpu < 0 || cpu >= (int)t.cpuNode.size()) return 0;
+    return t.cpuNode[cpu];
+}
+
+const std::vector<int> &Numa::CpusOfNode(int node) {
+    static const std::vector<int> s_empty;
+    const Topology &t = GetTopology();
+    if (node < 0 || node >= (int)t.nodeCpus.size()) return s_empty;
+    return t.nodeCpus[node];
+}
+
+bool Numa::BindThisThread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rt = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rt) {
+        QC_LOG_WARN("bind thread to cpu %d failed, rt = %d", cpu, rt);
+        return false;
+    }
+    return true;
+}
+
+int Numa::CurrentCpu() { return sched_getcpu(); }
+
+int Numa::GetPreferredNode() { return t_preferred_node; }
+
+void Numa::SetPreferredNode(int node) { t_preferred_node = node; }
+
+void *Numa::Alloc(size_t size, int node) {
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) return nullptr;
+    // 只有一个节点时不需要设置策略;mbind失败(没有权限或者内核不支持)不影响使用
+    if (node >= 0 && node < 64 && NodeCount() > 1) {
+        unsigned long mask = 1UL << node;
+        syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+    }
+    return ptr;
+}
+
+void Numa::Free(void *ptr, size_t size) {
+    if (ptr) munmap(ptr, size);
+}
+
+}  // namespace qc
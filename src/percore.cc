@@ -0,0 +1,231 @@
+/**
+ * @file percore.cc
+ * @author qc
+ * @brief 每核一个IOManager的运行时实现
+ * @version 0.1
+ * @date 2024-07-23
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "percore.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "fd_manager.hpp"
+#include "log.hpp"
+#include "mutex.hpp"
+
+namespace qc {
+
+MessageQueue::MessageQueue() {
+    m_tail = new Node;
+    m_head.store(m_tail, std::memory_order_relaxed);
+}
+
+MessageQueue::~MessageQueue() {
+    TaskFunc fn;
+    while (pop(fn)) fn = nullptr;
+    delete m_tail;
+}
+
+void MessageQueue::push(TaskFunc fn) {
+    Node *node = new Node;
+    node->fn = std::move(fn);
+    Node *prev = m_head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+}
+
+/// @details 取出的节点成为新的哨兵,它的消息已经移走
+bool MessageQueue::pop(TaskFunc &fn) {
+    Node *next = m_tail->next.load(std::memory_order_acquire);
+    if (!next) return false;
+    fn = std::move(next->fn);
+    delete m_tail;
+    m_tail = next;
+    return true;
+}
+
+/// @brief 当前线程所在的运行时和核,由每个核上的第一个任务设置
+static thread_local const PerCore *t_percore = nullptr;
+static thread_local int t_core = -1;
+
+/// @brief 进程可以使用的cpu
+static std::vector<int> AllowedCpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int i = 0; i < CPU_SETSIZE; ++i) {
+            if (CPU_ISSET(i, &set)) cpus.push_back(i);
+        }
+    }
+    if (cpus.empty()) cpus.push_back(0);
+    return cpus;
+}
+
+PerCore::PerCore(size_t cores, const std::string &name, const SchedulerOptions &options) {
+    std::vector<int> cpus = AllowedCpus();
+    if (!cores) cores = cpus.size();
+    for (size_t i = 0; i < cores; ++i) {
+        SchedulerOptions opts = options;
+        opts.cpus = {cpus[i % cpus.size()]};
+        // 每个核只能有一个线程,连接和分片的数据都只在这个线程上访问
+        opts.max_threads = 0;
+        opts.block_compensation = 0;
+        Core *core = new Core;
+        core->iom = new IOManager(1, false, name + " " + std::to_string(i), opts);
+        // 单线程的全局队列先进先出,之后的任务都能看到
+        core->iom->add_task([this, i]() {
+            t_percore = this;
+            t_core = i;
+        });
+        m_cores.push_back(core);
+    }
+}
+
+PerCore::~PerCore() {
+    stop();
+    for (Core *core : m_cores) {
+        delete core->iom;
+        delete core;
+    }
+}
+
+int PerCore::currentCore() const { return t_percore == this ? t_core : -1; }
+
+void PerCore::submit(size_t idx, TaskFunc fn) {
+    Core *core = m_cores[idx];
+    core->inbox.push(std::move(fn));
+    // 入队完成之后再检查标记,见drain
+    if (!core->scheduled.exchange(true)) core->iom->add_task([this, core]() { drain(core); });
+}
+
+/**
+ * @details 先清标记再取: 发送方入队完成之后才检查标记,看到标记还在的消息一定在清标记之前入队完成,这里取得到;
+ *          看到标记已清的由发送方再add_task一次
+ */
+void PerCore::drain(Core *core) {
+    core->scheduled.store(false);
+    TaskFunc fn;
+    while (core->inbox.pop(fn)) {
+        fn();
+        fn = nullptr;
+    }
+}
+
+/**
+ * @details 在YieldThen的回调里发消息,目标核执行fn时调用方一定已经挂起.
+ *          调用方在某个核上时,唤醒也通过它的消息队列发回去,在它自己的线程上add_task进本地队列
+ */
+void PerCore::invoke(size_t idx, TaskFunc fn) {
+    int self = currentCore();
+    if (self == (int)idx) {
+        fn();
+        return;
+    }
+    Scheduler *sched = Scheduler::GetThis();
+    Fiber *cur = Fiber::GetCurrent();
+    if (!sched || !cur || !cur->isRunInScheduler()) {
+        Semaphore done;
+        submit(idx, [&fn, &done]() {
+            fn();
+            done.V();
+        });
+        done.P();
+        return;
+    }
+    Fiber::ptr fiber(cur);
+    Scheduler::YieldThen([this, idx, self, sched, fiber, &fn]() mutable {
+        submit(idx, [this, self, sched, fiber, &fn]() mutable {
+            fn();
+            if (self >= 0) {
+                submit(self, [sched, fiber]() mutable { sched->add_task(std::move(fiber)); });
+            } else {
+                sched->add_task(std::move(fiber));
+            }
+        });
+    });
+}
+
+void PerCore::broadcast(const std::function<void()> &fn) {
+    for (size_t i = 0; i < m_cores.size(); ++i) {
+        std::function<void()> copy = fn;
+        submit(i, std::move(copy));
+    }
+}
+
+/// @brief 核上的accept循环,监听socket在stop时被关闭后退出
+static void AcceptLoop(int fd, PerCore::ConnHandler handler) {
+    IOManager *iom = IOManager::GetThis();
+    while (true) {
+        int conn = accept(fd, nullptr, nullptr);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            // 监听socket被关闭后返回EBADF
+            if (errno != EBADF) QC_LOG_ERROR("accept(%d) errno = %s", fd, strerror(errno));
+            break;
+        }
+        iom->add_task(std::bind(handler, conn));
+    }
+}
+
+int PerCore::listen(const std::string &ip, uint16_t port, ConnHandler handler, int backlog) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if (!inet_aton(ip.c_str(), &addr.sin_addr)) return -1;
+
+    std::vector<int> fds;
+    for (size_t i = 0; i < m_cores.size(); ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int on = 1;
+        addr.sin_port = htons(port);
+        socklen_t len = sizeof(addr);
+        if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) ||
+            bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || ::listen(fd, backlog) ||
+            getsockname(fd, (struct sockaddr *)&addr, &len)) {
+            QC_LOG_ERROR("listen %s:%u errno = %s", ip.c_str(), (unsigned)port, strerror(errno));
+            if (fd >= 0) close(fd);
+            for (int f : fds) close(f);
+            return -1;
+        }
+        port = ntohs(addr.sin_port);
+        fds.push_back(fd);
+    }
+
+    for (size_t i = 0; i < m_cores.size(); ++i) {
+        int fd = fds[i];
+        // 在调用线程上创建的socket没有经过hook登记,登记之后核上的accept才会挂起协程而不是阻塞线程
+        FdMgr::GetInstance()->get(fd, true);
+        m_cores[i]->listenFds.push_back(fd);
+        m_cores[i]->iom->add_task(std::bind(AcceptLoop, fd, handler));
+    }
+    return port;
+}
+
+void PerCore::stop() {
+    if (m_stopped) return;
+    m_stopped = true;
+    // 在核上关闭,hook的close取消挂在上面的accept
+    for (Core *core : m_cores) {
+        std::vector<int> fds;
+        fds.swap(core->listenFds);
+        if (fds.empty()) continue;
+        core->iom->add_task([fds]() {
+            for (int fd : fds) close(fd);
+        });
+    }
+    for (Core *core : m_cores) core->iom->stop();
+}
+
+}  // namespace qc
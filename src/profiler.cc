@@ -0,0 +1,388 @@
+/**
+ * @file profiler.cc
+ * @author qc
+ * @brief 采样profiler实现
+ * @version 0.1
+ * @date 2024-07-12
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "profiler.hpp"
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <typeinfo>
+
+#include "fiber.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "mutex.hpp"
+
+namespace qc {
+
+namespace {
+
+struct Sample {
+    std::atomic<bool> ready{false};
+    uint64_t fiber_id;
+    /// @brief 协程入口回调的类型,不在任务协程中时为nullptr
+    const std::type_info *entry_type;
+    /// @brief 入口回调是函数指针时的函数地址
+    const void *entry_fn;
+    int depth;
+    void *pcs[Profiler::MAX_DEPTH];
+};
+
+/// @brief backtrace结果中信号处理函数自身和信号返回跳板这两帧
+const int SIGNAL_FRAMES = 2;
+
+/// @brief 一次采样的样本数组,容量和数组一起发布,信号处理函数只读一次指针
+struct SampleBuffer {
+    explicit SampleBuffer(size_t n) : capacity(n), samples(new Sample[n]) {}
+    ~SampleBuffer() { delete[] samples; }
+
+    const size_t capacity;
+    /// @brief 已经占用的槽位数,可能超过capacity
+    std::atomic<size_t> next{0};
+    Sample *const samples;
+};
+
+/**
+ * @brief 当前的样本数组
+ * @details 只在没有采样,也没有信号处理函数正在写样本时(见s_inflight)替换,替换后旧的数组可以直接释放
+ */
+std::atomic<SampleBuffer *> s_buffer{nullptr};
+/// @brief 正在采样路径上的信号处理函数个数,Stop等它归零,之后再没有人写旧的样本数组
+std::atomic<int> s_inflight{0};
+std::atomic<uint64_t> s_dropped{0};
+std::atomic<bool> s_running{false};
+bool s_installed = false;
+/// @brief 正在使用信号处理函数的数量: 采样中算一个,每个进行中的CaptureStack算一个
+int s_users = 0;
+/// @brief 第一次安装之前的处理方式,不是我们的信号转给它,最后一个使用者离开时恢复
+struct sigaction s_prev;
+bool s_prev_saved = false;
+/// @brief 保护s_installed,s_users和s_prev,Start和CaptureStack可能在不同线程上调用
+Mutex s_install_mutex;
+
+/// @brief CaptureStack的请求和结果,同一时间只有一个请求
+Mutex s_capture_mutex;
+/// @brief 要回溯的线程,0表示没有请求
+std::atomic<pid_t> s_capture_tid{0};
+std::atomic<uint64_t> s_capture_seq{0};
+/// @brief 已经完成的请求序号
+std::atomic<uint64_t> s_capture_done{0};
+int s_capture_depth = 0;
+void *s_capture_pcs[Profiler::MAX_DEPTH];
+
+}  // namespace
+
+/// @brief 把不是我们的SIGPROF交给安装之前的处理函数,之前是默认处理或者忽略时丢掉
+static void ChainSigProf(int sig, siginfo_t *info, void *uctx) {
+    if (s_prev.sa_flags & SA_SIGINFO) {
+        if (s_prev.sa_sigaction) s_prev.sa_sigaction(sig, info, uctx);
+    } else if (s_prev.sa_handler != SIG_DFL && s_prev.sa_handler != SIG_IGN) {
+        s_prev.sa_handler(sig);
+    }
+}
+
+/**
+ * @details 只做异步信号安全的事情: 原子地占一个预先分配的槽位,读当前线程的t_fiber,回溯栈.
+ *          backtrace在Start中已经调用过一次,libgcc已经加载,这里不会再分配内存.
+ */
+static void OnSigProf(int sig, siginfo_t *info, void *uctx) {
+    int saved_errno = errno;
+    // CaptureStack发来的信号: 只回溯,不算作采样
+    pid_t target = s_capture_tid.load(std::memory_order_acquire);
+    if (qc_unlikely(target) && target == (pid_t)syscall(SYS_gettid)) {
+        uint64_t seq = s_capture_seq.load(std::memory_order_relaxed);
+        s_capture_depth = backtrace(s_capture_pcs, Profiler::MAX_DEPTH);
+        s_capture_done.store(seq, std::memory_order_release);
+        errno = saved_errno;
+        return;
+    }
+    // 先登记再检查s_running(都是seq_cst): 要么Stop等到这里结束,要么这里看到已经停止
+    s_inflight.fetch_add(1);
+    if (!s_running.load()) {
+        s_inflight.fetch_sub(1, std::memory_order_release);
+        errno = saved_errno;
+        ChainSigProf(sig, info, uctx);
+        return;
+    }
+    SampleBuffer *buf = s_buffer.load(std::memory_order_acquire);
+    size_t idx = buf->next.fetch_add(1, std::memory_order_relaxed);
+    if (idx >= buf->capacity) {
+        s_dropped.fetch_add(1, std::memory_order_relaxed);
+        s_inflight.fetch_sub(1, std::memory_order_release);
+        errno = saved_errno;
+        return;
+    }
+    Sample &s = buf->samples[idx];
+    Fiber *fiber = Fiber::GetCurrent();
+    s.fiber_id = fiber ? fiber->git_id() : 0;
+    s.entry_type = nullptr;
+    s.entry_fn = nullptr;
+    if (fiber && fiber->getCbType() != typeid(void)) {
+        s.entry_type = &fiber->getCbType();
+        s.entry_fn = fiber->getCbFunction();
+    }
+    s.depth = backtrace(s.pcs, Profiler::MAX_DEPTH);
+    s.ready.store(true, std::memory_order_release);
+    s_inflight.fetch_sub(1, std::memory_order_release);
+    errno = saved_errno;
+}
+
+/// @brief s_running已经为false,等正在写样本的信号处理函数结束
+static void WaitSamplersQuiescent() {
+    while (s_inflight.load(std::memory_order_acquire)) sched_yield();
+}
+
+/// @brief 安装SIGPROF处理函数(已经安装时只增加使用者),并预先调用一次backtrace
+static bool AcquireHandler() {
+    Mutex::Lock lock(s_install_mutex);
+    if (!s_installed) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = OnSigProf;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        // 只在第一次安装时保存,之后OnSigProf读s_prev不会和这里的写冲突
+        if (sigaction(SIGPROF, &sa, s_prev_saved ? nullptr : &s_prev)) {
+            QC_LOG_ERROR("sigaction(SIGPROF) errno = %s", strerror(errno));
+            return false;
+        }
+        s_prev_saved = true;
+        s_installed = true;
+    }
+    ++s_users;
+    // 第一次backtrace会加载libgcc,不能发生在信号处理函数里
+    void *warmup[1];
+    backtrace(warmup, 1);
+    return true;
+}
+
+/**
+ * @details 最后一个使用者离开时恢复之前的处理函数.
+ *          之前是默认处理时保留我们的: 还在路上的SIGPROF默认会终止进程,而空闲的OnSigProf什么也不做
+ */
+static void ReleaseHandler() {
+    Mutex::Lock lock(s_install_mutex);
+    if (--s_users > 0) return;
+    if (!(s_prev.sa_flags & SA_SIGINFO) && s_prev.sa_handler == SIG_DFL) return;
+    if (sigaction(SIGPROF, &s_prev, nullptr)) {
+        QC_LOG_ERROR("sigaction(SIGPROF) errno = %s", strerror(errno));
+        return;
+    }
+    s_installed = false;
+}
+
+/// @brief CaptureStack期间占用信号处理函数
+struct HandlerUser {
+    HandlerUser() : ok(AcquireHandler()) {}
+    ~HandlerUser() {
+        if (ok) ReleaseHandler();
+    }
+    bool ok;
+};
+
+bool Profiler::Start(int hz, size_t max_samples) {
+    if (s_running.load(std::memory_order_relaxed) || hz <= 0) return false;
+    if (!AcquireHandler()) return false;
+
+    if (max_samples == 0) max_samples = 1;
+    // 没有在采样,上一次Stop已经等信号处理函数离开了样本数组
+    delete s_buffer.exchange(new SampleBuffer(max_samples), std::memory_order_acq_rel);
+    s_dropped.store(0, std::memory_order_relaxed);
+    s_running.store(true);
+
+    struct itimerval tv;
+    tv.it_interval.tv_sec = 0;
+    tv.it_interval.tv_usec = hz >= 1000000 ? 1 : 1000000 / hz;
+    tv.it_value = tv.it_interval;
+    if (setitimer(ITIMER_PROF, &tv, nullptr)) {
+        QC_LOG_ERROR("setitimer(ITIMER_PROF) errno = %s", strerror(errno));
+        s_running.store(false);
+        WaitSamplersQuiescent();
+        ReleaseHandler();
+        return false;
+    }
+    return true;
+}
+
+void Profiler::Stop() {
+    struct itimerval tv;
+    memset(&tv, 0, sizeof(tv));
+    setitimer(ITIMER_PROF, &tv, nullptr);
+    if (!s_running.exchange(false)) return;
+    WaitSamplersQuiescent();
+    ReleaseHandler();
+}
+
+bool Profiler::IsRunning() { return s_running.load(std::memory_order_relaxed); }
+
+uint64_t Profiler::GetSamples() {
+    SampleBuffer *buf = s_buffer.load(std::memory_order_acquire);
+    return buf ? std::min(buf->next.load(std::memory_order_relaxed), buf->capacity) : 0;
+}
+
+uint64_t Profiler::GetDropped() { return s_dropped.load(std::memory_order_relaxed); }
+
+static std::string Demangle(const char *name) {
+    int status = 0;
+    char *demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    std::string ret = demangled ? demangled : name;
+    free(demangled);
+    // ';'是folded格式的分隔符
+    for (auto &c : ret) {
+        if (c == ';') c = ':';
+    }
+    return ret;
+}
+
+/// @brief 符号化,结果带缓存;同时返回函数起始地址用于识别Fiber::MainFunc
+class Symbolizer {
+public:
+    const std::string &name(const void *pc, const void **func = nullptr) {
+        auto it = m_cache.find(pc);
+        if (it == m_cache.end()) {
+            Dl_info info;
+            Entry e;
+            int found = dladdr(pc, &info);
+            if (found && info.dli_sname) {
+                e.name = Demangle(info.dli_sname);
+                e.func = info.dli_saddr;
+            } else if (found && info.dli_fname) {
+                // 没有符号时只保留模块名,同一个模块内的样本合并到一起
+                const char *base = strrchr(info.dli_fname, '/');
+                e.name = std::string("[") + (base ? base + 1 : info.dli_fname) + "]";
+            } else {
+                e.name = "[unknown]";
+            }
+            it = m_cache.emplace(pc, e).first;
+        }
+        if (func) *func = it->second.func;
+        return it->second.name;
+    }
+
+private:
+    struct Entry {
+        std::string name;
+        const void *func = nullptr;
+    };
+    std::map<const void *, Entry> m_cache;
+};
+
+std::string Profiler::DumpFolded(bool per_fiber) {
+    Symbolizer sym;
+    std::map<std::string, uint64_t> folded;
+    const void *main_func = (const void *)&Fiber::MainFunc;
+    SampleBuffer *buf = s_buffer.load(std::memory_order_acquire);
+    size_t n = buf ? std::min(buf->next.load(std::memory_order_relaxed), buf->capacity) : 0;
+
+    for (size_t i = 0; i < n; ++i) {
+        const Sample &s = buf->samples[i];
+        if (!s.ready.load(std::memory_order_acquire)) continue;
+
+        std::string root;
+        if (!s.entry_type) root = "[thread]";
+        else if (s.entry_fn) root = sym.name(s.entry_fn);
+        else root = Demangle(s.entry_type->name());
+
+        // 从外层往内层,协程栈上Fiber::MainFunc以及更外层的帧都一样,丢掉
+        int outer = s.depth - 1;
+        if (s.entry_type) {
+            for (int j = SIGNAL_FRAMES; j < s.depth; ++j) {
+                const void *func = nullptr;
+                sym.name((const char *)s.pcs[j] - 1, &func);
+                if (func == main_func) {
+                    outer = j - 1;
+                    break;
+                }
+            }
+        }
+        // 入口是函数指针时最外层的帧就是入口本身
+        if (s.entry_fn && outer > SIGNAL_FRAMES &&
+            sym.name((const char *)s.pcs[outer] - 1) == root) {
+            --outer;
+        }
+        if (per_fiber) root = "fiber " + std::to_string(s.fiber_id) + " " + root;
+        std::string key = root;
+        for (int j = outer; j >= SIGNAL_FRAMES; --j) {
+            // 除了被中断的那一帧,其余都是返回地址,减1落在call指令上
+            const char *pc = (const char *)s.pcs[j];
+            key.push_back(';');
+            key.append(sym.name(j == SIGNAL_FRAMES ? pc : pc - 1));
+        }
+        ++folded[key];
+    }
+
+    std::ostringstream os;
+    for (auto &i : folded) os << i.first << " " << i.second << "\n";
+    return os.str();
+}
+
+/**
+ * @details 超时后清掉目标线程再返回,之后才到的信号不会改写结果;
+ *          请求序号区分同一个线程上前后两次请求的结果
+ */
+std::string Profiler::CaptureStack(pid_t tid, int timeout_ms) {
+    Mutex::Lock lock(s_capture_mutex);
+    HandlerUser user;
+    if (!user.ok) return "";
+    uint64_t seq = s_capture_seq.load(std::memory_order_relaxed) + 1;
+    s_capture_seq.store(seq, std::memory_order_relaxed);
+    s_capture_tid.store(tid, std::memory_order_release);
+    if (syscall(SYS_tgkill, getpid(), tid, SIGPROF)) {
+        s_capture_tid.store(0, std::memory_order_relaxed);
+        return "";
+    }
+    uint64_t deadline = GetMonotonicNS() + (uint64_t)timeout_ms * 1000 * 1000;
+    while (s_capture_done.load(std::memory_order_acquire) != seq) {
+        if (GetMonotonicNS() >= deadline) {
+            s_capture_tid.store(0, std::memory_order_relaxed);
+            return "";
+        }
+        usleep(100);
+    }
+    s_capture_tid.store(0, std::memory_order_relaxed);
+
+    Symbolizer sym;
+    const void *main_func = (const void *)&Fiber::MainFunc;
+    std::ostringstream os;
+    for (int j = SIGNAL_FRAMES; j < s_capture_depth; ++j) {
+        const char *pc = (const char *)s_capture_pcs[j];
+        const void *func = nullptr;
+        os << "#" << (j - SIGNAL_FRAMES) << " " << sym.name(j == SIGNAL_FRAMES ? pc : pc - 1, &func)
+           << "\n";
+        // 协程栈到入口为止,再往外是MakeContext准备的空帧
+        if (func == main_func) break;
+    }
+    return os.str();
+}
+
+bool Profiler::WriteFolded(const std::string &path, bool per_fiber) {
+    FILE *fp = fopen(path.c_str(), "w");
+    if (!fp) return false;
+    std::string data = DumpFolded(per_fiber);
+    bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+    fclose(fp);
+    return ok;
+}
+
+}  // namespace qc
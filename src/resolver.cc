@@ -0,0 +1,464 @@
+/**
+ * @file resolver.cc
+ * @author qc
+ * @brief 协程友好的DNS解析器实现
+ * @version 0.1
+ * @date 2024-07-08
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "resolver.hpp"
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+#include "hook.hpp"
+#include "timer.hpp"
+
+namespace qc {
+
+static const uint16_t DNS_TYPE_A = 1;
+static const uint16_t DNS_TYPE_AAAA = 28;
+static const uint16_t DNS_CLASS_IN = 1;
+/// @brief 否定缓存(NXDOMAIN)的存活时间,秒
+static const uint32_t NEGATIVE_TTL = 10;
+/// @brief 不带EDNS时UDP应答最大512字节,这里留足余量
+static const size_t MAX_PACKET = 1500;
+
+static std::string ToLower(const std::string &s) {
+    std::string rt(s);
+    std::transform(rt.begin(), rt.end(), rt.begin(), ::tolower);
+    return rt;
+}
+
+/// @brief 每个线程独立的随机查询id,避免可预测的id被伪造应答
+static uint16_t NextQueryId() {
+    static thread_local std::mt19937 s_rng(std::random_device{}());
+    return (uint16_t)s_rng();
+}
+
+static void PutU16(std::string &out, uint16_t v) {
+    out.push_back((char)(v >> 8));
+    out.push_back((char)(v & 0xff));
+}
+
+static uint16_t GetU16(const uint8_t *p) { return (uint16_t)((p[0] << 8) | p[1]); }
+
+static uint32_t GetU32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/// @brief 构造查询报文: 头部 + 一个问题,设置RD位
+static bool BuildQuery(const std::string &name, uint16_t id, uint16_t qtype, std::string &out) {
+    out.clear();
+    PutU16(out, id);
+    PutU16(out, 0x0100);  // RD
+    PutU16(out, 1);       // QDCOUNT
+    PutU16(out, 0);
+    PutU16(out, 0);
+    PutU16(out, 0);
+
+    size_t begin = 0;
+    while (begin < name.size()) {
+        size_t end = name.find('.', begin);
+        if (end == std::string::npos) end = name.size();
+        size_t len = end - begin;
+        if (len == 0 || len > 63) return false;
+        out.push_back((char)len);
+        out.append(name, begin, len);
+        begin = end + 1;
+    }
+    out.push_back(0);
+    PutU16(out, qtype);
+    PutU16(out, DNS_CLASS_IN);
+    return out.size() <= 512;
+}
+
+/// @brief 跳过报文中的一个域名(可能是压缩指针)
+static bool SkipName(const uint8_t *buf, size_t len, size_t &off) {
+    while (off < len) {
+        uint8_t c = buf[off];
+        if ((c & 0xC0) == 0xC0) {
+            if (off + 2 > len) return false;
+            off += 2;
+            return true;
+        }
+        if (c == 0) {
+            ++off;
+            return true;
+        }
+        off += c + 1;
+    }
+    return false;
+}
+
+/**
+ * @brief 解析应答报文
+ * @return 0成功; EAI_NONAME 不存在; EAI_AGAIN 服务器临时失败; -1 不是我们的应答,继续等待
+ */
+static int ParseResponse(const uint8_t *buf, size_t len, uint16_t id, uint16_t qtype,
+                         std::vector<ResolvedAddr> &addrs, uint32_t &ttl) {
+    if (len < 12 || GetU16(buf) != id || !(buf[2] & 0x80)) return -1;
+    int rcode = buf[3] & 0x0f;
+    if (rcode == 3) return EAI_NONAME;
+    if (rcode != 0) return EAI_AGAIN;
+    bool truncated = buf[2] & 0x02;
+
+    uint16_t qdcount = GetU16(buf + 4);
+    uint16_t ancount = GetU16(buf + 6);
+    size_t off = 12;
+    for (uint16_t i = 0; i < qdcount; ++i) {
+        if (!SkipName(buf, len, off) || off + 4 > len) return -1;
+        off += 4;
+    }
+
+    ttl = ~0u;
+    for (uint16_t i = 0; i < ancount; ++i) {
+        if (!SkipName(buf, len, off) || off + 10 > len) return EAI_AGAIN;
+        uint16_t type = GetU16(buf + off);
+        uint16_t cls = GetU16(buf + off + 2);
+        uint32_t rr_ttl = GetU32(buf + off + 4);
+        uint16_t rdlen = GetU16(buf + off + 8);
+        off += 10;
+        if (off + rdlen > len) return EAI_AGAIN;
+        // CNAME之类的记录跳过,递归服务器会把最终的A/AAAA一起带回来
+        if (cls == DNS_CLASS_IN && type == qtype) {
+            ResolvedAddr addr;
+            if (type == DNS_TYPE_A && rdlen == 4) {
+                addr.family = AF_INET;
+                memcpy(&addr.addr.v4, buf + off, 4);
+                addrs.push_back(addr);
+                ttl = std::min(ttl, rr_ttl);
+            } else if (type == DNS_TYPE_AAAA && rdlen == 16) {
+                addr.family = AF_INET6;
+                memcpy(&addr.addr.v6, buf + off, 16);
+                addrs.push_back(addr);
+                ttl = std::min(ttl, rr_ttl);
+            }
+        }
+        off += rdlen;
+    }
+    if (addrs.empty()) {
+        // 被截断又没有可用的记录,没有实现TCP重试,当作临时失败
+        if (truncated) return EAI_AGAIN;
+        ttl = NEGATIVE_TTL;
+        return EAI_NONAME;
+    }
+    return 0;
+}
+
+Resolver::Resolver() {
+    loadResolvConf();
+    loadHosts();
+}
+
+bool Resolver::loadResolvConf(const std::string &path) {
+    std::vector<sockaddr_in> servers;
+    std::vector<std::string> search;
+    uint64_t timeout = 5000;
+    int attempts = 2;
+    int ndots = 1;
+
+    std::ifstream ifs(path);
+    bool ok = ifs.is_open();
+    std::string line;
+    while (ok && std::getline(ifs, line)) {
+        size_t pos = line.find_first_of("#;");
+        if (pos != std::string::npos) line.resize(pos);
+        std::istringstream iss(line);
+        std::string key;
+        if (!(iss >> key)) continue;
+        if (key == "nameserver") {
+            std::string ip;
+            iss >> ip;
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(53);
+            // 目前只支持IPv4的nameserver
+            if (inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) == 1) servers.push_back(addr);
+        } else if (key == "search" || key == "domain") {
+            search.clear();
+            std::string domain;
+            while (iss >> domain) search.push_back(ToLower(domain));
+        } else if (key == "options") {
+            std::string opt;
+            while (iss >> opt) {
+                if (opt.compare(0, 8, "timeout:") == 0) {
+                    timeout = std::max(1, atoi(opt.c_str() + 8)) * 1000;
+                } else if (opt.compare(0, 9, "attempts:") == 0) {
+                    attempts = std::max(1, atoi(opt.c_str() + 9));
+                } else if (opt.compare(0, 6, "ndots:") == 0) {
+                    ndots = std::max(0, atoi(opt.c_str() + 6));
+                }
+            }
+        }
+    }
+
+    // 和glibc一样,没有配置nameserver时使用本机
+    if (servers.empty()) {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(53);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        servers.push_back(addr);
+    }
+
+    RWMutexType::WriteLock lock(m_mutex);
+    m_servers.swap(servers);
+    m_search.swap(search);
+    m_timeout = timeout;
+    m_attempts = attempts;
+    m_ndots = ndots;
+    return ok;
+}
+
+bool Resolver::loadHosts(const std::string &path) {
+    std::unordered_map<std::string, std::vector<ResolvedAddr>> hosts;
+    std::ifstream ifs(path);
+    bool ok = ifs.is_open();
+    std::string line;
+    while (ok && std::getline(ifs, line)) {
+        size_t pos = line.find('#');
+        if (pos != std::string::npos) line.resize(pos);
+        std::istringstream iss(line);
+        std::string ip;
+        if (!(iss >> ip)) continue;
+
+        ResolvedAddr addr;
+        if (inet_pton(AF_INET, ip.c_str(), &addr.addr.v4) == 1) {
+            addr.family = AF_INET;
+        } else if (inet_pton(AF_INET6, ip.c_str(), &addr.addr.v6) == 1) {
+            addr.family = AF_INET6;
+        } else {
+            continue;
+        }
+        std::string name;
+        while (iss >> name) hosts[ToLower(name)].push_back(addr);
+    }
+
+    RWMutexType::WriteLock lock(m_mutex);
+    m_hosts.swap(hosts);
+    return ok;
+}
+
+void Resolver::setNameservers(const std::vector<sockaddr_in> &servers) {
+    RWMutexType::WriteLock lock(m_mutex);
+    m_servers = servers;
+}
+
+void Resolver::setTimeout(uint64_t ms) {
+    RWMutexType::WriteLock lock(m_mutex);
+    m_timeout = ms;
+}
+
+void Resolver::setAttempts(int attempts) {
+    RWMutexType::WriteLock lock(m_mutex);
+    m_attempts = std::max(1, attempts);
+}
+
+void Resolver::setCacheCapacity(size_t capacity) {
+    RWMutexType::WriteLock lock(m_mutex);
+    m_cacheCapacity = std::max<size_t>(1, capacity);
+    while (m_cache.size() > m_cacheCapacity) {
+        m_cache.erase(m_expiry.begin()->second);
+        m_expiry.erase(m_expiry.begin());
+    }
+}
+
+void Resolver::clearCache() {
+    RWMutexType::WriteLock lock(m_mutex);
+    m_cache.clear();
+    m_expiry.clear();
+}
+
+/**
+ * @details 查询路径只持有读锁,不能在那里删除过期条目,所以清理放在插入时:
+ *          按过期时间从前往后删掉已经过期的;还是满的话淘汰最早过期的一条,条数不会超过上限
+ */
+void Resolver::insertCacheLocked(const std::string &key, int result, uint64_t expire,
+                                 const std::vector<ResolvedAddr> &addrs) {
+    auto it = m_cache.find(key);
+    if (it != m_cache.end()) {
+        m_expiry.erase(it->second.expiry);
+        m_cache.erase(it);
+    }
+    uint64_t now = GetElapsedMS();
+    while (!m_expiry.empty() &&
+           (m_expiry.begin()->first <= now || m_cache.size() >= m_cacheCapacity)) {
+        m_cache.erase(m_expiry.begin()->second);
+        m_expiry.erase(m_expiry.begin());
+    }
+    CacheEntry &entry = m_cache[key];
+    entry.result = result;
+    entry.expire = expire;
+    entry.addrs = addrs;
+    entry.expiry = m_expiry.emplace(expire, key);
+}
+
+int Resolver::query(const std::string &name, uint16_t qtype, std::vector<ResolvedAddr> &addrs,
+                    uint32_t &ttl) {
+    std::vector<sockaddr_in> servers;
+    uint64_t timeout;
+    int attempts;
+    {
+        RWMutexType::ReadLock lock(m_mutex);
+        servers = m_servers;
+        timeout = m_timeout;
+        attempts = m_attempts;
+    }
+
+    std::string packet;
+    uint8_t buf[MAX_PACKET];
+    int ret = EAI_AGAIN;
+    for (int i = 0; i < attempts; ++i) {
+        for (auto &server : servers) {
+            uint16_t id = NextQueryId();
+            if (!BuildQuery(name, id, qtype, packet)) return EAI_NONAME;
+
+            // socket/sendto/recvfrom都是hook之后的,等待应答时只挂起当前协程
+            int fd = socket(AF_INET, SOCK_DGRAM, 0);
+            if (fd < 0) return EAI_SYSTEM;
+            if (sendto(fd, packet.data(), packet.size(), 0, (const sockaddr *)&server,
+                       sizeof(server)) != (ssize_t)packet.size()) {
+                close(fd);
+                continue;
+            }
+
+            uint64_t deadline = GetElapsedMS() + timeout;
+            int rt = -1;
+            while (true) {
+                uint64_t now = GetElapsedMS();
+                if (now >= deadline) break;
+                uint64_t left = deadline - now;
+                timeval tv{(time_t)(left / 1000), (suseconds_t)(left % 1000 * 1000)};
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+                sockaddr_in from;
+                socklen_t from_len = sizeof(from);
+                ssize_t n = recvfrom(fd, buf, sizeof(buf), 0, (sockaddr *)&from, &from_len);
+                if (n < 0) break;
+                // 不是来自查询的服务器,丢弃
+                if (from.sin_addr.s_addr != server.sin_addr.s_addr ||
+                    from.sin_port != server.sin_port)
+                    continue;
+                addrs.clear();
+                rt = ParseResponse(buf, n, id, qtype, addrs, ttl);
+                if (rt != -1) break;
+            }
+            close(fd);
+
+            // 成功或者权威的"不存在"都直接返回,其余情况换下一个服务器
+            if (rt == 0 || rt == EAI_NONAME) return rt;
+            if (rt != -1) ret = rt;
+        }
+    }
+    return ret;
+}
+
+int Resolver::lookup(const std::string &host, uint16_t qtype, std::vector<ResolvedAddr> &addrs,
+                     uint32_t &ttl) {
+    std::vector<std::string> names;
+    if (host.back() == '.') {
+        names.push_back(host.substr(0, host.size() - 1));
+    } else {
+        std::vector<std::string> search;
+        int ndots;
+        {
+            RWMutexType::ReadLock lock(m_mutex);
+            search = m_search;
+            ndots = m_ndots;
+        }
+        bool absolute_first = std::count(host.begin(), host.end(), '.') >= ndots;
+        if (absolute_first) names.push_back(host);
+        for (auto &domain : search) names.push_back(host + "." + domain);
+        if (!absolute_first) names.push_back(host);
+    }
+
+    int ret = EAI_NONAME;
+    for (auto &name : names) {
+        int rt = query(name, qtype, addrs, ttl);
+        if (rt == 0) return 0;
+        if (rt != EAI_NONAME) ret = rt;
+    }
+    return ret;
+}
+
+int Resolver::resolve(const std::string &host, int family, std::vector<ResolvedAddr> &addrs) {
+    addrs.clear();
+    if (host.empty()) return EAI_NONAME;
+    if (family != AF_UNSPEC && family != AF_INET && family != AF_INET6) return EAI_FAMILY;
+
+    // 数字形式的地址不需要解析
+    ResolvedAddr numeric;
+    if (family != AF_INET6 && inet_pton(AF_INET, host.c_str(), &numeric.addr.v4) == 1) {
+        numeric.family = AF_INET;
+        addrs.push_back(numeric);
+        return 0;
+    }
+    if (family != AF_INET && inet_pton(AF_INET6, host.c_str(), &numeric.addr.v6) == 1) {
+        numeric.family = AF_INET6;
+        addrs.push_back(numeric);
+        return 0;
+    }
+
+    std::string name = ToLower(host);
+    std::string key = std::to_string(family) + ":" + name;
+    {
+        RWMutexType::ReadLock lock(m_mutex);
+        std::string bare = name.back() == '.' ? name.substr(0, name.size() - 1) : name;
+        auto hit = m_hosts.find(bare);
+        if (hit != m_hosts.end()) {
+            for (auto &addr : hit->second) {
+                if (family == AF_UNSPEC || addr.family == family) addrs.push_back(addr);
+            }
+            if (!addrs.empty()) return 0;
+        }
+
+        auto it = m_cache.find(key);
+        if (it != m_cache.end() && it->second.expire > GetElapsedMS()) {
+            addrs = it->second.addrs;
+            return it->second.result;
+        }
+    }
+
+    int rt = EAI_NONAME;
+    uint32_t ttl = ~0u;
+    // A和AAAA有一个查到就算成功,都失败时临时失败优先于"不存在"
+    auto merge = [&](uint16_t qtype) {
+        std::vector<ResolvedAddr> found;
+        uint32_t found_ttl = 0;
+        int r = lookup(name, qtype, found, found_ttl);
+        if (r == 0) {
+            addrs.insert(addrs.end(), found.begin(), found.end());
+            ttl = std::min(ttl, found_ttl);
+            rt = 0;
+        } else if (rt != 0 && r != EAI_NONAME) {
+            rt = r;
+        }
+    };
+    if (family != AF_INET6) merge(DNS_TYPE_A);
+    if (family != AF_INET) merge(DNS_TYPE_AAAA);
+    if (rt == EAI_NONAME) ttl = NEGATIVE_TTL;
+
+    // 临时失败不缓存
+    if (rt == 0 || rt == EAI_NONAME) {
+        uint64_t expire = GetElapsedMS() + (uint64_t)ttl * 1000;
+        RWMutexType::WriteLock lock(m_mutex);
+        insertCacheLocked(key, rt, expire, addrs);
+    }
+    return rt;
+}
+
+}  // namespace qc
@@ -9,24 +9,71 @@
  *
  */
 #include "hook.hpp"
+#include "iomanager.hpp"
+#include "log.hpp"
+#include "numa.hpp"
+#include "profiler.hpp"
 #include "scheduler.hpp"
 
+#include <cxxabi.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <fstream>
+
 namespace qc {
 /// @brief 当前线程的调度器,同一个调度下的所有线程指同一个调度器实例
 static thread_local Scheduler *t_scheduler = nullptr;
 /// @brief 每个线程独有的 线程调度协程,Main函数也有.
 static thread_local Fiber *t_scheduler_fiber = nullptr;
+/// @brief 任务协程通过YieldThen让出后,由调度协程执行的回调
+static thread_local TaskFunc t_after_yield;
+/// @brief 当前工作线程的本地队列,只在run()期间有效
+static thread_local void *t_worker = nullptr;
+/// @brief 缓存的线程id,onOwnerThread在其他线程上调用时不用每次系统调用
+static thread_local pid_t t_tid = 0;
+
+static pid_t CurrentTid() {
+    if (!t_tid) t_tid = syscall(SYS_gettid);
+    return t_tid;
+}
+/// @brief 连续执行多少个任务之后调用一次pollEvents
+static const uint32_t POLL_BATCH = 64;
+/// @brief NullMutex策略下代替本地队列的锁,没有状态,所有调度器共用
+static NullMutex s_nullMutex;
+
+/// @brief 按锁策略取本地队列的锁: MutexType策略就是队列自己的锁,NullMutex策略下加解锁都是空函数
+template <class LockPolicy>
+static inline LockPolicy &QueueMutex(Scheduler::MutexType &m);
+
+template <>
+inline Scheduler::MutexType &QueueMutex<Scheduler::MutexType>(Scheduler::MutexType &m) {
+    return m;
+}
+
+template <>
+inline NullMutex &QueueMutex<NullMutex>(Scheduler::MutexType &) {
+    return s_nullMutex;
+}
+
+/// @brief 任务协程让出回到调度协程后调用
+static inline void RunAfterYield() {
+    if (qc_unlikely(t_after_yield)) {
+        TaskFunc cb(std::move(t_after_yield));
+        cb();
+    }
+}
 
 /**
  * @details 协程分为三类:Main线程主协程,线程调度协程,任务协程.
  * 每个线程都有线程调度协程由t_scheduler_fiber记录,Main线程根协程由t_thread_fiber记录,当前运行的协程(不论是线程调度协程,Main线程根协程,任务协程)由t_fiber记录
  *
  */
-Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name) {
+Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name,
+                     const SchedulerOptions &options)
+    : _options(options) {
     qc_assert(threads >= 1);
 
     _use_caller = use_caller;
@@ -38,7 +85,7 @@ Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name) {
         qc_assert(GetThis() == nullptr);
         t_scheduler = this;
 
-        _rootFiber.reset(new Fiber(std::bind(&Scheduler::run, this), 0, false));
+        _rootFiber = Fiber::Create(std::bind(&Scheduler::run, this), 0, false);
 
         t_scheduler_fiber = _rootFiber.get();
 
@@ -52,11 +99,35 @@ Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name) {
     t_scheduler = this;
 
     _threads_count = threads;
+    // 没有偷任务的线程: 只有一个工作线程,监视线程也不会创建临时工作线程
+    _ownerOnlyQueues = threads + (use_caller ? 1 : 0) == 1 && _options.block_compensation == 0 &&
+                       _options.max_threads <= 1;
+
+    std::string label = "{scheduler=\"" + _name + "\"}";
+    // 用任务计数而不是去读各个队列: 不加锁的本地队列只能由所属线程访问
+    _gaugeIds.push_back(Metrics::AddGauge("qc_queue_depth" + label,
+                                          [this]() { return (int64_t)getPendingTasks(); }));
+    _gaugeIds.push_back(Metrics::AddGauge("qc_active_threads" + label,
+                                          [this]() { return (int64_t)_activeThreadCount; }));
+    _gaugeIds.push_back(Metrics::AddGauge("qc_idle_threads" + label,
+                                          [this]() { return (int64_t)_idleThreadCount; }));
+    _gaugeIds.push_back(Metrics::AddGauge("qc_worker_threads" + label, [this]() {
+        return (int64_t)(getThreadCount() + _tempWorkerCount);
+    }));
 }
 
 Scheduler::~Scheduler() {
     qc_assert(_stopping);
+    for (auto id : _gaugeIds) Metrics::RemoveGauge(id);
     if (GetThis() == this) t_scheduler = nullptr;
+    for (Worker *w : _workers) {
+        if (w->onNode) {
+            w->~Worker();
+            Numa::Free(w, sizeof(Worker));
+        } else {
+            delete w;
+        }
+    }
 }
 
 Fiber* Scheduler::GetMainFiber() {
@@ -67,113 +138,634 @@ Scheduler *Scheduler::GetThis() { return t_scheduler; }
 
 void Scheduler::setThis() { t_scheduler = this; }
 
+void Scheduler::YieldThen(TaskFunc cb) {
+    Fiber *cur = Fiber::GetCurrent();
+    qc_assert(cur && cur->isRunInScheduler());
+    t_after_yield.swap(cb);
+    cur->yield();
+}
+
 void Scheduler::start() {
     MutexType::Lock lock(_mutex);
     if (_stopping) {
-        fprintf(stderr, "Schedule is stopped\n");
+        QC_LOG_WARN("Schedule %s is stopped", _name.c_str());
         return;
     }
 
     qc_assert(_threads.empty());
     _threads.resize(_threads_count);
+    createWorkers();
 
+    size_t first = _use_caller ? 1 : 0;
+    bool numa = _options.numa_aware;
     for (size_t i = 0; i < _threads_count; ++i) {
-        _threads[i].reset(new Thread(std::bind(&Scheduler::run, this),
-                                     _name + " " + std::to_string(i)));
+        Worker *w = _workers[first + i];
+        _threads[i].reset(new Thread(
+            [this, w, numa]() {
+                if (w->cpu >= 0) Numa::BindThisThread(w->cpu);
+                // 之后这个线程上创建的协程栈分配在所在节点上
+                if (numa && w->cpu >= 0) Numa::SetPreferredNode(w->node);
+                t_worker = w;
+                run();
+            },
+            _name + " " + std::to_string(i)));
         _threadIds.push_back(_threads[i]->getId());
     }
+    if (_options.time_slice_us || _options.block_threshold_us ||
+        _options.max_threads > getThreadCount()) {
+        _monitor.reset(new Thread(std::bind(&Scheduler::monitor, this), _name + " monitor"));
+    }
 }
 
+/**
+ * @details NUMA模式下没有指定cpu时,依次从每个节点取一个cpu排成列表,工作线程按顺序绑定,
+ *          这样线程数少于cpu数时也均匀分布在各个节点上.
+ *          use_caller的调用线程不绑定,节点取它当前所在的cpu.
+ */
+void Scheduler::createWorkers() {
+    std::vector<int> cpus = _options.cpus;
+    if (cpus.empty() && _options.numa_aware) {
+        int nodes = Numa::NodeCount();
+        for (size_t k = 0;; ++k) {
+            bool more = false;
+            for (int node = 0; node < nodes; ++node) {
+                const std::vector<int> &node_cpus = Numa::CpusOfNode(node);
+                if (k < node_cpus.size()) {
+                    cpus.push_back(node_cpus[k]);
+                    more = true;
+                }
+            }
+            if (!more) break;
+        }
+    }
+
+    size_t n = _threads_count + (_use_caller ? 1 : 0);
+    for (size_t i = 0; i < n; ++i) {
+        int cpu = -1;
+        int node = 0;
+        if (_use_caller && i == 0) {
+            node = Numa::NodeOfCpu(Numa::CurrentCpu());
+        } else if (!cpus.empty()) {
+            cpu = cpus[(i - (_use_caller ? 1 : 0)) % cpus.size()];
+            node = Numa::NodeOfCpu(cpu);
+        }
+
+        Worker *w = nullptr;
+        void *mem = (_options.numa_aware && cpu >= 0) ? Numa::Alloc(sizeof(Worker), node) : nullptr;
+        if (mem) {
+            w = new (mem) Worker;
+            w->onNode = true;
+        } else {
+            w = new Worker;
+        }
+        w->cpu = cpu;
+        w->node = node;
+        _workers.push_back(w);
+    }
+    for (size_t idx : _options.busy_poll) {
+        if (idx < _threads_count) _workers[idx + (_use_caller ? 1 : 0)]->busyPoll = true;
+        else QC_LOG_WARN("busy poll worker %zu out of range, scheduler=%s", idx, _name.c_str());
+    }
+
+    // 从下一个线程开始轮一圈,再把同节点的排到前面,不同线程的第一个偷取对象错开
+    for (size_t i = 0; i < n; ++i) {
+        Worker *self = _workers[i];
+        for (size_t k = 1; k < n; ++k) self->victims.push_back(_workers[(i + k) % n]);
+        std::stable_partition(self->victims.begin(), self->victims.end(),
+                              [self](Worker *v) { return v->node == self->node; });
+    }
+}
+
+bool Scheduler::push(ScheduleTask &task, bool local) {
+    // 工作线程自己产生的任务放进本地队列,空闲的线程会来偷
+    Worker *w = (Worker *)t_worker;
+    int p = task.priority;
+    bool need_tickle;
+    if (local && w && !w->temporary && task.thread == -1 && GetThis() == this) {
+        need_tickle = _ownerOnlyQueues ? pushLocal<NullMutex>(w, task) : pushLocal<MutexType>(w, task);
+    } else {
+        MutexType::Lock lock(_mutex);
+        need_tickle = _queue[p].empty();
+        _queue[p].push_back(std::move(task));
+        // 计数和出队都在同一个队列的锁内,不会减到负数
+        ++_pendingTasks[p];
+    }
+    QC_LOG_DEBUG("add task sucess");
+    return need_tickle;
+}
+
+template <class LockPolicy>
+bool Scheduler::pushLocal(Worker *self, ScheduleTask &task) {
+    typename LockPolicy::Lock lock(QueueMutex<LockPolicy>(self->mutex));
+    int p = task.priority;
+    bool was_empty = self->queue[p].empty();
+    self->queue[p].push_back(std::move(task));
+    ++_pendingTasks[p];
+    return was_empty;
+}
+
+/**
+ * @details 计数为0的优先级直接跳过,不去拿锁: 只有普通优先级任务时和原来一样只看本地队列.
+ *          计数在入队的锁内增加,读到0说明入队还没完成,和先检查队列再入队的情况一样由入队方tickle.
+ *          只有多个优先级同时有任务时才读时钟检查老化.
+ */
+template <class LockPolicy>
+bool Scheduler::popWith(Worker *self, ScheduleTask &task, bool &tickle_me) {
+    int top = 0;
+    while (top < PRIORITY_COUNT && !_pendingTasks[top].load()) ++top;
+    if (top == PRIORITY_COUNT) return false;
+
+    uint64_t aging_ns = _options.priority_aging_us * 1000;
+    if (aging_ns) {
+        uint64_t deadline = 0;
+        for (int p = PRIORITY_COUNT - 1; p > top; --p) {
+            if (!_pendingTasks[p].load()) continue;
+            if (!deadline) deadline = GetMonotonicNS() - aging_ns;
+            if (popLocal<LockPolicy>(self, p, deadline, task, tickle_me) ||
+                popGlobal(p, deadline, task, tickle_me)) {
+                Metrics::Inc(Metrics::PRIORITY_AGED);
+                return true;
+            }
+        }
+    }
+
+    for (int p = top; p < PRIORITY_COUNT; ++p) {
+        if (!_pendingTasks[p].load()) continue;
+        if (popLocal<LockPolicy>(self, p, UINT64_MAX, task, tickle_me) ||
+            popGlobal(p, UINT64_MAX, task, tickle_me) || (self && steal(self, p, task))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @details 单线程调度器上放回本地队列,不用拿全局队列的锁.但全局队列里还有任务(其他线程提交的)时
+ *          仍然放到全局队列的队尾: 本地队列先于全局队列被取,放回本地队列就白让了
+ */
+void Scheduler::requeue(Fiber::ptr fiber) {
+    ScheduleTask t(std::move(fiber), -1);
+    t.priority = t.inheritPriority();
+    t.enqueue_ns = GetMonotonicNS();
+    bool local = false;
+    Worker *w = (Worker *)t_worker;
+    if (_ownerOnlyQueues && w == _workers[0]) {
+        size_t queued = 0;
+        for (int p = 0; p < PRIORITY_COUNT; ++p) queued += w->queue[p].size();
+        local = getPendingTasks() == queued;
+    }
+    if (push(t, local)) tickle();
+}
+
+bool Scheduler::onOwnerThread() const {
+    if (!_ownerOnlyQueues) return false;
+    if (t_worker == _workers[0]) return true;
+    return _use_caller && CurrentTid() == _rootThread;
+}
+
+template <class LockPolicy>
+bool Scheduler::popLocal(Worker *self, int priority, uint64_t deadline, ScheduleTask &task,
+                         bool &tickle_me) {
+    if (!self) return false;
+    typename LockPolicy::Lock lock(QueueMutex<LockPolicy>(self->mutex));
+    std::deque<ScheduleTask> &queue = self->queue[priority];
+    if (queue.empty() || queue.front().enqueue_ns > deadline) return false;
+    task = std::move(queue.front());
+    queue.pop_front();
+    --_pendingTasks[priority];
+    // 还有剩余的任务,叫醒其他线程来偷
+    tickle_me = !queue.empty();
+    return true;
+}
+
+bool Scheduler::popGlobal(int priority, uint64_t deadline, ScheduleTask &task, bool &tickle_me) {
+    MutexType::Lock lock(_mutex);
+    std::list<ScheduleTask> &queue = _queue[priority];
+    auto it = queue.begin();
+    while (it != queue.end()) {
+        // 指定了其他线程执行的任务
+        if (it->thread != -1 && it->thread != syscall(SYS_gettid)) {
+            tickle_me = true;
+            ++it;
+            continue;
+        }
+        // 队列按入队时间排序,后面的更晚
+        if (it->enqueue_ns > deadline) return false;
+        task = std::move(*it);
+        queue.erase(it++);
+        --_pendingTasks[priority];
+        // 当前线程拿到一个任务,任务队列不为空,告诉其他线程
+        tickle_me |= (it != queue.end());
+        return true;
+    }
+    return false;
+}
+
+bool Scheduler::steal(Worker *self, int priority, ScheduleTask &task) {
+    for (Worker *v : self->victims) {
+        MutexType::Lock lock(v->mutex);
+        std::deque<ScheduleTask> &queue = v->queue[priority];
+        if (queue.empty()) continue;
+        // 从尾部偷,和队列主人从头部取的位置错开
+        task = std::move(queue.back());
+        queue.pop_back();
+        --_pendingTasks[priority];
+        lock.unlock();
+        Metrics::Inc(Metrics::STEALS);
+        if (v->node != self->node) Metrics::Inc(Metrics::REMOTE_STEALS);
+        return true;
+    }
+    return false;
+}
+
+/// @details 类型和锁策略在构造之后都不再变化,每个线程只在这里选一次
 void Scheduler::run() {
-    std::cout << "begin run" << std::endl;
+    if (_ioManager) {
+        _ownerOnlyQueues ? runLoop<IOManager, NullMutex>() : runLoop<IOManager, MutexType>();
+    } else {
+        _ownerOnlyQueues ? runLoop<Scheduler, NullMutex>() : runLoop<Scheduler, MutexType>();
+    }
+}
+
+template <class Derived, class LockPolicy>
+void Scheduler::runLoop() {
+    QC_LOG_DEBUG("begin run");
+    Derived *derived = static_cast<Derived *>(this);
     set_hook_enable(true);
     setThis();
     // 当前线程不是Main线程
     if (syscall(SYS_gettid) != _rootThread) {
         // 初始化当前线程的第一个协程主协程(调度协程)
         t_scheduler_fiber = Fiber::GetThis().get();
+    } else if (!_workers.empty()) {
+        t_worker = _workers[0];
     }
+    Worker *self = (Worker *)t_worker;
+    if (self) self->tid.store(syscall(SYS_gettid), std::memory_order_relaxed);
 
     // 创建idle协程
-    Fiber::ptr idleFiber(new Fiber(std::bind(&Scheduler::idle, this)));
+    Fiber::ptr idleFiber = Fiber::Create([derived]() { derived->idle(); });
     Fiber::ptr taskFiber;
 
     ScheduleTask task;
+    uint64_t start_ns = 0;
+    /// @brief 上次pollEvents之后连续执行的任务数
+    uint32_t batch = 0;
+    /// @brief 是否给监视线程记录任务的开始时间
+    bool tracking = self && (_options.time_slice_us || _options.block_threshold_us);
 
     while (1) {
+        if (qc_unlikely(self && self->retire.load(std::memory_order_relaxed))) {
+            // 临时工作线程退出: idle协程看到退出标记后结束,协程销毁前必须是TERM
+            if (idleFiber->getState() != Fiber::TERM) idleFiber->resume();
+            break;
+        }
         task.reset();
         /// 是否通知其他线程进行任务调度
         bool tickle_me = false;
-        {
-            MutexType::Lock lock(_mutex);
-
-            // std::cout << "_queue.size() = " << _queue.size() << std::endl;
-
-            auto it = _queue.begin();
-            while (it != _queue.end()) {
-                // 有调度任务
-                // std::cout << "_queue has task" << std::endl;
-
-                if (it->thread != -1 && it->thread != syscall(SYS_gettid)) {
-                    tickle_me = true;
-                    ++it;
-                    continue;
-                }
-                qc_assert(it->fiber || it->cb);
-                if (it->fiber) qc_assert(it->fiber->getState() == Fiber::READY);
-
-                task = *it;
-                _queue.erase(it++);
-                ++_activeThreadCount;
-                break;
+        // 先计数再取任务: stopping()先检查队列再检查计数,取出任务和计数之间不会被误判为可以停止
+        ++_activeThreadCount;
+        if (popWith<LockPolicy>(self, task, tickle_me)) {
+            if (task.fiber) qc_assert(task.fiber->getState() == Fiber::READY);
+        } else {
+            --_activeThreadCount;
+        }
+        QC_LOG_DEBUG("get a task");
+        if (tickle_me) derived->tickle();
+        if (task.fiber || task.cb) {
+            if (self && self->temporary) self->idleSince.store(0, std::memory_order_relaxed);
+            // 所有线程都在忙时没有人等在epoll_wait上,每一批任务之后顺便收一次IO事件
+            if (++batch >= POLL_BATCH) {
+                batch = 0;
+                if (!hasIdleThreads()) derived->pollEvents();
             }
-            std::cout << "get a task" << std::endl;
-            // 当前线程拿到一个线程,任务队列不为空,告诉其他线程
-            tickle_me |= (it != _queue.end());
+            start_ns = GetMonotonicNS();
+            Metrics::RecordSchedLatency(start_ns - task.enqueue_ns, task.priority);
         }
-        if (tickle_me) tickle();
         if (task.fiber) {
+            uint64_t fiber_id = task.fiber->git_id();
+            const std::type_info &cb_type = task.fiber->getCbType();
+            task.fiber->setPriority(task.priority);
+            if (tracking) beginRun(self, fiber_id, start_ns);
             task.fiber->resume();
+            if (tracking) self->runStart.store(0, std::memory_order_relaxed);
+            RunAfterYield();
             --_activeThreadCount;
+            traceRun(fiber_id, cb_type, start_ns);
+            Metrics::Inc(Metrics::TASKS_EXECUTED);
+            releaseFiber(self, task.fiber);
             task.reset();
         } else if (task.cb) {
-            // std::cout << "task.cb is not nullptr" << std::endl;
-            if (taskFiber) {
-                // std::cout << "cur taskFiber is not nullptr" << std::endl;
-                taskFiber->reset(task.cb);
-            } else {
-                // std::cout << "cur taskFiebr is nullptr" << std::endl;
-                taskFiber.reset(new Fiber(task.cb));
-            }
-            // std::cout << "get taskFiber" << std::endl;
+            const std::type_info &cb_type = task.cb.target_type();
+            taskFiber = acquireFiber(self, task.cb);
+            taskFiber->setPriority(task.priority);
             task.reset();
+            if (tracking) beginRun(self, taskFiber->git_id(), start_ns);
             taskFiber->resume();
+            if (tracking) self->runStart.store(0, std::memory_order_relaxed);
+            RunAfterYield();
             --_activeThreadCount;
-            taskFiber.reset();
+            traceRun(taskFiber->git_id(), cb_type, start_ns);
+            Metrics::Inc(Metrics::TASKS_EXECUTED);
+            // 让出的协程已经交给了唤醒方,这里只放回运行结束的
+            releaseFiber(self, taskFiber);
         } else {
             // 任务队列为空
             if (idleFiber->getState() == Fiber::TERM) {
-                std::cout << "idle fiber term" << std::endl;
+                QC_LOG_DEBUG("idle fiber term");
                 break;
             }
+            if (self && self->temporary && !self->idleSince.load(std::memory_order_relaxed)) {
+                self->idleSince.store(GetMonotonicNS(), std::memory_order_relaxed);
+            }
             ++_idleThreadCount;
             idleFiber->resume();
             --_idleThreadCount;
         }
     }
-    std::cout << "run exit" << std::endl;
+    // use_caller时run在stop()中返回到调用线程,之后调用线程上的sleep等不能再走hook
+    set_hook_enable(false);
+    t_worker = nullptr;
+    QC_LOG_DEBUG("run exit");
+}
+Fiber::ptr Scheduler::acquireFiber(Worker *self, TaskFunc &cb) {
+    if (self && !self->fiberPool.empty()) {
+        Fiber::ptr fiber = std::move(self->fiberPool.back());
+        self->fiberPool.pop_back();
+        fiber->reset(std::move(cb));
+        Metrics::Inc(Metrics::FIBER_POOL_HITS);
+        return fiber;
+    }
+    Metrics::Inc(Metrics::FIBER_POOL_MISSES);
+    return Fiber::Create(std::move(cb));
+}
+
+/**
+ * @details 只缓存和acquireFiber新建的一样的协程: 参与调度,默认栈大小,栈在当前线程的节点上.
+ *          use_count为1说明没有等待方或者唤醒方还持有它,放回池中之后不会再被别人resume.
+ */
+void Scheduler::releaseFiber(Worker *self, Fiber::ptr &fiber) {
+    if (self && fiber->getState() == Fiber::TERM && fiber.use_count() == 1 &&
+        fiber->isRunInScheduler() && fiber->getStackSize() == DEFAULT_STACKSIZE &&
+        fiber->getStackNode() == Numa::GetPreferredNode() &&
+        self->fiberPool.size() < _options.fiber_pool_size) {
+        self->fiberPool.push_back(std::move(fiber));
+    }
+    fiber.reset();
+}
+
+/**
+ * @details 任务只有主动让出才会回到调度协程,所以resume返回时测到的就是这一次连续占用线程的时长.
+ *          超过阈值的任务打印协程id和入口回调的类型,用来区分是排队久还是执行久.
+ */
+void Scheduler::traceRun(uint64_t fiber_id, const std::type_info &cb_type, uint64_t start_ns) {
+    uint64_t ns = GetMonotonicNS() - start_ns;
+    Metrics::RecordRunDuration(ns);
+    uint64_t threshold = _longRunThreshold.load(std::memory_order_relaxed);
+    if (qc_likely(!threshold || ns < threshold)) return;
+
+    Metrics::Inc(Metrics::LONG_RUNS);
+    int status = 0;
+    char *name = abi::__cxa_demangle(cb_type.name(), nullptr, nullptr, &status);
+    QC_LOG_WARN("fiber %lu ran %lu us without yielding, scheduler=%s entry=%s",
+                (unsigned long)fiber_id, (unsigned long)(ns / 1000), _name.c_str(),
+                name ? name : cb_type.name());
+    free(name);
+}
+
+/**
+ * @details 监视线程每半个时间片(或者半个阻塞阈值,取小的)醒来一次,所以任务最多运行1.5个时间片之后被标记.
+ *          标记写的是任务的开始时间而不是一个bool: 标记之前任务已经结束时,下一个任务的开始时间不同,不会被误伤
+ */
+void Scheduler::monitor() {
+    uint64_t slice_ns = _options.time_slice_us * 1000;
+    uint64_t block_ns = _options.block_threshold_us * 1000;
+    bool elastic = _options.max_threads > getThreadCount();
+    uint64_t interval_us = UINT64_MAX;
+    if (slice_ns) interval_us = _options.time_slice_us / 2;
+    if (block_ns) interval_us = std::min<uint64_t>(interval_us, _options.block_threshold_us / 2);
+    if (elastic) interval_us = std::min<uint64_t>(interval_us, _options.scale_latency_us / 2);
+    interval_us = std::max<uint64_t>(interval_us, 100);
+    while (!_monitorStop.load(std::memory_order_relaxed)) {
+        usleep(interval_us);
+        uint64_t now = GetMonotonicNS();
+        for (Worker *w : _workers) {
+            uint64_t start = w->runStart.load(std::memory_order_acquire);
+            if (!start) continue;
+            if (slice_ns && now - start >= slice_ns) w->preemptStart.store(start, std::memory_order_relaxed);
+            if (block_ns && now - start >= block_ns) reportBlocked(w, start, now);
+        }
+        if (block_ns) {
+            for (Worker *w : _tempWorkers) {
+                uint64_t start = w->runStart.load(std::memory_order_acquire);
+                if (start && now - start >= block_ns) reportBlocked(w, start, now);
+            }
+        }
+        if (elastic) scaleUp(now);
+        if (!_tempWorkers.empty()) reapTempWorkers(now);
+    }
+}
+
+/// @brief /proc中线程的状态: R运行,S可中断睡眠,D不可中断睡眠(磁盘IO等),读不到时为'?'
+static char ThreadState(pid_t tid) {
+    std::ifstream in("/proc/self/task/" + std::to_string(tid) + "/stat");
+    std::string stat;
+    std::getline(in, stat);
+    // 线程名可能包含空格和括号,状态在最后一个')'之后
+    size_t pos = stat.rfind(')');
+    return (pos != std::string::npos && pos + 2 < stat.size()) ? stat[pos + 2] : '?';
+}
+
+/**
+ * @details 心跳和开始时间不是一起读的,重新读一次开始时间确认还在同一个任务中.
+ *          线程状态为R说明是在计算而不是阻塞,也一样报告: 两者都让这个线程上的队列得不到处理.
+ *          日志一条放不下整个调用栈,每一帧单独一行
+ */
+void Scheduler::reportBlocked(Worker *w, uint64_t start, uint64_t now) {
+    uint64_t beat = w->heartbeat.load(std::memory_order_relaxed);
+    if (beat == w->reportedBeat || w->runStart.load(std::memory_order_acquire) != start) return;
+    w->reportedBeat = beat;
+    Metrics::Inc(Metrics::BLOCKED_WORKERS);
+
+    pid_t tid = w->tid.load(std::memory_order_relaxed);
+    QC_LOG_WARN("worker tid=%d stuck in fiber %lu for %lu ms, thread state %c, scheduler=%s",
+                (int)tid, (unsigned long)w->runFiber.load(std::memory_order_relaxed),
+                (unsigned long)((now - start) / 1000 / 1000), ThreadState(tid), _name.c_str());
+    if (_options.block_capture_stack) {
+        std::string stack = Profiler::CaptureStack(tid);
+        size_t pos = 0;
+        while (pos < stack.size()) {
+            size_t end = stack.find('\n', pos);
+            QC_LOG_WARN("  %s", stack.substr(pos, end - pos).c_str());
+            pos = end == std::string::npos ? end : end + 1;
+        }
+    }
+
+    if (w->temporary) return;
+    size_t live = 0;
+    for (Worker *t : _tempWorkers) live += !t->retire.load(std::memory_order_relaxed);
+    if (live < _options.block_compensation) spawnTempWorker(w, beat);
+}
+
+void Scheduler::spawnTempWorker(Worker *blocked, uint64_t beat) {
+    Worker *w = new Worker;
+    w->temporary = true;
+    // 弹性线程轮流放在各个工作线程所在的节点上
+    w->node = blocked ? blocked->node : _workers[_tempWorkers.size() % _workers.size()]->node;
+    w->blockedOn = blocked;
+    w->blockedBeat = beat;
+    w->victims = _workers;
+    std::stable_partition(w->victims.begin(), w->victims.end(),
+                          [w](Worker *v) { return v->node == w->node; });
+    bool numa = _options.numa_aware;
+    w->thread.reset(new Thread(
+        [this, w, numa]() {
+            if (numa) Numa::SetPreferredNode(w->node);
+            t_worker = w;
+            run();
+            w->exited.store(true, std::memory_order_release);
+        },
+        _name + (blocked ? " temp" : " elastic")));
+    _tempWorkers.push_back(w);
+    ++_tempWorkerCount;
+    if (blocked) {
+        Metrics::Inc(Metrics::COMPENSATION_WORKERS);
+        QC_LOG_INFO("spawned temporary worker for tid=%d, scheduler=%s",
+                    (int)blocked->tid.load(std::memory_order_relaxed), _name.c_str());
+    } else {
+        Metrics::Inc(Metrics::ELASTIC_SPAWNS);
+        QC_LOG_INFO("spawned elastic worker, %zu threads, scheduler=%s",
+                    getThreadCount() + _tempWorkerCount, _name.c_str());
+    }
+}
+
+/**
+ * @details 有空闲线程时排队久说明任务是指定给忙碌线程的,或者唤醒还在路上,加线程也没有用.
+ *          补偿线程不计入上限: 它们顶替的是阻塞的线程
+ */
+void Scheduler::scaleUp(uint64_t now) {
+    if (hasIdleThreads() || oldestWait(now) < _options.scale_latency_us * 1000) {
+        _slowChecks = 0;
+        return;
+    }
+    if (++_slowChecks < 2) return;
+    _slowChecks = 0;
+    size_t threads = getThreadCount();
+    for (Worker *t : _tempWorkers) threads += !t->blockedOn && !t->retire.load(std::memory_order_relaxed);
+    if (threads < _options.max_threads) spawnTempWorker(nullptr, 0);
+}
+
+uint64_t Scheduler::oldestWait(uint64_t now) {
+    uint64_t oldest = now;
+    {
+        MutexType::Lock lock(_mutex);
+        for (int p = 0; p < PRIORITY_COUNT; ++p) {
+            if (!_queue[p].empty()) oldest = std::min(oldest, _queue[p].front().enqueue_ns);
+        }
+    }
+    for (Worker *w : _workers) {
+        MutexType::Lock lock(w->mutex);
+        for (int p = 0; p < PRIORITY_COUNT; ++p) {
+            if (!w->queue[p].empty()) oldest = std::min(oldest, w->queue[p].front().enqueue_ns);
+        }
+    }
+    return now > oldest ? now - oldest : 0;
+}
+
+bool Scheduler::hasTasksFor(pid_t tid) {
+    MutexType::Lock lock(_mutex);
+    for (int p = 0; p < PRIORITY_COUNT; ++p) {
+        for (const ScheduleTask &t : _queue[p]) {
+            if (t.thread == tid) return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @details 阻塞的线程开始了下一个任务(心跳变了)或者回到了调度协程(开始时间为0),补偿线程就可以退出了.
+ *          弹性线程空闲超过冷却时间后退出,还有指定给它的任务时先留着.
+ *          临时线程在epoll_wait上最多等一小段时间(见IOManager::idle),不需要专门唤醒
+ */
+void Scheduler::reapTempWorkers(uint64_t now) {
+    for (auto it = _tempWorkers.begin(); it != _tempWorkers.end();) {
+        Worker *w = *it;
+        Worker *b = w->blockedOn;
+        bool retired = w->retire.load(std::memory_order_relaxed);
+        if (!retired && b) {
+            if (b->heartbeat.load(std::memory_order_relaxed) != w->blockedBeat ||
+                !b->runStart.load(std::memory_order_relaxed)) {
+                w->retire.store(true, std::memory_order_relaxed);
+            }
+        } else if (!retired) {
+            uint64_t idle = w->idleSince.load(std::memory_order_relaxed);
+            if (idle && now - idle >= _options.scale_cooldown_us * 1000 &&
+                !hasTasksFor(w->tid.load(std::memory_order_relaxed))) {
+                w->retire.store(true, std::memory_order_relaxed);
+                Metrics::Inc(Metrics::ELASTIC_RETIRES);
+            }
+        }
+        if (w->exited.load(std::memory_order_acquire)) {
+            w->thread->join();
+            delete w;
+            --_tempWorkerCount;
+            it = _tempWorkers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool maybe_yield() {
+    Scheduler::Worker *w = (Scheduler::Worker *)t_worker;
+    if (!w) return false;
+    uint64_t start = w->runStart.load(std::memory_order_relaxed);
+    if (qc_likely(!start || w->preemptStart.load(std::memory_order_relaxed) != start)) return false;
+
+    Scheduler *sched = Scheduler::GetThis();
+    Fiber *cur = Fiber::GetCurrent();
+    if (!sched || !cur || !cur->isRunInScheduler()) return false;
+    // 没有别的任务在等时让出也没有意义,重新开始计时
+    if (!sched->hasPendingTasks()) {
+        w->runStart.store(GetMonotonicNS(), std::memory_order_relaxed);
+        return false;
+    }
+    Metrics::Inc(Metrics::PREEMPTIONS);
+    Fiber::ptr fiber(cur);
+    Scheduler::YieldThen([sched, fiber]() mutable { sched->requeue(std::move(fiber)); });
+    return true;
+}
+
+bool Scheduler::isBusyPollThread() const {
+    Worker *w = (Worker *)t_worker;
+    return w && w->busyPoll && t_scheduler == this;
+}
+
+bool Scheduler::isTemporaryWorker() const {
+    Worker *w = (Worker *)t_worker;
+    return w && w->temporary && t_scheduler == this;
 }
+
+bool Scheduler::isRetiring() const {
+    Worker *w = (Worker *)t_worker;
+    return w && w->retire.load(std::memory_order_relaxed) && t_scheduler == this;
+}
+
 /// @brief 通知其他线程由epoll实现这里tickle为virtual 后面再实现
-void Scheduler::tickle() { std::cout << "tickle" << std::endl; }
+void Scheduler::tickle() { QC_LOG_DEBUG("tickle"); }
 
+/**
+ * @details 任务计数在入队的锁内增加,在出队的锁内减少,和逐个检查队列看到的一样;
+ *          取任务之前先增加活跃线程数,先读计数再读活跃线程数,取出任务和计数之间不会被误判为可以停止
+ */
 bool Scheduler::stopping() {
-    MutexType::Lock lock(_mutex);
-    return _stopping && _queue.empty() && _activeThreadCount == 0;
+    if (!_stopping.load()) return false;
+    return !hasPendingTasks() && _activeThreadCount == 0;
 }
 
 void Scheduler::idle() {
-    while (!stopping()) {
-        Fiber::GetThis()->yield();
+    while (!stopping() && !isRetiring()) {
+        Fiber::GetCurrent()->yield();
     }
 }
 
@@ -188,7 +780,8 @@ void Scheduler::stop() {
     // stop指令只能由Main线程发起
     // 这里只有一个调度器实例所以,如果使用caller线程GetThis() == this
     if (_use_caller) qc_assert(GetThis() == this);
-    else qc_assert(GetThis() != this);
+    // 不使用caller时构造线程上GetThis()也是这个调度器,它不是工作线程,可以stop;工作线程上stop会join自己
+    else qc_assert(GetThis() != this || !t_worker);
 
     for (size_t i = 0; i < _threads_count; ++i) {
         tickle();
@@ -196,7 +789,7 @@ void Scheduler::stop() {
 
     if (_rootFiber) {
         _rootFiber->resume();
-        std::cout << "root fiber end" << std::endl;
+        QC_LOG_DEBUG("root fiber end");
     }
 
     std::vector<Thread::ptr> threads;
@@ -205,6 +798,19 @@ void Scheduler::stop() {
         threads.swap(_threads);
     }
     for (auto &i : threads) i->join();
+
+    if (_monitor) {
+        _monitorStop = true;
+        _monitor->join();
+        _monitor.reset();
+    }
+    // 监视线程结束后不会再创建临时线程,它们和其他工作线程一样看到停止条件后退出
+    for (Worker *w : _tempWorkers) {
+        w->thread->join();
+        delete w;
+    }
+    _tempWorkers.clear();
+    _tempWorkerCount = 0;
 }
 
 }  // namespace qc
\ No newline at end of file
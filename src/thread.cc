@@ -13,6 +13,7 @@
 #include <sys/syscall.h>
 
 #include "thread.hpp"
+#include "log.hpp"
 
 
 namespace qc {
@@ -32,8 +33,9 @@ void* Thread::ThreadFunc(void* args) {
     pthread_setname_np(pthread_self(), thr->m_name.substr(0, 15).c_str());
     std::function<void()> cb;
     cb.swap(thr->m_cb);
+    thr->m_semaphore.V();
     
-    std::cout << "begin callback" << std::endl;
+    QC_LOG_DEBUG("thread %s begin callback", thr->m_name.c_str());
     cb();
     return nullptr;
 }
@@ -42,29 +44,30 @@ Thread::Thread(std::function<void()> cb, const std::string& name = "UNKNOWN") :
     // 创建线程
     int rt = pthread_create(&m_tid, nullptr, ThreadFunc, this);
     if (rt) {
-        std::cout << "pthread_create error, name : " << m_name << std::endl;
+        QC_LOG_ERROR("pthread_create error, name : %s", m_name.c_str());
         throw std::logic_error("pthread_create");
     }
+    m_semaphore.P();
 }
 
 Thread::~Thread() {
-    if (m_pid) {
-        pthread_detach(m_pid);
+    if (!m_joined) {
+        pthread_detach(m_tid);
     }
 }
 
 void Thread::join() {
-    if (m_pid) {
-        int rt = pthread_join(m_pid, nullptr);
+    if (!m_joined) {
+        int rt = pthread_join(m_tid, nullptr);
         if (rt) {
-            std::cout << "pthread_join error, name : " << m_name << std::endl;
+            QC_LOG_ERROR("pthread_join error, name : %s", m_name.c_str());
             throw std::logic_error("pthread_join");
         }
-        m_pid = 0;
+        m_joined = true;
     }
 }
 
-Thread* GetThis() {
+Thread* Thread::GetThis() {
     return t_thread;
 }
 
@@ -14,8 +14,11 @@
 #include <sys/time.h>
 #include <ctime>
 
+#include "fiber.hpp"
+#include "metrics.hpp"
 #include "mutex.hpp"
 #include "qc.hpp"
+#include "trace.hpp"
 namespace qc {
 
 uint64_t GetElapsedMS() {
@@ -36,28 +39,53 @@ bool Timer::Comparator::operator()(const Timer::ptr& lhs,
     return lhs.get() < rhs.get();
 }
 
-Timer::Timer(uint64_t ms, std::function<void()> cb, bool recurring,
+Timer::Timer(uint64_t ms, TaskFunc cb, bool recurring,
              TimerManager* manager)
-    : m_ms(ms), m_cb(cb), m_recurring(recurring), m_manager(manager) {
+    : m_ms(ms), m_cb(std::move(cb)), m_recurring(recurring), m_manager(manager) {
     m_next = m_ms + GetElapsedMS();
+    if (m_recurring && m_cb) {
+        m_shared = std::make_shared<TaskFunc>(std::move(m_cb));
+        std::shared_ptr<TaskFunc> shared = m_shared;
+        m_cb = [shared]() { (*shared)(); };
+    }
+    m_pending.store((bool)m_cb, std::memory_order_relaxed);
 }
 
 Timer::Timer(uint64_t next) : m_next(next) {}
 
 /// @brief 作为一个定时器,自己可以通过TimerManager取消自己
 bool Timer::cancel() {
-    RWMutex::WriteLock lock(m_manager->m_mutex);
+    Timer::ptr self = shared_from_this();
+    return m_manager->withLock([self](auto &mutex) { return self->cancelWith(mutex); },
+                               isPending());
+}
+
+template <class RW>
+bool Timer::cancelWith(RW &mutex) {
+    typename RW::WriteLock lock(mutex);
     if (m_cb) {
         m_cb = nullptr;
+        m_shared.reset();
+        m_pending.store(false, std::memory_order_release);
+        // 其他线程的cancel转过来时,也可能这个定时器在转交的添加执行之前就被取消了
         auto it = m_manager->m_timers.find(shared_from_this());
-        m_manager->m_timers.erase(it);
+        if (it != m_manager->m_timers.end()) m_manager->m_timers.erase(it);
+        m_manager->m_timerCount.store(m_manager->m_timers.size(), std::memory_order_release);
+        Metrics::Inc(Metrics::TIMER_CANCELS);
         return true;
     }
     return false;
 }
 
 bool Timer::refresh() {
-    RWMutex::WriteLock lock(m_manager->m_mutex);
+    Timer::ptr self = shared_from_this();
+    return m_manager->withLock([self](auto &mutex) { return self->refreshWith(mutex); },
+                               isPending());
+}
+
+template <class RW>
+bool Timer::refreshWith(RW &mutex) {
+    typename RW::WriteLock lock(mutex);
     if (!m_cb) {
         return false;
     }
@@ -73,7 +101,14 @@ bool Timer::refresh() {
 
 bool Timer::reset(uint64_t ms, bool from_now) {
     if (ms == m_ms && !from_now) return true;
-    RWMutex::WriteLock lock(m_manager->m_mutex);
+    Timer::ptr self = shared_from_this();
+    return m_manager->withLock(
+        [self, ms, from_now](auto &mutex) { return self->resetWith(mutex, ms, from_now); }, true);
+}
+
+template <class RW>
+bool Timer::resetWith(RW &mutex, uint64_t ms, bool from_now) {
+    typename RW::WriteLock lock(mutex);
     if (!m_cb) return true;
     auto it = m_manager->m_timers.find(shared_from_this());
     if (it == m_manager->m_timers.end()) return false;
@@ -86,7 +121,7 @@ bool Timer::reset(uint64_t ms, bool from_now) {
     }
     m_ms = ms;
     m_next = start + m_ms;
-    m_manager->add_timer(shared_from_this(), lock);
+    m_manager->insertTimer(shared_from_this(), lock);
     return true;
 }
 
@@ -94,17 +129,37 @@ TimerManager::TimerManager() { m_previousTime = GetElapsedMS(); }
 
 TimerManager::~TimerManager() {}
 
-Timer::ptr TimerManager::add_timer(uint64_t ms, std::function<void()> cb,
+/// @brief 所属线程上的NullRWMutex,不保护任何东西
+static NullRWMutex s_nullRWMutex;
+
+template <class R, class Op>
+R TimerManager::withLock(Op op, R forwarded) {
+    if (!m_ownerOnly) return op(m_mutex);
+    if (isTimerThread()) return op(s_nullRWMutex);
+    runOnTimerThread([op]() mutable { op(s_nullRWMutex); });
+    return forwarded;
+}
+
+Timer::ptr TimerManager::add_timer(uint64_t ms, TaskFunc cb,
                                    bool recurring) {
-    Timer::ptr timer(new Timer(ms, cb, recurring, this));
-    RWMutexType::WriteLock lock(m_mutex);
-    add_timer(timer, lock);
+    Timer::ptr timer(new Timer(ms, std::move(cb), recurring, this));
+    withLock(
+        [this, timer](auto &mutex) {
+            typename std::decay<decltype(mutex)>::type::WriteLock lock(mutex);
+            // 转交给所属线程之后,执行之前已经被取消的不再插入
+            if (timer->m_cb) insertTimer(timer, lock);
+            return true;
+        },
+        true);
     return timer;
 }
 
-void TimerManager::add_timer(Timer::ptr timer, RWMutexType::WriteLock& lock) {
+template <class Lock>
+void TimerManager::insertTimer(Timer::ptr timer, Lock& lock) {
     // it 指向插入的数据
     auto it = m_timers.insert(timer).first;
+    m_timerCount.store(m_timers.size(), std::memory_order_release);
+    Metrics::Inc(Metrics::TIMER_INSERTS);
     bool tickle = (it == m_timers.begin() && !m_tickled);
     if (tickle) m_tickled = true;
     lock.unlock();
@@ -113,23 +168,29 @@ void TimerManager::add_timer(Timer::ptr timer, RWMutexType::WriteLock& lock) {
 
 bool TimerManager::detectClockRollover(uint64_t now_ms) {
     bool rollover = false;
-    if (now_ms < m_previousTime && now_ms < (m_previousTime - 60 * 60 * 1000))
+    // now_ms在拿锁之前读取,可能比别的线程刚写入的m_previousTime略小;
+    // 开机不到一小时时m_previousTime - 1h会回绕,所以把减法移到左边
+    if (now_ms < m_previousTime && now_ms + 60 * 60 * 1000 < m_previousTime)
         rollover = true;
     m_previousTime = now_ms;
     return rollover;
 }
 
-void TimerManager::listExpiredCb(std::vector<std::function<void()>>& cbs) {
+void TimerManager::listExpiredCb(std::vector<TaskFunc>& cbs) {
+    if (!m_ownerOnly) return listExpiredWith(m_mutex, cbs);
+    qc_assert(isTimerThread());
+    listExpiredWith(s_nullRWMutex, cbs);
+}
+
+template <class RW>
+void TimerManager::listExpiredWith(RW &mutex, std::vector<TaskFunc>& cbs) {
     // std::cout << "listExpiredCb.." << std::endl;
     uint64_t now_ms = GetElapsedMS();
     std::vector<Timer::ptr> expired;
     // std::cout << "in listExpiredCb m_timer.size() = " << m_timers.size() <<
     // std::endl;
-    {
-        RWMutexType::ReadLock lock(m_mutex);
-        if (m_timers.empty()) return;
-    }
-    RWMutexType::WriteLock lock(m_mutex);
+    if (!getTimerCount()) return;
+    typename RW::WriteLock lock(mutex);
     if (m_timers.empty()) return;
 
     bool rollover = false;
@@ -147,18 +208,33 @@ void TimerManager::listExpiredCb(std::vector<std::function<void()>>& cbs) {
     m_timers.erase(m_timers.begin(), it);
 
     cbs.reserve(expired.size());
+    Metrics::Inc(Metrics::TIMER_FIRES, expired.size());
+    if (!expired.empty()) Tracer::Emit(Tracer::TIMER_FIRE, Fiber::GetFiberId(), expired.size());
     for (auto& timer : expired) {
-        cbs.push_back(timer->m_cb);
         if (timer->m_recurring) {
+            // 回调只能移动,循环定时器每次投递一个共享回调的包装,之后cancel也不影响已经投递的这一次
+            std::shared_ptr<TaskFunc> shared = timer->m_shared;
+            cbs.push_back([shared]() { (*shared)(); });
             timer->m_next = GetElapsedMS() + timer->m_ms;
             m_timers.insert(timer);
-        } else
+        } else {
+            cbs.push_back(std::move(timer->m_cb));
             timer->m_cb = nullptr;
+            timer->m_pending.store(false, std::memory_order_release);
+        }
     }
+    m_timerCount.store(m_timers.size(), std::memory_order_release);
 }
 
 uint64_t TimerManager::getNextTimer() {
-    RWMutexType::ReadLock lock(m_mutex);
+    if (!m_ownerOnly) return nextTimerWith(m_mutex);
+    qc_assert(isTimerThread());
+    return nextTimerWith(s_nullRWMutex);
+}
+
+template <class RW>
+uint64_t TimerManager::nextTimerWith(RW &mutex) {
+    typename RW::ReadLock lock(mutex);
     m_tickled = false;
     if (m_timers.empty()) return ~0ull;
     // std::cout << "cur m_timers.size() = " << m_timers.size() << std::endl;
@@ -0,0 +1,248 @@
+/**
+ * @file trace.cc
+ * @author qc
+ * @brief 协程生命周期追踪实现
+ * @version 0.1
+ * @date 2024-07-11
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "trace.hpp"
+
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <vector>
+
+#include "metrics.hpp"
+#include "mutex.hpp"
+#include "thread.hpp"
+
+namespace qc {
+
+std::atomic<bool> Tracer::s_enabled{false};
+
+namespace {
+
+/// @brief 单个线程的环形缓冲区,只由所属线程写,写满后覆盖最旧的记录
+struct TraceRing {
+    TraceRing(size_t size) : records(new Tracer::Record[size]), mask(size - 1) {}
+    ~TraceRing() { delete[] records; }
+
+    pid_t tid = 0;
+    std::string name;
+    /// @brief 累计写入条数
+    std::atomic<uint64_t> head{0};
+    /**
+     * @brief 记录属于哪一次Start
+     * @details Start只增加全局的代数,由所属线程在下一次写入时清空自己的环,
+     *          不去改正在写入的线程的head.和当前代数不同的环里是上一次的记录,不导出
+     */
+    std::atomic<uint64_t> epoch{0};
+    /// @brief 以下在TraceRegistry::mutex下修改;records和mask只有所属线程不加锁地读
+    Tracer::Record *records;
+    size_t mask;
+    /// @brief 所属线程已经退出
+    bool dead = false;
+    /// @brief 退出之后这一代的记录已经导出过
+    bool dumped = false;
+};
+
+struct TraceRegistry {
+    Mutex mutex;
+    /**
+     * @brief 所有线程的环
+     * @details 线程退出后保留到导出为止,之后交给新线程复用;补偿线程和弹性线程反复创建退出,
+     *          一直不导出时最多保留MAX_DEAD_RINGS个退出线程的环,再多就复用其中最早的
+     */
+    std::vector<TraceRing *> rings;
+    size_t ring_size = 64 * 1024;
+};
+
+static const size_t MAX_DEAD_RINGS = 16;
+/// @brief 每次Start加一
+static std::atomic<uint64_t> s_epoch{1};
+
+TraceRegistry &Registry() {
+    static TraceRegistry s_registry;
+    return s_registry;
+}
+
+}  // namespace
+
+static thread_local TraceRing *t_ring = nullptr;
+/// @brief 所属线程的LocalTrace已经析构,之后的记录丢弃,不再新建环
+static thread_local bool t_trace_gone = false;
+
+/// @brief 线程退出时把环标记为可以复用
+struct LocalTrace {
+    ~LocalTrace() {
+        if (ring) {
+            Mutex::Lock lock(Registry().mutex);
+            ring->dead = true;
+            ring->dumped = false;
+        }
+        t_ring = nullptr;
+        t_trace_gone = true;
+    }
+    TraceRing *ring = nullptr;
+};
+
+static thread_local LocalTrace t_local;
+
+/// @brief 需要持有TraceRegistry::mutex
+static void ResetRingLocked(TraceRing *ring, size_t size, uint64_t epoch) {
+    if (ring->mask + 1 != size) {
+        delete[] ring->records;
+        ring->records = new Tracer::Record[size];
+        ring->mask = size - 1;
+    }
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->epoch.store(epoch, std::memory_order_release);
+}
+
+/// @brief 取一个退出线程的环,没有可以复用的时候新建
+static TraceRing *AcquireRing() {
+    TraceRegistry &reg = Registry();
+    Mutex::Lock lock(reg.mutex);
+    uint64_t epoch = s_epoch.load(std::memory_order_acquire);
+    TraceRing *ring = nullptr;
+    TraceRing *oldest_dead = nullptr;
+    size_t dead = 0;
+    for (auto r : reg.rings) {
+        if (!r->dead) continue;
+        ++dead;
+        if (!oldest_dead) oldest_dead = r;
+        // 上一代的记录不会再导出,这一代的导出过了
+        if (r->epoch.load(std::memory_order_relaxed) != epoch || r->dumped) {
+            ring = r;
+            break;
+        }
+    }
+    if (!ring && dead >= MAX_DEAD_RINGS) ring = oldest_dead;
+    if (ring) {
+        ResetRingLocked(ring, reg.ring_size, epoch);
+        ring->dead = false;
+        ring->dumped = false;
+    } else {
+        ring = new TraceRing(reg.ring_size);
+        ring->epoch.store(epoch, std::memory_order_relaxed);
+        reg.rings.push_back(ring);
+    }
+    ring->tid = syscall(SYS_gettid);
+    ring->name = Thread::GetName();
+    return ring;
+}
+
+const char *Tracer::TypeName(Type t) {
+    switch (t) {
+#define XX(name, str) \
+        case name: return str;
+        XX(FIBER_CREATE, "create")
+        XX(FIBER_RESUME, "resume")
+        XX(FIBER_YIELD, "yield")
+        XX(FIBER_TERM, "term")
+        XX(EVENT_ADD, "addEvent")
+        XX(EVENT_TRIGGER, "triggerEvent")
+        XX(TIMER_FIRE, "timer")
+        XX(TICKLE, "tickle")
+#undef XX
+        default: return "unknown";
+    }
+}
+
+void Tracer::Start(size_t records_per_thread) {
+    size_t size = 1;
+    while (size < records_per_thread) size <<= 1;
+    TraceRegistry &reg = Registry();
+    Mutex::Lock lock(reg.mutex);
+    reg.ring_size = size;
+    // 各个线程看到新的代数后自己清空,退出线程的环在复用时清空
+    s_epoch.fetch_add(1, std::memory_order_acq_rel);
+    s_enabled.store(true, std::memory_order_release);
+}
+
+void Tracer::Stop() { s_enabled.store(false, std::memory_order_release); }
+
+void Tracer::Write(Type type, uint64_t fiber_id, uint64_t arg) {
+    TraceRing *ring = t_ring;
+    if (qc_unlikely(!ring)) {
+        if (t_trace_gone) return;
+        ring = AcquireRing();
+        t_local.ring = ring;
+        t_ring = ring;
+    }
+    uint64_t epoch = s_epoch.load(std::memory_order_acquire);
+    if (qc_unlikely(ring->epoch.load(std::memory_order_relaxed) != epoch)) {
+        TraceRegistry &reg = Registry();
+        Mutex::Lock lock(reg.mutex);
+        ResetRingLocked(ring, reg.ring_size, epoch);
+    }
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    Record &rec = ring->records[head & ring->mask];
+    rec.ts = GetMonotonicNS();
+    rec.fiber_id = fiber_id;
+    rec.arg = arg;
+    rec.type = type;
+    rec.reserved = 0;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+static bool WriteAll(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = ::write(fd, p, len);
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool Tracer::Dump(const std::string &path) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+
+    TraceRegistry &reg = Registry();
+    Mutex::Lock lock(reg.mutex);
+    uint64_t epoch = s_epoch.load(std::memory_order_acquire);
+    std::vector<TraceRing *> rings;
+    for (auto ring : reg.rings) {
+        if (ring->epoch.load(std::memory_order_acquire) == epoch) rings.push_back(ring);
+    }
+    FileHeader fh;
+    memset(&fh, 0, sizeof(fh));
+    memcpy(fh.magic, MAGIC, strlen(MAGIC));
+    fh.version = VERSION;
+    fh.threads = rings.size();
+    bool ok = WriteAll(fd, &fh, sizeof(fh));
+
+    for (auto ring : rings) {
+        if (!ok) break;
+        // 退出线程的环导出之后就可以交给新线程
+        if (ring->dead) ring->dumped = true;
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t size = ring->mask + 1;
+        uint64_t begin = head > size ? head - size : 0;
+
+        ThreadHeader th;
+        memset(&th, 0, sizeof(th));
+        th.tid = ring->tid;
+        strncpy(th.name, ring->name.c_str(), sizeof(th.name) - 1);
+        th.count = head - begin;
+        ok = WriteAll(fd, &th, sizeof(th));
+        // 环可能回绕,分成两段按时间顺序写出
+        uint64_t first = begin & ring->mask;
+        uint64_t n1 = std::min(th.count, size - first);
+        if (ok) ok = WriteAll(fd, ring->records + first, n1 * sizeof(Record));
+        if (ok && th.count > n1) ok = WriteAll(fd, ring->records, (th.count - n1) * sizeof(Record));
+    }
+    ::close(fd);
+    return ok;
+}
+
+}  // namespace qc
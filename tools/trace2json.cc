@@ -0,0 +1,208 @@
+/**
+ * @file trace2json.cc
+ * @author qc
+ * @brief 把Tracer::Dump()写出的二进制追踪文件转换成Chrome trace JSON
+ * @details 用法: trace2json in.qctrace [out.json],输出可以直接在chrome://tracing或ui.perfetto.dev打开.
+ *          "fibers"进程下每个协程一条轨道,resume到yield/term之间是一段运行切片;
+ *          "threads"进程下每个线程一条轨道,显示tickle,定时器和事件到达,事件到达用箭头连到被唤醒协程的下一次运行.
+ * @version 0.1
+ * @date 2024-07-11
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "trace.hpp"
+
+using qc::Tracer;
+
+static const int FIBER_PID = 1;
+static const int THREAD_PID = 2;
+
+struct Event {
+    int tid;
+    Tracer::Record rec;
+};
+
+struct ThreadInfo {
+    int tid;
+    std::string name;
+};
+
+static bool ReadTrace(FILE *fp, std::vector<ThreadInfo> &threads, std::vector<Event> &events) {
+    Tracer::FileHeader fh;
+    if (fread(&fh, sizeof(fh), 1, fp) != 1) return false;
+    if (strncmp(fh.magic, Tracer::MAGIC, sizeof(fh.magic)) || fh.version != Tracer::VERSION) {
+        fprintf(stderr, "not a qc trace file\n");
+        return false;
+    }
+    for (uint32_t i = 0; i < fh.threads; ++i) {
+        Tracer::ThreadHeader th;
+        if (fread(&th, sizeof(th), 1, fp) != 1) return false;
+        th.name[sizeof(th.name) - 1] = '\0';
+        threads.push_back({th.tid, th.name});
+        for (uint64_t j = 0; j < th.count; ++j) {
+            Event e;
+            e.tid = th.tid;
+            if (fread(&e.rec, sizeof(e.rec), 1, fp) != 1) return false;
+            events.push_back(e);
+        }
+    }
+    return true;
+}
+
+class JsonWriter {
+public:
+    JsonWriter(FILE *fp, uint64_t base) : m_fp(fp), m_base(base) {
+        fprintf(m_fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    }
+
+    ~JsonWriter() { fprintf(m_fp, "\n]}\n"); }
+
+    /// @brief 事件的公共部分,调用者接着输出剩余字段和右括号
+    void begin(const char *ph, const char *name, int pid, uint64_t tid, uint64_t ts) {
+        fprintf(m_fp, "%s{\"ph\":\"%s\",\"name\":\"%s\",\"pid\":%d,\"tid\":%lu,\"ts\":%.3f",
+                m_first ? "" : ",\n", ph, name, pid, (unsigned long)tid, (ts - m_base) / 1000.0);
+        m_first = false;
+    }
+
+    void metadata(const char *what, int pid, uint64_t tid, const std::string &name) {
+        fprintf(m_fp, "%s{\"ph\":\"M\",\"name\":\"%s\",\"pid\":%d,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}",
+                m_first ? "" : ",\n", what, pid, (unsigned long)tid, name.c_str());
+        m_first = false;
+    }
+
+    FILE *fp() { return m_fp; }
+
+private:
+    FILE *m_fp;
+    uint64_t m_base;
+    bool m_first = true;
+};
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s in.qctrace [out.json]\n", argv[0]);
+        return 1;
+    }
+    FILE *in = fopen(argv[1], "rb");
+    if (!in) {
+        perror(argv[1]);
+        return 1;
+    }
+    std::vector<ThreadInfo> threads;
+    std::vector<Event> events;
+    bool ok = ReadTrace(in, threads, events);
+    fclose(in);
+    if (!ok) {
+        fprintf(stderr, "%s: truncated trace\n", argv[1]);
+        return 1;
+    }
+    std::stable_sort(events.begin(), events.end(),
+                     [](const Event &a, const Event &b) { return a.rec.ts < b.rec.ts; });
+
+    FILE *out = argc > 2 ? fopen(argv[2], "w") : stdout;
+    if (!out) {
+        perror(argv[2]);
+        return 1;
+    }
+    uint64_t base = events.empty() ? 0 : events.front().rec.ts;
+    uint64_t last = events.empty() ? 0 : events.back().rec.ts;
+    {
+        JsonWriter w(out, base);
+        w.metadata("process_name", FIBER_PID, 0, "fibers");
+        w.metadata("process_name", THREAD_PID, 0, "threads");
+        for (auto &t : threads) {
+            w.metadata("thread_name", THREAD_PID, t.tid, t.name + " " + std::to_string(t.tid));
+        }
+
+        /// 协程id -> (开始运行的时间, 运行所在的线程)
+        std::map<uint64_t, std::pair<uint64_t, int>> running;
+        /// 协程id -> 唤醒它的事件对应的箭头id
+        std::map<uint64_t, uint64_t> wakeups;
+        std::map<uint64_t, bool> named;
+        uint64_t next_flow = 1;
+
+        auto name_fiber = [&](uint64_t id) {
+            if (named[id]) return;
+            named[id] = true;
+            w.metadata("thread_name", FIBER_PID, id, "fiber " + std::to_string(id));
+        };
+
+        for (auto &e : events) {
+            const Tracer::Record &r = e.rec;
+            Tracer::Type type = (Tracer::Type)r.type;
+            switch (type) {
+                case Tracer::FIBER_CREATE:
+                    name_fiber(r.fiber_id);
+                    w.begin("i", "create", FIBER_PID, r.fiber_id, r.ts);
+                    fprintf(w.fp(), ",\"s\":\"t\",\"args\":{\"thread\":%d,\"stack\":%lu}}", e.tid,
+                            (unsigned long)r.arg);
+                    break;
+                case Tracer::FIBER_RESUME: {
+                    name_fiber(r.fiber_id);
+                    running[r.fiber_id] = std::make_pair(r.ts, e.tid);
+                    auto it = wakeups.find(r.fiber_id);
+                    if (it != wakeups.end()) {
+                        w.begin("f", "wakeup", FIBER_PID, r.fiber_id, r.ts);
+                        fprintf(w.fp(), ",\"cat\":\"io\",\"bp\":\"e\",\"id\":%lu}", (unsigned long)it->second);
+                        wakeups.erase(it);
+                    }
+                    break;
+                }
+                case Tracer::FIBER_YIELD:
+                case Tracer::FIBER_TERM: {
+                    auto it = running.find(r.fiber_id);
+                    if (it == running.end()) break;
+                    w.begin("X", type == Tracer::FIBER_TERM ? "run (term)" : "run", FIBER_PID,
+                            r.fiber_id, it->second.first);
+                    fprintf(w.fp(), ",\"dur\":%.3f,\"args\":{\"thread\":%d}}",
+                            (r.ts - it->second.first) / 1000.0, it->second.second);
+                    running.erase(it);
+                    break;
+                }
+                case Tracer::EVENT_ADD:
+                    w.begin("i", "addEvent", FIBER_PID, r.fiber_id, r.ts);
+                    fprintf(w.fp(), ",\"s\":\"t\",\"args\":{\"fd\":%lu,\"event\":%lu}}",
+                            (unsigned long)(r.arg >> 8), (unsigned long)(r.arg & 0xff));
+                    break;
+                case Tracer::EVENT_TRIGGER:
+                    w.begin("i", "triggerEvent", THREAD_PID, e.tid, r.ts);
+                    fprintf(w.fp(), ",\"s\":\"t\",\"args\":{\"fd\":%lu,\"event\":%lu,\"fiber\":%lu}}",
+                            (unsigned long)(r.arg >> 8), (unsigned long)(r.arg & 0xff),
+                            (unsigned long)r.fiber_id);
+                    if (r.fiber_id) {
+                        w.begin("s", "wakeup", THREAD_PID, e.tid, r.ts);
+                        fprintf(w.fp(), ",\"cat\":\"io\",\"id\":%lu}", (unsigned long)next_flow);
+                        wakeups[r.fiber_id] = next_flow++;
+                    }
+                    break;
+                case Tracer::TIMER_FIRE:
+                    w.begin("i", "timer", THREAD_PID, e.tid, r.ts);
+                    fprintf(w.fp(), ",\"s\":\"t\",\"args\":{\"expired\":%lu}}", (unsigned long)r.arg);
+                    break;
+                case Tracer::TICKLE:
+                    w.begin("i", "tickle", THREAD_PID, e.tid, r.ts);
+                    fprintf(w.fp(), ",\"s\":\"t\"}");
+                    break;
+                default:
+                    break;
+            }
+        }
+        // 追踪结束时还在运行的协程,切片截断到最后一条记录
+        for (auto &i : running) {
+            w.begin("X", "run", FIBER_PID, i.first, i.second.first);
+            fprintf(w.fp(), ",\"dur\":%.3f,\"args\":{\"thread\":%d}}",
+                    (last - i.second.first) / 1000.0, i.second.second);
+        }
+    }
+    if (out != stdout) fclose(out);
+    return 0;
+}